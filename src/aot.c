@@ -0,0 +1,561 @@
+#include "aot.h"
+#include "decode.h"
+#include "isa.h"
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// bump when the generated code changes, so old shared objects are rebuilt
+#define AOT_VERSION 8
+
+// The state shared with the generated code. The declaration is pasted
+// into the generated C as text, so both sides see the same layout.
+#define AOT_STATE                                \
+  struct aot_state                               \
+  {                                              \
+    struct memory_leaf **leaves;                 \
+    struct memory *mem;                          \
+    int (*rd_w)(struct memory *, int);           \
+    int (*rd_h)(struct memory *, int);           \
+    int (*rd_b)(struct memory *, int);           \
+    void (*wr_w)(struct memory *, int, int);     \
+    void (*wr_h)(struct memory *, int, int);     \
+    void (*wr_b)(struct memory *, int, int);     \
+    uint32_t *regs;                              \
+    long count;                                  \
+    long limit;                                  \
+    int stale;                                   \
+    int jumped;                                  \
+    uint32_t from;                               \
+  }
+#define AOT_ENTRY                                          \
+  struct aot_entry                                         \
+  {                                                        \
+    uint32_t addr;                                         \
+    uint32_t (*fn)(struct aot_state *, uint32_t);          \
+  }
+#define STRING(...) #__VA_ARGS__
+#define EXPAND_STRING(...) STRING(__VA_ARGS__)
+
+AOT_STATE;
+AOT_ENTRY;
+
+typedef uint32_t (*aot_fn)(struct aot_state *, uint32_t);
+
+struct aot
+{
+  struct aot_state state;
+  void *handle;
+  uint32_t low;
+  uint32_t span; // high - low, zero once the translation is dropped
+  aot_fn *table; // block entry for each halfword of the text, or NULL
+};
+
+// Everything the translation depends on: the code, where the functions
+// start and the format of the generated code
+static unsigned long long text_hash(struct memory *mem, struct symbols *syms, uint32_t low, uint32_t high)
+{
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  uint32_t values[3] = {AOT_VERSION, low, high};
+  for (int i = 0; i < 3; ++i)
+    hash = (hash ^ values[i]) * 0x100000001b3ULL;
+  for (uint32_t pc = low; pc < high; pc += 2)
+    hash = (hash ^ (uint32_t)memory_rd_h(mem, pc)) * 0x100000001b3ULL;
+  for (int i = 0; i < symbols_count(syms); ++i)
+    hash = (hash ^ (uint32_t)symbols_addr(syms, i)) * 0x100000001b3ULL;
+  return hash;
+}
+
+struct text
+{
+  uint32_t low, high;
+  int size;           // number of halfwords
+  struct insn *insns; // decoded at the halfwords where an instruction starts
+  char *start;        // an instruction starts here
+  char *leader;       // first instruction of a basic block
+  char *function;     // first instruction of a function
+};
+
+static int in_text(struct text *t, uint32_t addr)
+{
+  return addr - t->low < t->high - t->low && (addr & 1) == 0;
+}
+
+// the halfword after the instruction at i
+static int following(struct text *t, int i)
+{
+  return i + t->insns[i].size / 2;
+}
+
+// where to look for the next instruction when going through [first, last),
+// which may start inside an instruction
+static int next_start(struct text *t, int i)
+{
+  return t->start[i] ? following(t, i) : i + 1;
+}
+
+// ecalls, floating point and atomic instructions are run by the interpreter
+static int interpreted(int op)
+{
+  return op == OP_ECALL || is_float(op) || is_atomic(op);
+}
+
+static void find_blocks(struct text *t, struct memory *mem, struct symbols *syms)
+{
+  t->leader[0] = t->function[0] = 1;
+  for (int i = 0; i < symbols_count(syms); ++i)
+  {
+    uint32_t addr = symbols_addr(syms, i);
+    if (in_text(t, addr))
+      t->leader[(addr - t->low) / 2] = t->function[(addr - t->low) / 2] = 1;
+  }
+  for (int i = 0; i < t->size; i = following(t, i))
+  {
+    decode(decode_fetch(mem, t->low + 2 * i), &t->insns[i]);
+    t->start[i] = 1;
+  }
+  for (int i = 0; i < t->size; i = following(t, i))
+  {
+    struct insn *d = &t->insns[i];
+    uint32_t pc = t->low + 2 * i;
+    if (d->op == OP_JAL || (d->op >= OP_BEQ && d->op <= OP_BGEU))
+    {
+      if (in_text(t, pc + d->imm))
+        t->leader[(pc + d->imm - t->low) / 2] = 1;
+    }
+    if ((is_control(d->op) || interpreted(d->op)) && following(t, i) < t->size)
+      t->leader[following(t, i)] = 1;
+  }
+}
+
+static void reg(char *name, int r)
+{
+  if (r == 0)
+    strcpy(name, "0u");
+  else
+    sprintf(name, "r%d", r);
+}
+
+// instructions counted in the block from i on, without those the interpreter runs
+static int block_count(struct text *t, int i)
+{
+  int n = 0;
+  do
+  {
+    if (!interpreted(t->insns[i].op))
+      n++;
+    i = following(t, i);
+  } while (i < t->size && !t->leader[i]);
+  return n;
+}
+
+static void emit_store(FILE *out, struct text *t, int i, const char *size, const char *value, int remaining)
+{
+  uint32_t pc = t->low + 2 * i;
+  if (strcmp(size, "w") == 0)
+    fprintf(out, "  if ((p = page(s, a, 1)) && !(a & 3))\n"
+                 "    p[(a & 0x%x) >> 2] = %s;\n  else\n  {\n", MEMORY_PAGE_SIZE - 1, value);
+  else if (strcmp(size, "h") == 0)
+    fprintf(out, "  if ((p = page(s, a, 1)) && !(a & 1))\n"
+                 "    ((uint16_t *)p)[(a & 0x%x) >> 1] = %s;\n  else\n  {\n", MEMORY_PAGE_SIZE - 1, value);
+  else
+    fprintf(out, "  if ((p = page(s, a, 1)))\n"
+                 "    ((uint8_t *)p)[a & 0x%x] = %s;\n  else\n  {\n", MEMORY_PAGE_SIZE - 1, value);
+  fprintf(out, "    s->wr_%s(s->mem, a, %s);\n", size, value);
+  fprintf(out, "    if (s->stale)\n    {\n      s->count -= %d;\n      next = 0x%xu;\n      goto out;\n    }\n  }\n",
+          remaining, pc + t->insns[i].size);
+}
+
+// The expressions from isa.h in terms of a and b
+static void emit_expression(FILE *out, const char *expression, const char *a, const char *b)
+{
+  fprintf(out, "({ uint32_t a = %s, b = %s; (void)a; (uint32_t)(%s); })", a, b, expression);
+}
+
+// A branch inside the function. Going back may loop, so the limit is
+// checked there, and the function returns once it is reached.
+static void emit_goto(FILE *out, uint32_t pc, uint32_t target)
+{
+  if (target > pc)
+    fprintf(out, "goto L%x;\n", target);
+  else
+    fprintf(out, "{\n    if (s->count >= s->limit)\n    {\n      next = 0x%xu;\n      goto out;\n    }\n"
+                 "    goto L%x;\n  }\n", target, target);
+}
+
+#define ALU_TEXT(op, name, mask, match, format, expression) \
+  case op: \
+    emit_expression(out, #expression, rs1, ISA_##format == ISA_R ? rs2 : imm_text); \
+    break;
+#define BRANCH_TEXT(op, name, mask, match, format, condition) \
+  case op: \
+    cond = #condition; \
+    break;
+#define SKIP(...)
+
+static void emit_insn(FILE *out, struct text *t, int i, int first, int last, int remaining)
+{
+  struct insn *d = &t->insns[i];
+  uint32_t pc = t->low + 2 * i;
+  char rd[8], rs1[8], rs2[8];
+  reg(rd, d->rd);
+  reg(rs1, d->rs1);
+  reg(rs2, d->rs2);
+  int write = d->rd != 0;
+  int32_t imm = d->imm;
+  char imm_text[16];
+  sprintf(imm_text, "0x%xu", (uint32_t)imm);
+  const char *cond = NULL;
+  if (interpreted(d->op))
+  {
+    fprintf(out, "  next = 0x%xu;\n  goto out;\n", pc);
+    return;
+  }
+  switch (d->op)
+  {
+  case OP_LUI:
+    if (write)
+      fprintf(out, "  %s = 0x%xu;\n", rd, (uint32_t)imm);
+    break;
+  case OP_AUIPC:
+    if (write)
+      fprintf(out, "  %s = 0x%xu;\n", rd, pc + imm);
+    break;
+  case OP_JAL:
+    if (d->rd == 0 && in_text(t, pc + imm) && t->start[(pc + imm - t->low) / 2] &&
+        (int)(pc + imm - t->low) / 2 >= first && (int)(pc + imm - t->low) / 2 < last)
+    {
+      fprintf(out, "  ");
+      emit_goto(out, pc, pc + imm);
+      break;
+    }
+    if (write)
+      fprintf(out, "  %s = 0x%xu;\n", rd, pc + d->size);
+    fprintf(out, "  s->jumped = 1;\n  s->from = 0x%xu;\n  next = 0x%xu;\n  goto out;\n", pc, pc + imm);
+    break;
+  case OP_JALR:
+    fprintf(out, "  next = (%s + %d) & ~1u;\n", rs1, imm);
+    if (write)
+      fprintf(out, "  %s = 0x%xu;\n", rd, pc + d->size);
+    fprintf(out, "  s->jumped = 1;\n  s->from = 0x%xu;\n  goto out;\n", pc);
+    break;
+  ISA_RV32IM(SKIP, BRANCH_TEXT, SKIP)
+  case OP_LB:
+  case OP_LH:
+  case OP_LW:
+  case OP_LBU:
+  case OP_LHU:
+    fprintf(out, "  a = %s + %d;\n", rs1, imm);
+    if (!write)
+    {
+      // the access still happens, it may fault
+      fprintf(out, "  s->rd_b(s->mem, a);\n");
+      break;
+    }
+    if (d->op == OP_LW)
+      fprintf(out, "  %s = (p = page(s, a, 0)) && !(a & 3) ? (uint32_t)p[(a & 0x%x) >> 2] : (uint32_t)s->rd_w(s->mem, a);\n",
+              rd, MEMORY_PAGE_SIZE - 1);
+    else if (d->op == OP_LBU)
+      fprintf(out, "  %s = (p = page(s, a, 0)) ? ((uint8_t *)p)[a & 0x%x] : (uint32_t)s->rd_b(s->mem, a);\n", rd,
+              MEMORY_PAGE_SIZE - 1);
+    else if (d->op == OP_LB)
+      fprintf(out, "  %s = (uint32_t)(int8_t)((p = page(s, a, 0)) ? ((uint8_t *)p)[a & 0x%x] : s->rd_b(s->mem, a));\n",
+              rd, MEMORY_PAGE_SIZE - 1);
+    else if (d->op == OP_LH)
+      fprintf(out, "  %s = (uint32_t)(int16_t)s->rd_h(s->mem, a);\n", rd);
+    else
+      fprintf(out, "  %s = (uint32_t)s->rd_h(s->mem, a);\n", rd);
+    break;
+  case OP_SB:
+  case OP_SH:
+  case OP_SW:
+    fprintf(out, "  a = %s + %d;\n", rs1, imm);
+    emit_store(out, t, i, d->op == OP_SB ? "b" : d->op == OP_SH ? "h" : "w", rs2, remaining);
+    break;
+  case OP_NOP:
+    break;
+  default:
+    if (!write)
+      break;
+    fprintf(out, "  %s = ", rd);
+    switch (d->op)
+    {
+    ISA_RV32IM(ALU_TEXT, SKIP, SKIP)
+    case OP_LI:
+      fprintf(out, "0x%xu", (uint32_t)imm);
+      break;
+    case OP_MV:
+      fprintf(out, "%s", rs1);
+      break;
+    case OP_SH1ADD:
+    case OP_SH2ADD:
+    case OP_SH3ADD:
+      fprintf(out, "(%s << %d) + %s", rs1, d->op - OP_SH1ADD + 1, rs2);
+      break;
+    case OP_ANDN:
+      fprintf(out, "%s & ~%s", rs1, rs2);
+      break;
+    case OP_ORN:
+      fprintf(out, "%s | ~%s", rs1, rs2);
+      break;
+    case OP_XNOR:
+      fprintf(out, "~(%s ^ %s)", rs1, rs2);
+      break;
+    case OP_CLZ:
+      fprintf(out, "%s ? (uint32_t)__builtin_clz(%s) : 32u", rs1, rs1);
+      break;
+    case OP_CTZ:
+      fprintf(out, "%s ? (uint32_t)__builtin_ctz(%s) : 32u", rs1, rs1);
+      break;
+    case OP_CPOP:
+      fprintf(out, "(uint32_t)__builtin_popcount(%s)", rs1);
+      break;
+    case OP_MIN:
+      fprintf(out, "(int32_t)%s < (int32_t)%s ? %s : %s", rs1, rs2, rs1, rs2);
+      break;
+    case OP_MINU:
+      fprintf(out, "%s < %s ? %s : %s", rs1, rs2, rs1, rs2);
+      break;
+    case OP_MAX:
+      fprintf(out, "(int32_t)%s > (int32_t)%s ? %s : %s", rs1, rs2, rs1, rs2);
+      break;
+    case OP_MAXU:
+      fprintf(out, "%s > %s ? %s : %s", rs1, rs2, rs1, rs2);
+      break;
+    case OP_SEXT_B:
+      fprintf(out, "(uint32_t)(int8_t)%s", rs1);
+      break;
+    case OP_SEXT_H:
+      fprintf(out, "(uint32_t)(int16_t)%s", rs1);
+      break;
+    case OP_ZEXT_H:
+      fprintf(out, "%s & 0xffffu", rs1);
+      break;
+    case OP_ROL:
+      fprintf(out, "(%s << (%s & 31)) | (%s >> (-%s & 31))", rs1, rs2, rs1, rs2);
+      break;
+    case OP_ROR:
+      fprintf(out, "(%s >> (%s & 31)) | (%s << (-%s & 31))", rs1, rs2, rs1, rs2);
+      break;
+    case OP_RORI:
+      fprintf(out, "(%s >> %d) | (%s << %d)", rs1, imm, rs1, -imm & 31);
+      break;
+    case OP_ORC_B:
+      fprintf(out, "~((~(((%s & 0x7f7f7f7fu) + 0x7f7f7f7fu) | %s | 0x7f7f7f7fu) >> 7) * 0xffu)", rs1, rs1);
+      break;
+    case OP_REV8:
+      fprintf(out, "__builtin_bswap32(%s)", rs1);
+      break;
+    }
+    fprintf(out, ";\n");
+    break;
+  }
+  if (cond)
+  {
+    uint32_t target = pc + imm;
+    int index = (int)(target - t->low) / 2;
+    fprintf(out, "  if (");
+    emit_expression(out, cond, rs1, rs2);
+    if (in_text(t, target) && t->start[index] && index >= first && index < last)
+    {
+      fprintf(out, ")\n    ");
+      emit_goto(out, pc, target);
+    }
+    else
+      fprintf(out, ")\n  {\n    next = 0x%xu;\n    goto out;\n  }\n", target);
+  }
+}
+
+// one C function for the guest function [first, last)
+static void emit_function(FILE *out, struct text *t, int first, int last)
+{
+  char used[32] = {0}, written[32] = {0};
+  for (int i = first; i < last; i = next_start(t, i))
+  {
+    struct insn *d = &t->insns[i];
+    if (!t->start[i] || interpreted(d->op))
+      continue;
+    used[d->rs1] = used[d->rs2] = used[d->rd] = 1;
+    written[d->rd] = d->op != OP_NOP && !(d->op >= OP_BEQ && d->op <= OP_BGEU) &&
+                     !(d->op >= OP_SB && d->op <= OP_SW) ? 1 : written[d->rd];
+  }
+  fprintf(out, "\nstatic uint32_t f%x(struct aot_state *s, uint32_t pc)\n{\n", t->low + 2 * first);
+  fprintf(out, "  uint32_t *x = s->regs;\n  uint32_t next, a;\n  int *p;\n");
+  for (int r = 1; r < 32; ++r)
+    if (used[r])
+      fprintf(out, "  uint32_t r%d = x[%d];\n", r, r);
+  fprintf(out, "  (void)a;\n  (void)p;\n  switch (pc)\n  {\n");
+  for (int i = first; i < last; ++i)
+    if (t->leader[i] && t->start[i])
+      fprintf(out, "  case 0x%xu:\n    goto L%x;\n", t->low + 2 * i, t->low + 2 * i);
+  fprintf(out, "  default:\n    return pc;\n  }\n");
+  int remaining = 0;
+  for (int i = first; i < last; i = next_start(t, i))
+  {
+    if (!t->start[i])
+      continue;
+    if (t->leader[i])
+    {
+      remaining = block_count(t, i);
+      fprintf(out, "L%x:\n  s->count += %d;\n", t->low + 2 * i, remaining);
+    }
+    if (!interpreted(t->insns[i].op))
+      remaining--;
+    emit_insn(out, t, i, first, last, remaining);
+  }
+  fprintf(out, "  next = 0x%xu;\nout:\n", t->low + 2 * last);
+  for (int r = 1; r < 32; ++r)
+    if (written[r])
+      fprintf(out, "  x[%d] = r%d;\n", r, r);
+  fprintf(out, "  return next;\n}\n");
+}
+
+static void translate(FILE *out, struct memory *mem, struct symbols *syms, uint32_t low, uint32_t high,
+                      unsigned long long hash)
+{
+  struct text t;
+  t.low = low;
+  t.high = high;
+  t.size = (high - low) / 2;
+  t.insns = calloc(t.size, sizeof(struct insn));
+  t.start = calloc(t.size, 1);
+  t.leader = calloc(t.size, 1);
+  t.function = calloc(t.size, 1);
+  find_blocks(&t, mem, syms);
+  fprintf(out, "// Generated by sim from the text at %x-%x\n#include <stdint.h>\n\nstruct memory;\n", low, high);
+  fprintf(out, "%s;\n%s;\n%s;\n", EXPAND_STRING(MEMORY_LEAF), EXPAND_STRING(AOT_STATE), EXPAND_STRING(AOT_ENTRY));
+  // the page of a, NULL if it isn't there or, for a store, has flags
+  fprintf(out, "\nstatic inline int *page(struct aot_state *s, uint32_t a, int store)\n{\n"
+               "  struct memory_leaf *l = s->leaves[a >> %d];\n"
+               "  uint32_t i = (a >> %d) & 0x%x;\n"
+               "  return l && !(store && l->flags[i]) ? l->pages[i] : 0;\n}\n",
+          MEMORY_PAGE_BITS + MEMORY_LEAF_BITS, MEMORY_PAGE_BITS, MEMORY_LEAF_PAGES - 1);
+  for (int first = 0, last; first < t.size; first = last)
+  {
+    for (last = first + 1; last < t.size && !t.function[last]; ++last)
+      ;
+    emit_function(out, &t, first, last);
+  }
+  fprintf(out, "\nconst unsigned long long aot_hash = 0x%llxULL;\nconst struct aot_entry aot_entries[] = {\n", hash);
+  int entries = 0;
+  uint32_t function = low;
+  for (int i = 0; i < t.size; ++i)
+  {
+    if (t.function[i])
+      function = low + 2 * i;
+    // a block that starts with an instruction for the interpreter is left to it
+    if (t.leader[i] && t.start[i] && !interpreted(t.insns[i].op))
+    {
+      fprintf(out, "  {0x%xu, f%x},\n", low + 2 * i, function);
+      entries++;
+    }
+  }
+  fprintf(out, "};\nconst int aot_num_entries = %d;\n", entries);
+  free(t.insns);
+  free(t.start);
+  free(t.leader);
+  free(t.function);
+}
+
+// opens so_path if it holds the translation with the given hash
+static void *open_translation(const char *so_path, unsigned long long hash)
+{
+  void *handle = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+  if (!handle)
+    return NULL;
+  const unsigned long long *found = dlsym(handle, "aot_hash");
+  if (found && *found == hash)
+    return handle;
+  dlclose(handle);
+  return NULL;
+}
+
+struct aot *aot_create(const char *so_path, struct memory *mem, struct symbols *syms,
+                       unsigned low, unsigned high)
+{
+  char path[4096], source[4200], built[4200], command[9000];
+  // dlopen only searches the library path for names without a slash
+  snprintf(path, sizeof(path), "%s%s", strchr(so_path, '/') ? "" : "./", so_path);
+  unsigned long long hash = text_hash(mem, syms, low, high);
+  void *handle = open_translation(path, hash);
+  if (!handle)
+  {
+    snprintf(source, sizeof(source), "%s.c", path);
+    snprintf(built, sizeof(built), "%s.tmp", path);
+    FILE *out = fopen(source, "w");
+    if (out == NULL)
+    {
+      printf("Could not write '%s'. Exiting\n", source);
+      exit(-1);
+    }
+    translate(out, mem, syms, low, high, hash);
+    fclose(out);
+    snprintf(command, sizeof(command), "gcc -O2 -shared -fPIC -w -o '%s' '%s'", built, source);
+    // a new file is renamed into place, so dlopen doesn't see an old one
+    if (system(command) != 0 || rename(built, path) != 0 || !(handle = open_translation(path, hash)))
+    {
+      printf("Could not compile the translation in '%s'. Exiting\n", source);
+      exit(-1);
+    }
+    remove(source);
+  }
+  struct aot *aot = calloc(sizeof(struct aot), 1);
+  aot->handle = handle;
+  aot->low = low;
+  aot->span = high - low;
+  aot->table = calloc(aot->span / 2 + 1, sizeof(aot_fn));
+  const struct aot_entry *entries = dlsym(handle, "aot_entries");
+  const int *num_entries = dlsym(handle, "aot_num_entries");
+  for (int i = 0; i < *num_entries; ++i)
+    aot->table[(entries[i].addr - low) / 2] = entries[i].fn;
+  struct aot_state *s = &aot->state;
+  s->leaves = memory_leaves(mem);
+  s->mem = mem;
+  s->rd_w = memory_rd_w;
+  s->rd_h = memory_rd_h;
+  s->rd_b = memory_rd_b;
+  s->wr_w = memory_wr_w;
+  s->wr_h = memory_wr_h;
+  s->wr_b = memory_wr_b;
+  // stores to the text must reach aot_invalidate
+  memory_mark_code(mem, low, high - low);
+  return aot;
+}
+
+void aot_delete(struct aot *aot)
+{
+  dlclose(aot->handle);
+  free(aot->table);
+  free(aot);
+}
+
+long aot_run(struct aot *aot, uint32_t *regs, struct hle *hle, uint32_t *pc, long limit)
+{
+  struct aot_state *s = &aot->state;
+  uint32_t next = *pc;
+  aot_fn fn;
+  s->regs = regs;
+  s->count = 0;
+  s->limit = limit;
+  while (s->count < limit && next - aot->low < aot->span && (fn = aot->table[(next - aot->low) >> 1]) != NULL &&
+         !(next & 1))
+  {
+    s->jumped = 0;
+    next = fn(s, next);
+    if (s->jumped && hle)
+      hle_jump(hle, regs, s->from, &next);
+  }
+  *pc = next;
+  return s->count;
+}
+
+void aot_invalidate(struct aot *aot, int addr, int len)
+{
+  if ((uint32_t)addr - aot->low < aot->span || (uint32_t)addr + len - 1 - aot->low < aot->span ||
+      ((uint32_t)addr < aot->low && (uint32_t)addr + len > aot->low))
+  {
+    aot->span = 0;
+    aot->state.stale = 1;
+  }
+}
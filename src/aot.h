@@ -0,0 +1,33 @@
+#ifndef __AOT_H__
+#define __AOT_H__
+
+#include "memory.h"
+#include "symbols.h"
+#include "hle.h"
+#include <stdint.h>
+
+// Ahead-of-time translation of the program text to C. Each guest function
+// (the code from one symbol to the next) becomes a C function in which the
+// basic blocks are labels and direct branches inside the function are
+// gotos. The C is compiled by the host gcc into a shared object, which is
+// cached and loaded with dlopen on later runs.
+struct aot;
+
+// Loads the translation of [low, high) from so_path. It is translated and
+// compiled first if so_path is missing or was made from other code.
+struct aot *aot_create(const char *so_path, struct memory *mem, struct symbols *syms,
+                       unsigned low, unsigned high);
+void aot_delete(struct aot *aot);
+
+// Runs translated code from *pc as long as execution reaches block entries
+// of the translation, and leaves *pc at the first instruction the
+// interpreter must run (ecalls, indirect targets outside the text). It also
+// stops at the first jump back or out of a function once limit instructions
+// have run. Returns the number of instructions executed.
+long aot_run(struct aot *aot, uint32_t *regs, struct hle *hle, uint32_t *pc, long limit);
+
+// The guest wrote [addr, addr+len): the translation is dropped if that
+// overlaps the text, and everything from then on is interpreted
+void aot_invalidate(struct aot *aot, int addr, int len);
+
+#endif
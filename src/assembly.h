@@ -1,16 +1,20 @@
 #ifndef __ASSEMBLY_H__
 #define __ASSEMBLY_H__
 
+#include "memory.h"
+#include "symbols.h"
+
 struct assembly;
 
 // opret og slet fortegnelse over assemblerkode
 struct assembly *assembly_create();
 void assembly_delete(struct assembly *);
 
-// tilføj assemblerkode knyttet til addresse
-void assembly_set(struct assembly *as, int addr, const char *text);
+// knyt fortegnelsen til programmets lager og symboler; syms må være NULL
+void assembly_attach(struct assembly *as, struct memory *mem, struct symbols *syms);
 
-// find assemblerkode knyttet til addresse
+// find assemblerkode knyttet til addresse; teksten dannes af instruktionen
+// i lageret, og gælder indtil næste kald i samme tråd
 const char *assembly_get(struct assembly *as, int addr);
 
 #endif
@@ -0,0 +1,320 @@
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define POLICY_LRU 0
+#define POLICY_FIFO 1
+#define POLICY_RANDOM 2
+
+static const char *policy_names[] = {"lru", "fifo", "random"};
+
+// One cache level. The tags of a set are kept next to each other in a
+// single array, most recently inserted (fifo) or used (lru) first, so a
+// lookup touches one or two host cache lines. A tag is the line number
+// plus one; zero marks an empty way.
+struct level
+{
+  const char *name;
+  int enabled;
+  int size, assoc, line_size, policy;
+  int line_shift;
+  uint32_t set_mask;
+  uint32_t *tags;
+  long accesses;
+  long misses;
+};
+
+// misses attributed to the function containing the pc
+struct symbol_stats
+{
+  long fetch_misses;
+  long data_accesses;
+  long data_misses;
+  long l2_misses;
+};
+
+struct cache
+{
+  struct cache_batch batch;
+  struct level l1i, l1d, l2;
+  uint32_t random_state;
+  struct symbols *syms;
+  int num_symbols;
+  struct symbol_stats *stats; // num_symbols + 1 entries, last is "no symbol"
+  uint32_t last_low, last_size;
+  int last_index;
+};
+
+static int log2_exact(int x)
+{
+  int shift = 0;
+  while ((1 << shift) < x)
+    shift++;
+  return (1 << shift) == x ? shift : -1;
+}
+
+static void level_defaults(struct level *level, const char *name, int size)
+{
+  level->name = name;
+  level->enabled = 1;
+  level->size = size;
+  level->assoc = 8;
+  level->line_size = 64;
+  level->policy = POLICY_LRU;
+}
+
+// parses "size:assoc:line[:policy]" or "off" into level
+static int parse_level(struct level *level, const char *spec)
+{
+  if (strcmp(spec, "off") == 0)
+  {
+    level->enabled = 0;
+    return 1;
+  }
+  char *end;
+  long size = strtol(spec, &end, 10);
+  if (*end == 'k' || *end == 'K')
+    size <<= 10, end++;
+  else if (*end == 'm' || *end == 'M')
+    size <<= 20, end++;
+  if (*end != ':')
+    return 0;
+  level->size = size;
+  level->assoc = strtol(end + 1, &end, 10);
+  if (*end != ':')
+    return 0;
+  level->line_size = strtol(end + 1, &end, 10);
+  if (*end == ':')
+  {
+    int p;
+    for (p = 0; p < 3; ++p)
+      if (strncmp(end + 1, policy_names[p], strlen(policy_names[p])) == 0)
+        break;
+    if (p == 3)
+      return 0;
+    level->policy = p;
+    end += 1 + strlen(policy_names[p]);
+  }
+  return *end == 0 || *end == ',';
+}
+
+static void level_init(struct level *level)
+{
+  if (!level->enabled)
+    return;
+  int sets = level->size / (level->assoc * level->line_size);
+  level->line_shift = log2_exact(level->line_size);
+  if (level->assoc <= 0 || sets <= 0 || level->line_shift < 0 || log2_exact(sets) < 0)
+  {
+    printf("Bad cache geometry for %s, sizes must be powers of two. Exiting\n", level->name);
+    exit(-1);
+  }
+  level->set_mask = sets - 1;
+  level->tags = calloc(sizeof(uint32_t), sets * level->assoc);
+}
+
+struct cache *cache_create(const char *config, struct symbols *syms)
+{
+  struct cache *cache = calloc(sizeof(struct cache), 1);
+  level_defaults(&cache->l1i, "L1I", 32 << 10);
+  level_defaults(&cache->l1d, "L1D", 32 << 10);
+  level_defaults(&cache->l2, "L2", 256 << 10);
+  if (strcmp(config, "default") != 0)
+  {
+    for (const char *p = config; p && *p; p = strchr(p, ','), p = p ? p + 1 : NULL)
+    {
+      struct level *level = NULL;
+      if (strncmp(p, "l1i=", 4) == 0)
+        level = &cache->l1i;
+      else if (strncmp(p, "l1d=", 4) == 0)
+        level = &cache->l1d;
+      else if (strncmp(p, "l2=", 3) == 0)
+        level = &cache->l2;
+      if (!level || !parse_level(level, strchr(p, '=') + 1))
+      {
+        printf("Bad cache configuration '%s'. Exiting\n", p);
+        exit(-1);
+      }
+    }
+  }
+  if (!cache->l1i.enabled || !cache->l1d.enabled)
+  {
+    printf("The L1 caches can't be turned off. Exiting\n");
+    exit(-1);
+  }
+  level_init(&cache->l1i);
+  level_init(&cache->l1d);
+  level_init(&cache->l2);
+  cache->random_state = 0x2545f491;
+  cache->syms = syms;
+  cache->num_symbols = symbols_count(syms);
+  cache->stats = calloc(sizeof(struct symbol_stats), cache->num_symbols + 1);
+  cache->batch.cache = cache;
+  cache->batch.fetch_shift = cache->l1i.line_shift;
+  cache->batch.last_fetch_line = UINT32_MAX;
+  return cache;
+}
+
+void cache_delete(struct cache *cache)
+{
+  free(cache->l1i.tags);
+  free(cache->l1d.tags);
+  free(cache->l2.tags);
+  free(cache->stats);
+  free(cache);
+}
+
+struct cache_batch *cache_batch(struct cache *cache)
+{
+  return &cache->batch;
+}
+
+static uint32_t next_random(struct cache *cache)
+{
+  uint32_t x = cache->random_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  cache->random_state = x;
+  return x;
+}
+
+// Returns 1 on a hit. Misses allocate the line (also for stores).
+static int level_access(struct cache *cache, struct level *level, uint32_t addr)
+{
+  uint32_t line = addr >> level->line_shift;
+  uint32_t tag = line + 1;
+  int assoc = level->assoc;
+  uint32_t *ways = level->tags + (line & level->set_mask) * assoc;
+  level->accesses++;
+  for (int w = 0; w < assoc; ++w)
+  {
+    if (ways[w] == tag)
+    {
+      if (level->policy == POLICY_LRU && w > 0)
+      {
+        memmove(ways + 1, ways, w * sizeof(uint32_t));
+        ways[0] = tag;
+      }
+      return 1;
+    }
+  }
+  level->misses++;
+  if (level->policy == POLICY_RANDOM)
+  {
+    int victim = ways[assoc - 1] ? (int)(next_random(cache) % assoc) : assoc - 1;
+    for (int w = 0; w < assoc; ++w)
+    {
+      if (ways[w] == 0)
+      {
+        victim = w;
+        break;
+      }
+    }
+    ways[victim] = tag;
+  }
+  else
+  {
+    memmove(ways + 1, ways, (assoc - 1) * sizeof(uint32_t));
+    ways[0] = tag;
+  }
+  return 0;
+}
+
+// Consecutive accesses mostly come from the same function, so the address
+// range of the last symbol looked up is remembered
+static struct symbol_stats *symbol_stats(struct cache *cache, uint32_t pc)
+{
+  if (pc - cache->last_low >= cache->last_size)
+  {
+    int index = symbols_index(cache->syms, pc);
+    cache->last_index = index < 0 ? cache->num_symbols : index;
+    cache->last_low = index < 0 ? 0 : (uint32_t)symbols_addr(cache->syms, index);
+    uint32_t high = index + 1 < cache->num_symbols ? (uint32_t)symbols_addr(cache->syms, index + 1) : UINT32_MAX;
+    if (index < 0)
+      high = cache->num_symbols ? (uint32_t)symbols_addr(cache->syms, 0) : UINT32_MAX;
+    cache->last_size = high - cache->last_low;
+  }
+  return &cache->stats[cache->last_index];
+}
+
+void cache_drain(struct cache *cache)
+{
+  struct cache_batch *batch = &cache->batch;
+  for (int i = 0; i < batch->count; ++i)
+  {
+    uint32_t addr = batch->addr[i];
+    int fetch = batch->kind[i] == CACHE_FETCH;
+    struct symbol_stats *stats = NULL;
+    if (!fetch)
+    {
+      stats = symbol_stats(cache, batch->pc[i]);
+      stats->data_accesses++;
+    }
+    if (level_access(cache, fetch ? &cache->l1i : &cache->l1d, addr))
+      continue;
+    if (!stats)
+      stats = symbol_stats(cache, batch->pc[i]);
+    if (fetch)
+      stats->fetch_misses++;
+    else
+      stats->data_misses++;
+    if (cache->l2.enabled && !level_access(cache, &cache->l2, addr))
+      stats->l2_misses++;
+  }
+  batch->count = 0;
+}
+
+static void report_level(struct level *level, long extra_hits, FILE *out)
+{
+  if (!level->enabled)
+    return;
+  long accesses = level->accesses + extra_hits;
+  double rate = accesses ? 100.0 * level->misses / accesses : 0.0;
+  int kib = level->size % 1024 == 0;
+  fprintf(out, "Cache %-3s %6d %-3s %2d-way %3d B %-6s: %12ld accesses %10ld misses (%.2f%% miss, %.2f%% hit)\n",
+          level->name, kib ? level->size >> 10 : level->size, kib ? "KiB" : "B", level->assoc, level->line_size,
+          policy_names[level->policy], accesses, level->misses, rate, accesses ? 100.0 - rate : 0.0);
+}
+
+static int count_level(struct level *level, long extra_hits, const char **names, long *values)
+{
+  static const char *count_names[][2] = {{"L1I accesses", "L1I misses"},
+                                         {"L1D accesses", "L1D misses"},
+                                         {"L2 accesses", "L2 misses"}};
+  if (!level->enabled)
+    return 0;
+  int index = level->name[1] == '2' ? 2 : level->name[2] == 'D';
+  names[0] = count_names[index][0];
+  names[1] = count_names[index][1];
+  values[0] = level->accesses + extra_hits;
+  values[1] = level->misses;
+  return 2;
+}
+
+int cache_counts(struct cache *cache, const char **names, long *values)
+{
+  cache_drain(cache);
+  int n = count_level(&cache->l1i, cache->batch.same_line_fetches, names, values);
+  n += count_level(&cache->l1d, 0, names + n, values + n);
+  n += count_level(&cache->l2, 0, names + n, values + n);
+  return n;
+}
+
+void cache_report(struct cache *cache, FILE *out)
+{
+  cache_drain(cache);
+  report_level(&cache->l1i, cache->batch.same_line_fetches, out);
+  report_level(&cache->l1d, 0, out);
+  report_level(&cache->l2, 0, out);
+  fprintf(out, "%-24s %10s %12s %10s %10s\n", "Symbol", "L1I miss", "L1D access", "L1D miss", "L2 miss");
+  for (int i = 0; i <= cache->num_symbols; ++i)
+  {
+    struct symbol_stats *s = &cache->stats[i];
+    if (!s->fetch_misses && !s->data_accesses && !s->data_misses && !s->l2_misses)
+      continue;
+    const char *name = i < cache->num_symbols ? symbols_name(cache->syms, i) : "(unknown)";
+    fprintf(out, "%-24s %10ld %12ld %10ld %10ld\n", name, s->fetch_misses, s->data_accesses,
+            s->data_misses, s->l2_misses);
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "symbols.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// Model of a cache hierarchy with split L1 instruction and data caches and
+// an optional unified L2. Accesses are recorded into a batch by the
+// simulation loop and run through the tag arrays when the batch is full.
+struct cache;
+
+#define CACHE_FETCH 0
+#define CACHE_LOAD 1
+#define CACHE_STORE 2
+
+#define CACHE_BATCH 4096
+
+struct cache_batch
+{
+  int count;
+  int fetch_shift;         // log2 of the L1I line size
+  uint32_t last_fetch_line; // line of the latest recorded fetch
+  long same_line_fetches;   // fetches from that line, always L1I hits
+  struct cache *cache;
+  uint32_t pc[CACHE_BATCH];
+  uint32_t addr[CACHE_BATCH];
+  uint8_t kind[CACHE_BATCH];
+};
+
+// config is "default" or a comma separated list of level=size:assoc:line[:policy]
+// for the levels l1i, l1d and l2, e.g. "l1d=16k:4:32:fifo,l2=off".
+// Policies are lru, fifo and random. syms is used for the per symbol report.
+struct cache *cache_create(const char *config, struct symbols *syms);
+void cache_delete(struct cache *cache);
+
+// the batch the simulation loop records into
+struct cache_batch *cache_batch(struct cache *cache);
+
+// run all recorded accesses through the model
+void cache_drain(struct cache *cache);
+
+// print hit/miss rates per level and per symbol
+void cache_report(struct cache *cache, FILE *out);
+
+// The totals behind the report, accesses and misses of each enabled level,
+// for sampling. Fills in at most CACHE_COUNTS names and values and returns
+// how many.
+#define CACHE_COUNTS 6
+int cache_counts(struct cache *cache, const char **names, long *values);
+
+static inline void cache_record(struct cache_batch *batch, uint32_t pc, uint32_t addr, int kind)
+{
+  batch->pc[batch->count] = pc;
+  batch->addr[batch->count] = addr;
+  batch->kind[batch->count] = kind;
+  if (++batch->count == CACHE_BATCH)
+    cache_drain(batch->cache);
+}
+
+// Sequential fetches from the line fetched last can't miss, so they are
+// only counted instead of being recorded
+static inline void cache_fetch(struct cache_batch *batch, uint32_t pc)
+{
+  uint32_t line = pc >> batch->fetch_shift;
+  if (line == batch->last_fetch_line)
+  {
+    batch->same_line_fetches++;
+    return;
+  }
+  batch->last_fetch_line = line;
+  cache_record(batch, pc, pc, CACHE_FETCH);
+}
+
+#endif
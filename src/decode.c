@@ -0,0 +1,450 @@
+#include "decode.h"
+#include "isa.h"
+#include <stddef.h>
+
+// Sign extends the lowest bits of value
+static int32_t sign_extend(uint32_t value, int bits) {
+    uint32_t sign = 1U << (bits - 1);
+    return (int32_t)((value ^ sign) - sign);
+}
+
+uint32_t decode_fetch(struct memory *mem, uint32_t pc) {
+    uint32_t low = memory_rd_h(mem, pc);
+    if ((low & 0x3) != 0x3) {
+        return low;
+    }
+    return low | ((uint32_t)memory_rd_h(mem, pc + 2) << 16);
+}
+
+// Encoders for the 32 bit formats, see figure 2.3 in the spec
+static uint32_t encode_r(int funct7, int rs2, int rs1, int funct3, int rd, int opcode) {
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t encode_i(int32_t imm, int rs1, int funct3, int rd, int opcode) {
+    return ((uint32_t)(imm & 0xFFF) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t encode_s(int32_t imm, int rs2, int rs1, int funct3, int opcode) {
+    return ((uint32_t)((imm >> 5) & 0x7F) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12)
+         | ((imm & 0x1F) << 7) | opcode;
+}
+
+static uint32_t encode_b(int32_t imm, int rs2, int rs1, int funct3) {
+    return ((uint32_t)((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3F) << 25) | (rs2 << 20) | (rs1 << 15)
+         | (funct3 << 12) | (((imm >> 1) & 0xF) << 8) | (((imm >> 11) & 1) << 7)
+         | OPCODE_BEQ_BNE_BLT_BGE_BLTU_BGEU;
+}
+
+static uint32_t encode_j(int32_t imm, int rd) {
+    return ((uint32_t)((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3FF) << 21) | (((imm >> 11) & 1) << 20)
+         | (imm & 0xFF000) | (rd << 7) | OPCODE_JAL;
+}
+
+// Bit i of c as bit `to` of the result
+#define BIT(c, i, to) ((((c) >> (i)) & 1) << (to))
+
+// RV32C, chapter 16 of the spec. rd'/rs1'/rs2' are x8-x15.
+uint32_t decode_expand(uint32_t c) {
+    int funct3 = (c >> 13) & 0x7;
+    int rd = (c >> 7) & 0x1F;   // also rs1
+    int rs2 = (c >> 2) & 0x1F;
+    int rd_p = 8 + ((c >> 2) & 0x7);  // rd' / rs2' in bits 4:2
+    int rs1_p = 8 + ((c >> 7) & 0x7); // rd' / rs1' in bits 9:7
+    int32_t imm6 = sign_extend(BIT(c, 12, 5) | ((c >> 2) & 0x1F), 6);
+    switch (c & 0x3) {
+        case 0x0:
+            switch (funct3) {
+                case 0x0: // c.addi4spn
+                    {
+                        int32_t imm = BIT(c, 12, 5) | BIT(c, 11, 4) | BIT(c, 10, 9) | BIT(c, 9, 8) | BIT(c, 8, 7)
+                                    | BIT(c, 7, 6) | BIT(c, 6, 2) | BIT(c, 5, 3);
+                        return imm ? encode_i(imm, 2, 0x0, rd_p, OPCODE_ADDI_SLTI_SLTIU_XORI_ORI_ANDI_SLLI_SRLI_SRAI) : 0;
+                    }
+                case 0x1: // c.fld
+                    return encode_i(((c >> 7) & 0x38) | BIT(c, 6, 7) | BIT(c, 5, 6), rs1_p, 0x3, rd_p, OPCODE_FLW_FLD);
+                case 0x2: // c.lw
+                    return encode_i(BIT(c, 12, 5) | BIT(c, 11, 4) | BIT(c, 10, 3) | BIT(c, 6, 2) | BIT(c, 5, 6),
+                                    rs1_p, 0x2, rd_p, OPCODE_LB_LH_LW_LBU_LHU);
+                case 0x3: // c.flw
+                    return encode_i(BIT(c, 12, 5) | BIT(c, 11, 4) | BIT(c, 10, 3) | BIT(c, 6, 2) | BIT(c, 5, 6),
+                                    rs1_p, 0x2, rd_p, OPCODE_FLW_FLD);
+                case 0x5: // c.fsd
+                    return encode_s(((c >> 7) & 0x38) | BIT(c, 6, 7) | BIT(c, 5, 6), rd_p, rs1_p, 0x3, OPCODE_FSW_FSD);
+                case 0x6: // c.sw
+                    return encode_s(BIT(c, 12, 5) | BIT(c, 11, 4) | BIT(c, 10, 3) | BIT(c, 6, 2) | BIT(c, 5, 6),
+                                    rd_p, rs1_p, 0x2, OPCODE_SB_SH_SW);
+                case 0x7: // c.fsw
+                    return encode_s(BIT(c, 12, 5) | BIT(c, 11, 4) | BIT(c, 10, 3) | BIT(c, 6, 2) | BIT(c, 5, 6),
+                                    rd_p, rs1_p, 0x2, OPCODE_FSW_FSD);
+            }
+            return 0;
+        case 0x1:
+            switch (funct3) {
+                case 0x0: // c.addi, c.nop
+                    return encode_i(imm6, rd, 0x0, rd, OPCODE_ADDI_SLTI_SLTIU_XORI_ORI_ANDI_SLLI_SRLI_SRAI);
+                case 0x1: // c.jal
+                case 0x5: // c.j
+                    return encode_j(sign_extend(BIT(c, 12, 11) | BIT(c, 11, 4) | BIT(c, 10, 9) | BIT(c, 9, 8)
+                                                | BIT(c, 8, 10) | BIT(c, 7, 6) | BIT(c, 6, 7) | BIT(c, 5, 3)
+                                                | BIT(c, 4, 2) | BIT(c, 3, 1) | BIT(c, 2, 5), 12),
+                                    funct3 == 0x1 ? 1 : 0);
+                case 0x2: // c.li
+                    return encode_i(imm6, 0, 0x0, rd, OPCODE_ADDI_SLTI_SLTIU_XORI_ORI_ANDI_SLLI_SRLI_SRAI);
+                case 0x3:
+                    if (rd == 2) { // c.addi16sp
+                        int32_t imm = sign_extend(BIT(c, 12, 9) | BIT(c, 6, 4) | BIT(c, 5, 6) | BIT(c, 4, 8)
+                                                  | BIT(c, 3, 7) | BIT(c, 2, 5), 10);
+                        return imm ? encode_i(imm, 2, 0x0, 2, OPCODE_ADDI_SLTI_SLTIU_XORI_ORI_ANDI_SLLI_SRLI_SRAI) : 0;
+                    }
+                    // c.lui
+                    return imm6 ? ((uint32_t)imm6 << 12) | (rd << 7) | OPCODE_LUI : 0;
+                case 0x4:
+                    switch ((c >> 10) & 0x3) {
+                        case 0x0: // c.srli
+                            return encode_i(rs2, rs1_p, 0x5, rs1_p, OPCODE_ADDI_SLTI_SLTIU_XORI_ORI_ANDI_SLLI_SRLI_SRAI);
+                        case 0x1: // c.srai
+                            return encode_i(0x400 | rs2, rs1_p, 0x5, rs1_p, OPCODE_ADDI_SLTI_SLTIU_XORI_ORI_ANDI_SLLI_SRLI_SRAI);
+                        case 0x2: // c.andi
+                            return encode_i(imm6, rs1_p, 0x7, rs1_p, OPCODE_ADDI_SLTI_SLTIU_XORI_ORI_ANDI_SLLI_SRLI_SRAI);
+                    }
+                    if (c & 0x1000) {
+                        return 0; // c.subw and c.addw are RV64
+                    }
+                    {
+                        // c.sub, c.xor, c.or, c.and
+                        static const int funct3s[4] = {0x0, 0x4, 0x6, 0x7};
+                        int op = (c >> 5) & 0x3;
+                        return encode_r(op == 0 ? 0x20 : 0x00, rd_p, rs1_p, funct3s[op], rs1_p,
+                                        OPCODE_ADD_SUB_SLL_SLT_SLTU_XOR_SRL_SRA_OR_AND);
+                    }
+                case 0x6: // c.beqz
+                case 0x7: // c.bnez
+                    return encode_b(sign_extend(BIT(c, 12, 8) | BIT(c, 11, 4) | BIT(c, 10, 3) | BIT(c, 6, 7)
+                                                | BIT(c, 5, 6) | BIT(c, 4, 2) | BIT(c, 3, 1) | BIT(c, 2, 5), 9),
+                                    0, rs1_p, funct3 == 0x6 ? 0x0 : 0x1);
+            }
+            return 0;
+        case 0x2:
+            switch (funct3) {
+                case 0x0: // c.slli
+                    return encode_i(rs2, rd, 0x1, rd, OPCODE_ADDI_SLTI_SLTIU_XORI_ORI_ANDI_SLLI_SRLI_SRAI);
+                case 0x1: // c.fldsp
+                    return encode_i(BIT(c, 12, 5) | (((c >> 5) & 0x3) << 3) | (((c >> 2) & 0x7) << 6),
+                                    2, 0x3, rd, OPCODE_FLW_FLD);
+                case 0x2: // c.lwsp
+                    return rd ? encode_i(BIT(c, 12, 5) | (((c >> 4) & 0x7) << 2) | (((c >> 2) & 0x3) << 6),
+                                         2, 0x2, rd, OPCODE_LB_LH_LW_LBU_LHU) : 0;
+                case 0x3: // c.flwsp
+                    return encode_i(BIT(c, 12, 5) | (((c >> 4) & 0x7) << 2) | (((c >> 2) & 0x3) << 6),
+                                    2, 0x2, rd, OPCODE_FLW_FLD);
+                case 0x4:
+                    if ((c & 0x1000) == 0) {
+                        if (rs2 == 0) { // c.jr
+                            return rd ? encode_i(0, rd, 0x0, 0, OPCODE_JALR) : 0;
+                        }
+                        return encode_r(0, rs2, 0, 0x0, rd, OPCODE_ADD_SUB_SLL_SLT_SLTU_XOR_SRL_SRA_OR_AND); // c.mv
+                    }
+                    if (rs2 == 0) {
+                        // c.ebreak, or c.jalr
+                        return rd ? encode_i(0, rd, 0x0, 1, OPCODE_JALR) : 0x00100073;
+                    }
+                    return encode_r(0, rs2, rd, 0x0, rd, OPCODE_ADD_SUB_SLL_SLT_SLTU_XOR_SRL_SRA_OR_AND); // c.add
+                case 0x5: // c.fsdsp
+                    return encode_s((((c >> 10) & 0x7) << 3) | (((c >> 7) & 0x7) << 6), rs2, 2, 0x3, OPCODE_FSW_FSD);
+                case 0x6: // c.swsp
+                    return encode_s((((c >> 9) & 0xF) << 2) | (((c >> 7) & 0x3) << 6), rs2, 2, 0x2, OPCODE_SB_SH_SW);
+                case 0x7: // c.fswsp
+                    return encode_s((((c >> 9) & 0xF) << 2) | (((c >> 7) & 0x3) << 6), rs2, 2, 0x2, OPCODE_FSW_FSD);
+            }
+            return 0;
+    }
+    return 0;
+}
+
+struct isa_entry {
+    uint32_t mask, match;
+    uint8_t op, format;
+    bool alu; // only computes rd, from an expression
+};
+
+#define ISA_ALU_ENTRY(op, name, mask, match, format, expression) {mask, match, op, ISA_##format, true},
+#define ISA_ENTRY(op, name, mask, match, format, ...) {mask, match, op, ISA_##format, false},
+static const struct isa_entry isa[] = {ISA_RV32IM(ISA_ALU_ENTRY, ISA_ENTRY, ISA_ENTRY)};
+
+uint32_t decode_alu(int op, uint32_t a, uint32_t b) {
+    switch (op) {
+#define ISA_ALU_CASE(op, name, mask, match, format, expression) \
+        case op: \
+            return (expression);
+#define ISA_SKIP(...)
+        ISA_RV32IM(ISA_ALU_CASE, ISA_SKIP, ISA_SKIP)
+    }
+    return 0;
+}
+
+static int32_t immediate(uint32_t instruction, int format) {
+    switch (format) {
+        case ISA_I:
+            return sign_extend(instruction >> 20, 12);
+        case ISA_SHAMT:
+            return (instruction >> 20) & 0x1F;
+        case ISA_S:
+            return sign_extend(((instruction >> 20) & 0xFE0) | ((instruction >> 7) & 0x1F), 12); // imm[11:5] and imm[4:0]
+        case ISA_B:
+            return sign_extend(((instruction & 0x80000000) >> 19) | // imm[12]
+                               ((instruction & 0x7E000000) >> 20) | // imm[10:5]
+                               ((instruction & 0x00000F00) >> 7) |  // imm[4:1]
+                               ((instruction & 0x00000080) << 4), 13); // imm[11]
+        case ISA_U:
+            return instruction & 0xFFFFF000; // imm[31:12]
+        case ISA_J:
+            return sign_extend(((instruction & 0x80000000) >> 11) | // imm[20]
+                               ((instruction & 0x7FE00000) >> 20) | // imm[10:1]
+                               ((instruction & 0x00100000) >> 9) |  // imm[11]
+                               (instruction & 0x000FF000), 21);     // imm[19:12]
+    }
+    return 0;
+}
+
+static const struct isa_entry *find(uint32_t instruction) {
+    for (unsigned i = 0; i < sizeof(isa) / sizeof(isa[0]); ++i) {
+        if ((instruction & isa[i].mask) == isa[i].match) {
+            return &isa[i];
+        }
+    }
+    return NULL;
+}
+
+int decode_isa(uint32_t instruction, int *format, int32_t *imm) {
+    const struct isa_entry *e = find(instruction);
+    if (e == NULL) {
+        return OP_UNDECODED;
+    }
+    *format = e->format;
+    *imm = immediate(instruction, e->format);
+    return e->op;
+}
+
+// Specialized forms of the operations that only compute rd, so the loop
+// never has to check for x0: nothing is written to x0, so that is a nop;
+// with x0 for every register operand the result is a constant; and adding,
+// or-ing or shifting by zero is a move.
+static void specialize(struct insn *d, int format) {
+    if (d->rd == 0) {
+        d->op = OP_NOP;
+        return;
+    }
+    if (format == ISA_U) {
+        return;
+    }
+    bool b_zero = format == ISA_R ? d->rs2 == 0 : d->imm == 0;
+    if (d->rs1 == 0 && b_zero) {
+        d->imm = decode_alu(d->op, 0, 0);
+        d->op = OP_LI;
+    } else if (d->rs1 == 0 && format == ISA_R) {
+        if (d->op == OP_ADD || d->op == OP_OR || d->op == OP_XOR) {
+            d->op = OP_MV; // c.mv is add rd, x0, rs2
+            d->rs1 = d->rs2;
+        }
+    } else if (d->rs1 == 0) {
+        d->imm = decode_alu(d->op, 0, d->imm); // li
+        d->op = OP_LI;
+    } else if (b_zero) {
+        switch (d->op) {
+            case OP_ADDI: // mv
+            case OP_XORI:
+            case OP_ORI:
+            case OP_SLLI:
+            case OP_SRLI:
+            case OP_SRAI:
+            case OP_ADD:
+            case OP_SUB:
+            case OP_SLL:
+            case OP_XOR:
+            case OP_SRL:
+            case OP_SRA:
+            case OP_OR:
+                d->op = OP_MV;
+                break;
+        }
+    }
+}
+
+void decode(uint32_t instruction, struct insn *d) {
+    d->size = 4;
+    if ((instruction & 0x3) != 0x3) {
+        instruction = decode_expand(instruction & 0xFFFF);
+        d->size = 2;
+    }
+    // Opcode is the last 7 bits in the instructions. See figure 2.2 & 2.4:
+    // https://riscv.org/wp-content/uploads/2017/05/riscv-spec-v2.2.pdf
+    uint32_t opcode = instruction & 0x7F;
+    uint32_t funct3 = (instruction >> 12) & 0x7;
+    uint32_t funct7 = (instruction >> 25) & 0x7F;
+    d->word = instruction;
+    d->rd = (instruction >> 7) & 0x1F;
+    d->rs1 = (instruction >> 15) & 0x1F;
+    d->rs2 = (instruction >> 20) & 0x1F;
+    d->imm = 0;
+    d->op = OP_NOP;
+    d->count = 1;
+    d->length = d->size;
+    const struct isa_entry *e = find(instruction);
+    if (e) {
+        d->op = e->op;
+        d->imm = immediate(instruction, e->format);
+        if (e->alu) {
+            specialize(d, e->format);
+        }
+        d->fop = d->op;
+        return;
+    }
+    // The extensions outside the table
+    switch (opcode) {
+        case OPCODE_ADDI_SLTI_SLTIU_XORI_ORI_ANDI_SLLI_SRLI_SRAI:
+            if (funct3 == 0x1 || funct3 == 0x5) { // shifts use imm[4:0] as shamt
+                uint32_t imm12 = instruction >> 20;
+                d->imm = imm12 & 0x1F;
+                // Zbb, the unary operations are told apart by the rs2 field
+                if (funct3 == 0x1 && funct7 == 0x30) {
+                    static const uint8_t unary[8] = {OP_CLZ, OP_CTZ, OP_CPOP, OP_NOP, OP_SEXT_B, OP_SEXT_H, OP_NOP, OP_NOP};
+                    d->op = d->rs2 < 8 ? unary[d->rs2] : OP_NOP;
+                }
+                if (funct3 == 0x5 && funct7 == 0x30) {
+                    d->op = OP_RORI;
+                }
+                if (funct3 == 0x5 && imm12 == 0x287) {
+                    d->op = OP_ORC_B;
+                }
+                if (funct3 == 0x5 && imm12 == 0x698) {
+                    d->op = OP_REV8;
+                }
+            }
+            break;
+        case OPCODE_ADD_SUB_SLL_SLT_SLTU_XOR_SRL_SRA_OR_AND:
+            // Zba and Zbb
+            if (funct7 == 0x10 && (funct3 == 0x2 || funct3 == 0x4 || funct3 == 0x6)) {
+                d->op = OP_SH1ADD + funct3 / 2 - 1;
+            }
+            if (funct7 == 0x20 && funct3 >= 0x4 && funct3 != 0x5) {
+                static const uint8_t negated[4] = {OP_XNOR, OP_NOP, OP_ORN, OP_ANDN};
+                d->op = negated[funct3 - 4];
+            }
+            if (funct7 == 0x05 && funct3 >= 0x4) {
+                static const uint8_t minmax[4] = {OP_MIN, OP_MINU, OP_MAX, OP_MAXU};
+                d->op = minmax[funct3 - 4];
+            }
+            if (funct7 == 0x30 && (funct3 == 0x1 || funct3 == 0x5)) {
+                d->op = funct3 == 0x1 ? OP_ROL : OP_ROR;
+            }
+            if (funct7 == 0x04 && funct3 == 0x4 && d->rs2 == 0) {
+                d->op = OP_ZEXT_H;
+            }
+            break;
+        case 0x73:
+            // The floating point CSRs fflags, frm and fcsr, and mhartid; other
+            // CSRs aren't simulated
+            if (funct3 != 0x0 && funct3 != 0x4 && (instruction >> 20) >= 0x1 && (instruction >> 20) <= 0x3) {
+                d->op = OP_FCSR;
+            }
+            if (funct3 != 0x0 && funct3 != 0x4 && (instruction >> 20) == 0xF14) {
+                d->op = OP_HARTID;
+            }
+            break;
+        case OPCODE_AMO:
+            if (funct3 == 0x2) {
+                // funct5 is the upper 5 bits of funct7, the aq and rl bits are ignored
+                static const uint8_t amos[32] = {
+                    [0x00] = OP_AMOADD_W, [0x01] = OP_AMOSWAP_W, [0x02] = OP_LR_W, [0x03] = OP_SC_W,
+                    [0x04] = OP_AMOXOR_W, [0x08] = OP_AMOOR_W, [0x0C] = OP_AMOAND_W, [0x10] = OP_AMOMIN_W,
+                    [0x14] = OP_AMOMAX_W, [0x18] = OP_AMOMINU_W, [0x1C] = OP_AMOMAXU_W,
+                };
+                d->op = amos[funct7 >> 2] ? amos[funct7 >> 2] : OP_NOP;
+            }
+            break;
+
+        // RV32F and RV32D, see chapters 11 and 12 of the spec. The operands
+        // are f registers except where the operation says otherwise, and
+        // fpu.c reads the rounding mode and rs3 from the instruction word.
+        case OPCODE_FLW_FLD:
+            d->op = funct3 == 0x2 ? OP_FLW : funct3 == 0x3 ? OP_FLD : OP_NOP;
+            d->imm = sign_extend(instruction >> 20, 12);
+            break;
+        case OPCODE_FSW_FSD:
+            d->op = funct3 == 0x2 ? OP_FSW : funct3 == 0x3 ? OP_FSD : OP_NOP;
+            d->imm = sign_extend((funct7 << 5) | d->rd, 12);
+            break;
+        case OPCODE_FMADD:
+        case OPCODE_FMSUB:
+        case OPCODE_FNMSUB:
+        case OPCODE_FNMADD:
+            if ((funct7 & 0x3) <= 1) { // fmt: S or D
+                d->op = OP_FMADD_S + ((opcode - OPCODE_FMADD) >> 2) + (funct7 & 0x1) * (OP_FMADD_D - OP_FMADD_S);
+            }
+            break;
+        case OPCODE_OP_FP:
+            {
+                // fmt is the lowest bit of funct7, the operation the rest
+                int double_offset = (funct7 & 0x1) * (OP_FMADD_D - OP_FMADD_S);
+                switch (funct7 & ~0x1) {
+                    case 0x00:
+                    case 0x04:
+                    case 0x08:
+                    case 0x0C:
+                        d->op = OP_FADD_S + (funct7 >> 2) + double_offset;
+                        break;
+                    case 0x2C:
+                        d->op = OP_FSQRT_S + double_offset;
+                        break;
+                    case 0x10:
+                        d->op = funct3 <= 0x2 ? OP_FSGNJ_S + funct3 + double_offset : OP_NOP;
+                        break;
+                    case 0x14:
+                        d->op = funct3 <= 0x1 ? OP_FMIN_S + funct3 + double_offset : OP_NOP;
+                        break;
+                    case 0x50:
+                        d->op = funct3 <= 0x2 ? OP_FLE_S + funct3 + double_offset : OP_NOP;
+                        break;
+                    case 0x60:
+                        d->op = d->rs2 <= 1 ? OP_FCVT_W_S + d->rs2 + double_offset : OP_NOP;
+                        break;
+                    case 0x68:
+                        d->op = d->rs2 <= 1 ? OP_FCVT_S_W + d->rs2 + double_offset : OP_NOP;
+                        break;
+                    case 0x70:
+                        if (funct3 == 0x1) {
+                            d->op = OP_FCLASS_S + double_offset;
+                        } else if (funct3 == 0x0 && funct7 == 0x70) {
+                            d->op = OP_FMV_X_W;
+                        }
+                        break;
+                    case 0x78:
+                        d->op = funct7 == 0x78 && funct3 == 0x0 ? OP_FMV_W_X : OP_NOP;
+                        break;
+                    case 0x20:
+                        // fcvt.s.d is fmt S from rs2 D, fcvt.d.s the other way round
+                        if (funct7 == 0x20 && d->rs2 == 1) {
+                            d->op = OP_FCVT_S_D;
+                        } else if (funct7 == 0x21 && d->rs2 == 0) {
+                            d->op = OP_FCVT_D_S;
+                        }
+                        break;
+                }
+                break;
+            }
+    }
+    d->fop = d->op;
+}
+
+bool is_control(int op) {
+    return op == OP_JAL || op == OP_JALR || (op >= OP_BEQ && op <= OP_BGEU) || op == OP_ECALL;
+}
+
+bool is_float(int op) {
+    return op >= OP_FLW && op <= OP_FCSR;
+}
+
+bool is_atomic(int op) {
+    return op >= OP_FENCE && op <= OP_AMOMAXU_W;
+}
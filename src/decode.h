@@ -0,0 +1,146 @@
+#ifndef __DECODE_H__
+#define __DECODE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory.h"
+
+// We define all of the opcodes from the different instructions to implement
+// by reading the opcode value in the tables p. 104 & 105 in the riscv spec.
+// The values are in binary and we translate them to hex as they are shorter
+// easier to read and use for comparisons.
+
+// RV321 Base Instruction Set
+// Opcodes
+#define OPCODE_LUI 0x37
+#define OPCODE_AUIPC 0x17
+#define OPCODE_JAL 0x6F
+#define OPCODE_JALR 0x67
+#define OPCODE_BEQ_BNE_BLT_BGE_BLTU_BGEU 0x63
+#define OPCODE_LB_LH_LW_LBU_LHU 0x3
+#define OPCODE_SB_SH_SW 0x23
+#define OPCODE_ADDI_SLTI_SLTIU_XORI_ORI_ANDI_SLLI_SRLI_SRAI 0x13
+#define OPCODE_ADD_SUB_SLL_SLT_SLTU_XOR_SRL_SRA_OR_AND 0x33
+
+// RV32M Standard Extension
+// Opcodes
+#define OPCODE_MUL_DIV_REM 0x33 // (They all share same value)
+
+// Funct7
+#define FUNCT7_MUL_DIV_REM 0x01 // (They all share same value)
+
+// RV32A Standard Extension
+// Opcodes
+#define OPCODE_AMO 0x2F
+#define OPCODE_FENCE 0x0F
+
+// RV32F and RV32D Standard Extensions
+// Opcodes
+#define OPCODE_FLW_FLD 0x07
+#define OPCODE_FSW_FSD 0x27
+#define OPCODE_FMADD 0x43
+#define OPCODE_FMSUB 0x47
+#define OPCODE_FNMSUB 0x4B
+#define OPCODE_FNMADD 0x4F
+#define OPCODE_OP_FP 0x53
+
+// Instructions are decoded once into a struct insn, kept in a decode
+// cache that mirrors the memory pages holding code. The simulation loop
+// then dispatches on the decoded operation instead of taking the
+// instruction word apart every time.
+enum operation {
+    OP_UNDECODED = 0, // decode cache entry not filled in yet
+    OP_NOP,           // fence, csr*, ebreak and unknown instructions are skipped
+    OP_LUI, OP_AUIPC, OP_JAL, OP_JALR,
+    OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+    OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU,
+    OP_SB, OP_SH, OP_SW,
+    OP_ADDI, OP_SLTI, OP_SLTIU, OP_XORI, OP_ORI, OP_ANDI, OP_SLLI, OP_SRLI, OP_SRAI,
+    OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+    OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+    // Zba
+    OP_SH1ADD, OP_SH2ADD, OP_SH3ADD,
+    // Zbb
+    OP_ANDN, OP_ORN, OP_XNOR, OP_CLZ, OP_CTZ, OP_CPOP, OP_MIN, OP_MINU, OP_MAX, OP_MAXU,
+    OP_SEXT_B, OP_SEXT_H, OP_ZEXT_H, OP_ROL, OP_ROR, OP_RORI, OP_ORC_B, OP_REV8,
+    // What the decoder makes of the common ways of writing li and mv: an
+    // operation on x0 only, with the result folded into imm, and one that
+    // gives back rs1. The operations in isa.h that only compute rd are
+    // OP_NOP instead when rd is x0, so these never have it either.
+    OP_LI, OP_MV,
+    OP_ECALL,
+    // RV32F and RV32D. Loads and stores are run in simulate.c, the rest in
+    // fpu.c. The double precision operations are in the same order as the
+    // single precision ones, OP_FMADD_D - OP_FMADD_S apart.
+    OP_FLW, OP_FSW, OP_FLD, OP_FSD,
+    OP_FMADD_S, OP_FMSUB_S, OP_FNMSUB_S, OP_FNMADD_S,
+    OP_FADD_S, OP_FSUB_S, OP_FMUL_S, OP_FDIV_S, OP_FSQRT_S,
+    OP_FSGNJ_S, OP_FSGNJN_S, OP_FSGNJX_S, OP_FMIN_S, OP_FMAX_S,
+    OP_FLE_S, OP_FLT_S, OP_FEQ_S, OP_FCLASS_S,
+    OP_FCVT_W_S, OP_FCVT_WU_S, OP_FCVT_S_W, OP_FCVT_S_WU,
+    OP_FMADD_D, OP_FMSUB_D, OP_FNMSUB_D, OP_FNMADD_D,
+    OP_FADD_D, OP_FSUB_D, OP_FMUL_D, OP_FDIV_D, OP_FSQRT_D,
+    OP_FSGNJ_D, OP_FSGNJN_D, OP_FSGNJX_D, OP_FMIN_D, OP_FMAX_D,
+    OP_FLE_D, OP_FLT_D, OP_FEQ_D, OP_FCLASS_D,
+    OP_FCVT_W_D, OP_FCVT_WU_D, OP_FCVT_D_W, OP_FCVT_D_WU,
+    OP_FMV_X_W, OP_FMV_W_X, OP_FCVT_S_D, OP_FCVT_D_S,
+    OP_FCSR, // csrrw/csrrs/csrrc(i) on fflags, frm or fcsr
+    // RV32A, and the fence and hart id read that go with running several harts
+    OP_FENCE, OP_HARTID, // fence, csrr rd, mhartid
+    OP_LR_W, OP_SC_W, OP_AMOSWAP_W, OP_AMOADD_W, OP_AMOXOR_W, OP_AMOAND_W, OP_AMOOR_W,
+    OP_AMOMIN_W, OP_AMOMAX_W, OP_AMOMINU_W, OP_AMOMAXU_W,
+    // Superinstructions: a common pair (or run) of instructions handled by
+    // one dispatch. They are only placed in fop of the first instruction, the
+    // following ones keep their own decoding, so a jump into the middle of a
+    // fused sequence executes exactly the instructions from there on.
+    OP_FUSED_LUI_ADDI,   // lui rd,hi + addi rd,rd,lo: load a 32 bit constant
+    OP_FUSED_AUIPC_JALR, // auipc t,hi + jalr rd,lo(t): pc relative call
+    OP_FUSED_PROLOGUE,   // addi sp,sp,-N + sw x,off(sp)...: stack frame setup
+    OP_FUSED_SET_BRANCH, // slt/sltu/slti/sltiu rd + beqz/bnez rd
+    // A debugger breakpoint, also only in fop. Loops that dispatch on fop
+    // stop there; stepping dispatches on op and runs the instruction.
+    OP_BREAK,
+};
+
+struct insn {
+    uint8_t op;    // the instruction itself
+    uint8_t fop;   // op, or a superinstruction starting here
+    uint8_t count; // number of instructions covered by fop
+    uint8_t size;  // 2 for a compressed instruction, else 4
+    uint8_t length; // number of bytes covered by fop
+    uint8_t rd, rs1, rs2;
+    int32_t imm;
+    uint32_t word; // the instruction word (expanded if compressed), for the timing model
+};
+
+// Reads the instruction at the 2-byte aligned pc: a 16 bit compressed one
+// or a 32 bit one, which may cross a page
+uint32_t decode_fetch(struct memory *mem, uint32_t pc);
+
+// The 32 bit equivalent of an RV32C instruction, 0 if it is illegal
+uint32_t decode_expand(uint32_t compressed);
+
+// Decodes one instruction into d, with fop = op and count = 1. If the two
+// lowest bits aren't 11 it is compressed, and the low 16 bits are expanded.
+// RV32IM is decoded from the table in isa.h, the rest by hand.
+void decode(uint32_t instruction, struct insn *d);
+
+// The RV32IM operation of a 32 bit instruction as it is in isa.h, before
+// decode specializes it, with its format and immediate. OP_UNDECODED if it
+// isn't in the table.
+int decode_isa(uint32_t instruction, int *format, int32_t *imm);
+
+// The result of an RV32IM operation that only computes rd, from the
+// expression in isa.h
+uint32_t decode_alu(int op, uint32_t a, uint32_t b);
+
+// true for the operations that end a straight line sequence
+bool is_control(int op);
+
+// true for the RV32F and RV32D operations, including their loads and stores
+bool is_float(int op);
+
+// true for the RV32A operations, fence and the mhartid read
+bool is_atomic(int op);
+
+#endif
@@ -0,0 +1,213 @@
+#include "disasm.h"
+#include "decode.h"
+#include "isa.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char *x_names[32] = {"zero", "ra", "sp", "gp", "tp",  "t0",  "t1", "t2", "s0", "s1", "a0",
+                                  "a1",   "a2", "a3", "a4", "a5",  "a6",  "a7", "s2", "s3", "s4", "s5",
+                                  "s6",   "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"};
+
+static const char *f_names[32] = {"ft0", "ft1", "ft2",  "ft3",  "ft4", "ft5", "ft6",  "ft7",
+                                  "fs0", "fs1", "fa0",  "fa1",  "fa2", "fa3", "fa4",  "fa5",
+                                  "fa6", "fa7", "fs2",  "fs3",  "fs4", "fs5", "fs6",  "fs7",
+                                  "fs8", "fs9", "fs10", "fs11", "ft8", "ft9", "ft10", "ft11"};
+
+#define ISA_NAME(op, name, ...) [op] = name,
+static const char *names[] = {
+    ISA_RV32IM(ISA_NAME, ISA_NAME, ISA_NAME)
+    [OP_SH1ADD] = "sh1add", [OP_SH2ADD] = "sh2add", [OP_SH3ADD] = "sh3add", [OP_ANDN] = "andn", [OP_ORN] = "orn",
+    [OP_XNOR] = "xnor", [OP_CLZ] = "clz", [OP_CTZ] = "ctz", [OP_CPOP] = "cpop", [OP_MIN] = "min", [OP_MINU] = "minu",
+    [OP_MAX] = "max", [OP_MAXU] = "maxu", [OP_SEXT_B] = "sext.b", [OP_SEXT_H] = "sext.h", [OP_ZEXT_H] = "zext.h",
+    [OP_ROL] = "rol", [OP_ROR] = "ror", [OP_RORI] = "rori", [OP_ORC_B] = "orc.b", [OP_REV8] = "rev8",
+    [OP_FLW] = "flw", [OP_FSW] = "fsw", [OP_FLD] = "fld", [OP_FSD] = "fsd",
+    [OP_FMADD_S] = "fmadd.s", [OP_FMSUB_S] = "fmsub.s", [OP_FNMSUB_S] = "fnmsub.s", [OP_FNMADD_S] = "fnmadd.s",
+    [OP_FADD_S] = "fadd.s", [OP_FSUB_S] = "fsub.s", [OP_FMUL_S] = "fmul.s", [OP_FDIV_S] = "fdiv.s",
+    [OP_FSQRT_S] = "fsqrt.s", [OP_FSGNJ_S] = "fsgnj.s", [OP_FSGNJN_S] = "fsgnjn.s", [OP_FSGNJX_S] = "fsgnjx.s",
+    [OP_FMIN_S] = "fmin.s", [OP_FMAX_S] = "fmax.s", [OP_FLE_S] = "fle.s", [OP_FLT_S] = "flt.s",
+    [OP_FEQ_S] = "feq.s", [OP_FCLASS_S] = "fclass.s", [OP_FCVT_W_S] = "fcvt.w.s", [OP_FCVT_WU_S] = "fcvt.wu.s",
+    [OP_FCVT_S_W] = "fcvt.s.w", [OP_FCVT_S_WU] = "fcvt.s.wu",
+    [OP_FMADD_D] = "fmadd.d", [OP_FMSUB_D] = "fmsub.d", [OP_FNMSUB_D] = "fnmsub.d", [OP_FNMADD_D] = "fnmadd.d",
+    [OP_FADD_D] = "fadd.d", [OP_FSUB_D] = "fsub.d", [OP_FMUL_D] = "fmul.d", [OP_FDIV_D] = "fdiv.d",
+    [OP_FSQRT_D] = "fsqrt.d", [OP_FSGNJ_D] = "fsgnj.d", [OP_FSGNJN_D] = "fsgnjn.d", [OP_FSGNJX_D] = "fsgnjx.d",
+    [OP_FMIN_D] = "fmin.d", [OP_FMAX_D] = "fmax.d", [OP_FLE_D] = "fle.d", [OP_FLT_D] = "flt.d",
+    [OP_FEQ_D] = "feq.d", [OP_FCLASS_D] = "fclass.d", [OP_FCVT_W_D] = "fcvt.w.d", [OP_FCVT_WU_D] = "fcvt.wu.d",
+    [OP_FCVT_D_W] = "fcvt.d.w", [OP_FCVT_D_WU] = "fcvt.d.wu",
+    [OP_FMV_X_W] = "fmv.x.w", [OP_FMV_W_X] = "fmv.w.x", [OP_FCVT_S_D] = "fcvt.s.d", [OP_FCVT_D_S] = "fcvt.d.s",
+    [OP_LR_W] = "lr.w", [OP_SC_W] = "sc.w", [OP_AMOSWAP_W] = "amoswap.w", [OP_AMOADD_W] = "amoadd.w",
+    [OP_AMOXOR_W] = "amoxor.w", [OP_AMOAND_W] = "amoand.w", [OP_AMOOR_W] = "amoor.w", [OP_AMOMIN_W] = "amomin.w",
+    [OP_AMOMAX_W] = "amomax.w", [OP_AMOMINU_W] = "amominu.w", [OP_AMOMAXU_W] = "amomaxu.w",
+};
+
+// pc-relative target, as "10094 <main+0x20>"
+static void target(char *out, int size, uint32_t addr, struct symbols *syms)
+{
+  int offset = 0;
+  const char *name = syms ? symbols_find(syms, addr, &offset) : NULL;
+  if (name == NULL)
+    snprintf(out, size, "%x", addr);
+  else if (offset == 0)
+    snprintf(out, size, "%x <%s>", addr, name);
+  else
+    snprintf(out, size, "%x <%s+0x%x>", addr, name, offset);
+}
+
+// The base instruction set, and its pseudo-instructions. Returns 0 if the
+// word isn't in isa.h.
+static int base(uint32_t pc, uint32_t word, struct symbols *syms, const char **name, char *ops, int size)
+{
+  int format;
+  int32_t imm;
+  int op = decode_isa(word, &format, &imm);
+  if (op == OP_UNDECODED)
+    return 0;
+  int rd = (word >> 7) & 0x1F, rs1 = (word >> 15) & 0x1F, rs2 = (word >> 20) & 0x1F;
+  const char *d = x_names[rd], *a = x_names[rs1], *b = x_names[rs2];
+  char to[128];
+  *name = names[op];
+  // the pseudo-instructions first, each with its own name and operands
+  const char *pseudo = NULL;
+  if (op == OP_ADDI && rd == 0 && rs1 == 0 && imm == 0)
+    pseudo = "nop";
+  else if (op == OP_ADDI && rs1 == 0)
+    pseudo = "li";
+  else if (op == OP_ADDI && imm == 0)
+    pseudo = "mv";
+  else if (op == OP_XORI && imm == -1)
+    pseudo = "not";
+  else if (op == OP_SLTIU && imm == 1)
+    pseudo = "seqz";
+  else if ((op == OP_ADD || op == OP_SUB || op == OP_SLTU) && rs1 == 0)
+    pseudo = op == OP_ADD ? "mv" : op == OP_SUB ? "neg" : "snez"; // c.mv is an add
+  else if (op == OP_JALR && rd == 0 && rs1 == 1 && imm == 0)
+    pseudo = "ret";
+  else if (op == OP_JALR && rd == 0 && imm == 0)
+    pseudo = "jr";
+  else if (op == OP_JAL && rd == 0)
+    pseudo = "j";
+  else if ((op == OP_BEQ || op == OP_BNE) && rs2 == 0)
+    pseudo = op == OP_BEQ ? "beqz" : "bnez";
+  else if ((op == OP_BLT || op == OP_BGE) && rs2 == 0)
+    pseudo = op == OP_BLT ? "bltz" : "bgez";
+  else if ((op == OP_BLT || op == OP_BGE) && rs1 == 0)
+    pseudo = op == OP_BLT ? "bgtz" : "blez";
+  if (format == ISA_B || format == ISA_J)
+    target(to, sizeof(to), pc + imm, syms);
+  if (pseudo)
+  {
+    *name = pseudo;
+    if (op == OP_ADDI && rs1 == 0 && rd != 0)
+      snprintf(ops, size, "%s,%d", d, imm);
+    else if (format == ISA_R)
+      snprintf(ops, size, "%s,%s", d, b);
+    else if ((op == OP_ADDI && rs1 != 0) || op == OP_XORI || op == OP_SLTIU)
+      snprintf(ops, size, "%s,%s", d, a); // and nop has none
+    else if (op == OP_JALR && rs1 != 1)
+      snprintf(ops, size, "%s", a);
+    else if (op == OP_JAL)
+      snprintf(ops, size, "%s", to);
+    else if (format == ISA_B)
+      snprintf(ops, size, "%s,%s", rs2 ? b : a, to);
+  }
+  else if (op == OP_JAL && rd == 1)
+    snprintf(ops, size, "%s", to); // jal with the return address in ra
+  else if (op == OP_JAL)
+    snprintf(ops, size, "%s,%s", d, to);
+  else if (op == OP_JALR && rd == 1 && imm == 0)
+    snprintf(ops, size, "%s", a);
+  else if (op == OP_JALR || (op >= OP_LB && op <= OP_LHU))
+    snprintf(ops, size, "%s,%d(%s)", d, imm, a);
+  else if (format == ISA_B)
+    snprintf(ops, size, "%s,%s,%s", a, b, to);
+  else if (format == ISA_S)
+    snprintf(ops, size, "%s,%d(%s)", b, imm, a);
+  else if (format == ISA_U)
+    snprintf(ops, size, "%s,0x%x", d, (uint32_t)imm >> 12);
+  else if (format == ISA_R)
+    snprintf(ops, size, "%s,%s,%s", d, a, b);
+  else if (op != OP_FENCE && op != OP_ECALL)
+    snprintf(ops, size, "%s,%s,%d", d, a, imm);
+  return 1;
+}
+
+// The extensions decoded by hand
+static void extension(uint32_t word, const struct insn *in, const char **name, char *ops, int size)
+{
+  const char *xd = x_names[in->rd], *xa = x_names[in->rs1], *xb = x_names[in->rs2];
+  const char *fd = f_names[in->rd], *fa = f_names[in->rs1], *fb = f_names[in->rs2];
+  int op = in->op;
+  *name = op < (int)(sizeof(names) / sizeof(names[0])) ? names[op] : NULL;
+  if ((op >= OP_CLZ && op <= OP_CPOP) || op == OP_SEXT_B || op == OP_SEXT_H || op == OP_ZEXT_H || op == OP_ORC_B ||
+      op == OP_REV8)
+    snprintf(ops, size, "%s,%s", xd, xa);
+  else if (op == OP_RORI)
+    snprintf(ops, size, "%s,%s,%d", xd, xa, in->imm);
+  else if (op >= OP_SH1ADD && op <= OP_REV8)
+    snprintf(ops, size, "%s,%s,%s", xd, xa, xb);
+  else if (op == OP_FLW || op == OP_FLD)
+    snprintf(ops, size, "%s,%d(%s)", fd, in->imm, xa);
+  else if (op == OP_FSW || op == OP_FSD)
+    snprintf(ops, size, "%s,%d(%s)", fb, in->imm, xa);
+  else if ((op >= OP_FMADD_S && op <= OP_FNMADD_S) || (op >= OP_FMADD_D && op <= OP_FNMADD_D))
+    snprintf(ops, size, "%s,%s,%s,%s", fd, fa, fb, f_names[word >> 27]);
+  else if (op == OP_FSQRT_S || op == OP_FSQRT_D || op == OP_FCVT_S_D || op == OP_FCVT_D_S)
+    snprintf(ops, size, "%s,%s", fd, fa);
+  else if ((op >= OP_FLE_S && op <= OP_FEQ_S) || (op >= OP_FLE_D && op <= OP_FEQ_D))
+    snprintf(ops, size, "%s,%s,%s", xd, fa, fb);
+  else if (op == OP_FCLASS_S || op == OP_FCLASS_D || op == OP_FCVT_W_S || op == OP_FCVT_WU_S ||
+           op == OP_FCVT_W_D || op == OP_FCVT_WU_D || op == OP_FMV_X_W)
+    snprintf(ops, size, "%s,%s", xd, fa);
+  else if (op == OP_FCVT_S_W || op == OP_FCVT_S_WU || op == OP_FCVT_D_W || op == OP_FCVT_D_WU || op == OP_FMV_W_X)
+    snprintf(ops, size, "%s,%s", fd, xa);
+  else if (is_float(op) && op != OP_FCSR)
+    snprintf(ops, size, "%s,%s,%s", fd, fa, fb);
+  else if (op == OP_LR_W)
+    snprintf(ops, size, "%s,(%s)", xd, xa);
+  else if (op >= OP_SC_W && op <= OP_AMOMAXU_W)
+    snprintf(ops, size, "%s,%s,(%s)", xd, xb, xa);
+  else if (op == OP_FCSR || op == OP_HARTID)
+  {
+    static const char *csrs[8] = {NULL, "csrrw", "csrrs", "csrrc", NULL, "csrrwi", "csrrsi", "csrrci"};
+    static const char *fcsrs[4] = {NULL, "fflags", "frm", "fcsr"};
+    int funct3 = (word >> 12) & 0x7;
+    const char *csr = op == OP_HARTID ? "mhartid" : fcsrs[word >> 20];
+    *name = csrs[funct3];
+    if (funct3 == 2 && in->rs1 == 0)
+    {
+      *name = "csrr";
+      snprintf(ops, size, "%s,%s", xd, csr);
+    }
+    else if (funct3 == 1 && in->rd == 0)
+    {
+      *name = "csrw";
+      snprintf(ops, size, "%s,%s", csr, xa);
+    }
+    else if (funct3 >= 4)
+      snprintf(ops, size, "%s,%s,%d", xd, csr, in->rs1);
+    else
+      snprintf(ops, size, "%s,%s,%s", xd, csr, xa);
+  }
+  else if (word == 0x00100073)
+    *name = "ebreak";
+  else
+    *name = NULL;
+}
+
+const char *disasm(uint32_t pc, uint32_t word, struct symbols *syms, char *text, int size)
+{
+  struct insn in;
+  decode(word, &in);
+  const char *name = NULL;
+  char ops[160] = "";
+  if (in.size == 2 && in.word == 0)
+    name = NULL; // not a valid compressed instruction
+  else if (!base(pc, in.word, syms, &name, ops, sizeof(ops)))
+    extension(in.word, &in, &name, ops, sizeof(ops));
+  if (name == NULL)
+    snprintf(text, size, in.size == 2 ? ".short   0x%04x" : ".word    0x%08x", in.size == 2 ? word & 0xFFFF : word);
+  else if (ops[0])
+    snprintf(text, size, "%-8s %s", name, ops);
+  else
+    snprintf(text, size, "%s", name);
+  return text;
+}
@@ -0,0 +1,15 @@
+#ifndef __DISASM_H__
+#define __DISASM_H__
+
+#include "symbols.h"
+#include <stdint.h>
+
+// Assembler text for the instruction at pc in the style of objdump: the
+// mnemonic, or one of the common pseudo-instructions such as li, mv, j and
+// ret, then the operands with register ABI names. Branch and jump targets
+// are shown as symbol+offset when syms has them; syms may be NULL. word is
+// the instruction as decode_fetch reads it, and a compressed instruction is
+// shown as what it expands to. Returns text.
+const char *disasm(uint32_t pc, uint32_t word, struct symbols *syms, char *text, int size);
+
+#endif
@@ -0,0 +1,29 @@
+#include "error.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static __thread jmp_buf *trap;
+static __thread char message[256];
+
+void error_fail(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  if (trap)
+    longjmp(*trap, 1);
+  printf("%s\n", message);
+  exit(-1);
+}
+
+void error_trap(jmp_buf *new_trap)
+{
+  trap = new_trap;
+}
+
+const char *error_message()
+{
+  return message;
+}
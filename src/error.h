@@ -0,0 +1,18 @@
+#ifndef __ERROR_H__
+#define __ERROR_H__
+
+#include <setjmp.h>
+
+// Errors that stop the simulated machine, such as unaligned accesses. The
+// message is printed and the process exits, unless the thread has set a
+// trap, as libsim does: then the message is kept and the trap is jumped to
+// with longjmp(*trap, 1).
+void error_fail(const char *format, ...) __attribute__((noreturn, format(printf, 1, 2)));
+
+// set the trap of this thread, NULL to exit on errors again
+void error_trap(jmp_buf *trap);
+
+// the message of the latest error trapped in this thread
+const char *error_message();
+
+#endif
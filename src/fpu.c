@@ -0,0 +1,390 @@
+#include "fpu.h"
+#include <fenv.h>
+#include <math.h>
+#include <string.h>
+
+// https://riscv.org/wp-content/uploads/2017/05/riscv-spec-v2.2.pdf chapters 8 and 9
+__thread uint64_t fregisters[32];
+
+#define BOX 0xFFFFFFFF00000000ULL
+#define CANONICAL_NAN_S 0x7FC00000U
+#define CANONICAL_NAN_D 0x7FF8000000000000ULL
+
+// fflags
+#define NV 0x10 // invalid operation
+#define DZ 0x08 // divide by zero
+#define OF 0x04 // overflow
+#define UF 0x02 // underflow
+#define NX 0x01 // inexact
+
+#define RMM 4
+#define DYNAMIC 7
+
+// The host's exception flags are sticky like fflags, so the arithmetic just
+// leaves them to accrue and they are read when the guest reads fflags.
+// Only what the host flags differently (conversions to integers, NaN
+// operands of min/max and compares) is kept in fflags.
+static __thread uint32_t fflags;
+static __thread uint32_t frm;
+static __thread int host_mode = FE_TONEAREST; // the floating point environment is per thread
+
+static uint32_t accrued(void)
+{
+  int host = fetestexcept(FE_ALL_EXCEPT);
+  return fflags | (host & FE_INVALID ? NV : 0) | (host & FE_DIVBYZERO ? DZ : 0) | (host & FE_OVERFLOW ? OF : 0) |
+         (host & FE_UNDERFLOW ? UF : 0) | (host & FE_INEXACT ? NX : 0);
+}
+
+static void set_flags(uint32_t flags)
+{
+  feclearexcept(FE_ALL_EXCEPT);
+  fflags = flags & 0x1F;
+}
+
+static int rounding_mode(uint32_t word)
+{
+  int rm = (word >> 12) & 0x7;
+  return rm == DYNAMIC ? (int)frm : rm;
+}
+
+// Sets the host rounding mode for the rm field of word. The host has no
+// round to nearest, ties to max magnitude, so RMM rounds to nearest even
+// except in the conversions to integers.
+static void round_as(uint32_t word)
+{
+  static const int modes[8] = {FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD,
+                               FE_TONEAREST, FE_TONEAREST, FE_TONEAREST, FE_TONEAREST};
+  int mode = modes[rounding_mode(word) & 0x7];
+  if (mode != host_mode)
+  {
+    fesetround(mode);
+    host_mode = mode;
+  }
+}
+
+// A single precision operand that isn't properly NaN-boxed is the canonical NaN
+static uint32_t bits_s(int r)
+{
+  uint64_t value = fregisters[r];
+  return (value & BOX) == BOX ? (uint32_t)value : CANONICAL_NAN_S;
+}
+
+static float get_s(int r)
+{
+  uint32_t bits = bits_s(r);
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static double get_d(int r)
+{
+  double f;
+  memcpy(&f, &fregisters[r], sizeof(f));
+  return f;
+}
+
+// Results that are NaN are always the canonical NaN
+static void set_s(int r, float f)
+{
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  fregisters[r] = BOX | (isnan(f) ? CANONICAL_NAN_S : bits);
+}
+
+static void set_d(int r, double f)
+{
+  uint64_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  fregisters[r] = isnan(f) ? CANONICAL_NAN_D : bits;
+}
+
+static int is_signaling(double f)
+{
+  uint64_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return isnan(f) && !(bits & 0x0008000000000000ULL);
+}
+
+// Single precision operands are widened to double here. That is exact, and
+// the host flags a signaling NaN as invalid while widening it.
+
+// fmin and fmax return the other operand if one is NaN, and -0 < +0
+static double min_max(double a, double b, int max)
+{
+  if (is_signaling(a) || is_signaling(b))
+    fflags |= NV;
+  if (isnan(a))
+    return b;
+  if (isnan(b))
+    return a;
+  if (a == b)
+    return (signbit(a) ? !max : max) ? a : b;
+  return (a < b) != max ? a : b;
+}
+
+// fle, flt and feq. Only feq is quiet, flagging signaling NaNs alone.
+static uint32_t compare(double a, double b, int op)
+{
+  if (isnan(a) || isnan(b))
+  {
+    if (op != OP_FEQ_S - OP_FLE_S || is_signaling(a) || is_signaling(b))
+      fflags |= NV;
+    return 0;
+  }
+  if (op == OP_FLE_S - OP_FLE_S)
+    return a <= b;
+  if (op == OP_FLT_S - OP_FLE_S)
+    return a < b;
+  return a == b;
+}
+
+// fcvt.w[u].[sd]: NaN and values out of range saturate and flag invalid
+static uint32_t to_int(double f, uint32_t word, int is_unsigned)
+{
+  if (isnan(f))
+  {
+    fflags |= NV;
+    return is_unsigned ? UINT32_MAX : INT32_MAX;
+  }
+  round_as(word);
+  double r = rounding_mode(word) == RMM ? round(f) : nearbyint(f);
+  if (r > (is_unsigned ? 4294967295.0 : 2147483647.0))
+  {
+    fflags |= NV;
+    return is_unsigned ? UINT32_MAX : INT32_MAX;
+  }
+  if (r < (is_unsigned ? 0.0 : -2147483648.0))
+  {
+    fflags |= NV;
+    return is_unsigned ? 0 : (uint32_t)INT32_MIN;
+  }
+  if (r != f)
+    fflags |= NX;
+  return is_unsigned ? (uint32_t)r : (uint32_t)(int32_t)r;
+}
+
+// fclass: one bit set, -inf, -normal, -subnormal, -0, +0, +subnormal, +normal, +inf, sNaN, qNaN
+static uint32_t classify(uint64_t bits, int exponent_bits, int mantissa_bits)
+{
+  int sign = (bits >> (exponent_bits + mantissa_bits)) & 1;
+  uint64_t exponent = (bits >> mantissa_bits) & ((1ULL << exponent_bits) - 1);
+  uint64_t mantissa = bits & ((1ULL << mantissa_bits) - 1);
+  if (exponent == (1ULL << exponent_bits) - 1)
+  {
+    if (mantissa == 0)
+      return sign ? 1 << 0 : 1 << 7;
+    return mantissa >> (mantissa_bits - 1) ? 1 << 9 : 1 << 8;
+  }
+  if (exponent == 0)
+  {
+    if (mantissa == 0)
+      return sign ? 1 << 3 : 1 << 4;
+    return sign ? 1 << 2 : 1 << 5;
+  }
+  return sign ? 1 << 1 : 1 << 6;
+}
+
+uint32_t fpu_get_fcsr()
+{
+  return (frm << 5) | accrued();
+}
+
+void fpu_set_fcsr(uint32_t fcsr)
+{
+  host_mode = fegetround();
+  set_flags(fcsr);
+  frm = (fcsr >> 5) & 0x7;
+}
+
+// csrrw, csrrs and csrrc, also with an immediate in the rs1 field
+static uint32_t access_csr(uint32_t word, uint32_t *x)
+{
+  int csr = word >> 20;
+  int funct3 = (word >> 12) & 0x7;
+  int rs1 = (word >> 15) & 0x1F;
+  uint32_t flags = accrued();
+  uint32_t old = csr == 1 ? flags : csr == 2 ? frm : (frm << 5) | flags;
+  uint32_t value = funct3 & 0x4 ? (uint32_t)rs1 : x[rs1];
+  uint32_t new_value = (funct3 & 0x3) == 1 ? value : (funct3 & 0x3) == 2 ? old | value : old & ~value;
+  if ((funct3 & 0x3) != 1 && rs1 == 0)
+    return old; // csrrs and csrrc don't write with x0 or 0
+  if (csr == 1)
+    set_flags(new_value);
+  else if (csr == 2)
+    frm = new_value & 0x7;
+  else
+  {
+    set_flags(new_value);
+    frm = (new_value >> 5) & 0x7;
+  }
+  return old;
+}
+
+void fpu_execute(const struct insn *d, uint32_t *x)
+{
+  uint32_t word = d->word;
+  int rd = d->rd, rs1 = d->rs1, rs2 = d->rs2, rs3 = word >> 27;
+  uint32_t result; // for the operations that write an x register
+  switch (d->op)
+  {
+  case OP_FMADD_S:
+    round_as(word);
+    set_s(rd, fmaf(get_s(rs1), get_s(rs2), get_s(rs3)));
+    return;
+  case OP_FMSUB_S:
+    round_as(word);
+    set_s(rd, fmaf(get_s(rs1), get_s(rs2), -get_s(rs3)));
+    return;
+  case OP_FNMSUB_S:
+    round_as(word);
+    set_s(rd, fmaf(-get_s(rs1), get_s(rs2), get_s(rs3)));
+    return;
+  case OP_FNMADD_S:
+    round_as(word);
+    set_s(rd, fmaf(-get_s(rs1), get_s(rs2), -get_s(rs3)));
+    return;
+  case OP_FADD_S:
+    round_as(word);
+    set_s(rd, get_s(rs1) + get_s(rs2));
+    return;
+  case OP_FSUB_S:
+    round_as(word);
+    set_s(rd, get_s(rs1) - get_s(rs2));
+    return;
+  case OP_FMUL_S:
+    round_as(word);
+    set_s(rd, get_s(rs1) * get_s(rs2));
+    return;
+  case OP_FDIV_S:
+    round_as(word);
+    set_s(rd, get_s(rs1) / get_s(rs2));
+    return;
+  case OP_FSQRT_S:
+    round_as(word);
+    set_s(rd, sqrtf(get_s(rs1)));
+    return;
+  case OP_FSGNJ_S:
+    fregisters[rd] = BOX | (bits_s(rs1) & 0x7FFFFFFF) | (bits_s(rs2) & 0x80000000);
+    return;
+  case OP_FSGNJN_S:
+    fregisters[rd] = BOX | (bits_s(rs1) & 0x7FFFFFFF) | (~bits_s(rs2) & 0x80000000);
+    return;
+  case OP_FSGNJX_S:
+    fregisters[rd] = BOX | (bits_s(rs1) ^ (bits_s(rs2) & 0x80000000));
+    return;
+  case OP_FMIN_S:
+  case OP_FMAX_S:
+    set_s(rd, min_max(get_s(rs1), get_s(rs2), d->op == OP_FMAX_S));
+    return;
+  case OP_FLE_S:
+  case OP_FLT_S:
+  case OP_FEQ_S:
+    result = compare(get_s(rs1), get_s(rs2), d->op - OP_FLE_S);
+    break;
+  case OP_FCLASS_S:
+    result = classify(bits_s(rs1), 8, 23);
+    break;
+  case OP_FCVT_W_S:
+  case OP_FCVT_WU_S:
+    result = to_int(get_s(rs1), word, d->op == OP_FCVT_WU_S);
+    break;
+  case OP_FCVT_S_W:
+    round_as(word);
+    set_s(rd, (float)(int32_t)x[rs1]);
+    return;
+  case OP_FCVT_S_WU:
+    round_as(word);
+    set_s(rd, (float)x[rs1]);
+    return;
+
+  case OP_FMADD_D:
+    round_as(word);
+    set_d(rd, fma(get_d(rs1), get_d(rs2), get_d(rs3)));
+    return;
+  case OP_FMSUB_D:
+    round_as(word);
+    set_d(rd, fma(get_d(rs1), get_d(rs2), -get_d(rs3)));
+    return;
+  case OP_FNMSUB_D:
+    round_as(word);
+    set_d(rd, fma(-get_d(rs1), get_d(rs2), get_d(rs3)));
+    return;
+  case OP_FNMADD_D:
+    round_as(word);
+    set_d(rd, fma(-get_d(rs1), get_d(rs2), -get_d(rs3)));
+    return;
+  case OP_FADD_D:
+    round_as(word);
+    set_d(rd, get_d(rs1) + get_d(rs2));
+    return;
+  case OP_FSUB_D:
+    round_as(word);
+    set_d(rd, get_d(rs1) - get_d(rs2));
+    return;
+  case OP_FMUL_D:
+    round_as(word);
+    set_d(rd, get_d(rs1) * get_d(rs2));
+    return;
+  case OP_FDIV_D:
+    round_as(word);
+    set_d(rd, get_d(rs1) / get_d(rs2));
+    return;
+  case OP_FSQRT_D:
+    round_as(word);
+    set_d(rd, sqrt(get_d(rs1)));
+    return;
+  case OP_FSGNJ_D:
+    fregisters[rd] = (fregisters[rs1] & ~(1ULL << 63)) | (fregisters[rs2] & (1ULL << 63));
+    return;
+  case OP_FSGNJN_D:
+    fregisters[rd] = (fregisters[rs1] & ~(1ULL << 63)) | (~fregisters[rs2] & (1ULL << 63));
+    return;
+  case OP_FSGNJX_D:
+    fregisters[rd] = fregisters[rs1] ^ (fregisters[rs2] & (1ULL << 63));
+    return;
+  case OP_FMIN_D:
+  case OP_FMAX_D:
+    set_d(rd, min_max(get_d(rs1), get_d(rs2), d->op == OP_FMAX_D));
+    return;
+  case OP_FLE_D:
+  case OP_FLT_D:
+  case OP_FEQ_D:
+    result = compare(get_d(rs1), get_d(rs2), d->op - OP_FLE_D);
+    break;
+  case OP_FCLASS_D:
+    result = classify(fregisters[rs1], 11, 52);
+    break;
+  case OP_FCVT_W_D:
+  case OP_FCVT_WU_D:
+    result = to_int(get_d(rs1), word, d->op == OP_FCVT_WU_D);
+    break;
+  case OP_FCVT_D_W:
+    set_d(rd, (int32_t)x[rs1]); // exact
+    return;
+  case OP_FCVT_D_WU:
+    set_d(rd, x[rs1]);
+    return;
+
+  case OP_FMV_X_W:
+    result = (uint32_t)fregisters[rs1];
+    break;
+  case OP_FMV_W_X:
+    fregisters[rd] = BOX | x[rs1];
+    return;
+  case OP_FCVT_S_D:
+    round_as(word);
+    set_s(rd, (float)get_d(rs1));
+    return;
+  case OP_FCVT_D_S:
+    set_d(rd, get_s(rs1));
+    return;
+  case OP_FCSR:
+    result = access_csr(word, x);
+    break;
+  default:
+    return;
+  }
+  if (rd != 0)
+    x[rd] = result;
+}
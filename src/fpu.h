@@ -0,0 +1,22 @@
+#ifndef __FPU_H__
+#define __FPU_H__
+
+#include "decode.h"
+#include <stdint.h>
+
+// RV32F and RV32D executed on the host's floating point unit. The f
+// registers are 64 bit; a single precision value is NaN-boxed, held in the
+// low half with the high half all ones. Every hart has its own.
+extern __thread uint64_t fregisters[32];
+
+// Runs a floating point operation other than a load or store, those go
+// through struct memory in simulate.c. x is the integer register file.
+void fpu_execute(const struct insn *d, uint32_t *x);
+
+// fcsr of this thread, frm and the accrued flags. Setting it also clears
+// the host's exception flags, so what it raises afterwards is the guest's,
+// and reads the host's rounding mode again, which others may have changed.
+uint32_t fpu_get_fcsr();
+void fpu_set_fcsr(uint32_t fcsr);
+
+#endif
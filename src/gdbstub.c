@@ -0,0 +1,423 @@
+#include "gdbstub.h"
+#include "error.h"
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+extern __thread uint32_t registers[32];
+
+#define MAX_PACKET 4096
+#define MAX_BREAKPOINTS 256
+// instructions run between looks for a ^C from gdb while continuing
+#define POLL_INSNS (1 << 20)
+
+struct gdbstub
+{
+  int fd;
+  char in[MAX_PACKET];
+  int in_start, in_end;
+  int num_breakpoints;
+  uint32_t breakpoints[MAX_BREAKPOINTS];
+};
+
+static void fail(const char *what, const char *where)
+{
+  printf("Could not %s '%s' for gdb. Exiting\n", what, where);
+  exit(-1);
+}
+
+struct gdbstub *gdbstub_create(const char *where)
+{
+  char *end;
+  long port = strtol(where, &end, 10);
+  int listener;
+  if (*end == 0)
+  {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int on = 1;
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      fail("listen on port", where);
+  }
+  else
+  {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", where);
+    unlink(where);
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      fail("listen on socket", where);
+  }
+  if (listen(listener, 1) < 0)
+    fail("listen on", where);
+  printf("Waiting for gdb on %s\n", where);
+  fflush(stdout);
+  int fd = accept(listener, NULL, NULL);
+  close(listener);
+  if (fd < 0)
+    fail("accept gdb on", where);
+  // packets are small and answered one at a time
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  struct gdbstub *stub = calloc(sizeof(struct gdbstub), 1);
+  stub->fd = fd;
+  return stub;
+}
+
+void gdbstub_delete(struct gdbstub *stub)
+{
+  close(stub->fd);
+  free(stub);
+}
+
+// next byte from gdb, -1 when it has gone
+static int get_byte(struct gdbstub *stub)
+{
+  if (stub->in_start == stub->in_end)
+  {
+    int n = read(stub->fd, stub->in, sizeof(stub->in));
+    if (n <= 0)
+      return -1;
+    stub->in_start = 0;
+    stub->in_end = n;
+  }
+  return (unsigned char)stub->in[stub->in_start++];
+}
+
+static int hex_digit(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// two hex digits as a byte, -1 if they aren't
+static int hex_byte(const char *in)
+{
+  int high = hex_digit(in[0]);
+  int low = high < 0 ? -1 : hex_digit(in[1]);
+  return low < 0 ? -1 : high * 16 + low;
+}
+
+// Reads a packet "$data#cs" into packet and acknowledges it. Returns its
+// length, or -1 when gdb has gone.
+static int get_packet(struct gdbstub *stub, char *packet)
+{
+  while (1)
+  {
+    int c;
+    while ((c = get_byte(stub)) != '$')
+    {
+      if (c < 0)
+        return -1;
+    }
+    int len = 0;
+    unsigned char sum = 0;
+    while ((c = get_byte(stub)) != '#' && c >= 0)
+    {
+      if (c == '$')
+      {
+        len = sum = 0; // a new packet started
+        continue;
+      }
+      sum += c;
+      if (len < MAX_PACKET - 1)
+        packet[len++] = c;
+    }
+    int high = get_byte(stub);
+    int low = get_byte(stub);
+    if (c < 0 || high < 0 || low < 0)
+      return -1;
+    packet[len] = 0;
+    char checksum[2] = {high, low};
+    if (hex_byte(checksum) == sum)
+    {
+      write(stub->fd, "+", 1);
+      return len;
+    }
+    write(stub->fd, "-", 1);
+  }
+}
+
+// Sends "$data#cs". gdb's acknowledgement is skipped by get_packet, which
+// looks for the next '$'.
+static void put_packet(struct gdbstub *stub, const char *data)
+{
+  char out[MAX_PACKET + 4];
+  unsigned char sum = 0;
+  int len = strlen(data);
+  for (int i = 0; i < len; ++i)
+    sum += data[i];
+  int n = snprintf(out, sizeof(out), "$%s#%02x", data, sum);
+  if (write(stub->fd, out, n) != n)
+    return;
+}
+
+// registers are sent as little-endian hex
+static void put_word(char *out, uint32_t value)
+{
+  for (int i = 0; i < 4; ++i)
+    sprintf(out + 2 * i, "%02x", (value >> (8 * i)) & 0xff);
+}
+
+// -1 if the eight digits aren't all hex
+static int get_word(const char *in, uint32_t *value)
+{
+  *value = 0;
+  for (int i = 0; i < 4; ++i)
+  {
+    int byte = hex_byte(in + 2 * i);
+    if (byte < 0)
+      return -1;
+    *value |= (uint32_t)byte << (8 * i);
+  }
+  return 0;
+}
+
+// m: pages already there are read as they are. Others are made as a load
+// would make them, which also loads them from the program file if it is
+// still being read; -1 if that would go over -memlimit.
+static int read_memory(struct memory *mem, uint32_t addr, unsigned size, char *reply)
+{
+  jmp_buf trap;
+  if (setjmp(trap))
+  {
+    error_trap(NULL);
+    return -1;
+  }
+  error_trap(&trap);
+  for (unsigned i = 0; i < size; ++i)
+  {
+    uint32_t at = addr + i;
+    int len = 1;
+    int *page = memory_find_page(mem, at);
+    unsigned char *byte = page ? (unsigned char *)page + (at & (MEMORY_PAGE_SIZE - 1))
+                               : (unsigned char *)memory_span(mem, at, &len);
+    sprintf(reply + 2 * i, "%02x", *byte);
+  }
+  error_trap(NULL);
+  return 0;
+}
+
+// Whether gdb has sent ^C, or gone, since the program was continued. Nothing
+// else comes from gdb while the program runs.
+static int interrupted(struct gdbstub *stub)
+{
+  struct pollfd poll_fd = {stub->fd, POLLIN, 0};
+  if (stub->in_start == stub->in_end && poll(&poll_fd, 1, 0) <= 0)
+    return 0;
+  int c = get_byte(stub);
+  return c == 3 || c < 0;
+}
+
+static int find_breakpoint(struct gdbstub *stub, uint32_t addr)
+{
+  for (int i = 0; i < stub->num_breakpoints; ++i)
+  {
+    if (stub->breakpoints[i] == addr)
+      return i;
+  }
+  return -1;
+}
+
+// Z0/z0 (and Z1/z1, hardware breakpoints being no different here)
+static const char *breakpoint(struct gdbstub *stub, struct memory *mem, struct simulation *sim, const char *args,
+                              int set)
+{
+  unsigned type, addr;
+  if (sscanf(args, "%x,%x", &type, &addr) != 2 || type > 1)
+    return "";
+  int i = find_breakpoint(stub, addr);
+  if (set && i < 0)
+  {
+    if (stub->num_breakpoints == MAX_BREAKPOINTS)
+      return "E01";
+    stub->breakpoints[stub->num_breakpoints++] = addr;
+  }
+  else if (!set && i >= 0)
+    stub->breakpoints[i] = stub->breakpoints[--stub->num_breakpoints];
+  simulate_breakpoint(mem, sim, addr, set);
+  return "OK";
+}
+
+// The reply to a stop: exited with its code, or stopped by a trap
+static void stopped(struct gdbstub *stub, struct simulation *sim)
+{
+  char reply[8];
+  if (sim->exited)
+    snprintf(reply, sizeof(reply), "W%02x", syscalls_exit_code(sim->sys) & 0xff);
+  else
+    snprintf(reply, sizeof(reply), "S05");
+  put_packet(stub, reply);
+}
+
+long int gdbstub_run(struct gdbstub *stub, struct memory *mem, struct simulation *sim, uint32_t start_addr)
+{
+  char packet[MAX_PACKET], reply[MAX_PACKET];
+  uint32_t pc = start_addr;
+  long int instructions = 0;
+  int len;
+  while ((len = get_packet(stub, packet)) >= 0)
+  {
+    const char *args = packet + 1;
+    unsigned addr, size;
+    reply[0] = 0;
+    switch (packet[0])
+    {
+    case '?':
+      strcpy(reply, "S05");
+      break;
+    case 'g':
+      for (int i = 0; i < 32; ++i)
+        put_word(reply + 8 * i, registers[i]);
+      put_word(reply + 8 * 32, pc);
+      break;
+    case 'G':
+    {
+      // nothing is set unless all of it is hex
+      uint32_t values[33];
+      int count = 0, bad = 0;
+      for (; count < 33 && len >= 8 * (count + 1) + 1 && !bad; ++count)
+        bad = get_word(args + 8 * count, &values[count]);
+      if (bad)
+      {
+        strcpy(reply, "E01");
+        break;
+      }
+      for (int i = 1; i < count && i < 32; ++i)
+        registers[i] = values[i];
+      if (count == 33)
+        pc = values[32];
+      strcpy(reply, "OK");
+      break;
+    }
+    case 'p':
+      addr = strtoul(args, NULL, 16);
+      if (addr <= 32)
+        put_word(reply, addr == 32 ? pc : registers[addr]);
+      else
+        strcpy(reply, "E01");
+      break;
+    case 'P':
+    {
+      char *value;
+      uint32_t word;
+      addr = strtoul(args, &value, 16);
+      if (*value != '=' || addr > 32 || get_word(value + 1, &word) < 0)
+        strcpy(reply, "E01");
+      else
+      {
+        if (addr == 32)
+          pc = word;
+        else if (addr != 0)
+          registers[addr] = word;
+        strcpy(reply, "OK");
+      }
+      break;
+    }
+    case 'm':
+      if (sscanf(args, "%x,%x", &addr, &size) != 2 || size > (MAX_PACKET - 1) / 2)
+      {
+        strcpy(reply, "E01");
+        break;
+      }
+      if (read_memory(mem, addr, size, reply) < 0)
+        strcpy(reply, "E01");
+      break;
+    case 'M':
+    {
+      const char *data = strchr(args, ':');
+      int bad = sscanf(args, "%x,%x", &addr, &size) != 2 || data == NULL || strlen(data + 1) < 2 * size;
+      for (unsigned i = 0; i < size && !bad; ++i)
+        bad = hex_byte(data + 1 + 2 * i) < 0;
+      if (bad)
+      {
+        strcpy(reply, "E01");
+        break;
+      }
+      for (unsigned i = 0; i < size; ++i)
+        memory_wr_b(mem, addr + i, hex_byte(data + 1 + 2 * i));
+      // the store dropped any breakpoints in the code written
+      for (int i = 0; i < stub->num_breakpoints; ++i)
+      {
+        if (stub->breakpoints[i] - addr < size || addr - stub->breakpoints[i] < 4)
+          simulate_breakpoint(mem, sim, stub->breakpoints[i], 1);
+      }
+      strcpy(reply, "OK");
+      break;
+    }
+    case 'c':
+    case 's':
+      if (len > 1)
+        pc = strtoul(args, NULL, 16);
+      // a breakpoint at pc is stepped over before continuing
+      sim->limit = 1;
+      instructions += simulate_run(mem, sim, &pc);
+      // then run to a stop in chunks ending at jumps, looking for a ^C
+      // between them; a chunk cut short was stopped by something else
+      sim->limit = POLL_INSNS;
+      sim->limit_at_jumps = 1;
+      if (packet[0] == 'c' && !sim->exited && find_breakpoint(stub, pc) < 0)
+      {
+        long int done;
+        do
+        {
+          done = simulate_run(mem, sim, &pc);
+          instructions += done;
+        } while (done >= POLL_INSNS && !sim->exited && !interrupted(stub));
+      }
+      sim->limit = 0;
+      sim->limit_at_jumps = 0;
+      stopped(stub, sim);
+      if (sim->exited)
+        return instructions;
+      continue;
+    case 'Z':
+    case 'z':
+      strcpy(reply, breakpoint(stub, mem, sim, args, packet[0] == 'Z'));
+      break;
+    case 'k':
+      return instructions;
+    case 'D':
+      put_packet(stub, "OK");
+      for (int i = 0; i < stub->num_breakpoints; ++i)
+        simulate_breakpoint(mem, sim, stub->breakpoints[i], 0);
+      while (!sim->exited)
+        instructions += simulate_run(mem, sim, &pc);
+      return instructions;
+    case 'H':
+      strcpy(reply, "OK");
+      break;
+    case 'q':
+      if (!strncmp(packet, "qSupported", 10))
+        snprintf(reply, sizeof(reply), "PacketSize=%x", MAX_PACKET - 1);
+      else if (!strcmp(packet, "qAttached"))
+        strcpy(reply, "1");
+      else if (!strcmp(packet, "qC"))
+        strcpy(reply, "QC1");
+      else if (!strcmp(packet, "qfThreadInfo"))
+        strcpy(reply, "m1");
+      else if (!strcmp(packet, "qsThreadInfo"))
+        strcpy(reply, "l");
+      break;
+    }
+    put_packet(stub, reply);
+  }
+  return instructions;
+}
@@ -0,0 +1,24 @@
+#ifndef __GDBSTUB_H__
+#define __GDBSTUB_H__
+
+#include "memory.h"
+#include "simulate.h"
+
+// A GDB remote serial protocol server. gdb connects with
+// "target remote localhost:port" (or the path of a Unix socket) and can
+// read and write the registers and memory, step, continue and set software
+// breakpoints. These go into the decoded instructions, see
+// simulate_breakpoint, so the program runs at full speed in between.
+struct gdbstub;
+
+// listen on where, a localhost port number or the path of a Unix socket, and
+// wait for gdb to connect
+struct gdbstub *gdbstub_create(const char *where);
+void gdbstub_delete(struct gdbstub *stub);
+
+// Runs the program from start_addr under control of gdb, until it exits or
+// gdb kills it. Detaching lets it run to the end on its own. Returns the
+// number of instructions executed.
+long int gdbstub_run(struct gdbstub *stub, struct memory *mem, struct simulation *sim, uint32_t start_addr);
+
+#endif
@@ -0,0 +1,312 @@
+#include "hle.h"
+#include "error.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The native versions work on whole page spans with the host's libc
+// routines, which are vectorised, instead of the guest's byte loops.
+
+enum hle_function
+{
+  HLE_MEMCPY,
+  HLE_MEMSET,
+  HLE_STRLEN,
+  HLE_STRCMP,
+  HLE_MEMCMP,
+  HLE_FUNCTIONS
+};
+
+static const char *function_names[HLE_FUNCTIONS] = {"memcpy", "memset", "strlen", "strcmp", "memcmp"};
+
+// results of memcpy/memset larger than this are not checked byte by byte
+#define MAX_VERIFY_BYTES (16 << 20)
+#define MAX_PENDING 64
+
+// a guest call being verified: checked when it returns to ra with sp restored
+struct pending
+{
+  int function;
+  uint32_t from; // the pc of the call
+  uint32_t ra;
+  uint32_t sp;
+  uint32_t expected;
+  uint32_t dst;
+  uint32_t len;
+  char *bytes; // expected destination contents, NULL if not checked
+};
+
+struct hle
+{
+  struct memory *mem;
+  int verify;
+  int num_entries;
+  uint32_t entry_addr[HLE_FUNCTIONS];
+  uint32_t entry_end[HLE_FUNCTIONS]; // address of the following symbol
+  int entry_function[HLE_FUNCTIONS];
+  uint32_t low, high; // range of entry addresses, for a quick reject
+  long calls[HLE_FUNCTIONS];
+  long mismatches[HLE_FUNCTIONS];
+  int num_pending;
+  struct pending pending[MAX_PENDING];
+};
+
+struct hle *hle_create(struct memory *mem, struct symbols *syms, const char *names, int verify)
+{
+  int listed[HLE_FUNCTIONS] = {0};
+  int all = strcmp(names, "all") == 0;
+  for (const char *p = names; !all; )
+  {
+    const char *end = strchr(p, ',');
+    int len = end ? end - p : (int)strlen(p);
+    int f = 0;
+    while (f < HLE_FUNCTIONS && !(strncmp(p, function_names[f], len) == 0 && function_names[f][len] == 0))
+      ++f;
+    if (f == HLE_FUNCTIONS)
+      error_fail("Error: no native version of '%.*s'. Exiting", len, p);
+    listed[f] = 1;
+    if (!end)
+      break;
+    p = end + 1;
+  }
+  struct hle *hle = calloc(sizeof(struct hle), 1);
+  hle->mem = mem;
+  hle->verify = verify;
+  hle->low = UINT32_MAX;
+  for (int f = 0; f < HLE_FUNCTIONS; ++f)
+  {
+    if (!all && !listed[f])
+      continue;
+    int addr = symbols_lookup(syms, function_names[f]);
+    if (addr == -1)
+      continue; // the program doesn't contain it
+    hle->entry_addr[hle->num_entries] = addr;
+    hle->entry_end[hle->num_entries] = addr + 4;
+    for (int s = 0; s < symbols_count(syms); ++s)
+    {
+      if ((uint32_t)symbols_addr(syms, s) > (uint32_t)addr)
+      {
+        hle->entry_end[hle->num_entries] = symbols_addr(syms, s);
+        break;
+      }
+    }
+    hle->entry_function[hle->num_entries] = f;
+    hle->num_entries++;
+    if ((uint32_t)addr < hle->low)
+      hle->low = addr;
+    if ((uint32_t)addr > hle->high)
+      hle->high = addr;
+  }
+  return hle;
+}
+
+void hle_delete(struct hle *hle)
+{
+  for (int i = 0; i < hle->num_pending; ++i)
+    free(hle->pending[i].bytes);
+  free(hle);
+}
+
+// Span of bytes at addr that is contiguous on the host, at most len
+static char *span(struct hle *hle, uint32_t addr, uint32_t len, int *chunk)
+{
+  *chunk = len > 0x10000 ? 0x10000 : len;
+  return memory_span(hle->mem, addr, chunk);
+}
+
+// as span, for a destination that is about to be written
+static char *wr_span(struct hle *hle, uint32_t addr, uint32_t len, int *chunk)
+{
+  *chunk = len > 0x10000 ? 0x10000 : len;
+  return memory_wr_span(hle->mem, addr, chunk);
+}
+
+static void native_memcpy(struct hle *hle, uint32_t dst, uint32_t src, uint32_t len)
+{
+  while (len > 0)
+  {
+    int dchunk, schunk;
+    char *d = wr_span(hle, dst, len, &dchunk);
+    char *s = span(hle, src, len, &schunk);
+    int chunk = dchunk < schunk ? dchunk : schunk;
+    memmove(d, s, chunk);
+    dst += chunk;
+    src += chunk;
+    len -= chunk;
+  }
+}
+
+static void native_memset(struct hle *hle, uint32_t dst, int c, uint32_t len)
+{
+  while (len > 0)
+  {
+    int chunk;
+    char *d = wr_span(hle, dst, len, &chunk);
+    memset(d, c, chunk);
+    dst += chunk;
+    len -= chunk;
+  }
+}
+
+static uint32_t native_strlen(struct hle *hle, uint32_t s)
+{
+  uint32_t len = 0;
+  while (1)
+  {
+    int chunk;
+    char *p = span(hle, s + len, 0x10000, &chunk);
+    char *nul = memchr(p, 0, chunk);
+    if (nul)
+      return len + (nul - p);
+    len += chunk;
+  }
+}
+
+static int first_difference(const unsigned char *a, const unsigned char *b, int len)
+{
+  for (int i = 0; i < len; ++i)
+    if (a[i] != b[i])
+      return a[i] - b[i];
+  return 0;
+}
+
+// memcmp, or strcmp when strings is set; returns the difference of the first
+// differing bytes as unsigned chars, like the usual C implementations
+static int32_t native_compare(struct hle *hle, uint32_t a, uint32_t b, uint32_t len, int strings)
+{
+  while (len > 0)
+  {
+    int achunk, bchunk;
+    unsigned char *pa = (unsigned char *)span(hle, a, len, &achunk);
+    unsigned char *pb = (unsigned char *)span(hle, b, len, &bchunk);
+    int chunk = achunk < bchunk ? achunk : bchunk;
+    unsigned char *nul = strings ? memchr(pa, 0, chunk) : NULL;
+    if (nul)
+      chunk = nul - pa + 1;
+    if (memcmp(pa, pb, chunk) != 0)
+      return first_difference(pa, pb, chunk);
+    if (nul)
+      return 0;
+    a += chunk;
+    b += chunk;
+    if (!strings)
+      len -= chunk;
+  }
+  return 0;
+}
+
+// Computes the result of f without touching guest memory
+static uint32_t native_result(struct hle *hle, int f, uint32_t *regs)
+{
+  switch (f)
+  {
+  case HLE_STRLEN:
+    return native_strlen(hle, regs[10]);
+  case HLE_STRCMP:
+    return native_compare(hle, regs[10], regs[11], UINT32_MAX, 1);
+  case HLE_MEMCMP:
+    return native_compare(hle, regs[10], regs[11], regs[12], 0);
+  default:
+    return regs[10]; // memcpy and memset return dst
+  }
+}
+
+static void start_verify(struct hle *hle, int f, uint32_t *regs, uint32_t from)
+{
+  if (hle->num_pending == MAX_PENDING)
+    return;
+  struct pending *p = &hle->pending[hle->num_pending++];
+  p->function = f;
+  p->from = from;
+  p->ra = regs[1];
+  p->sp = regs[2];
+  p->expected = native_result(hle, f, regs);
+  p->dst = regs[10];
+  p->len = 0;
+  p->bytes = NULL;
+  if ((f == HLE_MEMCPY || f == HLE_MEMSET) && regs[12] <= MAX_VERIFY_BYTES)
+  {
+    p->len = regs[12];
+    p->bytes = malloc(p->len ? p->len : 1);
+    if (f == HLE_MEMCPY)
+      memory_rd_block(hle->mem, regs[11], p->bytes, p->len);
+    else
+      memset(p->bytes, regs[11], p->len);
+  }
+}
+
+static int sign(int32_t x)
+{
+  return (x > 0) - (x < 0);
+}
+
+static void finish_verify(struct hle *hle, struct pending *p, uint32_t *regs)
+{
+  int f = p->function;
+  int ok = f == HLE_STRCMP || f == HLE_MEMCMP
+               ? sign(regs[10]) == sign(p->expected)
+               : regs[10] == p->expected;
+  if (ok && p->bytes)
+  {
+    char *actual = malloc(p->len ? p->len : 1);
+    memory_rd_block(hle->mem, p->dst, actual, p->len);
+    ok = memcmp(actual, p->bytes, p->len) == 0;
+    free(actual);
+  }
+  if (!ok)
+  {
+    hle->mismatches[f]++;
+    fprintf(stderr, "HLE verify: %s called from %x returned %x, native result %x%s\n",
+            function_names[f], p->from, regs[10], p->expected,
+            p->bytes ? " (or memory differs)" : "");
+  }
+  free(p->bytes);
+}
+
+int hle_jump(struct hle *hle, uint32_t *regs, uint32_t from, uint32_t *pc)
+{
+  while (hle->num_pending > 0)
+  {
+    struct pending *p = &hle->pending[hle->num_pending - 1];
+    if (*pc != p->ra || regs[2] != p->sp)
+      break;
+    finish_verify(hle, p, regs);
+    hle->num_pending--;
+  }
+  if (*pc < hle->low || *pc > hle->high)
+    return 0;
+  for (int i = 0; i < hle->num_entries; ++i)
+  {
+    if (hle->entry_addr[i] != *pc)
+      continue;
+    if (from >= hle->entry_addr[i] && from < hle->entry_end[i])
+      return 0; // a loop inside the function, not a call
+    int f = hle->entry_function[i];
+    hle->calls[f]++;
+    if (hle->verify)
+    {
+      start_verify(hle, f, regs, from);
+      return 0;
+    }
+    if (f == HLE_MEMCPY)
+      native_memcpy(hle, regs[10], regs[11], regs[12]);
+    else if (f == HLE_MEMSET)
+      native_memset(hle, regs[10], regs[11], regs[12]);
+    else
+      regs[10] = native_result(hle, f, regs);
+    *pc = regs[1] & ~1U; // return with ra
+    return 1;
+  }
+  return 0;
+}
+
+void hle_report(struct hle *hle, FILE *out)
+{
+  for (int i = 0; i < hle->num_entries; ++i)
+  {
+    int f = hle->entry_function[i];
+    fprintf(out, "HLE %-8s %10ld calls", function_names[f], hle->calls[f]);
+    if (hle->verify)
+      fprintf(out, ", %ld mismatches", hle->mismatches[f]);
+    fprintf(out, "\n");
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef __HLE_H__
+#define __HLE_H__
+
+#include "memory.h"
+#include "symbols.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// High-level emulation of libc routines: calls to memcpy, memset, strlen,
+// strcmp and memcmp are recognised by symbol and run natively on the host.
+struct hle;
+
+// names is a comma separated list of functions to emulate, or "all". A name
+// without a native version is an error.
+// With verify set the guest code still runs, and its results are checked
+// against the native implementation when the function returns.
+struct hle *hle_create(struct memory *mem, struct symbols *syms, const char *names, int verify);
+void hle_delete(struct hle *hle);
+
+// to be called after every jump from pc "from" to *pc. Returns 1 if the jump
+// was a call that has been performed natively; a0 and pc (= ra) are updated.
+int hle_jump(struct hle *hle, uint32_t *regs, uint32_t from, uint32_t *pc);
+
+// print call counts and verification results
+void hle_report(struct hle *hle, FILE *out);
+
+#endif
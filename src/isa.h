@@ -0,0 +1,75 @@
+#ifndef __ISA_H__
+#define __ISA_H__
+
+// RV32IM in one table, chapters 2 and 7 of the spec. Every instruction is
+// given once, with its operation, its name, the bits that identify it (mask)
+// and their value (match), and its format, which says where the immediate
+// is. Instructions that only compute rd from a = rs1 and b = rs2, or b = the
+// immediate, also give that as an expression, and branches their condition.
+// The decoder, the cases in the simulation loop, the translation in aot.c
+// and the instruction tests are all expanded from this table by passing
+// macros for the three kinds of entries:
+//   ALU(op, name, mask, match, format, expression)
+//   BRANCH(op, name, mask, match, format, condition)
+//   OTHER(op, name, mask, match, format)
+// The expressions are also printed into the translated code, so they only
+// use a, b, casts and literals.
+#define ISA_RV32IM(ALU, BRANCH, OTHER) \
+    ALU(OP_LUI, "lui", 0x0000007F, 0x00000037, U, b) \
+    OTHER(OP_AUIPC, "auipc", 0x0000007F, 0x00000017, U) \
+    OTHER(OP_JAL, "jal", 0x0000007F, 0x0000006F, J) \
+    OTHER(OP_JALR, "jalr", 0x0000707F, 0x00000067, I) \
+    BRANCH(OP_BEQ, "beq", 0x0000707F, 0x00000063, B, a == b) \
+    BRANCH(OP_BNE, "bne", 0x0000707F, 0x00001063, B, a != b) \
+    BRANCH(OP_BLT, "blt", 0x0000707F, 0x00004063, B, (int32_t)a < (int32_t)b) \
+    BRANCH(OP_BGE, "bge", 0x0000707F, 0x00005063, B, (int32_t)a >= (int32_t)b) \
+    BRANCH(OP_BLTU, "bltu", 0x0000707F, 0x00006063, B, a < b) \
+    BRANCH(OP_BGEU, "bgeu", 0x0000707F, 0x00007063, B, a >= b) \
+    OTHER(OP_LB, "lb", 0x0000707F, 0x00000003, I) \
+    OTHER(OP_LH, "lh", 0x0000707F, 0x00001003, I) \
+    OTHER(OP_LW, "lw", 0x0000707F, 0x00002003, I) \
+    OTHER(OP_LBU, "lbu", 0x0000707F, 0x00004003, I) \
+    OTHER(OP_LHU, "lhu", 0x0000707F, 0x00005003, I) \
+    OTHER(OP_SB, "sb", 0x0000707F, 0x00000023, S) \
+    OTHER(OP_SH, "sh", 0x0000707F, 0x00001023, S) \
+    OTHER(OP_SW, "sw", 0x0000707F, 0x00002023, S) \
+    ALU(OP_ADDI, "addi", 0x0000707F, 0x00000013, I, a + b) \
+    ALU(OP_SLTI, "slti", 0x0000707F, 0x00002013, I, (int32_t)a < (int32_t)b) \
+    ALU(OP_SLTIU, "sltiu", 0x0000707F, 0x00003013, I, a < b) \
+    ALU(OP_XORI, "xori", 0x0000707F, 0x00004013, I, a ^ b) \
+    ALU(OP_ORI, "ori", 0x0000707F, 0x00006013, I, a | b) \
+    ALU(OP_ANDI, "andi", 0x0000707F, 0x00007013, I, a & b) \
+    ALU(OP_SLLI, "slli", 0xFE00707F, 0x00001013, SHAMT, a << b) \
+    ALU(OP_SRLI, "srli", 0xFE00707F, 0x00005013, SHAMT, a >> b) \
+    ALU(OP_SRAI, "srai", 0xFE00707F, 0x40005013, SHAMT, (uint32_t)((int32_t)a >> b)) \
+    ALU(OP_ADD, "add", 0xFE00707F, 0x00000033, R, a + b) \
+    ALU(OP_SUB, "sub", 0xFE00707F, 0x40000033, R, a - b) \
+    ALU(OP_SLL, "sll", 0xFE00707F, 0x00001033, R, a << (b & 31)) \
+    ALU(OP_SLT, "slt", 0xFE00707F, 0x00002033, R, (int32_t)a < (int32_t)b) \
+    ALU(OP_SLTU, "sltu", 0xFE00707F, 0x00003033, R, a < b) \
+    ALU(OP_XOR, "xor", 0xFE00707F, 0x00004033, R, a ^ b) \
+    ALU(OP_SRL, "srl", 0xFE00707F, 0x00005033, R, a >> (b & 31)) \
+    ALU(OP_SRA, "sra", 0xFE00707F, 0x40005033, R, (uint32_t)((int32_t)a >> (b & 31))) \
+    ALU(OP_OR, "or", 0xFE00707F, 0x00006033, R, a | b) \
+    ALU(OP_AND, "and", 0xFE00707F, 0x00007033, R, a & b) \
+    /* fence.i is left out, it is a nop as the decode cache follows stores by itself */ \
+    OTHER(OP_FENCE, "fence", 0x0000707F, 0x0000000F, I) \
+    OTHER(OP_ECALL, "ecall", 0xFFFFFFFF, 0x00000073, I) \
+    ALU(OP_MUL, "mul", 0xFE00707F, 0x02000033, R, a * b) \
+    ALU(OP_MULH, "mulh", 0xFE00707F, 0x02001033, R, (uint32_t)(((int64_t)(int32_t)a * (int32_t)b) >> 32)) \
+    ALU(OP_MULHSU, "mulhsu", 0xFE00707F, 0x02002033, R, (uint32_t)(((int64_t)(int32_t)a * (int64_t)b) >> 32)) \
+    ALU(OP_MULHU, "mulhu", 0xFE00707F, 0x02003033, R, (uint32_t)(((uint64_t)a * b) >> 32)) \
+    /* division by zero gives all bits set, the overflow gives the dividend */ \
+    ALU(OP_DIV, "div", 0xFE00707F, 0x02004033, R, \
+        b == 0 ? 0xFFFFFFFFu : a == 0x80000000u && b == 0xFFFFFFFFu ? a : (uint32_t)((int32_t)a / (int32_t)b)) \
+    ALU(OP_DIVU, "divu", 0xFE00707F, 0x02005033, R, b == 0 ? 0xFFFFFFFFu : a / b) \
+    /* and the remainder is the dividend, and 0 on overflow, where the host would trap */ \
+    ALU(OP_REM, "rem", 0xFE00707F, 0x02006033, R, \
+        b == 0 ? a : a == 0x80000000u && b == 0xFFFFFFFFu ? 0 : (uint32_t)((int32_t)a % (int32_t)b)) \
+    ALU(OP_REMU, "remu", 0xFE00707F, 0x02007033, R, b == 0 ? a : a % b)
+
+// Where the immediate is, figure 2.4 of the spec. SHAMT is the I format
+// with only the shift amount in its lower 5 bits.
+enum isa_format { ISA_R, ISA_I, ISA_SHAMT, ISA_S, ISA_B, ISA_U, ISA_J };
+
+#endif
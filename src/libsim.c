@@ -0,0 +1,258 @@
+#include "libsim.h"
+#include "memory.h"
+#include "read_exec.h"
+#include "simulate.h"
+#include "syscalls.h"
+#include "fpu.h"
+#include "error.h"
+#include <fenv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern __thread uint32_t registers[32];
+
+_Static_assert(LIBSIM_SYSCALL_DONE == SYSCALL_CONTINUE && LIBSIM_SYSCALL_EXIT == SYSCALL_EXIT
+               && LIBSIM_SYSCALL_DEFAULT == SYSCALL_DEFAULT, "libsim and syscalls.h disagree");
+
+// The register files of the simulation loop belong to the thread, so a
+// guest's registers are kept here between runs.
+struct libsim
+{
+  char *root;
+  struct memory *mem;
+  struct simulation sim;
+  uint32_t pc;
+  uint32_t regs[32];
+  uint64_t fregs[32];
+  uint32_t fcsr;
+  int loaded;
+  int hook_exit; // the syscall hook ended the program
+  int faulted;   // a run was stopped by an error, somewhere after pc
+  int exit_code;
+  long memory_limit;
+  libsim_syscall_fn syscall;
+  void *user;
+  char message[256];
+};
+
+struct libsim *libsim_create(const char *root)
+{
+  struct libsim *sim = calloc(sizeof(struct libsim), 1);
+  sim->root = root ? strdup(root) : NULL;
+  sim->mem = memory_create();
+  return sim;
+}
+
+static void unload(struct libsim *sim)
+{
+  if (sim->sim.sys)
+    syscalls_delete(sim->sim.sys);
+  sim->sim.sys = NULL;
+  memory_delete(sim->mem);
+}
+
+void libsim_delete(struct libsim *sim)
+{
+  unload(sim);
+  free(sim->root);
+  free(sim);
+}
+
+static int load(struct libsim *sim, FILE *fp)
+{
+  if (fp == NULL)
+    return LIBSIM_ERROR_LOAD;
+  unload(sim);
+  sim->mem = memory_create();
+  memory_set_limit(sim->mem, sim->memory_limit);
+  sim->loaded = 0;
+  // the program may not fit in the memory limit
+  FILE *volatile open = fp;
+  jmp_buf trap;
+  error_trap(&trap);
+  if (setjmp(trap))
+  {
+    error_trap(NULL);
+    if (open)
+      fclose(open);
+    snprintf(sim->message, sizeof(sim->message), "%s", error_message());
+    return LIBSIM_ERROR_LOAD;
+  }
+  struct exec_extent extent;
+  int start_addr = read_exec_stream(sim->mem, NULL, NULL, fp, &extent);
+  open = NULL;
+  fclose(fp);
+  if (start_addr == -1)
+  {
+    error_trap(NULL);
+    return LIBSIM_ERROR_LOAD;
+  }
+  sim->sim.sys = syscalls_create(sim->mem, extent.end, sim->root);
+  error_trap(NULL);
+  memset(sim->regs, 0, sizeof(sim->regs));
+  memset(sim->fregs, 0, sizeof(sim->fregs));
+  sim->fcsr = 0;
+  sim->pc = start_addr;
+  sim->sim.exited = 0;
+  sim->hook_exit = 0;
+  sim->faulted = 0;
+  sim->loaded = 1;
+  return LIBSIM_OK;
+}
+
+int libsim_load_file(struct libsim *sim, const char *path)
+{
+  return load(sim, fopen(path, "r"));
+}
+
+int libsim_load_buffer(struct libsim *sim, const char *text, size_t len)
+{
+  // fmemopen wants a buffer it may write to, even for reading
+  return load(sim, len ? fmemopen((void *)text, len, "r") : NULL);
+}
+
+static int syscall_hook(void *ctx, uint32_t *regs)
+{
+  struct libsim *sim = ctx;
+  int result = sim->syscall(sim->user, sim, regs);
+  if (result == LIBSIM_SYSCALL_EXIT)
+  {
+    sim->hook_exit = 1;
+    sim->exit_code = regs[10];
+  }
+  return result;
+}
+
+void libsim_set_syscall(struct libsim *sim, libsim_syscall_fn fn, void *user)
+{
+  sim->syscall = fn;
+  sim->user = user;
+  sim->sim.syscall_hook = fn ? syscall_hook : NULL;
+  sim->sim.syscall_ctx = sim;
+}
+
+// The end of libsim_run, also when it has been trapped. The application
+// gets its own floating point environment back.
+static int finish_run(struct libsim *sim, int status, const fenv_t *host)
+{
+  error_trap(NULL);
+  memcpy(sim->regs, registers, sizeof(sim->regs));
+  memcpy(sim->fregs, fregisters, sizeof(sim->fregs));
+  sim->fcsr = fpu_get_fcsr();
+  fesetenv(host);
+  syscalls_flush(sim->sim.sys);
+  return status;
+}
+
+int libsim_run(struct libsim *sim, long limit, long *executed)
+{
+  if (executed)
+    *executed = 0;
+  if (!sim->loaded || sim->sim.exited || sim->faulted)
+    return LIBSIM_ERROR_STATE;
+  memcpy(registers, sim->regs, sizeof(sim->regs));
+  memcpy(fregisters, sim->fregs, sizeof(sim->fregs));
+  fenv_t host;
+  fegetenv(&host);
+  fpu_set_fcsr(sim->fcsr);
+  sim->sim.limit = limit;
+  jmp_buf trap;
+  error_trap(&trap);
+  if (setjmp(trap))
+  {
+    // the loop doesn't leave the pc of the fault, so the guest can't go on
+    snprintf(sim->message, sizeof(sim->message), "%s", error_message());
+    sim->faulted = 1;
+    return finish_run(sim, LIBSIM_ERROR_FAULT, &host);
+  }
+  long count = simulate_run(sim->mem, &sim->sim, &sim->pc);
+  if (executed)
+    *executed = count;
+  return finish_run(sim, sim->sim.exited ? LIBSIM_EXITED : LIBSIM_OK, &host);
+}
+
+int libsim_step(struct libsim *sim)
+{
+  return libsim_run(sim, 1, NULL);
+}
+
+int libsim_get_reg(struct libsim *sim, int reg, uint32_t *value)
+{
+  if (reg < 0 || reg > 31)
+    return LIBSIM_ERROR_ARG;
+  *value = sim->regs[reg];
+  return LIBSIM_OK;
+}
+
+int libsim_set_reg(struct libsim *sim, int reg, uint32_t value)
+{
+  if (reg < 0 || reg > 31)
+    return LIBSIM_ERROR_ARG;
+  if (reg != 0)
+    sim->regs[reg] = value;
+  return LIBSIM_OK;
+}
+
+uint32_t libsim_get_pc(struct libsim *sim)
+{
+  return sim->pc;
+}
+
+void libsim_set_pc(struct libsim *sim, uint32_t pc)
+{
+  sim->pc = pc;
+}
+
+// the pages copied to or from may not fit in the memory limit
+static int copy_mem(struct libsim *sim, uint32_t addr, void *buf, size_t len, int write)
+{
+  jmp_buf trap;
+  error_trap(&trap);
+  if (setjmp(trap))
+  {
+    error_trap(NULL);
+    snprintf(sim->message, sizeof(sim->message), "%s", error_message());
+    return LIBSIM_ERROR_FAULT;
+  }
+  if (write)
+    memory_wr_block(sim->mem, addr, buf, len);
+  else
+    memory_rd_block(sim->mem, addr, buf, len);
+  error_trap(NULL);
+  return LIBSIM_OK;
+}
+
+int libsim_read_mem(struct libsim *sim, uint32_t addr, void *dst, size_t len)
+{
+  return copy_mem(sim, addr, dst, len, 0);
+}
+
+int libsim_write_mem(struct libsim *sim, uint32_t addr, const void *src, size_t len)
+{
+  return copy_mem(sim, addr, (void *)src, len, 1);
+}
+
+void libsim_set_memory_limit(struct libsim *sim, size_t limit)
+{
+  sim->memory_limit = limit;
+  memory_set_limit(sim->mem, limit);
+}
+
+void libsim_memory_usage(struct libsim *sim, size_t *committed, size_t *peak)
+{
+  long now, most;
+  memory_usage(sim->mem, &now, &most);
+  *committed = now;
+  *peak = most;
+}
+
+int libsim_exit_code(struct libsim *sim)
+{
+  return sim->hook_exit ? sim->exit_code : syscalls_exit_code(sim->sim.sys);
+}
+
+const char *libsim_error(struct libsim *sim)
+{
+  return sim->message;
+}
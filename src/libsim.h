@@ -0,0 +1,77 @@
+#ifndef __LIBSIM_H__
+#define __LIBSIM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The simulator as a library, for running guest programs in-process. make
+// lib builds libsim.a and libsim.so. A struct libsim is one guest with its
+// own memory, registers and system call state. Guests may run in different
+// threads, but each struct libsim is used by one thread at a time.
+struct libsim;
+
+// Results. Errors are negative, and nothing in the library exits the process.
+#define LIBSIM_OK 0           // done, or stopped at the instruction limit
+#define LIBSIM_EXITED 1       // the program has exited
+#define LIBSIM_ERROR_LOAD -1  // the program could not be read or has no _start
+#define LIBSIM_ERROR_FAULT -2 // the program was stopped by an error, see libsim_error
+#define LIBSIM_ERROR_STATE -3 // nothing to run: no program, or it has exited or faulted
+#define LIBSIM_ERROR_ARG -4   // no such register
+
+// root is the host directory the guest's files are confined to, NULL for no
+// file access
+struct libsim *libsim_create(const char *root);
+void libsim_delete(struct libsim *sim);
+
+// Load a program in the .dis format, from a file or from memory, in place of
+// any earlier one. The registers are cleared and the pc set to _start.
+int libsim_load_file(struct libsim *sim, const char *path);
+int libsim_load_buffer(struct libsim *sim, const char *text, size_t len);
+
+// Run at most limit instructions, or until the program exits if limit is 0.
+// The number run goes to *executed unless it is NULL. Guest output is
+// flushed before returning. After LIBSIM_ERROR_FAULT the registers are those
+// at the fault, but the pc and the count are not known, so the program can't
+// run again until one is loaded.
+int libsim_run(struct libsim *sim, long limit, long *executed);
+
+// run a single instruction
+int libsim_step(struct libsim *sim);
+
+// x0-x31, and the pc
+int libsim_get_reg(struct libsim *sim, int reg, uint32_t *value);
+int libsim_set_reg(struct libsim *sim, int reg, uint32_t value);
+uint32_t libsim_get_pc(struct libsim *sim);
+void libsim_set_pc(struct libsim *sim, uint32_t pc);
+
+// copy to and from guest memory
+int libsim_read_mem(struct libsim *sim, uint32_t addr, void *dst, size_t len);
+int libsim_write_mem(struct libsim *sim, uint32_t addr, const void *src, size_t len);
+
+// Called for every ecall before the built in system calls, with the guest's
+// registers (number in regs[17], arguments from regs[10]), which it may
+// change, as it may change memory through sim. Returns one of these:
+#define LIBSIM_SYSCALL_DONE 0    // handled, the program goes on
+#define LIBSIM_SYSCALL_EXIT 1    // handled, the program exits with regs[10]
+#define LIBSIM_SYSCALL_DEFAULT 2 // not handled, leave it to the simulator
+typedef int (*libsim_syscall_fn)(void *user, struct libsim *sim, uint32_t *regs);
+void libsim_set_syscall(struct libsim *sim, libsim_syscall_fn fn, void *user);
+
+// Cap the memory of the guest, its pages, their tables and the instructions
+// decoded from them (32 KiB for every 4 KiB page of code run), at limit bytes,
+// 0 for none. It holds for this program and the ones loaded after it. A
+// program that needs more stops with LIBSIM_ERROR_FAULT, or gets
+// LIBSIM_ERROR_LOAD if it doesn't fit at all.
+void libsim_set_memory_limit(struct libsim *sim, size_t limit);
+
+// bytes of memory the guest uses now and has used at most, as counted by the
+// limit
+void libsim_memory_usage(struct libsim *sim, size_t *committed, size_t *peak);
+
+// exit status of the program, once libsim_run has returned LIBSIM_EXITED
+int libsim_exit_code(struct libsim *sim);
+
+// the message of the latest LIBSIM_ERROR_FAULT
+const char *libsim_error(struct libsim *sim);
+
+#endif
@@ -2,6 +2,16 @@
 #include "assembly.h"
 #include "read_exec.h"
 #include "simulate.h"
+#include "syscalls.h"
+#include "symbols.h"
+#include "hle.h"
+#include "cache.h"
+#include "timing.h"
+#include "aot.h"
+#include "verify.h"
+#include "sample.h"
+#include "plugin.h"
+#include "gdbstub.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +24,24 @@ void terminate(const char *error)
   printf("    sim-options: options to the simulator\n");
   printf("      sim riscv-dis -l log     // log each instruction\n");
   printf("      sim riscv-dis -s log     // log only summary\n");
+  printf("      sim riscv-dis -root dir  // give the program access to files below dir\n");
+  printf("      sim riscv-dis -hle fns   // run libc functions natively, fns is e.g. memcpy,strlen or all\n");
+  printf("      sim riscv-dis -hle-verify fns // run fns in the guest and check them against native code\n");
+  printf("      sim riscv-dis -cache cfg // model caches, cfg is 'default' or e.g. l1d=16k:4:32:lru,l2=off\n");
+  printf("      sim riscv-dis -timing bp // estimate cycles, bp is bimodal or gshare[:bits[:btb[:ras]]]\n");
+  printf("      sim riscv-dis -aot lib.so // translate the program to native code, cached in lib.so\n");
+  printf("      sim riscv-dis -harts n   // run n harts in parallel, each in a host thread\n");
+  printf("      sim riscv-dis -plugin lib.so[,args] // load an instrumentation plugin, may be repeated\n");
+  printf("      sim riscv-dis -g port    // wait for gdb on a localhost port, or a Unix socket path\n");
+  printf("      sim riscv-dis -watch addr[:len][:r|w|rw] // report accesses, addr may be a symbol; may be repeated\n");
+  printf("      sim riscv-dis -watch-stop addr[:len][:r|w|rw] // report an access and stop there\n");
+  printf("      sim riscv-dis -record file // save the input the program gets from stdin and the clock\n");
+  printf("      sim riscv-dis -replay file // give the program the saved input instead\n");
+  printf("      sim riscv-dis -metrics file[,secs] // write live metrics for Prometheus every secs (1)\n");
+  printf("      sim riscv-dis -metrics unix:path[,secs] // serve them on a Unix socket instead\n");
+  printf("      sim riscv-dis -verify n  // check the fast engine against the reference every n instructions\n");
+  printf("      sim riscv-dis -sample skip:warm:measure // run -cache and -timing only in windows, e.g. 10m:100k:100k\n");
+  printf("      sim riscv-dis -memlimit size // stop the program if its memory grows past size, e.g. 64m\n");
   printf("    prog-args: arguments to the simulated program\n");
   printf("               these arguments are provided through argv. Puts '--' in argv[0]\n");
   printf("      sim riscv-dis -- gylletank   // run riscv-dis with 'gylletank' in argv[1]\n");
@@ -50,51 +78,361 @@ int pass_args_to_program(struct memory* mem, int argc, char* argv[]) {
   return seperator_position;
 }
 
+// addr[:len][:r|w|rw], where addr is a number or a symbol. A word is
+// watched for writes when only addr is given.
+void add_watch(struct memory *mem, struct symbols *syms, const char *spec)
+{
+  char name[256];
+  int n = strcspn(spec, ":");
+  if (n == 0 || n >= (int)sizeof(name))
+    terminate("Invalid watchpoint");
+  memcpy(name, spec, n);
+  name[n] = 0;
+  char *end;
+  long addr = strtoul(name, &end, 0);
+  if (*end)
+  {
+    addr = symbols_lookup(syms, name);
+    if (addr == -1)
+      terminate("Unknown symbol in watchpoint");
+  }
+  spec += n;
+  int len = 4;
+  int kind = MEMORY_WATCH_WRITE;
+  if (*spec == ':' && spec[1] >= '0' && spec[1] <= '9')
+  {
+    len = strtol(spec + 1, &end, 0);
+    spec = end;
+  }
+  if (*spec == ':')
+  {
+    spec++;
+    if (!strcmp(spec, "r"))
+      kind = MEMORY_WATCH_READ;
+    else if (!strcmp(spec, "rw"))
+      kind = MEMORY_WATCH_READ | MEMORY_WATCH_WRITE;
+    else if (strcmp(spec, "w"))
+      terminate("Invalid watchpoint");
+  }
+  else if (*spec)
+    terminate("Invalid watchpoint");
+  if (len <= 0)
+    terminate("Invalid watchpoint");
+  memory_watch(mem, addr, len, kind);
+}
+
+// A count of instructions with an optional k, m or g after it
+static long int sample_count(const char *spec, char **end)
+{
+  long int n = strtol(spec, end, 10);
+  const char *suffixes = "kmg";
+  const char *suffix = **end ? strchr(suffixes, **end) : NULL;
+  if (suffix)
+  {
+    for (int i = 0; i <= suffix - suffixes; ++i)
+      n *= 1000;
+    ++*end;
+  }
+  return n;
+}
+
+// A number of bytes with an optional k, m or g after it
+static long int memory_size(const char *spec)
+{
+  char *end;
+  long int n = strtol(spec, &end, 10);
+  const char *suffixes = "kmg";
+  const char *suffix = *end ? strchr(suffixes, *end) : NULL;
+  if (suffix)
+  {
+    for (int i = 0; i <= suffix - suffixes; ++i)
+      n *= 1024;
+    ++end;
+  }
+  if (*end || n <= 0)
+    terminate("Invalid memory limit");
+  return n;
+}
+
+// skip:warm:measure
+struct sampler *parse_sample(const char *spec)
+{
+  char *end;
+  long int skip = sample_count(spec, &end);
+  if (*end != ':')
+    terminate("Invalid sampling");
+  long int warm = sample_count(end + 1, &end);
+  if (*end != ':')
+    terminate("Invalid sampling");
+  long int measure = sample_count(end + 1, &end);
+  if (*end || skip <= 0 || warm < 0 || measure <= 0)
+    terminate("Invalid sampling");
+  return sample_create(skip, warm, measure);
+}
+
 int main(int argc, char *argv[])
 { 
   struct memory *mem = memory_create();
+  int all_args = argc;
   argc = pass_args_to_program(mem, argc, argv);
-  if (argc == 2 || argc == 4)
+  if (argc < 2)
+  {
+    terminate("Missing operands");
+  }
+  const char *log_name = NULL;
+  const char *summary_name = NULL;
+  const char *root = NULL;
+  const char *hle_names = NULL;
+  int hle_verify = 0;
+  const char *cache_config = NULL;
+  const char *timing_config = NULL;
+  const char *aot_name = NULL;
+  int harts = 1;
+  struct plugins *plugins = NULL;
+  const char *gdb_where = NULL;
+  const char *watches[argc];
+  int num_watches = 0;
+  int watch = 0;
+  const char *record_name = NULL;
+  const char *replay_name = NULL;
+  const char *metrics_where = NULL;
+  long int verify_every = 0;
+  long int memory_limit = 0;
+  const char *sample_spec = NULL;
+  for (int i = 2; i < argc; i += 2)
   {
-    struct assembly *as = assembly_create();
-    FILE *log_file = NULL;
-    if (argc == 4 && !strcmp(argv[2], "-l"))
+    if (i + 1 == argc)
+      terminate("Missing argument to option");
+    if (!strcmp(argv[i], "-l"))
+      log_name = argv[i + 1];
+    else if (!strcmp(argv[i], "-s"))
+      summary_name = argv[i + 1];
+    else if (!strcmp(argv[i], "-root"))
+      root = argv[i + 1];
+    else if (!strcmp(argv[i], "-hle") || !strcmp(argv[i], "-hle-verify"))
     {
-      log_file = fopen(argv[3], "w");
-      if (log_file == NULL)
-      {
-        terminate("Could not open logfile, terminating.");
-      }
+      hle_names = argv[i + 1];
+      hle_verify = !strcmp(argv[i], "-hle-verify");
     }
-    int start_addr = read_exec(mem, as, argv[1], log_file);
-    clock_t before = clock();
-    long int num_insns = simulate(mem, as, start_addr, log_file);
-    clock_t after = clock();
-    int ticks = after - before;
-    double mips = (1.0 * num_insns * CLOCKS_PER_SEC) / ticks / 1000000;
-    if (argc == 4 && !strcmp(argv[2], "-s"))
+    else if (!strcmp(argv[i], "-cache"))
+      cache_config = argv[i + 1];
+    else if (!strcmp(argv[i], "-timing"))
+      timing_config = argv[i + 1];
+    else if (!strcmp(argv[i], "-aot"))
+      aot_name = argv[i + 1];
+    else if (!strcmp(argv[i], "-harts"))
+      harts = atoi(argv[i + 1]);
+    else if (!strcmp(argv[i], "-g"))
+      gdb_where = argv[i + 1];
+    else if (!strcmp(argv[i], "-watch") || !strcmp(argv[i], "-watch-stop"))
     {
-      log_file = fopen(argv[3], "w");
-      if (log_file == NULL)
-      {
-        terminate("Could not open logfile, terminating.");
-      }
+      watches[num_watches++] = argv[i + 1];
+      if (!strcmp(argv[i], "-watch-stop"))
+        watch = 2;
+      else if (watch == 0)
+        watch = 1;
     }
-    if (log_file)
+    else if (!strcmp(argv[i], "-record"))
+      record_name = argv[i + 1];
+    else if (!strcmp(argv[i], "-replay"))
+      replay_name = argv[i + 1];
+    else if (!strcmp(argv[i], "-verify"))
     {
-      fprintf(log_file, "\nSimulated %ld instructions in %d ticks (%f MIPS)\n", num_insns, ticks, mips);
-      fclose(log_file);
+      verify_every = atol(argv[i + 1]);
+      if (verify_every <= 0)
+        terminate("The number of instructions between checks must be positive");
+    }
+    else if (!strcmp(argv[i], "-sample"))
+      sample_spec = argv[i + 1];
+    else if (!strcmp(argv[i], "-memlimit"))
+      memory_limit = memory_size(argv[i + 1]);
+    else if (!strcmp(argv[i], "-metrics"))
+      metrics_where = argv[i + 1];
+    else if (!strcmp(argv[i], "-plugin"))
+    {
+      if (plugins == NULL)
+        plugins = plugins_create();
+      plugins_load(plugins, argv[i + 1]);
     }
     else
+      terminate("Unknown option");
+  }
+  if (harts < 1)
+    terminate("The number of harts must be positive");
+  // the models, the translation and the plugins keep state for a single hart
+  if (harts > 1 && (hle_names || cache_config || timing_config || aot_name || plugins))
+    terminate("-harts can't be combined with -hle, -cache, -timing, -aot or -plugin");
+  // breakpoints are only seen by the loop that runs superinstructions
+  if (gdb_where && (harts > 1 || cache_config || timing_config || aot_name || plugins))
+    terminate("-g can't be combined with -harts, -cache, -timing, -aot or -plugin");
+  // the translated code and the other harts don't know where they are
+  if (watch && (harts > 1 || aot_name || gdb_where))
+    terminate("-watch can't be combined with -harts, -aot or -g");
+  // input is kept with the instruction count of a single run of a single hart
+  if ((record_name || replay_name) && (harts > 1 || gdb_where))
+    terminate("-record and -replay can't be combined with -harts or -g");
+  if (record_name && replay_name)
+    terminate("-record and -replay can't be combined");
+  // gdb runs the program a little at a time, each run counting from zero
+  if (metrics_where && gdb_where)
+    terminate("-metrics can't be combined with -g");
+  // the reference is the plain interpreter, and is only compared to the
+  // engines that run the same instructions faster
+  if (verify_every && (harts > 1 || hle_names || cache_config || timing_config || plugins || gdb_where || watch ||
+                       metrics_where))
+    terminate("-verify can only be combined with -aot, -record, -replay, -root and -memlimit");
+  // the program is run in parts, each counting from zero
+  if (sample_spec && !cache_config && !timing_config)
+    terminate("-sample needs -cache or -timing");
+  if (sample_spec && (harts > 1 || plugins || gdb_where || watch || record_name || replay_name || metrics_where ||
+                      verify_every))
+    terminate("-sample can't be combined with -harts, -plugin, -g, -watch, -record, -replay, -metrics or -verify");
+  struct sampler *sampler = sample_spec ? parse_sample(sample_spec) : NULL;
+  struct assembly *as = assembly_create();
+  struct symbols *syms = symbols_create();
+  FILE *log_file = NULL;
+  if (log_name)
+  {
+    log_file = fopen(log_name, "w");
+    if (log_file == NULL)
     {
-      printf("\nSimulated %ld instructions in %d ticks (%f MIPS)\n", num_insns, ticks, mips);
+      terminate("Could not open logfile, terminating.");
     }
-    assembly_delete(as);
-    memory_delete(mem);
   }
-  else {
-    terminate("Missing operands");
-    memory_delete(mem);
+  memory_set_limit(mem, memory_limit);
+  struct exec_extent extent;
+  int start_addr = read_exec(mem, as, syms, argv[1], log_file, &extent);
+  for (int i = 0; i < num_watches; ++i)
+    add_watch(mem, syms, watches[i]);
+  struct memory *ref_mem = NULL;
+  if (verify_every)
+  {
+    // a copy of its own, read up front
+    ref_mem = memory_create();
+    memory_set_limit(ref_mem, memory_limit);
+    pass_args_to_program(ref_mem, all_args, argv);
+    FILE *fp = fopen(argv[1], "r");
+    struct assembly *ref_as = assembly_create();
+    struct symbols *ref_syms = symbols_create();
+    struct exec_extent ref_extent;
+    if (fp == NULL || read_exec_stream(ref_mem, ref_as, ref_syms, fp, &ref_extent) != start_addr)
+      terminate("Could not read the program again for -verify");
+    fclose(fp);
+    symbols_delete(ref_syms);
+    assembly_delete(ref_as);
+  }
+  struct syscalls *sys = syscalls_create(mem, extent.end, root);
+  if (record_name)
+    syscalls_record(sys, record_name);
+  if (replay_name)
+    syscalls_replay(sys, replay_name);
+  struct simulation sim = {0};
+  sim.sys = sys;
+  sim.harts = harts;
+  sim.plugins = plugins;
+  sim.watch = watch;
+  if (metrics_where)
+  {
+    char where[strlen(metrics_where) + 1];
+    strcpy(where, metrics_where);
+    char *comma = strrchr(where, ',');
+    double interval = 1;
+    if (comma)
+    {
+      *comma = 0;
+      interval = atof(comma + 1);
+    }
+    sim.metrics = metrics_create(where, interval, mem, syms);
+  }
+  sim.hle = hle_names ? hle_create(mem, syms, hle_names, hle_verify) : NULL;
+  sim.cache = cache_config ? cache_create(cache_config, syms) : NULL;
+  sim.timing = timing_config ? timing_create(timing_config) : NULL;
+  if (aot_name)
+    sim.aot = aot_create(aot_name, mem, syms, extent.text_low, extent.text_high);
+  clock_t before = clock();
+  long int num_insns;
+  if (gdb_where)
+  {
+    struct gdbstub *stub = gdbstub_create(gdb_where);
+    num_insns = gdbstub_run(stub, mem, &sim, start_addr);
+    gdbstub_delete(stub);
+  }
+  else if (verify_every)
+    num_insns = verify_run(mem, ref_mem, as, &sim, start_addr, verify_every);
+  else if (sampler)
+    num_insns = sample_run(sampler, mem, &sim, start_addr);
+  else
+    num_insns = simulate(mem, as, &sim, start_addr, log_file);
+  clock_t after = clock();
+  syscalls_flush(sys);
+  int ticks = after - before;
+  double mips = (1.0 * num_insns * CLOCKS_PER_SEC) / ticks / 1000000;
+  if (summary_name)
+  {
+    log_file = fopen(summary_name, "w");
+    if (log_file == NULL)
+    {
+      terminate("Could not open logfile, terminating.");
+    }
+  }
+  if (log_file)
+  {
+    fprintf(log_file, "\nSimulated %ld instructions in %d ticks (%f MIPS)\n", num_insns, ticks, mips);
+    memory_report(mem, log_file);
+    if (sim.hle)
+      hle_report(sim.hle, log_file);
+    if (sampler)
+      sample_report(sampler, log_file);
+    else
+    {
+      if (sim.cache)
+        cache_report(sim.cache, log_file);
+      if (sim.timing)
+        timing_report(sim.timing, log_file);
+    }
+    if (sim.plugins)
+      plugins_exit(sim.plugins, syscalls_exit_code(sys), log_file);
+    fclose(log_file);
+  }
+  else
+  {
+    printf("\nSimulated %ld instructions in %d ticks (%f MIPS)\n", num_insns, ticks, mips);
+    memory_report(mem, stdout);
+    if (sim.hle)
+      hle_report(sim.hle, stdout);
+    if (sampler)
+      sample_report(sampler, stdout);
+    else
+    {
+      if (sim.cache)
+        cache_report(sim.cache, stdout);
+      if (sim.timing)
+        timing_report(sim.timing, stdout);
+    }
+    if (sim.plugins)
+      plugins_exit(sim.plugins, syscalls_exit_code(sys), stdout);
   }
-  
+  int exit_code = syscalls_exit_code(sys);
+  if (sim.hle)
+    hle_delete(sim.hle);
+  if (sim.cache)
+    cache_delete(sim.cache);
+  if (sim.timing)
+    timing_delete(sim.timing);
+  if (sampler)
+    sample_delete(sampler);
+  if (sim.aot)
+    aot_delete(sim.aot);
+  if (sim.plugins)
+    plugins_delete(sim.plugins);
+  if (sim.metrics)
+    metrics_delete(sim.metrics);
+  syscalls_delete(sys);
+  read_exec_finish(mem);
+  symbols_delete(syms);
+  assembly_delete(as);
+  memory_delete(mem);
+  if (ref_mem)
+    memory_delete(ref_mem);
+  return exit_code;
 }
@@ -1,103 +1,540 @@
 #include "memory.h"
+#include "error.h"
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+// page flags
+#define PAGE_CODE 1
+#define PAGE_WATCH_READ 2
+#define PAGE_WATCH_WRITE 4
+#define PAGE_CLEAN 8 // not written since memory_clean
+
+#define LEAF_SHIFT (MEMORY_PAGE_BITS + MEMORY_LEAF_BITS)
+#define PAGE_INDEX(addr) (((uint32_t)(addr) >> MEMORY_PAGE_BITS) & (MEMORY_LEAF_PAGES - 1))
+#define PAGE_OFFSET(addr) ((uint32_t)(addr) & (MEMORY_PAGE_SIZE - 1))
+#define SLAB_PAGES 64 // pages are handed out from slabs of this many
+
+struct watch
+{
+  uint32_t addr, len;
+  int kind;
+};
 
 struct memory
 {
-  int *pages[0x10000];
+  // A leaf is made when one of its pages is first needed, so a program
+  // using a few scattered words only has a few small pages. The flags are
+  // set for pages holding decoded instructions or watched addresses, an
+  // access to any other page costs a single test of them.
+  struct memory_leaf *leaves[MEMORY_LEAVES];
+  unsigned char leaf_flags; // the flags of the pages of new leaves
+  memory_code_hook code_hook;
+  void *code_ctx;
+  memory_fill_hook fill_hook;
+  void *fill_ctx;
+  memory_watch_hook watch_hook;
+  void *watch_ctx;
+  int num_watches;
+  struct watch *watches;
+  int num_pages;
+  // Pages come from slabs, and pages given back go on a free list, linked
+  // through their first word. Each thread hands out pages from a slab of
+  // its own, so the lock is only taken to make a slab or to reuse a page
+  // that has been given back.
+  pthread_mutex_t lock;
+  long id; // tells the threads' slabs of different memories apart
+  int num_slabs;
+  char **slabs;
+  void *free_pages;
+  long committed, peak, limit;
+  int decoded_size; // bytes in each page of decoded instructions
+  // pages written since memory_clean, in the order they were first written
+  int num_dirty, dirty_size;
+  int *dirty;
 };
 
+// The slab the thread hands out pages from
+struct thread_slab
+{
+  long id; // of the memory it belongs to
+  char *next;
+  int left;
+};
+static __thread struct thread_slab thread_slab;
+static long memories_made;
+
 struct memory *memory_create()
 {
-  return calloc(sizeof(struct memory), 1);
+  struct memory *mem = calloc(sizeof(struct memory), 1);
+  pthread_mutex_init(&mem->lock, NULL);
+  mem->id = __atomic_add_fetch(&memories_made, 1, __ATOMIC_RELAXED);
+  return mem;
 }
 
 void memory_delete(struct memory *mem)
 {
-  for (int j = 0; j < 0x10000; ++j)
+  for (int j = 0; j < MEMORY_LEAVES; ++j)
   {
-    if (mem->pages[j])
-      free(mem->pages[j]);
+    for (int i = 0; mem->leaves[j] && i < MEMORY_LEAF_PAGES; ++i)
+    {
+      for (int k = 0; mem->leaves[j]->decoded[i] && k < MEMORY_DECODERS; ++k)
+        free(mem->leaves[j]->decoded[i][k]);
+      free(mem->leaves[j]->decoded[i]);
+    }
+    free(mem->leaves[j]);
   }
+  for (int j = 0; j < mem->num_slabs; ++j)
+    free(mem->slabs[j]);
+  free(mem->slabs);
+  free(mem->watches);
+  free(mem->dirty);
+  pthread_mutex_destroy(&mem->lock);
   free(mem);
 }
 
-int *get_page(struct memory *mem, int addr)
+struct memory_leaf **memory_leaves(struct memory *mem)
+{
+  return mem->leaves;
+}
+
+// Counts bytes taken into use, or given back when bytes is negative. Taking
+// more than the limit stops the machine.
+static void charge(struct memory *mem, long bytes, uint32_t addr)
 {
-  int page_number = (addr >> 16) & 0x0ffff;
-  if (mem->pages[page_number] == NULL)
+  long now = __atomic_add_fetch(&mem->committed, bytes, __ATOMIC_RELAXED);
+  if (bytes > 0 && mem->limit && now > mem->limit)
   {
-    mem->pages[page_number] = calloc(65536, 1);
+    __atomic_sub_fetch(&mem->committed, bytes, __ATOMIC_RELAXED);
+    error_fail("Out of memory at %x: the limit is %ld KiB", addr, mem->limit / 1024);
   }
-  return mem->pages[page_number];
+  long peak = __atomic_load_n(&mem->peak, __ATOMIC_RELAXED);
+  while (now > peak && !__atomic_compare_exchange_n(&mem->peak, &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+// The leaf of addr, made if it is not there yet. As with pages, the first
+// thread to fill in the slot wins.
+static struct memory_leaf *get_leaf(struct memory *mem, uint32_t addr)
+{
+  struct memory_leaf **slot = &mem->leaves[addr >> LEAF_SHIFT];
+  struct memory_leaf *leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (leaf == NULL)
+  {
+    charge(mem, sizeof(struct memory_leaf), addr);
+    struct memory_leaf *fresh = calloc(sizeof(struct memory_leaf), 1);
+    memset(fresh->flags, mem->leaf_flags, sizeof(fresh->flags));
+    if (__atomic_compare_exchange_n(slot, &leaf, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      leaf = fresh;
+    else
+    {
+      charge(mem, -(long)sizeof(struct memory_leaf), addr);
+      free(fresh);
+    }
+  }
+  return leaf;
+}
+
+// A zeroed page, from the thread's slab, the free list or a new slab
+static int *take_page(struct memory *mem, uint32_t addr)
+{
+  charge(mem, MEMORY_PAGE_SIZE, addr);
+  struct thread_slab *own = &thread_slab;
+  if (own->id == mem->id && own->left > 0 && __atomic_load_n(&mem->free_pages, __ATOMIC_RELAXED) == NULL)
+  {
+    char *page = own->next;
+    own->next += MEMORY_PAGE_SIZE;
+    own->left--;
+    return (int *)page;
+  }
+  pthread_mutex_lock(&mem->lock);
+  char *page = mem->free_pages;
+  if (page)
+  {
+    mem->free_pages = *(void **)page;
+    pthread_mutex_unlock(&mem->lock);
+    memset(page, 0, MEMORY_PAGE_SIZE);
+    return (int *)page;
+  }
+  if (own->id != mem->id || own->left == 0)
+  {
+    mem->slabs = realloc(mem->slabs, (mem->num_slabs + 1) * sizeof(char *));
+    // a large calloc is mapped fresh, so the host only commits the pages
+    // of the slab as they are handed out and written
+    own->next = mem->slabs[mem->num_slabs++] = calloc(SLAB_PAGES, MEMORY_PAGE_SIZE);
+    own->left = SLAB_PAGES;
+    own->id = mem->id;
+  }
+  pthread_mutex_unlock(&mem->lock);
+  page = own->next;
+  own->next += MEMORY_PAGE_SIZE;
+  own->left--;
+  return (int *)page;
+}
+
+static void give_page(struct memory *mem, int *page)
+{
+  charge(mem, -MEMORY_PAGE_SIZE, 0);
+  pthread_mutex_lock(&mem->lock);
+  *(void **)page = mem->free_pages;
+  __atomic_store_n(&mem->free_pages, page, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&mem->lock);
+}
+
+// Every page starts out clean, after that only the dirty ones need to be
+// made clean again
+void memory_clean(struct memory *mem)
+{
+  if (!(mem->leaf_flags & PAGE_CLEAN))
+  {
+    mem->leaf_flags |= PAGE_CLEAN;
+    for (int j = 0; j < MEMORY_LEAVES; ++j)
+    {
+      for (int i = 0; mem->leaves[j] && i < MEMORY_LEAF_PAGES; ++i)
+        mem->leaves[j]->flags[i] |= PAGE_CLEAN;
+    }
+  }
+  for (int i = 0; i < mem->num_dirty; ++i)
+  {
+    uint32_t addr = (uint32_t)mem->dirty[i] << MEMORY_PAGE_BITS;
+    get_leaf(mem, addr)->flags[PAGE_INDEX(addr)] |= PAGE_CLEAN;
+  }
+  mem->num_dirty = 0;
+}
+
+int memory_dirty_pages(struct memory *mem, const int **pages)
+{
+  *pages = mem->dirty;
+  return mem->num_dirty;
+}
+
+int memory_page_count(struct memory *mem)
+{
+  return __atomic_load_n(&mem->num_pages, __ATOMIC_RELAXED);
+}
+
+void memory_set_limit(struct memory *mem, long limit)
+{
+  mem->limit = limit;
+}
+
+long memory_get_limit(struct memory *mem)
+{
+  return mem->limit;
+}
+
+void memory_usage(struct memory *mem, long *committed, long *peak)
+{
+  *committed = __atomic_load_n(&mem->committed, __ATOMIC_RELAXED);
+  *peak = __atomic_load_n(&mem->peak, __ATOMIC_RELAXED);
+}
+
+void memory_report(struct memory *mem, FILE *out)
+{
+  long committed, peak;
+  memory_usage(mem, &committed, &peak);
+  fprintf(out, "Memory: %ld KiB committed in %d pages of %d KiB, their tables and decoded code, %ld KiB at the peak\n",
+          committed / 1024, memory_page_count(mem), MEMORY_PAGE_SIZE / 1024, peak / 1024);
+}
+
+void memory_set_code_hook(struct memory *mem, memory_code_hook hook, void *ctx)
+{
+  mem->code_hook = hook;
+  mem->code_ctx = ctx;
+}
+
+void memory_set_fill_hook(struct memory *mem, memory_fill_hook hook, void *ctx)
+{
+  mem->fill_hook = hook;
+  mem->fill_ctx = ctx;
+}
+
+memory_fill_hook memory_fill_hook_of(struct memory *mem, void **ctx)
+{
+  *ctx = mem->fill_ctx;
+  return mem->fill_hook;
+}
+
+// Sets flag for the pages of [addr, addr+len)
+static void flag_pages(struct memory *mem, uint32_t addr, uint32_t len, int flag)
+{
+  for (uint32_t page = addr >> MEMORY_PAGE_BITS; page <= (addr + len - 1) >> MEMORY_PAGE_BITS; ++page)
+  {
+    uint32_t at = page << MEMORY_PAGE_BITS;
+    __atomic_or_fetch(&get_leaf(mem, at)->flags[PAGE_INDEX(at)], flag, __ATOMIC_RELAXED);
+    if (page == 0xFFFFFFFFu >> MEMORY_PAGE_BITS)
+      break;
+  }
+}
+
+void memory_mark_code(struct memory *mem, int addr, int len)
+{
+  flag_pages(mem, addr, len, PAGE_CODE);
+}
+
+void memory_set_watch_hook(struct memory *mem, memory_watch_hook hook, void *ctx)
+{
+  mem->watch_hook = hook;
+  mem->watch_ctx = ctx;
+}
+
+void memory_watch(struct memory *mem, int addr, int len, int kind)
+{
+  mem->watches = realloc(mem->watches, (mem->num_watches + 1) * sizeof(struct watch));
+  mem->watches[mem->num_watches++] = (struct watch){addr, len, kind};
+  int flag = (kind & MEMORY_WATCH_READ ? PAGE_WATCH_READ : 0) | (kind & MEMORY_WATCH_WRITE ? PAGE_WATCH_WRITE : 0);
+  flag_pages(mem, addr, len, flag);
+}
+
+static void code_written(struct memory *mem, int addr, int len)
+{
+  if (mem->code_hook)
+    mem->code_hook(mem->code_ctx, mem, addr, len);
+}
+
+// The decoders of a page are made together, by whichever comes first. Each
+// decoder then makes its own page of decoded instructions.
+void *memory_decoded(struct memory *mem, int addr, int decoder, int size)
+{
+  struct memory_leaf *leaf = get_leaf(mem, addr);
+  void ***slot = &leaf->decoded[PAGE_INDEX(addr)];
+  void **decoders = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (decoders == NULL)
+  {
+    charge(mem, MEMORY_DECODERS * sizeof(void *), addr);
+    void **fresh = calloc(MEMORY_DECODERS, sizeof(void *));
+    if (__atomic_compare_exchange_n(slot, &decoders, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      decoders = fresh;
+    else
+    {
+      charge(mem, -(long)(MEMORY_DECODERS * sizeof(void *)), addr);
+      free(fresh);
+    }
+  }
+  if (decoders[decoder] == NULL)
+  {
+    charge(mem, size, addr);
+    mem->decoded_size = size;
+    // stores to the page must reach the code hook before it is decoded
+    flag_pages(mem, addr, 1, PAGE_CODE);
+    decoders[decoder] = calloc(1, size);
+  }
+  return decoders[decoder];
+}
+
+void *memory_find_decoded(struct memory *mem, int addr, int decoder)
+{
+  struct memory_leaf *leaf = __atomic_load_n(&mem->leaves[(uint32_t)addr >> LEAF_SHIFT], __ATOMIC_ACQUIRE);
+  void **decoders = leaf ? __atomic_load_n(&leaf->decoded[PAGE_INDEX(addr)], __ATOMIC_ACQUIRE) : NULL;
+  return decoders ? decoders[decoder] : NULL;
+}
+
+void memory_drop_decoded(struct memory *mem, int decoder)
+{
+  for (int j = 0; j < MEMORY_LEAVES; ++j)
+  {
+    struct memory_leaf *leaf = __atomic_load_n(&mem->leaves[j], __ATOMIC_ACQUIRE);
+    for (int i = 0; leaf && i < MEMORY_LEAF_PAGES; ++i)
+    {
+      void **decoders = __atomic_load_n(&leaf->decoded[i], __ATOMIC_ACQUIRE);
+      if (decoders && decoders[decoder])
+      {
+        free(decoders[decoder]);
+        decoders[decoder] = NULL;
+        charge(mem, -mem->decoded_size, 0);
+      }
+    }
+  }
+}
+
+// Harts in other threads may create the same page at the same time. The
+// first to fill in the slot wins and the others give their page back. A
+// page is filled before it is published, so nobody sees it half loaded.
+static __attribute__((noinline)) int *make_page(struct memory *mem, int addr, unsigned char *flags)
+{
+  struct memory_leaf *leaf = get_leaf(mem, addr);
+  int **slot = &leaf->pages[PAGE_INDEX(addr)];
+  int *page = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (page == NULL)
+  {
+    int *fresh = take_page(mem, addr);
+    if (mem->fill_hook)
+      mem->fill_hook(mem->fill_ctx, addr & ~(MEMORY_PAGE_SIZE - 1), fresh);
+    if (__atomic_compare_exchange_n(slot, &page, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      page = fresh;
+      __atomic_add_fetch(&mem->num_pages, 1, __ATOMIC_RELAXED);
+    }
+    else
+      give_page(mem, fresh);
+  }
+  *flags = leaf->flags[PAGE_INDEX(addr)];
+  return page;
+}
+
+// The page of addr, made if it is not there yet. *flags is set to its flags.
+static inline int *get_page(struct memory *mem, int addr, unsigned char *flags)
+{
+  struct memory_leaf *leaf = __atomic_load_n(&mem->leaves[(uint32_t)addr >> LEAF_SHIFT], __ATOMIC_ACQUIRE);
+  int *page = leaf ? __atomic_load_n(&leaf->pages[PAGE_INDEX(addr)], __ATOMIC_ACQUIRE) : NULL;
+  if (page == NULL)
+    return make_page(mem, addr, flags);
+  *flags = leaf->flags[PAGE_INDEX(addr)];
+  return page;
+}
+
+int *memory_find_page(struct memory *mem, int addr)
+{
+  struct memory_leaf *leaf = __atomic_load_n(&mem->leaves[(uint32_t)addr >> LEAF_SHIFT], __ATOMIC_ACQUIRE);
+  return leaf ? __atomic_load_n(&leaf->pages[PAGE_INDEX(addr)], __ATOMIC_ACQUIRE) : NULL;
+}
+
+static void dirtied(struct memory *mem, uint32_t addr)
+{
+  get_leaf(mem, addr)->flags[PAGE_INDEX(addr)] &= ~PAGE_CLEAN;
+  if (mem->num_dirty == mem->dirty_size)
+  {
+    mem->dirty_size = mem->dirty_size ? 2 * mem->dirty_size : 64;
+    mem->dirty = realloc(mem->dirty, mem->dirty_size * sizeof(int));
+  }
+  mem->dirty[mem->num_dirty++] = addr >> MEMORY_PAGE_BITS;
+}
+
+// Other harts must not use the pages while they are given back. Written
+// pages are reported as if they had been zeroed.
+void memory_release(struct memory *mem, int addr, int len)
+{
+  uint32_t from = ((uint32_t)addr + MEMORY_PAGE_SIZE - 1) & ~(MEMORY_PAGE_SIZE - 1);
+  uint32_t to = ((uint32_t)addr + len) & ~(MEMORY_PAGE_SIZE - 1);
+  for (uint32_t at = from; at < to; at += MEMORY_PAGE_SIZE)
+  {
+    struct memory_leaf *leaf = mem->leaves[at >> LEAF_SHIFT];
+    int *page = leaf ? __atomic_exchange_n(&leaf->pages[PAGE_INDEX(at)], NULL, __ATOMIC_ACQ_REL) : NULL;
+    if (page == NULL)
+      continue;
+    unsigned char flags = leaf->flags[PAGE_INDEX(at)];
+    if (flags & PAGE_CLEAN)
+      dirtied(mem, at);
+    if (flags & PAGE_CODE)
+      code_written(mem, at, MEMORY_PAGE_SIZE);
+    give_page(mem, page);
+    __atomic_sub_fetch(&mem->num_pages, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// up to 4 bytes at addr, which may cross a page
+static uint32_t peek(struct memory *mem, uint32_t addr, int size)
+{
+  uint32_t value = 0;
+  unsigned char flags;
+  for (int i = 0; i < size; ++i)
+    value |= (uint32_t)((unsigned char *)get_page(mem, addr + i, &flags))[PAGE_OFFSET(addr + i)] << (8 * i);
+  return value;
+}
+
+// An access of size bytes at addr to a page with watched addresses. The hook
+// hears of the part of it inside each watch of the right kind, at most 4
+// bytes of it, with the value from before a write: old_value when the caller
+// knows it, else what memory holds now.
+static void watched(struct memory *mem, uint32_t addr, int size, int kind, const uint32_t *old_value,
+                    const uint32_t *new_value)
+{
+  for (int i = 0; i < mem->num_watches && mem->watch_hook; ++i)
+  {
+    struct watch *w = &mem->watches[i];
+    if (!(w->kind & kind) || (addr - w->addr >= w->len && w->addr - addr >= (uint32_t)size))
+      continue;
+    uint32_t from = addr - w->addr < w->len ? addr : w->addr;
+    uint32_t to = addr + size - w->addr <= w->len ? addr + size : w->addr + w->len;
+    int part = to - from > 4 ? 4 : to - from;
+    // the new value is only given when all of it was watched
+    const uint32_t *new_part = part == size ? new_value : NULL;
+    uint32_t old_part = old_value ? *old_value >> (8 * (from - addr)) : peek(mem, from, part);
+    mem->watch_hook(mem->watch_ctx, from, part, kind, old_part, new_part);
+  }
+}
+
+// A store to a page with flags: watches hear of it first, a clean page is
+// noted as dirtied, and decoded code is dropped once the new bytes are in
+static void flagged_store(struct memory *mem, uint32_t addr, int size, unsigned char flags, void *at,
+                          uint32_t value)
+{
+  if (flags & PAGE_WATCH_WRITE)
+    watched(mem, addr, size, MEMORY_WATCH_WRITE, NULL, &value);
+  if (flags & PAGE_CLEAN)
+    dirtied(mem, addr);
+  memcpy(at, &value, size);
+  if (flags & PAGE_CODE)
+    code_written(mem, addr, size);
 }
 
 void memory_wr_w(struct memory *mem, int addr, int data)
 {
   if (addr & 0x3)
   {
-    printf("Unaligned word write to %x\n", addr);
-    exit(-1);
+    error_fail("Unaligned word write to %x", addr);
   }
-  int *page = get_page(mem, addr);
-  page[(addr >> 2) & 0x3fff] = data;
+  unsigned char flags;
+  int *page = get_page(mem, addr, &flags);
+  if (__builtin_expect(flags, 0))
+    flagged_store(mem, addr, 4, flags, &page[PAGE_OFFSET(addr) >> 2], data);
+  else
+    page[PAGE_OFFSET(addr) >> 2] = data;
 }
 
 void memory_wr_h(struct memory *mem, int addr, int data)
 {
   if (addr & 0x1)
   {
-    printf("Unaligned halfword write to %x\n", addr);
-    exit(-1);
+    error_fail("Unaligned halfword write to %x", addr);
   }
-  int *page = get_page(mem, addr);
-  int index = (addr >> 2) & 0x3fff;
-  if ((addr & 2) == 0)
-    page[index] = (page[index] & 0xffff0000) | (data & 0x0000ffff);
+  // The pages are little-endian like the host, so halfwords and bytes are
+  // stored on their own, and harts writing next to each other don't undo
+  // each other's stores
+  unsigned short half = data;
+  unsigned char flags;
+  char *page = (char *)get_page(mem, addr, &flags);
+  if (__builtin_expect(flags, 0))
+    flagged_store(mem, addr, 2, flags, page + PAGE_OFFSET(addr), half);
   else
-    page[index] = (page[index] & 0x0000ffff) | ((unsigned)data << 16);
+    memcpy(page + PAGE_OFFSET(addr), &half, 2);
 }
 
 void memory_wr_b(struct memory *mem, int addr, int data)
 {
-  int *page = get_page(mem, addr);
-  int index = (addr >> 2) & 0x3fff;
-  switch (addr & 0x3)
-  {
-  case 0:
-    page[index] = (page[index] & 0xffffff00) | (data & 0xff);
-    break;
-  case 1:
-    page[index] = (page[index] & 0xffff00ff) | ((data & 0xff) << 8);
-    break;
-  case 2:
-    page[index] = (page[index] & 0xff00ffff) | ((data & 0xff) << 16);
-    break;
-  case 3:
-    page[index] = (page[index] & 0x00ffffff) | (((unsigned)(data & 0xff)) << 24);
-    break;
-  }
+  unsigned char flags;
+  unsigned char *page = (unsigned char *)get_page(mem, addr, &flags);
+  if (__builtin_expect(flags, 0))
+    flagged_store(mem, addr, 1, flags, page + PAGE_OFFSET(addr), data & 0xff);
+  else
+    page[PAGE_OFFSET(addr)] = data;
 }
 
 int memory_rd_w(struct memory *mem, int addr)
 {
-  int *page = get_page(mem, addr);
+  unsigned char flags;
+  int *page = get_page(mem, addr, &flags);
+  if (flags & PAGE_WATCH_READ)
+    watched(mem, addr, 4, MEMORY_WATCH_READ, NULL, NULL);
   if (addr & 0x3)
   {
-    printf("Unaligned word read from %x\n", addr);
-    exit(-1);
+    error_fail("Unaligned word read from %x", addr);
   }
-  return page[(addr >> 2) & 0x3fff];
+  return page[PAGE_OFFSET(addr) >> 2];
 }
 
 int memory_rd_h(struct memory *mem, int addr)
 {
-  int *page = get_page(mem, addr);
-  int index = (addr >> 2) & 0x3fff;
+  unsigned char flags;
+  int *page = get_page(mem, addr, &flags);
+  if (flags & PAGE_WATCH_READ)
+    watched(mem, addr, 2, MEMORY_WATCH_READ, NULL, NULL);
+  int index = PAGE_OFFSET(addr) >> 2;
   if (addr & 0x1)
   {
-    printf("Unaligned halfword read from %x\n", addr);
-    exit(-1);
+    error_fail("Unaligned halfword read from %x", addr);
   }
   if ((addr & 2) == 0)
     return page[index] & 0xffff;
@@ -107,8 +544,11 @@ int memory_rd_h(struct memory *mem, int addr)
 
 int memory_rd_b(struct memory *mem, int addr)
 {
-  int *page = get_page(mem, addr);
-  int index = (addr >> 2) & 0x3fff;
+  unsigned char flags;
+  int *page = get_page(mem, addr, &flags);
+  if (flags & PAGE_WATCH_READ)
+    watched(mem, addr, 1, MEMORY_WATCH_READ, NULL, NULL);
+  int index = PAGE_OFFSET(addr) >> 2;
   switch (addr & 0x3)
   {
   case 0:
@@ -126,3 +566,93 @@ int memory_rd_b(struct memory *mem, int addr)
   }
   return 0; // silence a warning
 }
+
+// Pages are arrays of little-endian words, so on a little-endian host the
+// byte at addr is simply byte PAGE_OFFSET(addr) of its page. Bulk
+// operations use this to work on a whole page at a time instead of byte by
+// byte.
+static char *span(struct memory *mem, int addr, int *len, unsigned char *flags)
+{
+  int offset = PAGE_OFFSET(addr);
+  if (*len > MEMORY_PAGE_SIZE - offset)
+    *len = MEMORY_PAGE_SIZE - offset;
+  return (char *)get_page(mem, addr, flags) + offset;
+}
+
+char *memory_span(struct memory *mem, int addr, int *len)
+{
+  unsigned char flags;
+  return span(mem, addr, len, &flags);
+}
+
+char *memory_wr_span(struct memory *mem, int addr, int *len)
+{
+  unsigned char flags;
+  char *p = span(mem, addr, len, &flags);
+  if (__builtin_expect(flags, 0))
+  {
+    if (flags & PAGE_WATCH_WRITE)
+      watched(mem, addr, *len, MEMORY_WATCH_WRITE, NULL, NULL);
+    if (flags & PAGE_CLEAN)
+      dirtied(mem, addr);
+    if (flags & PAGE_CODE)
+      code_written(mem, addr, *len);
+  }
+  return p;
+}
+
+uint32_t *memory_atomic_word(struct memory *mem, int addr)
+{
+  unsigned char flags;
+  uint32_t *word = (uint32_t *)((char *)get_page(mem, addr, &flags) + PAGE_OFFSET(addr));
+  if (__builtin_expect(flags & (PAGE_CLEAN | PAGE_CODE), 0))
+  {
+    if (flags & PAGE_CLEAN)
+      dirtied(mem, addr);
+    if (flags & PAGE_CODE)
+      code_written(mem, addr, 4);
+  }
+  return word;
+}
+
+void memory_watched(struct memory *mem, int addr, int size, int kind, uint32_t old_value,
+                    const uint32_t *new_value)
+{
+  unsigned char flags;
+  get_page(mem, addr, &flags);
+  if ((flags & PAGE_WATCH_READ) && (kind & MEMORY_WATCH_READ))
+    watched(mem, addr, size, MEMORY_WATCH_READ, &old_value, NULL);
+  if ((flags & PAGE_WATCH_WRITE) && (kind & MEMORY_WATCH_WRITE))
+    watched(mem, addr, size, MEMORY_WATCH_WRITE, &old_value, new_value);
+}
+
+void memory_rd_block(struct memory *mem, int addr, void *dst, int len)
+{
+  char *out = dst;
+  while (len > 0)
+  {
+    int chunk = len;
+    unsigned char flags;
+    char *src = span(mem, addr, &chunk, &flags);
+    if (flags & PAGE_WATCH_READ)
+      watched(mem, addr, chunk, MEMORY_WATCH_READ, NULL, NULL);
+    memcpy(out, src, chunk);
+    out += chunk;
+    addr += chunk;
+    len -= chunk;
+  }
+}
+
+void memory_wr_block(struct memory *mem, int addr, const void *src, int len)
+{
+  const char *in = src;
+  while (len > 0)
+  {
+    int chunk = len;
+    char *dst = memory_wr_span(mem, addr, &chunk);
+    memcpy(dst, in, chunk);
+    in += chunk;
+    addr += chunk;
+    len -= chunk;
+  }
+}
@@ -1,6 +1,9 @@
 #ifndef __MEMORY_H__
 #define __MEMORY_H__
 
+#include <stdint.h>
+#include <stdio.h>
+
 struct memory;
 
 // opret/nedlæg lager
@@ -16,4 +19,104 @@ void memory_wr_b(struct memory *mem, int addr, int data);
 int memory_rd_w(struct memory *mem, int addr);
 int memory_rd_h(struct memory *mem, int addr);
 int memory_rd_b(struct memory *mem, int addr);
+
+// sidetabellen har to niveauer: MEMORY_LEAVES blade, der hver dækker
+// MEMORY_LEAF_PAGES sider af MEMORY_PAGE_SIZE bytes, med siderne, deres
+// flag (se memory_code_pages) og de afkodede instruktioner på dem (se
+// memory_decoded). Blade og sider er NULL indtil de oprettes.
+// Erklæringen af bladet er en makro, så aot.c kan indsætte den som tekst
+#define MEMORY_PAGE_BITS 12
+#define MEMORY_LEAF_BITS 10
+#define MEMORY_PAGE_SIZE (1 << MEMORY_PAGE_BITS)
+#define MEMORY_LEAF_PAGES (1 << MEMORY_LEAF_BITS)
+#define MEMORY_LEAVES (1 << (32 - MEMORY_PAGE_BITS - MEMORY_LEAF_BITS))
+#define MEMORY_LEAF                          \
+  struct memory_leaf                         \
+  {                                          \
+    int *pages[MEMORY_LEAF_PAGES];           \
+    unsigned char flags[MEMORY_LEAF_PAGES];  \
+    void **decoded[MEMORY_LEAF_PAGES];       \
+  }
+MEMORY_LEAF;
+struct memory_leaf **memory_leaves(struct memory *mem);
+
+// siden der holder addr, eller NULL hvis den ikke er oprettet endnu
+int *memory_find_page(struct memory *mem, int addr);
+
+// sider skrevet siden sidste memory_clean, hver én gang; fra første kald af
+// memory_clean bliver skrivninger til rene sider noteret
+void memory_clean(struct memory *mem);
+int memory_dirty_pages(struct memory *mem, const int **pages);
+
+// antal sider der er oprettet
+int memory_page_count(struct memory *mem);
+
+// øvre grænse i bytes for lager der må tages i brug, sider, sidetabeller og
+// afkodede instruktioner; 0 er ingen grænse. En adgang der ville gå over grænsen stopper maskinen
+// med en fejl, se error.h
+void memory_set_limit(struct memory *mem, long limit);
+long memory_get_limit(struct memory *mem);
+
+// lager i brug nu og højst på noget tidspunkt, i bytes
+void memory_usage(struct memory *mem, long *committed, long *peak);
+void memory_report(struct memory *mem, FILE *out);
+
+// giv hele sider i [addr, addr+len) tilbage; de læses som nul bagefter
+void memory_release(struct memory *mem, int addr, int len);
+
+// værtsadresse for byte på addr; *len begrænses til resten af siden
+char *memory_span(struct memory *mem, int addr, int *len);
+
+// værtsadresse som ovenfor til skrivning; siden meldes skrevet som ved memory_wr_*
+char *memory_wr_span(struct memory *mem, int addr, int *len);
+
+// kopier blokke mellem værtens lager og simuleret lager, en side ad gangen
+void memory_rd_block(struct memory *mem, int addr, void *dst, int len);
+void memory_wr_block(struct memory *mem, int addr, const void *src, int len);
+
+// sider med afkodet kode: skrivninger til dem kaldes videre til hook, så
+// afkodede instruktioner i [addr, addr+len) kan kasseres
+typedef void (*memory_code_hook)(void *ctx, struct memory *mem, int addr, int len);
+void memory_set_code_hook(struct memory *mem, memory_code_hook hook, void *ctx);
+void memory_mark_code(struct memory *mem, int addr, int len);
+
+// afkodede instruktioner: hver side kan have en side af size bytes for hver
+// af MEMORY_DECODERS afkodere (én pr. hart), som kun afkoderen selv rører.
+// memory_decoded giver den for siden med addr og opretter den nulstillet,
+// talt med under grænsen, hvis den mangler; siden markeres så som kode.
+// memory_find_decoded giver NULL i stedet, og memory_drop_decoded giver alle
+// afkoderens sider tilbage
+#define MEMORY_DECODERS 64
+void *memory_decoded(struct memory *mem, int addr, int decoder, int size);
+void *memory_find_decoded(struct memory *mem, int addr, int decoder);
+void memory_drop_decoded(struct memory *mem, int decoder);
+
+// Flagene i bladene er sat for sider med afkodet kode, overvågede adresser
+// eller rene sider; skrivninger til sider med flag skal gå gennem memory_wr_*
+
+// overvågning (watchpoints) af [addr, addr+len): hver læsning eller skrivning
+// der rammer kaldes videre til hook med den gamle værdi og, for skrivninger
+// af kendt værdi, den nye; ellers er new_value NULL. Kun sider med
+// overvågede adresser betaler for det
+#define MEMORY_WATCH_READ 1
+#define MEMORY_WATCH_WRITE 2
+typedef void (*memory_watch_hook)(void *ctx, int addr, int size, int kind,
+                                  uint32_t old_value, const uint32_t *new_value);
+void memory_set_watch_hook(struct memory *mem, memory_watch_hook hook, void *ctx);
+void memory_watch(struct memory *mem, int addr, int len, int kind);
+
+// ord til atomiske operationer på addr: siden meldes skrevet som ved
+// memory_wr_span, men overvågningen hører først om adgangen bagefter fra
+// memory_watched, med de værdier operationen læste og skrev. kind kan være
+// både læsning og skrivning
+uint32_t *memory_atomic_word(struct memory *mem, int addr);
+void memory_watched(struct memory *mem, int addr, int size, int kind, uint32_t old_value,
+                    const uint32_t *new_value);
+
+// sider der oprettes ved første berøring: hook får den nye, nulstillede side
+// til at fylde, f.eks. fra programfilen, før den bliver synlig for nogen.
+// memory_fill_hook_of giver den satte hook og dens ctx, NULL hvis ingen
+typedef void (*memory_fill_hook)(void *ctx, int addr, void *page);
+void memory_set_fill_hook(struct memory *mem, memory_fill_hook hook, void *ctx);
+memory_fill_hook memory_fill_hook_of(struct memory *mem, void **ctx);
 #endif
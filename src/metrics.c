@@ -0,0 +1,221 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_TEXT 65536
+
+struct metrics
+{
+  struct metrics_hart harts[METRICS_HARTS];
+  struct memory *mem;
+  struct symbols *syms;
+  char *file; // written as file.tmp and renamed, so readers never see half
+  char *socket_path; // the other way, NULL for a file
+  int listener;
+  int interval_ms;
+  int wake[2]; // written to stop the thread
+  pthread_t thread;
+  // the previous sample, for the current MIPS
+  long int sampled;
+  double sampled_at;
+  double mips;
+};
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fail(const char *what, const char *where)
+{
+  printf("Could not %s '%s' for metrics. Exiting\n", what, where);
+  exit(-1);
+}
+
+struct metrics_hart *metrics_hart(struct metrics *metrics, int hart)
+{
+  return &metrics->harts[hart];
+}
+
+static long int instructions(struct metrics *metrics)
+{
+  long int sum = 0;
+  for (int i = 0; i < METRICS_HARTS; ++i)
+    sum += __atomic_load_n(&metrics->harts[i].instructions, __ATOMIC_RELAXED);
+  return sum;
+}
+
+static void sample(struct metrics *metrics)
+{
+  long int count = instructions(metrics);
+  double at = now();
+  metrics->mips = (count - metrics->sampled) / (at - metrics->sampled_at) / 1e6;
+  metrics->sampled = count;
+  metrics->sampled_at = at;
+}
+
+// Symbol names are mostly C identifiers, but a label value must not end early
+static int put_label(char *out, int size, const char *value)
+{
+  int n = 0;
+  for (; *value && n < size - 2; ++value)
+  {
+    if (*value == '"' || *value == '\\')
+      out[n++] = '\\';
+    out[n++] = *value;
+  }
+  out[n] = 0;
+  return n;
+}
+
+static int format(struct metrics *metrics, char *text)
+{
+  long int syscalls = 0;
+  for (int i = 0; i < METRICS_HARTS; ++i)
+    syscalls += __atomic_load_n(&metrics->harts[i].syscalls, __ATOMIC_RELAXED);
+  int n = snprintf(text, MAX_TEXT,
+                   "# HELP rvsim_instructions_total Instructions retired by all harts.\n"
+                   "# TYPE rvsim_instructions_total counter\n"
+                   "rvsim_instructions_total %ld\n"
+                   "# HELP rvsim_mips Million instructions per second over the last interval.\n"
+                   "# TYPE rvsim_mips gauge\n"
+                   "rvsim_mips %.3f\n"
+                   "# HELP rvsim_syscalls_total System calls made by the program.\n"
+                   "# TYPE rvsim_syscalls_total counter\n"
+                   "rvsim_syscalls_total %ld\n"
+                   "# HELP rvsim_pages Pages of 4 KiB allocated in simulated memory.\n"
+                   "# TYPE rvsim_pages gauge\n"
+                   "rvsim_pages %d\n"
+                   "# HELP rvsim_function Function each hart was in at its last control transfer.\n"
+                   "# TYPE rvsim_function gauge\n",
+                   instructions(metrics), metrics->mips, syscalls, memory_page_count(metrics->mem));
+  for (int i = 0; i < METRICS_HARTS && n < MAX_TEXT - 512; ++i)
+  {
+    if (__atomic_load_n(&metrics->harts[i].instructions, __ATOMIC_RELAXED) == 0)
+      continue;
+    uint32_t pc = __atomic_load_n(&metrics->harts[i].pc, __ATOMIC_RELAXED);
+    const char *name = metrics->syms ? symbols_find(metrics->syms, pc, NULL) : NULL;
+    char label[256];
+    put_label(label, sizeof(label), name ? name : "");
+    n += snprintf(text + n, MAX_TEXT - n, "rvsim_function{hart=\"%d\",function=\"%s\",pc=\"0x%x\"} 1\n", i, label, pc);
+  }
+  return n;
+}
+
+static void write_file(struct metrics *metrics)
+{
+  char text[MAX_TEXT];
+  int n = format(metrics, text);
+  char tmp[strlen(metrics->file) + 5];
+  sprintf(tmp, "%s.tmp", metrics->file);
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL)
+    return; // tried again next interval
+  fwrite(text, 1, n, fp);
+  fclose(fp);
+  rename(tmp, metrics->file);
+}
+
+// Each connection gets the current numbers and is closed
+static void serve(struct metrics *metrics)
+{
+  int fd = accept(metrics->listener, NULL, NULL);
+  if (fd < 0)
+    return;
+  char text[MAX_TEXT];
+  int n = format(metrics, text);
+  for (int done = 0; done < n;)
+  {
+    int sent = write(fd, text + done, n - done);
+    if (sent <= 0)
+      break;
+    done += sent;
+  }
+  close(fd);
+}
+
+static void *publish(void *arg)
+{
+  struct metrics *metrics = arg;
+  struct pollfd fds[2] = {{metrics->wake[0], POLLIN, 0}, {metrics->listener, POLLIN, 0}};
+  int nfds = metrics->socket_path ? 2 : 1;
+  double due = now() + metrics->interval_ms / 1e3;
+  while (1)
+  {
+    int wait = (due - now()) * 1e3;
+    poll(fds, nfds, wait > 0 ? wait : 0);
+    if (fds[0].revents)
+      break;
+    if (now() >= due)
+    {
+      sample(metrics);
+      if (metrics->file)
+        write_file(metrics);
+      due += metrics->interval_ms / 1e3;
+    }
+    if (nfds == 2 && (fds[1].revents & POLLIN))
+      serve(metrics);
+  }
+  return NULL;
+}
+
+struct metrics *metrics_create(const char *where, double interval, struct memory *mem, struct symbols *syms)
+{
+  struct metrics *metrics = calloc(sizeof(struct metrics), 1);
+  metrics->mem = mem;
+  metrics->syms = syms;
+  metrics->interval_ms = interval * 1000;
+  if (metrics->interval_ms <= 0)
+    fail("publish every interval of", where);
+  metrics->listener = -1;
+  if (!strncmp(where, "unix:", 5))
+  {
+    metrics->socket_path = strdup(where + 5);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", metrics->socket_path);
+    unlink(metrics->socket_path);
+    metrics->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (metrics->listener < 0 || bind(metrics->listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(metrics->listener, 4) < 0)
+      fail("listen on socket", where);
+  }
+  else
+  {
+    metrics->file = strdup(where);
+    write_file(metrics);
+  }
+  metrics->sampled_at = now();
+  if (pipe(metrics->wake) < 0 || pthread_create(&metrics->thread, NULL, publish, metrics) != 0)
+    fail("start publishing to", where);
+  return metrics;
+}
+
+void metrics_delete(struct metrics *metrics)
+{
+  if (write(metrics->wake[1], "", 1) != 1)
+    fail("stop publishing to", metrics->file ? metrics->file : metrics->socket_path);
+  pthread_join(metrics->thread, NULL);
+  close(metrics->wake[0]);
+  close(metrics->wake[1]);
+  sample(metrics);
+  if (metrics->file)
+    write_file(metrics);
+  else
+  {
+    close(metrics->listener);
+    unlink(metrics->socket_path);
+  }
+  free(metrics->file);
+  free(metrics->socket_path);
+  free(metrics);
+}
@@ -0,0 +1,33 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "memory.h"
+#include "symbols.h"
+#include <stdint.h>
+
+// Live metrics of a running simulation in the Prometheus text format. The
+// simulation loop stores its counters in the slot of its hart whenever
+// control is transferred, and a thread of its own reads them every interval
+// and writes them to a file, or serves them on a Unix socket given as
+// unix:path, so a long run can be followed without stopping it.
+#define METRICS_HARTS 64
+
+struct metrics_hart
+{
+  long int instructions;
+  long int syscalls;
+  uint32_t pc;
+} __attribute__((aligned(64))); // harts don't share cache lines
+
+struct metrics;
+
+// start publishing every interval seconds
+struct metrics *metrics_create(const char *where, double interval, struct memory *mem, struct symbols *syms);
+
+// writes the final numbers and stops the thread
+void metrics_delete(struct metrics *metrics);
+
+// the slot hart writes its counters to
+struct metrics_hart *metrics_hart(struct metrics *metrics, int hart);
+
+#endif
@@ -0,0 +1,153 @@
+#include "plugin.h"
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int (*plugin_init_fn)(struct plugin_callbacks *cb, const char *args);
+
+struct plugins
+{
+  int count;
+  struct plugin_callbacks cb[MAX_PLUGINS];
+  void *handles[MAX_PLUGINS];
+  // translated blocks, hashed by pc with linear probing. The table is at
+  // most half full.
+  int size, used;
+  struct plugin_block *blocks;
+};
+
+struct plugins *plugins_create()
+{
+  struct plugins *plugins = calloc(sizeof(struct plugins), 1);
+  plugins->size = 1024;
+  plugins->blocks = calloc(plugins->size, sizeof(struct plugin_block));
+  return plugins;
+}
+
+void plugins_delete(struct plugins *plugins)
+{
+  for (int i = 0; i < plugins->count; ++i)
+    dlclose(plugins->handles[i]);
+  free(plugins->blocks);
+  free(plugins);
+}
+
+void plugins_load(struct plugins *plugins, const char *spec)
+{
+  char path[4096];
+  if (plugins->count == MAX_PLUGINS)
+  {
+    printf("At most %d plugins can be loaded. Exiting\n", MAX_PLUGINS);
+    exit(-1);
+  }
+  const char *comma = strchr(spec, ',');
+  int len = comma ? comma - spec : (int)strlen(spec);
+  // dlopen only searches the library path for names without a slash
+  snprintf(path, sizeof(path), "%s%.*s", memchr(spec, '/', len) ? "" : "./", len, spec);
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  plugin_init_fn init = NULL;
+  // the way POSIX has for turning the result of dlsym into a function pointer
+  if (handle)
+    *(void **)&init = dlsym(handle, "plugin_init");
+  if (init == NULL)
+  {
+    printf("Could not load plugin '%s': %s. Exiting\n", path, dlerror());
+    exit(-1);
+  }
+  struct plugin_callbacks *cb = &plugins->cb[plugins->count];
+  if (init(cb, comma ? comma + 1 : NULL) != 0)
+  {
+    printf("Plugin '%s' could not start. Exiting\n", path);
+    exit(-1);
+  }
+  plugins->handles[plugins->count++] = handle;
+}
+
+// 0 is never the pc of a block, so it marks free slots
+static struct plugin_block *find(struct plugins *plugins, uint32_t pc)
+{
+  uint32_t i = (pc >> 1) * 0x9E3779B1U;
+  for (i &= plugins->size - 1; plugins->blocks[i].pc && plugins->blocks[i].pc != pc; i = (i + 1) & (plugins->size - 1))
+    ;
+  return &plugins->blocks[i];
+}
+
+const struct plugin_block *plugins_block(struct plugins *plugins, uint32_t pc)
+{
+  struct plugin_block *block = find(plugins, pc);
+  return block->pc ? block : NULL;
+}
+
+const struct plugin_block *plugins_translate(struct plugins *plugins, uint32_t pc, int insns, int bytes)
+{
+  if (2 * (plugins->used + 1) > plugins->size)
+  {
+    struct plugin_block *old = plugins->blocks;
+    int old_size = plugins->size;
+    plugins->size *= 2;
+    plugins->blocks = calloc(plugins->size, sizeof(struct plugin_block));
+    for (int i = 0; i < old_size; ++i)
+    {
+      if (old[i].pc)
+        *find(plugins, old[i].pc) = old[i];
+    }
+    free(old);
+  }
+  struct plugin_block *block = find(plugins, pc);
+  block->pc = pc;
+  block->insns = insns;
+  block->exec = block->mem = 0;
+  for (int i = 0; i < plugins->count; ++i)
+  {
+    struct plugin_callbacks *cb = &plugins->cb[i];
+    int events = cb->translate ? cb->translate(cb->user, pc, insns, bytes) : PLUGIN_EXEC | PLUGIN_MEM;
+    if ((events & PLUGIN_EXEC) && cb->block)
+      block->exec |= 1U << i;
+    if ((events & PLUGIN_MEM) && cb->access)
+      block->mem |= 1U << i;
+  }
+  plugins->used++;
+  return block;
+}
+
+void plugins_invalidate(struct plugins *plugins)
+{
+  memset(plugins->blocks, 0, plugins->size * sizeof(struct plugin_block));
+  plugins->used = 0;
+}
+
+void plugins_exec(struct plugins *plugins, const struct plugin_block *block)
+{
+  for (uint32_t mask = block->exec; mask; mask &= mask - 1)
+  {
+    struct plugin_callbacks *cb = &plugins->cb[__builtin_ctz(mask)];
+    cb->block(cb->user, block->pc, block->insns);
+  }
+}
+
+void plugins_access(struct plugins *plugins, uint32_t mask, uint32_t pc, uint32_t addr, int size, int store)
+{
+  for (; mask; mask &= mask - 1)
+  {
+    struct plugin_callbacks *cb = &plugins->cb[__builtin_ctz(mask)];
+    cb->access(cb->user, pc, addr, size, store);
+  }
+}
+
+void plugins_syscall(struct plugins *plugins, const uint32_t *regs)
+{
+  for (int i = 0; i < plugins->count; ++i)
+  {
+    if (plugins->cb[i].syscall)
+      plugins->cb[i].syscall(plugins->cb[i].user, regs);
+  }
+}
+
+void plugins_exit(struct plugins *plugins, int exit_code, FILE *out)
+{
+  for (int i = 0; i < plugins->count; ++i)
+  {
+    if (plugins->cb[i].exit)
+      plugins->cb[i].exit(plugins->cb[i].user, exit_code, out);
+  }
+}
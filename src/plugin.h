@@ -0,0 +1,72 @@
+#ifndef __PLUGIN_H__
+#define __PLUGIN_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Plugins are shared objects loaded with -plugin lib.so[,args]. They watch
+// the simulation through callbacks and are only called for the blocks and
+// events they ask for. A plugin exports
+//
+//   int plugin_init(struct plugin_callbacks *cb, const char *args);
+//
+// which fills in cb and returns 0, or something else if it can't run. args
+// is the text after the comma, or NULL. Callbacks not needed are left NULL,
+// and user is handed back to every callback.
+
+// events a plugin can ask for in a block
+#define PLUGIN_EXEC 1 // block is called every time the block is entered
+#define PLUGIN_MEM 2  // access is called for every load and store in it
+
+struct plugin_callbacks
+{
+  void *user;
+  // A block, the straight line code from pc up to and including the next
+  // control transfer, is about to run for the first time. Returns the
+  // PLUGIN_* events wanted for it. If NULL, every event with a callback is.
+  int (*translate)(void *user, uint32_t pc, int insns, int bytes);
+  void (*block)(void *user, uint32_t pc, int insns);
+  // loads, stores and atomics done by the program; store is 1 for stores
+  // and for atomics, which may store
+  void (*access)(void *user, uint32_t pc, uint32_t addr, int size, int store);
+  // an ecall, before it is handled; regs[17] is the system call number
+  void (*syscall)(void *user, const uint32_t *regs);
+  // the simulation has ended, reports go to out
+  void (*exit)(void *user, int exit_code, FILE *out);
+};
+
+// Simulator side: the loaded plugins and the blocks they have seen
+struct plugins;
+
+#define MAX_PLUGINS 32
+
+// A translated block. exec and mem have a bit per plugin asking for the event.
+struct plugin_block
+{
+  uint32_t pc;
+  int insns;
+  uint32_t exec;
+  uint32_t mem;
+};
+
+struct plugins *plugins_create();
+void plugins_delete(struct plugins *plugins);
+
+// load lib.so[,args] and call its plugin_init
+void plugins_load(struct plugins *plugins, const char *spec);
+
+// the block at pc, NULL if it hasn't been translated
+const struct plugin_block *plugins_block(struct plugins *plugins, uint32_t pc);
+
+// ask the plugins about a new block and remember their answers
+const struct plugin_block *plugins_translate(struct plugins *plugins, uint32_t pc, int insns, int bytes);
+
+// forget all blocks, after the code has been written to
+void plugins_invalidate(struct plugins *plugins);
+
+void plugins_exec(struct plugins *plugins, const struct plugin_block *block);
+void plugins_access(struct plugins *plugins, uint32_t mask, uint32_t pc, uint32_t addr, int size, int store);
+void plugins_syscall(struct plugins *plugins, const uint32_t *regs);
+void plugins_exit(struct plugins *plugins, int exit_code, FILE *out);
+
+#endif
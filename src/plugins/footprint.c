@@ -0,0 +1,70 @@
+// Example plugin: the memory footprint of the program, as the number of
+// distinct pages loaded from and stored to. The page size in bytes may be
+// given as argument, e.g. -plugin plugins/footprint.so,64 to count lines.
+#include "../plugin.h"
+#include <stdlib.h>
+
+struct footprint
+{
+  int shift;
+  uint32_t pages;
+  unsigned char *loaded, *stored; // a bit per page
+  long loads, stores;
+};
+
+static int count_bits(const unsigned char *bits, uint32_t pages)
+{
+  int count = 0;
+  for (uint32_t i = 0; i < (pages + 7) / 8; ++i)
+    count += __builtin_popcount(bits[i]);
+  return count;
+}
+
+static void access(void *user, uint32_t pc, uint32_t addr, int size, int store)
+{
+  struct footprint *fp = user;
+  (void)pc;
+  // an access may straddle two pages
+  for (uint32_t page = addr >> fp->shift; page <= (addr + size - 1) >> fp->shift; ++page)
+  {
+    unsigned char *bits = store ? fp->stored : fp->loaded;
+    bits[page / 8] |= 1 << (page % 8);
+  }
+  if (store)
+    fp->stores++;
+  else
+    fp->loads++;
+}
+
+static void report(void *user, int exit_code, FILE *out)
+{
+  struct footprint *fp = user;
+  (void)exit_code;
+  int loaded = count_bits(fp->loaded, fp->pages);
+  int stored = count_bits(fp->stored, fp->pages);
+  fprintf(out, "footprint: %ld loads touching %d pages (%ld KiB), %ld stores touching %d pages (%ld KiB)\n",
+          fp->loads, loaded, ((long)loaded << fp->shift) >> 10, fp->stores, stored,
+          ((long)stored << fp->shift) >> 10);
+  free(fp->loaded);
+  free(fp->stored);
+  free(fp);
+}
+
+int plugin_init(struct plugin_callbacks *cb, const char *args)
+{
+  int page_size = args ? atoi(args) : 4096;
+  if (page_size < 4 || (page_size & (page_size - 1)))
+  {
+    printf("footprint: the page size must be a power of two of at least 4\n");
+    return -1;
+  }
+  struct footprint *fp = calloc(sizeof(struct footprint), 1);
+  fp->shift = __builtin_ctz(page_size);
+  fp->pages = 1U << (32 - fp->shift);
+  fp->loaded = calloc(fp->pages / 8, 1);
+  fp->stored = calloc(fp->pages / 8, 1);
+  cb->user = fp;
+  cb->access = access;
+  cb->exit = report;
+  return 0;
+}
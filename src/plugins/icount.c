@@ -0,0 +1,47 @@
+// Example plugin: counts instructions and blocks from block executions.
+// Build with make plugins and run with -plugin plugins/icount.so
+#include "../plugin.h"
+#include <stdlib.h>
+
+struct icount
+{
+  long instructions;
+  long blocks;
+  long translated;
+};
+
+static int translate(void *user, uint32_t pc, int insns, int bytes)
+{
+  (void)pc;
+  (void)insns;
+  (void)bytes;
+  ((struct icount *)user)->translated++;
+  return PLUGIN_EXEC;
+}
+
+static void block(void *user, uint32_t pc, int insns)
+{
+  struct icount *count = user;
+  (void)pc;
+  count->instructions += insns;
+  count->blocks++;
+}
+
+static void report(void *user, int exit_code, FILE *out)
+{
+  struct icount *count = user;
+  (void)exit_code;
+  fprintf(out, "icount: %ld instructions in %ld block executions, %ld blocks translated\n", count->instructions,
+          count->blocks, count->translated);
+  free(count);
+}
+
+int plugin_init(struct plugin_callbacks *cb, const char *args)
+{
+  (void)args;
+  cb->user = calloc(sizeof(struct icount), 1);
+  cb->translate = translate;
+  cb->block = block;
+  cb->exit = report;
+  return 0;
+}
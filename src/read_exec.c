@@ -4,14 +4,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define MAXLINE 1024
-char line[MAXLINE];
-char hexes[4][9]; // 8+1 for zero termination
-char symbol[1024];
-char opcode[8], args[16], rest[24];
 
-int is_hex(char c)
+static int is_hex(char c)
 {
   if (c >= '0' && c <= '9')
     return 1;
@@ -20,7 +22,7 @@ int is_hex(char c)
   return 0;
 }
 
-int to_hex(char c)
+static int to_hex(char c)
 {
   if (c >= '0' && c <= '9')
     return c - '0';
@@ -31,13 +33,13 @@ int to_hex(char c)
   return 0; // silence a warning
 }
 
-int to_hex2(char a, char b)
+static int to_hex2(char a, char b)
 {
   return to_hex(a) * 16 + to_hex(b);
 }
 
 // count number of 2-digit hexes in "size" strings of max 4 hexes each
-int count_hexes(char hexes[][9], int size)
+static int count_hexes(char hexes[][9], int size)
 {
   int num = 0;
   for (int k = 0; k < size; ++k)
@@ -53,84 +55,451 @@ int count_hexes(char hexes[][9], int size)
   return num / 2;
 }
 
-int read_exec(struct memory *mem, struct assembly *as, const char *name, FILE *log_file)
+enum line_kind
 {
-  FILE *fp;
-  fp = fopen(name, "r");
-  if (fp == NULL)
+  LINE_OTHER,
+  LINE_DATA,
+  LINE_INSN,
+  LINE_ENTRY,
+  LINE_START
+};
+
+static const char *line_msgs[] = {"Ukendt", "Data", "Insn", "Entry", "Start"};
+
+// Where the bytes of a line go: straight into struct memory, or into one
+// page that is being filled on its first touch. Then only the bytes in
+// [base, base + MEMORY_PAGE_SIZE) are kept.
+struct sink
+{
+  struct memory *mem;
+  unsigned char *page;
+  unsigned base;
+};
+
+static void put_byte(struct sink *s, unsigned addr, int data)
+{
+  if (s->page == NULL)
+    memory_wr_b(s->mem, addr, data);
+  else if (addr - s->base < MEMORY_PAGE_SIZE)
+    s->page[addr - s->base] = data;
+}
+
+// Parse one line and store what it holds. [*addr, *end) is set to the bytes
+// stored. syms may be NULL.
+static enum line_kind load_line(const char *line, struct sink *s, struct symbols *syms,
+                                unsigned *addr, unsigned *end)
+{
+  char hexes[4][9]; // 8+1 for zero termination
+  char symbol[1024];
+  unsigned int a;            // value
+  int num_hex = 0;
+  int first = 0, after = 0; // where the instruction word starts and ends in the line
+  int n = sscanf(line, " %x %s%s%s%s*c[ ]*c[]", addr, hexes[0], hexes[1], hexes[2], hexes[3]);
+  if (n >= 2)
   {
-    printf("Error: could not open file '%s'. Exiting\n", name);
-    exit(-1);
+    num_hex = count_hexes(hexes, n - 1);
   }
-  int count = 0;
+  if (num_hex)
+  {
+    for (int i = 0; i < num_hex; ++i)
+    {
+      int block = i / 4;
+      int disp = (i % 4) * 2;
+      put_byte(s, *addr + i, to_hex2(hexes[block][disp], hexes[block][disp + 1]));
+    }
+    *end = *addr + num_hex;
+    return LINE_DATA;
+  }
+  if (sscanf(line, " %x: %n%x%n", addr, &first, &a, &after) == 2)
+  {
+    // compressed (RV32C) instructions are shown as 4 hex digits
+    unsigned size = after - first <= 4 ? 2 : 4;
+    for (unsigned i = 0; i < size; ++i)
+      put_byte(s, *addr + i, (a >> (8 * i)) & 0xff);
+    *end = *addr + size;
+    return LINE_INSN;
+  }
+  if (sscanf(line, "%x <%s", addr, symbol) == 2)
+  {
+    *end = *addr;
+    // sscanf included the terminating ">:" in the string, check for it here:
+    int len = strlen(symbol);
+    if (syms && len > 2 && strcmp(symbol + len - 2, ">:") == 0)
+    {
+      symbol[len - 2] = 0;
+      symbols_add(syms, *addr, symbol);
+      symbol[len - 2] = '>';
+    }
+    if (strcmp(symbol, "_start>:") == 0)
+      return LINE_START;
+    return LINE_ENTRY;
+  }
+  return LINE_OTHER;
+}
+
+static void start_extent(struct exec_extent *extent)
+{
+  extent->end = 0;
+  extent->text_low = UINT_MAX;
+  extent->text_high = 0;
+}
+
+static void extend_image(struct exec_extent *extent, enum line_kind kind, unsigned addr, unsigned end)
+{
+  if (end > extent->end)
+    extent->end = end;
+  if (kind == LINE_INSN)
+  {
+    if (addr < extent->text_low)
+      extent->text_low = addr;
+    if (end > extent->text_high)
+      extent->text_high = end;
+  }
+}
+
+static void finish_extent(struct exec_extent *extent)
+{
+  if (extent->text_low >= extent->text_high)
+    extent->text_low = 0;
+}
+
+// A run of lines in the file, by offset, holding bytes for one page
+struct range
+{
+  size_t from, to;
+};
+
+struct page_index
+{
+  int count, size;
+  struct range *ranges;
+};
+
+// The index has a region for every 64 KiB with lines, with the pages in it
+#define REGION_PAGES (0x10000 / MEMORY_PAGE_SIZE)
+
+// Loading on first touch: the file is mapped, and indexed by page when it is
+// opened. Only addresses and symbols are parsed then, the rest of a line
+// when its page is touched, by the simulation or by the thread loading the
+// remaining pages in the background. The whole file is indexed before the
+// program starts, as all symbols and the end of the image are wanted then
+// and a page may have lines anywhere in the file, so start-up still grows
+// with the size of the file, if much more slowly than a full load. The
+// loader is the ctx of the memory's fill hook, which is how it is found
+// again when the memory is done with.
+struct loader
+{
+  struct memory *mem;
+  const char *file;
+  size_t size;
+  struct page_index *regions[0x10000];
+  pthread_t thread;
+  int stop;
+};
+
+// The index of the page at addr, NULL if no line is in its region
+static struct page_index *page_index(struct loader *ld, unsigned addr)
+{
+  struct page_index *region = ld->regions[addr >> 16];
+  return region ? &region[(addr & 0xffff) / MEMORY_PAGE_SIZE] : NULL;
+}
+
+static void add_range(struct loader *ld, unsigned addr, size_t from, size_t to)
+{
+  if (ld->regions[addr >> 16] == NULL)
+    ld->regions[addr >> 16] = calloc(sizeof(struct page_index), REGION_PAGES);
+  struct page_index *pi = page_index(ld, addr);
+  if (pi->count && pi->ranges[pi->count - 1].to == from)
+  {
+    pi->ranges[pi->count - 1].to = to;
+    return;
+  }
+  if (pi->count == pi->size)
+  {
+    pi->size = pi->size ? 2 * pi->size : 4;
+    pi->ranges = realloc(pi->ranges, pi->size * sizeof(struct range));
+  }
+  pi->ranges[pi->count].from = from;
+  pi->ranges[pi->count].to = to;
+  pi->count++;
+}
+
+// Copy the line at p, without its newline, so sscanf can be used on it.
+// Like fgets, a line longer than the buffer is split.
+static const char *copy_line(const char *p, const char *end, char *line)
+{
+  const char *nl = memchr(p, '\n', end - p);
+  size_t len = (nl ? nl : end) - p;
+  if (len > MAXLINE - 1)
+    len = MAXLINE - 1;
+  memcpy(line, p, len);
+  line[len] = 0;
+  return p + len + (p + len < end && p[len] == '\n');
+}
+
+static const char *skip_space(const char *p, const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t'))
+    ++p;
+  return p;
+}
+
+static const char *scan_hex(const char *p, const char *end, unsigned *value)
+{
+  *value = 0;
+  while (p < end && (is_hex(*p) || (*p >= 'A' && *p <= 'F')))
+    *value = *value * 16 + to_hex(*p++);
+  return p;
+}
+
+// The part of load_line needed for the index: the kind of line and the
+// bytes it covers, found without sscanf. Symbol lines are few and left to
+// load_line, they come back as LINE_ENTRY.
+static enum line_kind scan_line(const char *p, const char *end, unsigned *addr, unsigned *size)
+{
+  p = skip_space(p, end);
+  const char *digits = p;
+  p = scan_hex(p, end, addr);
+  if (p == digits)
+    return LINE_OTHER;
+  if (p < end && *p == ':')
+  {
+    const char *first = skip_space(p + 1, end);
+    unsigned a;
+    const char *after = scan_hex(first, end, &a);
+    if (after == first)
+      return LINE_OTHER;
+    *size = after - first <= 4 ? 2 : 4;
+    return LINE_INSN;
+  }
+  // up to four words of data, counted like count_hexes does
+  unsigned num = 0;
+  const char *q = p;
+  for (int k = 0; k < 4; ++k)
+  {
+    q = skip_space(q, end);
+    if (q == end || *q == '\n')
+      break;
+    int i = 0;
+    while (i < 8 && q < end && is_hex(*q))
+      ++i, ++q;
+    num += i;
+    if (i < 8)
+      break;
+    while (q < end && *q != ' ' && *q != '\t' && *q != '\n')
+      ++q;
+  }
+  if (num / 2)
+  {
+    *size = num / 2;
+    return LINE_DATA;
+  }
+  return LINE_ENTRY;
+}
+
+static void fill_page(void *ctx, int addr, void *page)
+{
+  struct loader *ld = ctx;
+  struct page_index *pi = page_index(ld, addr);
+  if (pi == NULL)
+    return;
+  struct sink s = {ld->mem, page, addr};
+  const char *end = ld->file + ld->size;
+  char line[MAXLINE];
+  for (int r = 0; r < pi->count; ++r)
+  {
+    const char *p = ld->file + pi->ranges[r].from;
+    const char *to = ld->file + pi->ranges[r].to;
+    while (p < to)
+    {
+      unsigned from, until;
+      p = copy_line(p, end, line);
+      load_line(line, &s, NULL, &from, &until);
+    }
+  }
+}
+
+// Under a memory limit only the pages the program touches are loaded, so
+// they alone count against it, and the limit is never hit in this thread
+static void *prefault(void *arg)
+{
+  struct loader *ld = arg;
+  if (memory_get_limit(ld->mem))
+    return NULL;
+  for (int region = 0; region < 0x10000 && !__atomic_load_n(&ld->stop, __ATOMIC_RELAXED); ++region)
+  {
+    for (int i = 0; ld->regions[region] && i < REGION_PAGES; ++i)
+    {
+      int len = 1;
+      if (ld->regions[region][i].count)
+        memory_span(ld->mem, (region << 16) + i * MEMORY_PAGE_SIZE, &len);
+    }
+  }
+  return NULL;
+}
+
+// Index the mapped file and start loading it in the background. Returns
+// _start or -1.
+static int index_exec(struct loader *ld, struct symbols *syms, struct exec_extent *extent)
+{
+  int start_addr = -1;
+  const char *p = ld->file;
+  const char *end = ld->file + ld->size;
+  char line[MAXLINE];
+  while (p < end)
+  {
+    const char *next = memchr(p, '\n', end - p);
+    next = next ? next + 1 : end;
+    if (next - p >= MAXLINE)
+      next = p + MAXLINE - 1;
+    unsigned addr, size;
+    enum line_kind kind = scan_line(p, next, &addr, &size);
+    if (kind == LINE_ENTRY)
+    {
+      unsigned until;
+      struct sink none = {ld->mem, NULL, 0};
+      copy_line(p, end, line);
+      if (load_line(line, &none, syms, &addr, &until) == LINE_START)
+        start_addr = addr;
+    }
+    else if (kind != LINE_OTHER)
+    {
+      extend_image(extent, kind, addr, addr + size);
+      for (unsigned page = addr / MEMORY_PAGE_SIZE; page <= (addr + size - 1) / MEMORY_PAGE_SIZE; ++page)
+        add_range(ld, page * MEMORY_PAGE_SIZE, p - ld->file, next - ld->file);
+    }
+    p = next;
+  }
+  return start_addr;
+}
+
+static struct loader *open_exec(struct memory *mem, const char *name)
+{
+  int fd = open(name, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) || st.st_size == 0)
+  {
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+  void *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED)
+    return NULL;
+  struct loader *ld = calloc(sizeof(struct loader), 1);
+  ld->mem = mem;
+  ld->file = file;
+  ld->size = st.st_size;
+  return ld;
+}
+
+// Reads the file up front, line by line. Returns _start or -1.
+static int read_lines(struct memory *mem, struct symbols *syms, FILE *fp, FILE *log_file,
+                      struct exec_extent *extent)
+{
   int start_addr = -1; // invalid starting addr
+  int count = 0;
+  char line[MAXLINE];
+  struct sink s = {mem, NULL, 0};
   while (fgets(line, MAXLINE, fp))
   {
     // remove any trailing newline:
     int last = strlen(line) - 1;
     if (line[last] == '\n')
       line[last] = 0;
-    char *msg = "Ukendt";
-    unsigned int addr;
-    unsigned int a;            // value
-    int num_hex = 0;
-    int n = sscanf(line, " %x %s%s%s%s*c[ ]*c[]", &addr, hexes[0], hexes[1], hexes[2], hexes[3]);
-    if (n >= 2)
-    {
-      num_hex = count_hexes(hexes, n - 1);
-    }
-    if (num_hex)
-    {
-   
-      msg = "Data";
-      for (int i = 0; i < num_hex; ++i)
-      {
-        int block = i / 4;
-        int disp = (i % 4) * 2;
-        int data = to_hex2(hexes[block][disp], hexes[block][disp + 1]);
-        memory_wr_b(mem, addr, data);
-        ++addr;
-      }
-    }
-    else if ((n = sscanf(line, " %x: %x %7s %15s %23s", &addr, &a, opcode, args, rest)) >= 2)
+    unsigned addr, end;
+    enum line_kind kind = load_line(line, &s, syms, &addr, &end);
+    if (kind == LINE_DATA || kind == LINE_INSN)
+      extend_image(extent, kind, addr, end);
+    if (kind == LINE_START)
+      start_addr = addr;
+    ++count;
+    if (log_file)
+      fprintf(log_file, "%d -- %s -- %s\n", count, line_msgs[kind], line);
+  }
+  return start_addr;
+}
+
+int read_exec(struct memory *mem, struct assembly *as, struct symbols *syms, const char *name, FILE *log_file,
+              struct exec_extent *extent)
+{
+  start_extent(extent);
+  int start_addr = -1; // invalid starting addr
+  if (as)
+    assembly_attach(as, mem, syms);
+  // the log lists every line as it is read, so it is read up front, as is
+  // a second file for memory still loading one
+  void *ctx;
+  struct loader *loader;
+  if (log_file == NULL && memory_fill_hook_of(mem, &ctx) == NULL && (loader = open_exec(mem, name)))
+  {
+    start_addr = index_exec(loader, syms, extent);
+    finish_extent(extent);
+    if (start_addr == -1)
     {
-      msg = "Insn";
-      memory_wr_w(mem, addr, a);
-      if (n > 2)
-      {
-        char text[64];
-        if (n == 3)
-        {
-          sprintf(text, "%-8s", opcode);
-        }
-        else if (n == 4)
-        {
-          sprintf(text, "%-8s %-16s", opcode, args);
-        }
-        else if (n == 5)
-        {
-          sprintf(text, "%-8s %-16s %-24s", opcode, args, rest);
-        }
-        assembly_set(as, addr, text);
-      }
+      printf("Start symbol not found in file. Terminating");
+      exit(-1);
     }
-    else if (sscanf(line, "%x <%s", &addr, symbol) == 2)
+    // pages written before the file was read, such as the one holding the
+    // program arguments, are loaded over now as they would have been
+    for (int region = 0; region < 0x10000; ++region)
     {
-      msg = "Entry";
-      // sscanf included the terminating ">:" in the string, check for it here:
-      if (strcmp(symbol, "_start>:") == 0)
+      for (int i = 0; loader->regions[region] && i < REGION_PAGES; ++i)
       {
-        msg = "Start";
-        start_addr = addr;
+        unsigned addr = (region << 16) + i * MEMORY_PAGE_SIZE;
+        int *page = memory_find_page(mem, addr);
+        if (page)
+          fill_page(loader, addr, page);
       }
     }
-    ++count;
-    if (log_file)
-      fprintf(log_file, "%d -- %s -- %s\n", count, msg, line);
+    memory_set_fill_hook(mem, fill_page, loader);
+    pthread_create(&loader->thread, NULL, prefault, loader);
+    return start_addr;
+  }
+  FILE *fp;
+  fp = fopen(name, "r");
+  if (fp == NULL)
+  {
+    printf("Error: could not open file '%s'. Exiting\n", name);
+    exit(-1);
   }
+  start_addr = read_lines(mem, syms, fp, log_file, extent);
+  finish_extent(extent);
+  fclose(fp);
   if (start_addr != -1)
     return start_addr;
   printf("Start symbol not found in file. Terminating");
   exit(-1);
   return 0; // silence warning
 }
+
+int read_exec_stream(struct memory *mem, struct assembly *as, struct symbols *syms, FILE *fp,
+                     struct exec_extent *extent)
+{
+  start_extent(extent);
+  if (as)
+    assembly_attach(as, mem, syms);
+  int start_addr = read_lines(mem, syms, fp, NULL, extent);
+  finish_extent(extent);
+  return start_addr;
+}
+
+void read_exec_finish(struct memory *mem)
+{
+  void *ctx;
+  if (memory_fill_hook_of(mem, &ctx) != fill_page)
+    return;
+  struct loader *loader = ctx;
+  __atomic_store_n(&loader->stop, 1, __ATOMIC_RELAXED);
+  pthread_join(loader->thread, NULL);
+  memory_set_fill_hook(mem, NULL, NULL);
+  for (int region = 0; region < 0x10000; ++region)
+  {
+    for (int i = 0; loader->regions[region] && i < REGION_PAGES; ++i)
+      free(loader->regions[region][i].ranges);
+    free(loader->regions[region]);
+  }
+  munmap((void *)loader->file, loader->size);
+  free(loader);
+}
@@ -3,10 +3,33 @@
 
 #include "memory.h"
 #include "assembly.h"
+#include "symbols.h"
 
 #include <stdio.h>
 
-// read file into simulated memory, return value of _start symbol
-int read_exec(struct memory *, struct assembly *, const char *, FILE *log_file);
+// What one call loaded: every byte is below end, and the instruction lines
+// are in [text_low, text_high), which is empty if there are none. It is
+// returned by each call, so programs may be loaded in several threads.
+struct exec_extent
+{
+  unsigned end;
+  unsigned text_low, text_high;
+};
+
+// read file into simulated memory, return value of _start symbol.
+// All symbols are added to syms unless it is NULL.
+// Without a log file only an index of the whole file is read here. Pages are
+// then loaded when first touched, and by a thread loading the rest meanwhile,
+// until read_exec_finish(mem); a second file for the same memory is read up
+// front.
+int read_exec(struct memory *, struct assembly *, struct symbols *syms, const char *, FILE *log_file,
+              struct exec_extent *extent);
+
+// read an opened file or buffer (fmemopen) up front. Returns _start, or -1
+// if it isn't there, instead of exiting.
+int read_exec_stream(struct memory *, struct assembly *, struct symbols *syms, FILE *fp, struct exec_extent *extent);
+
+// stop loading in the background and let go of the file, before mem is deleted
+void read_exec_finish(struct memory *mem);
 
 #endif
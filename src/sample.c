@@ -0,0 +1,134 @@
+#include "sample.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_COUNTS (CACHE_COUNTS + TIMING_COUNTS)
+// the normal quantile for a two-sided 95% interval
+#define Z_95 1.96
+
+struct sampler
+{
+  long int skip, warm, measure;
+  long int total; // instructions executed in all
+  long int measured;
+  int windows;
+  int num_counts;
+  const char *names[MAX_COUNTS];
+  // sums of the rate per instruction of each count over the windows, and of
+  // its square, for the mean and the spread
+  double sum[MAX_COUNTS];
+  double sum_squares[MAX_COUNTS];
+};
+
+struct sampler *sample_create(long int skip, long int warm, long int measure)
+{
+  struct sampler *sampler = calloc(sizeof(struct sampler), 1);
+  sampler->skip = skip;
+  sampler->warm = warm;
+  sampler->measure = measure;
+  return sampler;
+}
+
+void sample_delete(struct sampler *sampler)
+{
+  free(sampler);
+}
+
+static int counts(struct simulation *sim, const char **names, long *values)
+{
+  int n = 0;
+  if (sim->cache)
+    n += cache_counts(sim->cache, names, values);
+  if (sim->timing)
+    n += timing_counts(sim->timing, names + n, values + n);
+  return n;
+}
+
+static long int run_part(struct memory *mem, struct simulation *sim, uint32_t *pc, long int limit, int *exited)
+{
+  sim->limit = limit;
+  long int n = simulate_run(mem, sim, pc);
+  *exited = sim->exited;
+  return n;
+}
+
+long int sample_run(struct sampler *sampler, struct memory *mem, struct simulation *sim, uint32_t start_addr)
+{
+  // the fast loops run without the models, and stop at the first jump after
+  // skip instructions
+  struct simulation fast = *sim;
+  fast.cache = NULL;
+  fast.timing = NULL;
+  fast.limit_at_jumps = 1;
+  struct simulation detailed = *sim;
+  detailed.aot = NULL;
+  detailed.limit_at_jumps = 0;
+  uint32_t pc = start_addr;
+  int exited = 0;
+  long int before[MAX_COUNTS], after[MAX_COUNTS];
+  while (1)
+  {
+    sampler->total += run_part(mem, &fast, &pc, sampler->skip, &exited);
+    if (exited)
+      break;
+    // a limit of 0 would be none
+    if (sampler->warm > 0)
+      sampler->total += run_part(mem, &detailed, &pc, sampler->warm, &exited);
+    if (exited)
+      break;
+    sampler->num_counts = counts(sim, sampler->names, before);
+    long int n = run_part(mem, &detailed, &pc, sampler->measure, &exited);
+    counts(sim, sampler->names, after);
+    sampler->total += n;
+    // a window cut short by the exit is still a fair sample, unless it is
+    // too short to say anything
+    if (n > 0)
+    {
+      for (int i = 0; i < sampler->num_counts; ++i)
+      {
+        double rate = (double)(after[i] - before[i]) / n;
+        sampler->sum[i] += rate;
+        sampler->sum_squares[i] += rate * rate;
+      }
+      sampler->measured += n;
+      sampler->windows++;
+    }
+    if (exited)
+      break;
+  }
+  sim->exited = 1;
+  return sampler->total;
+}
+
+void sample_report(struct sampler *sampler, FILE *out)
+{
+  fprintf(out, "\nSampling: %d windows of %ld instructions after %ld of warm-up, every %ld\n", sampler->windows,
+          sampler->measure, sampler->warm, sampler->skip + sampler->warm + sampler->measure);
+  if (sampler->windows == 0)
+  {
+    fprintf(out, "  the program exited before the first window\n");
+    return;
+  }
+  fprintf(out, "  measured %ld of %ld instructions (%.2f%%)\n", sampler->measured, sampler->total,
+          100.0 * sampler->measured / sampler->total);
+  fprintf(out, "  estimated for the whole run, with 95%% confidence intervals:\n");
+  fprintf(out, "  %-20s %14s %14s %12s %10s\n", "count", "total", "+-", "per insn", "+-");
+  int n = sampler->windows;
+  for (int i = 0; i < sampler->num_counts; ++i)
+  {
+    double mean = sampler->sum[i] / n;
+    fprintf(out, "  %-20s %14.0f", sampler->names[i], mean * sampler->total);
+    if (n < 2)
+    {
+      fprintf(out, " %14s %12.4f %10s\n", "?", mean, "?");
+      continue;
+    }
+    // the sample variance, which rounding may take just below zero
+    double variance = (sampler->sum_squares[i] - n * mean * mean) / (n - 1);
+    double error = Z_95 * sqrt(variance > 0 ? variance : 0) / sqrt(n);
+    fprintf(out, " %14.0f %12.4f %10.4f\n", error * sampler->total, mean, error);
+  }
+  if (n < 30)
+    fprintf(out, "  the intervals are rough with fewer than 30 windows\n");
+}
@@ -0,0 +1,28 @@
+#ifndef __SAMPLE_H__
+#define __SAMPLE_H__
+
+#include "memory.h"
+#include "simulate.h"
+#include <stdio.h>
+
+// Sampled simulation with the cache and timing models. The program is run
+// in the fast loop, or in the translation when sim->aot is set, for skip
+// instructions, then in the detailed loop for warm instructions to bring
+// the caches and predictors back up to date, and then for measure
+// instructions whose counts are kept, over and over until it exits. Each
+// count is extrapolated to the whole run from its rate per instruction in
+// the windows measured, with a confidence interval from their spread.
+struct sampler;
+
+struct sampler *sample_create(long int skip, long int warm, long int measure);
+void sample_delete(struct sampler *sampler);
+
+// Runs the program from start_addr like simulate, and returns the number of
+// instructions executed
+long int sample_run(struct sampler *sampler, struct memory *mem, struct simulation *sim, uint32_t start_addr);
+
+// the estimates of every count the cache and timing models keep, in place
+// of their own reports
+void sample_report(struct sampler *sampler, FILE *out);
+
+#endif
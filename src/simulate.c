@@ -2,447 +2,1051 @@
 #include "assembly.h"
 #include <stdio.h>
 #include "simulate.h"
+#include "syscalls.h"
+#include "hle.h"
+#include "cache.h"
+#include "timing.h"
+#include "decode.h"
+#include "isa.h"
+#include "fpu.h"
+#include "plugin.h"
+#include "error.h"
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
 
-// We define all of the opcodes from the different instructions to implement
-// by reading the opcode value in the tables p. 104 & 105 in the riscv spec.
-// The values are in binary and we translate them to hex as they are shorter
-// easier to read and use for comparisons.
-
-// RV321 Base Instruction Set
-// Opcodes
-#define OPCODE_LUI 0x37
-#define OPCODE_AUIPC 0x17
-#define OPCODE_JAL 0x6F
-#define OPCODE_JALR 0x67
-#define OPCODE_BEQ_BNE_BLT_BGE_BLTU_BGEU 0x63
-#define OPCODE_LB_LH_LW_LBU_LHU 0x3
-#define OPCODE_SB_SH_SW 0x23
-#define OPCODE_ADDI_SLTI_SLTIU_XORI_ORI_ANDI_SLLI_SRLI_SRAI 0x13
-#define OPCODE_ADD_SUB_SLL_SLT_SLTU_XOR_SRL_SRA_OR_AND 0x33
-
-// RV32M Standard Extension
-// Opcodes
-#define OPCODE_MUL_DIV_REM 0x33 // (They all share same value)
-
-// Funct7
-#define FUNCT7_MUL_DIV_REM 0x01 // (They all share same value)
-
-// 32 bit register as RISC-V is 32 bit
-uint32_t registers[32];
+// 32 bit register as RISC-V is 32 bit. Every hart has its own.
+__thread uint32_t registers[32];
 
 // Writes a 32 bit value at specified index 
-void write_register(int register_index, uint32_t value) {
+static void write_register(int register_index, uint32_t value) {
     if (register_index != 0) { // // Register 0 is always 0.
         registers[register_index] = value;
     }
 }
 
-// Reads the register at specified index
-uint32_t read_register(int register_index) {
-    return registers[register_index];
+// The decode cache has a page of entries for every memory page with code,
+// kept by the memory with the page
+#define PAGE_MASK (MEMORY_PAGE_SIZE - 1)
+#define PAGE_INSNS (MEMORY_PAGE_SIZE / 2) // one entry per halfword, instructions may be compressed
+#define MAX_BLOCK 64 // decode at most this many instructions at a time
+#define MAX_PROLOGUE_STORES 16
+#define AOT_PUBLISH (1 << 20) // instructions of translated code between live metrics
+
+#define MAX_HARTS MEMORY_DECODERS // every hart has decode pages of its own
+
+// The page table of the memory the thread runs
+static __thread struct memory_leaf **leaves;
+
+#define MAX_PENDING 16 // invalidations waiting for a hart, beyond that it drops its whole cache
+
+// Stores to code by other harts, waiting for the hart to take them at its
+// next jump. Only the hart itself touches its decode cache.
+struct inbox {
+    pthread_mutex_t lock;
+    int pending; // set when there is something to take
+    int count;
+    bool overflow;
+    struct { int addr, len; } ranges[MAX_PENDING];
+};
+
+// The harts of a simulation run by run_harts. Every hart has a decode cache
+// of its own, so decoding needs no locking. Stores to code reach the others
+// through their inboxes. Each of the harts' threads points at the group,
+// so simulations in other threads are kept apart.
+struct hart_group {
+    int stopping; // set when the simulation ends
+    int num_caches;
+    struct inbox inboxes[MAX_HARTS];
+    pthread_mutex_t syscall_lock;
+};
+static __thread struct hart_group *group;
+
+static __thread int hart_id;
+// lr.w reservation, an odd address when there is none
+static __thread uint32_t reserved_addr = 1;
+static __thread uint32_t reserved_value;
+
+// Watchpoints: the pc of the instruction making the access, and whether a
+// hit has asked the loop to stop
+static __thread uint32_t watch_pc;
+static __thread bool watch_stop;
+struct watch_report {
+    struct assembly *as;
+    struct simulation *sim;
+};
+static struct watch_report watch_report;
+
+static struct insn *lookup_insn(struct memory *mem, uint32_t pc) {
+    struct memory_leaf *leaf = __atomic_load_n(&leaves[pc >> (MEMORY_PAGE_BITS + MEMORY_LEAF_BITS)], __ATOMIC_ACQUIRE);
+    void **decoders = leaf ? __atomic_load_n(&leaf->decoded[(pc >> MEMORY_PAGE_BITS) & (MEMORY_LEAF_PAGES - 1)],
+                                             __ATOMIC_ACQUIRE) : NULL;
+    struct insn *page = decoders ? decoders[hart_id] : NULL;
+    if (page == NULL) {
+        page = memory_decoded(mem, pc, hart_id, PAGE_INSNS * sizeof(struct insn));
+    }
+    return &page[(pc & PAGE_MASK) >> 1];
 }
 
+// The decode entry of the instruction after d
+static inline struct insn *following(struct insn *d) {
+    return d + (d->size >> 1);
+}
 
-long int simulate(struct memory *mem, struct assembly *as, int start_addr, FILE *log_file) {
-    uint32_t pc = start_addr; // Program counter
-    long int instructions = 0;
-    (void)as; 
+// Looks for superinstructions starting at d. next points at the decoded
+// entries that follow in the same page, up to the page end. A breakpoint
+// is never covered by one.
+static void fuse(struct insn *d, struct insn *page_end) {
+    struct insn *next = following(d);
+    if (next >= page_end || next->op == OP_UNDECODED || next->fop == OP_BREAK) {
+        return;
+    }
+    if (d->op == OP_LUI && next->op == OP_ADDI && next->rs1 == d->rd && next->rd == d->rd) {
+        d->fop = OP_FUSED_LUI_ADDI;
+        d->count = 2;
+    } else if (d->op == OP_AUIPC && next->op == OP_JALR && next->rs1 == d->rd && d->rd != 0) {
+        d->fop = OP_FUSED_AUIPC_JALR;
+        d->count = 2;
+    } else if (d->op == OP_ADDI && d->rd == 2 && d->rs1 == 2 && next->op == OP_SW && next->rs1 == 2) {
+        int count = 1;
+        int length = d->size;
+        while (next < page_end && count <= MAX_PROLOGUE_STORES && next->op == OP_SW && next->rs1 == 2
+               && next->fop != OP_BREAK) {
+            count++;
+            length += next->size;
+            next = following(next);
+        }
+        d->fop = OP_FUSED_PROLOGUE;
+        d->count = count;
+        d->length = length;
+        return;
+    } else if ((d->op == OP_SLT || d->op == OP_SLTU || d->op == OP_SLTI || d->op == OP_SLTIU) && d->rd != 0
+               && (next->op == OP_BEQ || next->op == OP_BNE) && next->rs1 == d->rd && next->rs2 == 0) {
+        d->fop = OP_FUSED_SET_BRANCH;
+        d->count = 2;
+    } else {
+        return;
+    }
+    d->length = d->size + next->size;
+}
 
-    while (1) {
-        int instruction = memory_rd_w(mem, pc);
-        // Opcode is the last 7 bits in the instructions. See figure 2.2 & 2.4:
-        // https://riscv.org/wp-content/uploads/2017/05/riscv-spec-v2.2.pdf
-        int opcode = instruction & 0x7F;
-
-        // ecall
-        if (opcode == 0x73) {
-            int a7 = read_register(17); 
-            switch(a7) {
-                case 1:
-                    ;
-                    int input_char = getchar();
-                    write_register(10, input_char);
-                    break;
-                case 2: 
-                    ;
-                    int output_char = read_register(10);
-                    putchar(output_char);
-                    break;
-                case 3:
-                    printf("Quitting simulation. Ran %ld instructions\n ", instructions);
-                    exit(0);
-                    break;
-                case 93:
-                    printf("Quitting simulation. Ran %ld instructions\n ", instructions);
-                    exit(0);
-                    break;
-                default:
-                    printf("Problem with system call A7 = %d \n", a7);
-                    exit(-1);
-            }
+// Superinstructions that start before d and cover it are split up
+static void split_covering(struct insn *page, struct insn *d) {
+    for (int back = 1; back <= 2 * (MAX_PROLOGUE_STORES + 1) && d - back >= page; ++back) {
+        if (d[-back].length > 2 * back) {
+            d[-back].fop = d[-back].op;
+            d[-back].count = 1;
+            d[-back].length = d[-back].size;
         }
-       
-        // Implement LUI
-        if (opcode == OPCODE_LUI)
-        {
-            uint32_t imm32_12 = (instruction >> 12) & 0xFFFFF; // Extract the imm field (bits 12-32)
-            uint32_t rd = (instruction >> 7) & 0x1F;
-            write_register(rd, imm32_12 << 12);
+    }
+}
+
+// Called by the memory for stores to pages with decoded code. Instructions
+// overlapping the written bytes go back to OP_UNDECODED, and
+// superinstructions that cover one of them are split, so the next time they
+// are reached they are decoded again.
+static void invalidate_decoded(struct memory *mem, int decoder, int addr, int len) {
+    uint32_t first = ((uint32_t)addr & ~1U) - 2; // a 32 bit instruction may start before addr
+    uint32_t last = ((uint32_t)addr + len - 1) & ~1U;
+    for (uint32_t a = first; a - first <= last - first; a += 2) {
+        struct insn *page = memory_find_decoded(mem, a, decoder);
+        if (page == NULL) {
+            a |= PAGE_MASK - 1; // nothing decoded in the rest of this page
+            continue;
+        }
+        struct insn *d = &page[(a & PAGE_MASK) >> 1];
+        if (d->op == OP_UNDECODED) {
+            continue; // and no superinstruction can cover it
         }
+        d->op = d->fop = OP_UNDECODED;
+        d->count = 0;
+        split_covering(page, d);
+    }
+}
 
-        if (opcode == OPCODE_AUIPC)
-        {
-            uint32_t imm32_12 = (instruction >> 12) & 0xFFFFF; // Extract the imm field (bits 12-32)
-            uint32_t rd = (instruction >> 7) & 0x1F;
-            /// Store offset + pc to rd
-            write_register(rd,(imm32_12 << 12)+pc);
+// The memory's code hook: the storing hart's decode pages see the store at
+// once and the other harts' at their next jump
+static void invalidate_code(void *ctx, struct memory *mem, int addr, int len) {
+    struct simulation *sim = ctx;
+    if (sim->aot) {
+        aot_invalidate(sim->aot, addr, len);
+    }
+    if (sim->plugins) {
+        plugins_invalidate(sim->plugins);
+    }
+    invalidate_decoded(mem, hart_id, addr, len);
+    if (group == NULL) {
+        return;
+    }
+    for (int i = 0; i < group->num_caches; ++i) {
+        if (i == hart_id) {
+            continue;
         }
-        
-
-        // JAL
-        if (opcode == OPCODE_JAL) {
-            uint32_t rd = (instruction >> 7) & 0x1F;
-            int32_t imm = ((instruction & 0x80000000) >> 11) | // imm[20]
-                        ((instruction & 0x7FE00000) >> 20) | // imm[10:1]
-                        ((instruction & 0x00100000) >> 9) |  // imm[11]
-                        (instruction & 0x000FF000);          // imm[19:12]
-            if (imm & 0x100000) { // sign extend 
-                imm |= 0xFFE00000;
-            }
-            write_register(rd, pc + 4);
-            pc += imm;
-            continue; // Skip the normal increment
+        struct inbox *inbox = &group->inboxes[i];
+        pthread_mutex_lock(&inbox->lock);
+        if (inbox->count < MAX_PENDING) {
+            inbox->ranges[inbox->count].addr = addr;
+            inbox->ranges[inbox->count].len = len;
+            inbox->count++;
+        } else {
+            inbox->overflow = true;
         }
-        // JALR
-        if (opcode == OPCODE_JALR) {
-            uint32_t rd = (instruction >> 7) & 0x1F;
-            uint32_t rs1 = (instruction >> 15) & 0x1F;
-            int32_t imm = (instruction >> 20) & 0xFFF;
-            if (imm & 0x800) { // sign extend
-                imm |= 0xFFFFF000;
-            }
-            write_register(rd, pc + 4);
-            pc = (read_register(rs1) + imm) & ~1U; // Clear the least significant bit
-            continue; // Skip the normal increment
+        __atomic_store_n(&inbox->pending, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&inbox->lock);
+    }
+}
+
+// Applies the stores to code that other harts have left in this hart's inbox
+static void take_invalidations(struct memory *mem) {
+    struct inbox *inbox = &group->inboxes[hart_id];
+    pthread_mutex_lock(&inbox->lock);
+    if (inbox->overflow) {
+        memory_drop_decoded(mem, hart_id);
+    } else {
+        for (int i = 0; i < inbox->count; ++i) {
+            invalidate_decoded(mem, hart_id, inbox->ranges[i].addr, inbox->ranges[i].len);
         }
+    }
+    inbox->count = 0;
+    inbox->overflow = false;
+    __atomic_store_n(&inbox->pending, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&inbox->lock);
+}
 
+// Decodes the straight line code starting at pc and runs the fusion pass
+// over it. Decoding stops after a control transfer, at an entry that is
+// already decoded, at the end of the page or after MAX_BLOCK instructions.
+static void decode_block(struct memory *mem, uint32_t pc, struct insn *d) {
+    struct insn *page_end = d - ((pc & PAGE_MASK) >> 1) + PAGE_INSNS;
+    struct insn *end = d;
+    struct insn *last;
+    int n = 0;
+    do {
+        last = end;
+        // the page of d is marked as code already, an instruction that may
+        // cross into the next page marks that one too
+        if ((pc & PAGE_MASK) == PAGE_MASK - 1) {
+            memory_mark_code(mem, pc + 2, 2);
+        }
+        decode(decode_fetch(mem, pc), end);
+        pc += end->size;
+        end = following(end);
+        n++;
+    } while (end < page_end && n < MAX_BLOCK && end->op == OP_UNDECODED && !is_control(last->op));
+    for (struct insn *i = d; i < end; i = following(i)) {
+        fuse(i, page_end);
+    }
+}
+
+// The block at pc as the plugins see it: the straight line code up to and
+// including the next control transfer, at most MAX_BLOCK instructions. It is
+// decoded here if it hasn't been reached yet.
+static const struct plugin_block *plugin_block(struct memory *mem, struct plugins *plugins, uint32_t pc) {
+    const struct plugin_block *block = plugins_block(plugins, pc);
+    if (block) {
+        return block;
+    }
+    uint32_t end = pc;
+    int n = 0;
+    struct insn *d;
+    do {
+        d = lookup_insn(mem, end);
+        if (d->op == OP_UNDECODED) {
+            decode_block(mem, end, d);
+        }
+        end += d->size;
+        n++;
+    } while (n < MAX_BLOCK && !is_control(d->op));
+    return plugins_translate(plugins, pc, n, end - pc);
+}
 
-        // BEQ
-        if (opcode == OPCODE_BEQ_BNE_BLT_BGE_BLTU_BGEU) {
-            uint32_t funct3 = (instruction >> 12) & 0x7;
-            uint32_t rs1 = (instruction >> 15) & 0x1F;
-            uint32_t rs2 = (instruction >> 20) & 0x1F;
-            int32_t imm = ((instruction & 0x80000000) >> 19) | // imm[12]
-                        ((instruction & 0x7E000000) >> 20) | // imm[10:5]
-                        ((instruction & 0x00000F00) >> 7) |  // imm[4:1]
-                        ((instruction & 0x00000080) << 4);   // imm[11]
-            if (imm & 0x1000) { // Sign extend 
-                imm |= 0xFFFFE000;
+// Reports the load, store or atomic d to the plugins in mask
+static void plugin_access(struct plugins *plugins, uint32_t mask, uint32_t pc, struct insn *d, uint32_t rs1_value) {
+    uint32_t addr = rs1_value + d->imm;
+    switch (d->op) {
+        case OP_LB:
+        case OP_LBU:
+            plugins_access(plugins, mask, pc, addr, 1, 0);
+            break;
+        case OP_LH:
+        case OP_LHU:
+            plugins_access(plugins, mask, pc, addr, 2, 0);
+            break;
+        case OP_LW:
+        case OP_FLW:
+            plugins_access(plugins, mask, pc, addr, 4, 0);
+            break;
+        case OP_FLD:
+            plugins_access(plugins, mask, pc, addr, 8, 0);
+            break;
+        case OP_SB:
+            plugins_access(plugins, mask, pc, addr, 1, 1);
+            break;
+        case OP_SH:
+            plugins_access(plugins, mask, pc, addr, 2, 1);
+            break;
+        case OP_SW:
+        case OP_FSW:
+            plugins_access(plugins, mask, pc, addr, 4, 1);
+            break;
+        case OP_FSD:
+            plugins_access(plugins, mask, pc, addr, 8, 1);
+            break;
+        default:
+            // the atomics have no offset
+            if (d->op >= OP_LR_W && d->op <= OP_AMOMAXU_W) {
+                plugins_access(plugins, mask, pc, rs1_value, 4, d->op != OP_LR_W);
             }
-            bool take_branch = false;
-            switch (funct3) {
-                case 0x0: // BEQ
-                    take_branch = read_register(rs1) == read_register(rs2);
-                    break;
-                case 0x1: // BNE
-                    take_branch = read_register(rs1) != read_register(rs2);
-                    break;
-                case 0x4: // BLT
-                    take_branch = (int32_t)read_register(rs1) < (int32_t)read_register(rs2);
-                    break;
-                case 0x5: // BGE
-                    take_branch = (int32_t)read_register(rs1) >= (int32_t)read_register(rs2);
-                    break;
-                case 0x6: // BLTU
-                    take_branch = read_register(rs1) < read_register(rs2);
-                    break;
-                case 0x7: // BGEU
-                    take_branch = read_register(rs1) >= read_register(rs2);
-                    break;
+            break;
+    }
+}
+
+// Advance n bytes, or jump to target. The decode entry is looked up again
+// only when the pc leaves the current page, or when this hart's decode pages
+// may have been dropped.
+#define NEXT(n) do { pc += (n); d += (n) >> 1; if ((pc & PAGE_MASK) < (uint32_t)(n)) d = lookup_insn(mem, pc); } while (0)
+#define JUMP(target) do { \
+        uint32_t to = (target); \
+        if (parallel && __atomic_load_n(&group->stopping, __ATOMIC_RELAXED)) return instructions; \
+        if (parallel && __atomic_load_n(&group->inboxes[hart_id].pending, __ATOMIC_ACQUIRE)) { \
+            take_invalidations(mem); \
+            d = lookup_insn(mem, to); \
+        } else if ((to ^ pc) & ~PAGE_MASK) { \
+            d = lookup_insn(mem, to); \
+        } else { \
+            d += (int32_t)(to - pc) >> 1; \
+        } \
+        pc = to; \
+        if (meter) PUBLISH(); \
+        if (!observed && instructions >= limit) { *resume = pc; return instructions; } \
+    } while (0)
+#define PUBLISH() do { \
+        __atomic_store_n(&meter->instructions, instructions, __ATOMIC_RELAXED); \
+        __atomic_store_n(&meter->pc, pc, __ATOMIC_RELAXED); \
+    } while (0)
+
+// The cases generated from isa.h. b is rs2 in the R format, else the
+// immediate. The decoder never leaves rd = x0 in an ALU operation, so rd is
+// written without checking.
+#define OPERAND_R rs2_value
+#define OPERAND_I (uint32_t)d->imm
+#define OPERAND_SHAMT (uint32_t)d->imm
+#define OPERAND_U (uint32_t)d->imm
+#define ALU_CASE(op, name, mask, match, format, expression) \
+            case op: { \
+                uint32_t a = rs1_value, b = OPERAND_##format; \
+                (void)a; \
+                registers[d->rd] = (expression); \
+                break; \
             }
-            if (take_branch) {
-                pc += imm;
-                continue; // Skip normal PC increment
+#define BRANCH_CASE(op, name, mask, match, format, condition) \
+                        case op: \
+                            take_branch = (condition); \
+                            break;
+#define SKIP(...)
+
+// System calls from several harts are serialized. exit from a hart other
+// than hart 0 only stops that hart; hart 0 exiting, or any hart calling
+// exit_group, ends the simulation.
+static int ecall(struct simulation *sim, long int instructions) {
+    if (sim->harts <= 1) {
+        int result = sim->syscall_hook ? sim->syscall_hook(sim->syscall_ctx, registers) : SYSCALL_DEFAULT;
+        return result == SYSCALL_DEFAULT ? syscalls_handle(sim->sys, registers, instructions) : result;
+    }
+    if (hart_id != 0 && registers[17] == 93) { // exit
+        return SYSCALL_EXIT;
+    }
+    pthread_mutex_lock(&group->syscall_lock);
+    int result = syscalls_handle(sim->sys, registers, instructions);
+    pthread_mutex_unlock(&group->syscall_lock);
+    if (result == SYSCALL_EXIT) {
+        __atomic_store_n(&group->stopping, 1, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+// Prints a watchpoint hit, and stops the loop for -watch-stop
+static void watch_hit(void *ctx, int addr, int size, int kind, uint32_t old_value, const uint32_t *new_value) {
+    struct watch_report *report = ctx;
+    uint32_t mask = size == 4 ? ~0U : (1U << (8 * size)) - 1;
+    syscalls_flush(report->sim->sys);
+    printf("Watchpoint at %8x: %s %d at %8x: %x", watch_pc,
+           kind == MEMORY_WATCH_READ ? "read" : "write", size, addr, old_value & mask);
+    if (new_value) {
+        printf(" -> %x", *new_value & mask);
+    } else if (kind == MEMORY_WATCH_WRITE) {
+        printf(" -> ?");
+    }
+    // the text is padded for the trace, which is not wanted here
+    const char *text = report->as ? assembly_get(report->as, watch_pc) : "";
+    int length = strlen(text);
+    while (length > 0 && text[length - 1] == ' ') {
+        length--;
+    }
+    printf("  %.*s\n", length, text);
+    if (report->sim->watch == 2) {
+        watch_stop = true;
+    }
+}
+
+// Host address of the word an atomic operation works on. Stores mark the
+// page written up front; watchpoints hear of the access afterwards, from
+// atomic_done, once the values are known.
+static uint32_t *atomic_word(struct memory *mem, uint32_t addr, bool store) {
+    if (addr & 0x3) {
+        error_fail("Misaligned atomic access at %x. Exiting", addr);
+    }
+    int len = 4;
+    return store ? memory_atomic_word(mem, addr) : (uint32_t *)memory_span(mem, addr, &len);
+}
+
+// What an amo stores, given the old word and rs2
+static uint32_t amo_value(int op, uint32_t old, uint32_t value) {
+    switch (op) {
+        case OP_AMOSWAP_W:
+            return value;
+        case OP_AMOADD_W:
+            return old + value;
+        case OP_AMOXOR_W:
+            return old ^ value;
+        case OP_AMOAND_W:
+            return old & value;
+        case OP_AMOOR_W:
+            return old | value;
+        case OP_AMOMIN_W:
+            return (int32_t)value < (int32_t)old ? value : old;
+        case OP_AMOMAX_W:
+            return (int32_t)value > (int32_t)old ? value : old;
+        case OP_AMOMINU_W:
+            return value < old ? value : old;
+        default: // OP_AMOMAXU_W
+            return value > old ? value : old;
+    }
+}
+
+// Reports an amo's read of old and write of its result to the watchpoints,
+// and gives old for rd
+static uint32_t atomic_done(struct memory *mem, uint32_t addr, int op, uint32_t value, uint32_t old) {
+    uint32_t new_value = amo_value(op, old, value);
+    memory_watched(mem, addr, 4, MEMORY_WATCH_READ | MEMORY_WATCH_WRITE, old, &new_value);
+    return old;
+}
+
+// amomin and amomax have no host instruction, they retry a compare and swap
+static uint32_t atomic_min_max(uint32_t *word, uint32_t value, int op) {
+    uint32_t old = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+    while (!__atomic_compare_exchange_n(word, &old, amo_value(op, old, value), false, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST)) {
+    }
+    return old;
+}
+
+// The simulation loop. It is instantiated five times: with observed ==
+// false it dispatches on superinstructions and has no per-instruction
+// hooks; with observed == true every instruction is executed on its own and
+// reported to the cache and timing models; with plugged == true as well the
+// plugins are called for the blocks and events they asked for; with
+// translated == true the ahead-of-time translation is run whenever the pc
+// reaches one of its blocks, and the interpreter only covers what it can't;
+// with watched == true the pc of every instruction is kept for watchpoint
+// hits, which observed loops do too when there are watchpoints.
+// The loop starts at *resume, and leaves the pc there when it stops at
+// sim->limit, which observed loops check before every instruction and the
+// others at jumps, at a watchpoint, or when the program exits.
+static inline __attribute__((always_inline))
+long int run(struct memory *mem, struct simulation *sim, uint32_t *resume, const bool observed,
+             const bool translated, const bool plugged, const bool watched) {
+    uint32_t pc = *resume; // Program counter
+    const long int limit = sim->limit ? sim->limit : LONG_MAX;
+    long int instructions = 0;
+    struct hle *hle = sim->hle;
+    struct cache_batch *cache = sim->cache ? cache_batch(sim->cache) : NULL;
+    struct timing *timing = sim->timing;
+    // The timing model needs to know where an instruction went, so it is
+    // given the previous instruction at the start of the next one
+    uint32_t timed_pc = 0;
+    uint32_t timed_word = 0;
+    int timed_size = 0;
+    const bool parallel = sim->harts > 1;
+    // the counters of this hart for live metrics, published at every jump
+    struct metrics_hart *meter = sim->metrics ? metrics_hart(sim->metrics, hart_id) : NULL;
+    // instructions left in the current plugin block, and the plugins
+    // watching its memory accesses
+    int block_left = 0;
+    uint32_t mem_hooks = 0;
+    const bool watching = watched || (observed && sim->watch);
+    struct insn *d = lookup_insn(mem, pc);
+    if (watching) {
+        watch_stop = false;
+    }
+
+    while (1) {
+        if (watching) {
+            if (watch_stop) {
+                *resume = pc;
+                return instructions;
             }
+            watch_pc = pc;
         }
-
-        // Load Instructions
-        if (opcode == OPCODE_LB_LH_LW_LBU_LHU)
-        {
-            // Retrive the addresse
-            int funct3 = (instruction >> 12) & 0x7;
-            int rs1 = (instruction >> 15) & 0x1F;
-            int rd = (instruction >> 7) & 0x1F;
-            uint32_t imm32_20 = (instruction >> 20) & 0x7F;// Extract the funct7 field (bits 20-32)
-            uint32_t adr = imm32_20 + read_register(rs1);
-            switch (funct3) {
-                case 0x0: // LB
-                    ;
-                    // load the byte from memory
-                    uint32_t byte = memory_rd_w(mem, adr);
-                    // get the sign of the byte 
-                    uint32_t sign_byte = (byte <0x07)* 0xff;
-                    /// read_register the byte into memory
-                    write_register(rd,sign_byte + byte);;
-                    break;
-                case 0x1: // LH
-                    ;
-                    // load the halfword from memory
-                    uint32_t halfword = memory_rd_w(mem, adr);
-                    // get the sign of the halfword 
-                    uint32_t sign_halfword = (halfword <0x0f)* 0xffff;
-                    /// read_register the halfword into memory
-                    write_register(rd, sign_halfword + halfword);
-                    break;
-                case 0x2: // LW
-                    // Load a Word from Memoery
-                    write_register(rd,memory_rd_w(mem, adr));
-                    break;
-                case 0x4: // LBU
-                    // Load A Byte from memory Unsigned
-                    write_register(rd, memory_rd_w(mem, adr));
-                    break;
-                case 0x5: // LHU
-                    // Load Unsigned Halfword from memory
-                    write_register(rd,memory_rd_w(mem, adr));
-                    break;
-                default:
-                    break;
+        if (translated) {
+            uint32_t before = pc;
+            // live metrics are published between runs of translated code
+            long int left = limit - instructions;
+            long int done = aot_run(sim->aot, registers, hle, &pc, meter && left > AOT_PUBLISH ? AOT_PUBLISH : left);
+            instructions += done;
+            if (pc != before || done) {
+                d = lookup_insn(mem, pc);
+                if (meter) {
+                    PUBLISH();
+                }
+                if (instructions >= limit) {
+                    *resume = pc;
+                    return instructions;
                 }
-        }
-
-        // Store Instructions
-        if (opcode == OPCODE_SB_SH_SW)
-        {
-            uint32_t imm4_0 = (instruction >> 7) & 0x1F; // Extract the imm4_0 field (bits 7-11)
-            uint32_t imm32_25 = (instruction >> 25) & 0x7F; // Extract the funct7 field (bits 25-32)
-            uint32_t funct3 = (instruction >> 12) & 0x7;     // Extract the funct3 field (bits 12-14)
-            uint32_t rs1 = (instruction >> 15) & 0x1F;       // Extract bits 19:15
-            uint32_t rs2 = (instruction >> 20) & 0x1F; // Extract bits 24:20
-            uint32_t adr = read_register(rs1) +imm32_25 +imm4_0; // get memory location and add offset
-            switch (funct3) {
-            case 0x0: // SB
-                memory_wr_b(mem,adr, read_register(rs2));
-                // printf("Opcode: SB \n");
-                break;
-            case 0x1: // SH
-                memory_wr_h(mem,adr, read_register(rs2));
-                // printf("Opcode: SH \n");
-                break;
-            case 0x2: // SW
-                memory_wr_w(mem,adr, read_register(rs2));
-                // printf("Opcode: SW \n");
-                break;
-            default:
-                break;
             }
-            break;
         }
-       
-    
-
-        if (opcode == OPCODE_ADDI_SLTI_SLTIU_XORI_ORI_ANDI_SLLI_SRLI_SRAI) {
-            uint32_t funct3 = (instruction >> 12) & 0x7;
-            uint32_t rs1 = (instruction >> 15) & 0x1F;
-            uint32_t rd = (instruction >> 7) & 0x1F;
-            int32_t imm = ((instruction >> 20) & 0xFFF);
-            if (imm & 0x800) { // sign extend 
-                imm |= 0xFFFFF000;
+        if (observed) {
+            if (instructions >= limit) {
+                *resume = pc;
+                return instructions;
             }
-
-            switch (funct3) {
-                case 0x0: // ADDI
-                    write_register(rd, read_register(rs1) + imm);
-                    break;
-                case 0x2: // SLTI
-                    write_register(rd, (int32_t)read_register(rs1) < imm ? 1 : 0);
-                    break;
-                case 0x3: // SLTIU
-                    write_register(rd, read_register(rs1) < (uint32_t)imm ? 1 : 0);
-                    break;
-                case 0x4: // XORI
-                    write_register(rd, read_register(rs1) ^ imm);
-                    break;
-                case 0x6: // ORI
-                    write_register(rd, read_register(rs1) | imm);
-                    break;
-                case 0x7: // ANDI
-                    write_register(rd, read_register(rs1) & imm);
-                    break;
-                case 0x1: // SLLI
-                    write_register(rd, read_register(rs1) << (imm & 0x1F));
-                    break;
-                case 0x5: // SRLI / SRAI
-                    if ((instruction >> 30) & 0x1) { // SRAI
-                        write_register(rd, (int32_t)read_register(rs1) >> (imm & 0x1F));
-                    } else { // SRLI
-                        write_register(rd, read_register(rs1) >> (imm & 0x1F));
+            if (d->op == OP_UNDECODED) {
+                decode_block(mem, pc, d);
+            }
+            if (cache) {
+                cache_fetch(cache, pc);
+            }
+            if (timing) {
+                if (instructions > 0) {
+                    timing_insn(timing, timed_pc, timed_word, timed_size, pc);
+                }
+                timed_pc = pc;
+                timed_word = d->word;
+                timed_size = d->size;
+            }
+            if (plugged) {
+                if (block_left == 0) {
+                    const struct plugin_block *block = plugin_block(mem, sim->plugins, pc);
+                    block_left = block->insns;
+                    mem_hooks = block->mem;
+                    if (block->exec) {
+                        plugins_exec(sim->plugins, block);
                     }
-                    break;
+                }
+                block_left--;
             }
+        }
+        uint32_t rs1_value = registers[d->rs1];
+        uint32_t rs2_value = registers[d->rs2];
+        if (plugged && mem_hooks) {
+            plugin_access(sim->plugins, mem_hooks, pc, d, rs1_value);
+        }
+        switch (observed ? d->op : d->fop) {
+            case OP_UNDECODED:
+                decode_block(mem, pc, d);
+                continue; // dispatch again on the decoded instruction
+            case OP_NOP:
+                break;
+
+            // ecall
+            case OP_ECALL:
+                instructions++;
+                if (plugged) {
+                    plugins_syscall(sim->plugins, registers);
+                }
+                if (meter) {
+                    __atomic_store_n(&meter->syscalls, meter->syscalls + 1, __ATOMIC_RELAXED);
+                    PUBLISH();
+                }
+                if (ecall(sim, instructions) == SYSCALL_EXIT) {
+                    if (observed && timing) {
+                        timing_insn(timing, pc, d->word, d->size, pc + d->size);
+                    }
+                    if (!parallel) {
+                        sim->exited = 1;
+                    }
+                    *resume = pc;
+                    return instructions;
+                }
+                NEXT(d->size);
+                continue;
 
-        if (opcode == OPCODE_ADD_SUB_SLL_SLT_SLTU_XOR_SRL_SRA_OR_AND) {
-            uint32_t funct3 = (instruction >> 12) & 0x7;
-            uint32_t funct7 = (instruction >> 25) & 0x7F;
-            uint32_t rs1 = (instruction >> 15) & 0x1F;
-            uint32_t rs2 = (instruction >> 20) & 0x1F;
-            uint32_t rd = (instruction >> 7) & 0x1F;
+            case OP_AUIPC:
+                /// Store offset + pc to rd
+                write_register(d->rd, d->imm + pc);
+                break;
 
-            switch (funct3) {
-                case 0x0: // ADD / SUB
-                    if (funct7 == 0x20) {
-                        // SUB
-                        int64_t sub = (int64_t)read_register(rs1) - (int64_t)read_register(rs2);
-                        write_register(rd, (uint32_t)sub);
+            case OP_JAL:
+            case OP_JALR:
+                {
+                    uint32_t from = pc;
+                    uint32_t target = d->op == OP_JAL ? pc + d->imm
+                                                      : (rs1_value + d->imm) & ~1U; // Clear the least significant bit
+                    write_register(d->rd, pc + d->size); // rd may be rs1, so read it first
+                    instructions++;
+                    if (hle) {
+                        hle_jump(hle, registers, from, &target);
+                    }
+                    JUMP(target);
+                    continue; // Skip the normal increment
+                }
 
+            case OP_BEQ:
+            case OP_BNE:
+            case OP_BLT:
+            case OP_BGE:
+            case OP_BLTU:
+            case OP_BGEU:
+                {
+                    bool take_branch = false;
+                    uint32_t a = rs1_value, b = rs2_value;
+                    switch (d->op) {
+                        ISA_RV32IM(SKIP, BRANCH_CASE, SKIP)
+                    }
+                    instructions++;
+                    if (take_branch) {
+                        JUMP(pc + d->imm);
                     } else {
-                        // ADD
-                        int64_t add = (int64_t)read_register(rs1) + (int64_t)read_register(rs2);
-                        write_register(rd, (uint32_t)add);
+                        NEXT(d->size);
+                    }
+                    continue;
+                }
+
+            // Load Instructions
+            case OP_LB:
+            case OP_LH:
+            case OP_LW:
+            case OP_LBU:
+            case OP_LHU:
+                {
+                    uint32_t adr = rs1_value + d->imm;
+                    if (observed && cache) {
+                        cache_record(cache, pc, adr, CACHE_LOAD);
+                    }
+                    switch (d->op) {
+                        case OP_LB: // load the byte from memory and sign extend it
+                            write_register(d->rd, (int32_t)(int8_t)memory_rd_b(mem, adr));
+                            break;
+                        case OP_LH: // load the halfword from memory and sign extend it
+                            write_register(d->rd, (int32_t)(int16_t)memory_rd_h(mem, adr));
+                            break;
+                        case OP_LW: // Load a Word from Memoery
+                            write_register(d->rd, memory_rd_w(mem, adr));
+                            break;
+                        case OP_LBU: // Load A Byte from memory Unsigned
+                            write_register(d->rd, memory_rd_b(mem, adr));
+                            break;
+                        case OP_LHU: // Load Unsigned Halfword from memory
+                            write_register(d->rd, memory_rd_h(mem, adr));
+                            break;
                     }
                     break;
-                case 0x1: // SLL
-                    ;
-                    int64_t sll = (int64_t)read_register(rs1) << (read_register(rs2) & 0x1F);
-                    write_register(rd, (uint32_t)sll);
-                    break;
-                case 0x2: // SLT
-                    ;
-                    int32_t slt = ((int32_t)read_register(rs1) < (int32_t)read_register(rs2)) ? 1 : 0;
-                    write_register(rd, (uint32_t)slt);
-                    break;
-                case 0x3: // SLTU 
-                    ;
-                    uint32_t sltu = (read_register(rs1) < read_register(rs2)) ? 1 : 0;
-                    write_register(rd, sltu);
-                    break;
-                case 0x4: // XOR 
-                    ;
-                    uint32_t xor = read_register(rs1) ^ read_register(rs2);
-                    write_register(rd, xor);
-                    break;
-                case 0x5: // SRL / SRA 
-                    if (funct7 == 0x20) {
-                        // SRA
-                        int32_t sra = (int32_t)read_register(rs1) >> (read_register(rs2) & 0x1F);
-                        write_register(rd, (uint32_t)sra);
+                }
+
+            // Store Instructions
+            case OP_SB:
+            case OP_SH:
+            case OP_SW:
+                {
+                    uint32_t adr = rs1_value + d->imm; // get memory location and add offset
+                    if (observed && cache) {
+                        cache_record(cache, pc, adr, CACHE_STORE);
+                    }
+                    if (d->op == OP_SB) {
+                        memory_wr_b(mem, adr, rs2_value);
+                    } else if (d->op == OP_SH) {
+                        memory_wr_h(mem, adr, rs2_value);
                     } else {
-                        // SRL
-                        uint32_t srl = read_register(rs1) >> (read_register(rs2) & 0x1F);
-                        write_register(rd, srl);
+                        memory_wr_w(mem, adr, rs2_value);
                     }
                     break;
-                case 0x6: // OR 
-                    ;
-                    uint32_t or = read_register(rs1) | read_register(rs2);
-                    write_register(rd, or);
+                }
+
+            // Floating point loads and stores. The other RV32F and RV32D
+            // operations are run by fpu.c.
+            case OP_FLW:
+            case OP_FLD:
+            case OP_FSW:
+            case OP_FSD:
+                {
+                    uint32_t adr = rs1_value + d->imm;
+                    if (observed && cache) {
+                        cache_record(cache, pc, adr, d->op == OP_FLW || d->op == OP_FLD ? CACHE_LOAD : CACHE_STORE);
+                    }
+                    switch (d->op) {
+                        case OP_FLW: // NaN-boxed in the 64 bit register
+                            fregisters[d->rd] = 0xFFFFFFFF00000000ULL | (uint32_t)memory_rd_w(mem, adr);
+                            break;
+                        case OP_FLD:
+                            fregisters[d->rd] = (uint32_t)memory_rd_w(mem, adr)
+                                              | (uint64_t)(uint32_t)memory_rd_w(mem, adr + 4) << 32;
+                            break;
+                        case OP_FSW:
+                            memory_wr_w(mem, adr, (uint32_t)fregisters[d->rs2]);
+                            break;
+                        case OP_FSD:
+                            memory_wr_w(mem, adr, (uint32_t)fregisters[d->rs2]);
+                            memory_wr_w(mem, adr + 4, (uint32_t)(fregisters[d->rs2] >> 32));
+                            break;
+                    }
                     break;
-                case 0x7: // AND 
-                    ;
-                    uint32_t and = read_register(rs1) & read_register(rs2);
-                    write_register(rd, and);
+                }
+            // RV32A. The atomic operations are sequentially consistent host
+            // atomics whatever their aq and rl bits say, and plain loads and
+            // stores are ordered as the host orders them (TSO on x86-64,
+            // which is stronger than RVWMO). A fence is a full host fence.
+            case OP_FENCE:
+                if (parallel) {
+                    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                }
+                break;
+            case OP_HARTID:
+                write_register(d->rd, hart_id);
+                break;
+            case OP_LR_W:
+                reserved_value = __atomic_load_n(atomic_word(mem, rs1_value, false), __ATOMIC_SEQ_CST);
+                reserved_addr = rs1_value;
+                memory_watched(mem, rs1_value, 4, MEMORY_WATCH_READ, reserved_value, NULL);
+                write_register(d->rd, reserved_value);
+                break;
+            case OP_SC_W:
+                {
+                    // Succeeds if the word still holds what lr.w read. A
+                    // store of the same value in between goes unnoticed.
+                    // A failed one only read the word.
+                    uint32_t expected = reserved_value;
+                    bool stored = false;
+                    if (reserved_addr == rs1_value) {
+                        stored = __atomic_compare_exchange_n(atomic_word(mem, rs1_value, true), &expected,
+                                                             rs2_value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                        memory_watched(mem, rs1_value, 4, stored ? MEMORY_WATCH_READ | MEMORY_WATCH_WRITE
+                                                                 : MEMORY_WATCH_READ, expected, &rs2_value);
+                    }
+                    reserved_addr = 1;
+                    write_register(d->rd, stored ? 0 : 1);
                     break;
-            }
+                }
+            case OP_AMOSWAP_W:
+                write_register(d->rd, atomic_done(mem, rs1_value, d->op, rs2_value,
+                    __atomic_exchange_n(atomic_word(mem, rs1_value, true), rs2_value, __ATOMIC_SEQ_CST)));
+                break;
+            case OP_AMOADD_W:
+                write_register(d->rd, atomic_done(mem, rs1_value, d->op, rs2_value,
+                    __atomic_fetch_add(atomic_word(mem, rs1_value, true), rs2_value, __ATOMIC_SEQ_CST)));
+                break;
+            case OP_AMOXOR_W:
+                write_register(d->rd, atomic_done(mem, rs1_value, d->op, rs2_value,
+                    __atomic_fetch_xor(atomic_word(mem, rs1_value, true), rs2_value, __ATOMIC_SEQ_CST)));
+                break;
+            case OP_AMOAND_W:
+                write_register(d->rd, atomic_done(mem, rs1_value, d->op, rs2_value,
+                    __atomic_fetch_and(atomic_word(mem, rs1_value, true), rs2_value, __ATOMIC_SEQ_CST)));
+                break;
+            case OP_AMOOR_W:
+                write_register(d->rd, atomic_done(mem, rs1_value, d->op, rs2_value,
+                    __atomic_fetch_or(atomic_word(mem, rs1_value, true), rs2_value, __ATOMIC_SEQ_CST)));
+                break;
+            case OP_AMOMIN_W:
+            case OP_AMOMAX_W:
+            case OP_AMOMINU_W:
+            case OP_AMOMAXU_W:
+                write_register(d->rd, atomic_done(mem, rs1_value, d->op, rs2_value,
+                    atomic_min_max(atomic_word(mem, rs1_value, true), rs2_value, d->op)));
+                break;
 
-        }
+            // RV32IM computations, from the table in isa.h, and the
+            // specialized forms the decoder gives some of them
+            ISA_RV32IM(ALU_CASE, SKIP, SKIP)
+            case OP_LI:
+                registers[d->rd] = d->imm;
+                break;
+            case OP_MV:
+                registers[d->rd] = rs1_value;
+                break;
 
-       // RV32M Standard Extension
-        if (opcode == OPCODE_MUL_DIV_REM) {  
-            // The instructions in this extension are all of R-type.
-            uint32_t funct3 = (instruction >> 12) & 0x7;
-            uint32_t funct7 = (instruction >> 25) & 0x7F;
-            uint32_t rs1 = (instruction >> 15) & 0x1F;
-            uint32_t rs2 = (instruction >> 20) & 0x1F;
-            uint32_t rd = (instruction >> 7) & 0x1F;
-
-            uint32_t rs1_value = read_register(rs1);
-            uint32_t rs2_value = read_register(rs2);
-
-            if (funct7 == FUNCT7_MUL_DIV_REM) {
-                switch (funct3) {
-                    // Following link has been used as help when implementing the instructions
-                    // https://msyksphinz-self.github.io/riscv-isadoc/html/rvm.html
-                    case 0x0: // MUL
-                        ;
-                        uint32_t mul = rs1_value * rs2_value;
-                        write_register(rd, mul);
-                        break;
-                    case 0x1: // MULH
-                        ;
-                        int64_t mulh_rs1_value = (int64_t)(int32_t)rs1_value;
-                        int64_t mulh_rs2_value = (int64_t)(int32_t)rs2_value;
-                        int64_t mulh = mulh_rs1_value * mulh_rs2_value;
-                        write_register(rd, (uint32_t)(mulh >> 32));
-                        break;
-                    case 0x2: // MULHSU
-                        ;
-                        // Same as above but unsigned rs2
-                        int64_t mulhsu_rs1_value = (int64_t)(int32_t)rs1_value; 
-                        uint64_t mulhsu_rs2_value = (uint64_t)read_register(rs2_value);
-                        int64_t mulhsu = mulhsu_rs1_value * (int64_t)mulhsu_rs2_value; 
-                        uint32_t upper_bits_mulhsu = (uint32_t)(mulhsu >> 32); 
-                        write_register(rd, upper_bits_mulhsu);
-                        break;
-                    case 0x3: // MULHU
-                        ;
-                        uint64_t mulhu_rs1_value = (uint64_t)read_register(rs1);
-                        uint64_t mulhu_rs2_value = (uint64_t)read_register(rs2);
-                        uint64_t mulhu = mulhu_rs1_value * mulhu_rs2_value;
-                        write_register(rd, (uint32_t)(mulhu >> 32));
-                        break;
-                    case 0x4: // DIV
-                        if (rs2_value == 0 ) {
-                            printf("Division by 0");
-                        }
-                        else {
-                           uint32_t div = rs1_value / rs2_value;
-                           write_register(rd, div);
-                        }
-                        break;
-                    case 0x5: // DIVU
-                        ;
-                        uint32_t divu;
-                        if (rs2_value == 0) {
-                            divu = UINT32_MAX; // Division by zero gets largest unsigned value
-                        } else {
-                            divu = rs1_value / rs2_value; 
-                        }
-                        write_register(rd, divu);
-                        break;
-                    case 0x6: // REM
-                        ;
-                        int32_t rem_rs1_value = (int32_t)rs1_value; 
-                        int32_t rem_rs2_value = (int32_t)rs2_value; 
-
-                        int32_t rem;
-                        if (rem_rs2_value == 0) {
-                            rem = rem_rs1_value; 
-                        } else {
-                            rem = rem_rs1_value % rem_rs2_value; 
+            // Zba and Zbb bit manipulation extensions, mapped onto the host's
+            // builtins where it has an instruction for them
+            // https://github.com/riscv/riscv-bitmanip/releases/download/1.0.0/bitmanip-1.0.0.pdf
+            case OP_SH1ADD:
+                write_register(d->rd, (rs1_value << 1) + rs2_value);
+                break;
+            case OP_SH2ADD:
+                write_register(d->rd, (rs1_value << 2) + rs2_value);
+                break;
+            case OP_SH3ADD:
+                write_register(d->rd, (rs1_value << 3) + rs2_value);
+                break;
+            case OP_ANDN:
+                write_register(d->rd, rs1_value & ~rs2_value);
+                break;
+            case OP_ORN:
+                write_register(d->rd, rs1_value | ~rs2_value);
+                break;
+            case OP_XNOR:
+                write_register(d->rd, ~(rs1_value ^ rs2_value));
+                break;
+            case OP_CLZ:
+                // __builtin_clz is undefined for 0
+                write_register(d->rd, rs1_value ? __builtin_clz(rs1_value) : 32);
+                break;
+            case OP_CTZ:
+                write_register(d->rd, rs1_value ? __builtin_ctz(rs1_value) : 32);
+                break;
+            case OP_CPOP:
+                write_register(d->rd, __builtin_popcount(rs1_value));
+                break;
+            case OP_MIN:
+                write_register(d->rd, (int32_t)rs1_value < (int32_t)rs2_value ? rs1_value : rs2_value);
+                break;
+            case OP_MINU:
+                write_register(d->rd, rs1_value < rs2_value ? rs1_value : rs2_value);
+                break;
+            case OP_MAX:
+                write_register(d->rd, (int32_t)rs1_value > (int32_t)rs2_value ? rs1_value : rs2_value);
+                break;
+            case OP_MAXU:
+                write_register(d->rd, rs1_value > rs2_value ? rs1_value : rs2_value);
+                break;
+            case OP_SEXT_B:
+                write_register(d->rd, (int32_t)(int8_t)rs1_value);
+                break;
+            case OP_SEXT_H:
+                write_register(d->rd, (int32_t)(int16_t)rs1_value);
+                break;
+            case OP_ZEXT_H:
+                write_register(d->rd, rs1_value & 0xFFFF);
+                break;
+            case OP_ROL:
+                // The compiler turns this into a rotate instruction
+                write_register(d->rd, (rs1_value << (rs2_value & 0x1F)) | (rs1_value >> (-rs2_value & 0x1F)));
+                break;
+            case OP_ROR:
+                write_register(d->rd, (rs1_value >> (rs2_value & 0x1F)) | (rs1_value << (-rs2_value & 0x1F)));
+                break;
+            case OP_RORI:
+                write_register(d->rd, (rs1_value >> d->imm) | (rs1_value << (-d->imm & 0x1F)));
+                break;
+            case OP_ORC_B:
+                {
+                    // 0x80 in every byte of rs1 that is zero
+                    uint32_t zero = ~(((rs1_value & 0x7F7F7F7F) + 0x7F7F7F7F) | rs1_value | 0x7F7F7F7F);
+                    write_register(d->rd, ~((zero >> 7) * 0xFF));
+                    break;
+                }
+            case OP_REV8:
+                write_register(d->rd, __builtin_bswap32(rs1_value));
+                break;
+
+            // Superinstructions, only reached when !observed
+            case OP_FUSED_LUI_ADDI:
+                write_register(d->rd, d->imm + following(d)->imm);
+                instructions += 2;
+                NEXT(d->length);
+                continue;
+            case OP_FUSED_AUIPC_JALR:
+                {
+                    struct insn *jalr = following(d);
+                    uint32_t from = pc + d->size;
+                    uint32_t base = pc + d->imm;
+                    uint32_t target = (base + jalr->imm) & ~1U;
+                    write_register(d->rd, base);
+                    write_register(jalr->rd, pc + d->length);
+                    instructions += 2;
+                    if (hle) {
+                        hle_jump(hle, registers, from, &target);
+                    }
+                    JUMP(target);
+                    continue;
+                }
+            case OP_FUSED_PROLOGUE:
+                {
+                    uint32_t sp = rs1_value + d->imm;
+                    int count = d->count;
+                    int length = d->size;
+                    int i;
+                    struct insn *store = following(d);
+                    registers[2] = sp;
+                    // A store may overwrite one of the following stores
+                    for (i = 1; i < count && store->op == OP_SW; ++i) {
+                        if (watched) {
+                            watch_pc = pc + length;
                         }
-                        write_register(rd, rem);
-                        break;
-                    case 0x7: // REMU
-                        ;
-                        uint32_t remu;
-                        if (rs2_value == 0) {
-                            remu = rs1_value;
-                        } else {
-                            remu = rs1_value % rs2_value;
+                        length += store->size;
+                        memory_wr_w(mem, sp + store->imm, registers[store->rs2]);
+                        store = following(store);
+                        if (watched && watch_stop) {
+                            ++i;
+                            break;
                         }
-                        write_register(rd, remu);
-                        break;
+                    }
+                    instructions += i;
+                    NEXT(length);
+                    continue;
                 }
-            }
+            case OP_FUSED_SET_BRANCH:
+                {
+                    bool set;
+                    switch (d->op) {
+                        case OP_SLT:
+                            set = (int32_t)rs1_value < (int32_t)rs2_value;
+                            break;
+                        case OP_SLTU:
+                            set = rs1_value < rs2_value;
+                            break;
+                        case OP_SLTI:
+                            set = (int32_t)rs1_value < d->imm;
+                            break;
+                        default: // OP_SLTIU
+                            set = rs1_value < (uint32_t)d->imm;
+                            break;
+                    }
+                    registers[d->rd] = set;
+                    instructions += 2;
+                    struct insn *branch = following(d);
+                    if (set == (branch->op == OP_BNE)) {
+                        JUMP(pc + d->size + branch->imm);
+                    } else {
+                        NEXT(d->length);
+                    }
+                    continue;
+                }
+
+            case OP_BREAK:
+                *resume = pc;
+                return instructions;
+
+            default: // the rest of RV32F and RV32D
+                fpu_execute(d, registers);
+                break;
+        }
+        instructions++;
+        NEXT(d->size); // Go to next instruction
+    }
+}
+
+static long int run_fast(struct memory *mem, struct simulation *sim, uint32_t *resume) {
+    return run(mem, sim, resume, false, false, false, false);
+}
+
+struct hart {
+    struct memory *mem;
+    struct simulation *sim;
+    uint32_t start_addr;
+    int id;
+    struct hart_group *group;
+    long int instructions;
+    pthread_t thread;
+};
+
+static void *run_hart(void *arg) {
+    struct hart *hart = arg;
+    hart_id = hart->id;
+    leaves = memory_leaves(hart->mem);
+    group = hart->group;
+    hart->instructions = run_fast(hart->mem, hart->sim, &hart->start_addr);
+    return NULL;
+}
+
+// Hart 0 runs in the calling thread and the others in threads of their
+// own, all from start_addr with zeroed registers. The program tells them
+// apart by reading mhartid.
+static long int run_harts(struct memory *mem, struct simulation *sim, uint32_t start_addr) {
+    struct hart harts[MAX_HARTS];
+    if (sim->harts > MAX_HARTS) {
+        printf("At most %d harts are supported. Exiting\n", MAX_HARTS);
+        exit(-1);
+    }
+    struct hart_group harts_group = {0};
+    harts_group.num_caches = sim->harts;
+    pthread_mutex_init(&harts_group.syscall_lock, NULL);
+    for (int i = 0; i < sim->harts; ++i) {
+        pthread_mutex_init(&harts_group.inboxes[i].lock, NULL);
+    }
+    for (int i = 1; i < sim->harts; ++i) {
+        harts[i] = (struct hart){mem, sim, start_addr, i, &harts_group, 0, 0};
+    }
+    group = &harts_group;
+    for (int i = 1; i < sim->harts; ++i) {
+        if (pthread_create(&harts[i].thread, NULL, run_hart, &harts[i]) != 0) {
+            printf("Could not start hart %d. Exiting\n", i);
+            exit(-1);
         }
+    }
+    long int instructions = run_fast(mem, sim, &start_addr);
+    __atomic_store_n(&harts_group.stopping, 1, __ATOMIC_RELAXED);
+    for (int i = 1; i < sim->harts; ++i) {
+        pthread_join(harts[i].thread, NULL);
+        instructions += harts[i].instructions;
+        memory_drop_decoded(mem, i);
+    }
+    // the decode pages of hart 0 outlive the run
+    take_invalidations(mem);
+    group = NULL;
+    for (int i = 0; i < sim->harts; ++i) {
+        pthread_mutex_destroy(&harts_group.inboxes[i].lock);
+    }
+    pthread_mutex_destroy(&harts_group.syscall_lock);
+    return instructions;
+}
+
+// Picks the instantiation of the loop for a single hart
+static long int dispatch(struct memory *mem, struct simulation *sim, uint32_t *resume) {
+    if (sim->plugins) {
+        return run(mem, sim, resume, true, false, true, false);
+    }
+    if (sim->cache || sim->timing || (sim->limit && !sim->limit_at_jumps)) {
+        return run(mem, sim, resume, true, false, false, false);
+    }
+    if (sim->aot) {
+        return run(mem, sim, resume, false, true, false, false);
+    }
+    if (sim->watch) {
+        return run(mem, sim, resume, false, false, false, true);
+    }
+    return run_fast(mem, sim, resume);
+}
 
-        pc += 4; // Go to next instruction
+long int simulate(struct memory *mem, struct assembly *as, struct simulation *sim, int start_addr, FILE *log_file) {
+    (void)log_file;
+    uint32_t pc = start_addr;
+    memory_set_code_hook(mem, invalidate_code, sim);
+    leaves = memory_leaves(mem);
+    if (sim->watch) {
+        watch_report = (struct watch_report){as, sim};
+        memory_set_watch_hook(mem, watch_hit, &watch_report);
+    }
+    if (sim->harts > 1) {
+        return run_harts(mem, sim, start_addr);
+    }
+    return dispatch(mem, sim, &pc);
+}
 
+// A breakpoint is put in the fop of the decoded instruction, which is
+// decoded for it if it hasn't been already, so the loop only stops there
+// and costs nothing elsewhere.
+void simulate_breakpoint(struct memory *mem, struct simulation *sim, uint32_t addr, int set) {
+    memory_set_code_hook(mem, invalidate_code, sim);
+    leaves = memory_leaves(mem);
+    addr &= ~1U;
+    struct insn *d = lookup_insn(mem, addr);
+    if (d->op == OP_UNDECODED) {
+        decode_block(mem, addr, d);
+    }
+    if (set) {
+        split_covering(d - ((addr & PAGE_MASK) >> 1), d);
+        d->fop = OP_BREAK;
+    } else if (d->fop == OP_BREAK) {
+        d->fop = d->op;
     }
+    d->count = 1;
+    d->length = d->size;
+}
 
-    }   
-    return 0;
+long int simulate_run(struct memory *mem, struct simulation *sim, uint32_t *pc) {
+    memory_set_code_hook(mem, invalidate_code, sim);
+    leaves = memory_leaves(mem);
+    return dispatch(mem, sim, pc);
 }
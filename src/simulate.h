@@ -3,9 +3,48 @@
 
 #include "memory.h"
 #include "assembly.h"
+#include "syscalls.h"
+#include "hle.h"
+#include "cache.h"
+#include "timing.h"
+#include "aot.h"
+#include "plugin.h"
+#include "metrics.h"
 #include <stdio.h>
 
+struct insn;
+
 // Simuler RISC-V program i givet lager og fra given start adresse
-long int simulate(struct memory *mem, struct assembly *as, int start_addr, FILE *log_file);
+// Det der indgår i simulationen ud over lager og program. sys skal være sat,
+// de øvrige felter er NULL når de ikke bruges.
+struct simulation
+{
+  struct syscalls *sys; // systemkald
+  struct hle *hle;      // libc-funktioner udført på værten
+  struct cache *cache;  // model af cache-hierarkiet
+  struct timing *timing; // cykeltid for en simpel pipeline
+  struct aot *aot;       // programmet oversat til værtens kode
+  int harts;             // antal harts, hver i sin tråd; 0 eller 1 for én
+  struct plugins *plugins; // indlæste plugins
+  // kaldes ved ecall før syscalls; returnerer SYSCALL_DEFAULT for at lade sys klare det
+  int (*syscall_hook)(void *ctx, uint32_t *regs);
+  void *syscall_ctx;
+  long int limit; // højst så mange instruktioner pr. kørsel, 0 for ingen grænse
+  int limit_at_jumps; // limit ses først ved næste hop, så de hurtige løkker kan bruges
+  int exited;     // sat når programmet har afsluttet
+  int watch;      // watchpoints: 1 for at melde dem, 2 for også at stoppe
+  struct metrics *metrics; // tællere der udgives mens programmet kører
+};
+
+// Returnerer antal udførte instruktioner
+long int simulate(struct memory *mem, struct assembly *as, struct simulation *sim, int start_addr, FILE *log_file);
+
+// Kør én hart fra *pc til programmet afslutter eller sim->limit er nået, og
+// efterlad *pc der hvor den stoppede. Registrene er trådens egne.
+long int simulate_run(struct memory *mem, struct simulation *sim, uint32_t *pc);
+
+// sæt eller fjern et breakpoint på addr; simulate_run stopper før
+// instruktionen der, når den ikke er begrænset af sim->limit
+void simulate_breakpoint(struct memory *mem, struct simulation *sim, uint32_t addr, int set);
 
 #endif
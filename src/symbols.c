@@ -0,0 +1,111 @@
+#include "symbols.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct symbol
+{
+  unsigned addr;
+  const char *name;
+};
+
+struct symbols
+{
+  int count;
+  int capacity;
+  int sorted;
+  struct symbol *table;
+};
+
+struct symbols *symbols_create()
+{
+  return calloc(sizeof(struct symbols), 1);
+}
+
+void symbols_delete(struct symbols *syms)
+{
+  for (int i = 0; i < syms->count; ++i)
+    free((void *)syms->table[i].name);
+  free(syms->table);
+  free(syms);
+}
+
+void symbols_add(struct symbols *syms, int addr, const char *name)
+{
+  if (syms->count == syms->capacity)
+  {
+    syms->capacity = syms->capacity ? 2 * syms->capacity : 64;
+    syms->table = realloc(syms->table, syms->capacity * sizeof(struct symbol));
+  }
+  syms->table[syms->count].addr = addr;
+  syms->table[syms->count].name = strdup(name);
+  syms->count++;
+  syms->sorted = 0;
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+  unsigned x = ((const struct symbol *)a)->addr;
+  unsigned y = ((const struct symbol *)b)->addr;
+  return x < y ? -1 : x > y;
+}
+
+// Symbols are added in file order; sort them on first lookup by address
+static void symbols_sort(struct symbols *syms)
+{
+  if (!syms->sorted)
+  {
+    qsort(syms->table, syms->count, sizeof(struct symbol), compare_symbols);
+    syms->sorted = 1;
+  }
+}
+
+int symbols_lookup(struct symbols *syms, const char *name)
+{
+  for (int i = 0; i < syms->count; ++i)
+    if (strcmp(syms->table[i].name, name) == 0)
+      return syms->table[i].addr;
+  return -1;
+}
+
+int symbols_index(struct symbols *syms, int addr)
+{
+  symbols_sort(syms);
+  // binary search for the last symbol with address <= addr
+  int lo = 0, hi = syms->count;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (syms->table[mid].addr <= (unsigned)addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo - 1;
+}
+
+const char *symbols_find(struct symbols *syms, int addr, int *offset)
+{
+  int index = symbols_index(syms, addr);
+  if (index < 0)
+    return NULL;
+  if (offset)
+    *offset = addr - syms->table[index].addr;
+  return syms->table[index].name;
+}
+
+int symbols_count(struct symbols *syms)
+{
+  return syms->count;
+}
+
+int symbols_addr(struct symbols *syms, int index)
+{
+  symbols_sort(syms);
+  return syms->table[index].addr;
+}
+
+const char *symbols_name(struct symbols *syms, int index)
+{
+  symbols_sort(syms);
+  return syms->table[index].name;
+}
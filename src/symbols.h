@@ -0,0 +1,28 @@
+#ifndef __SYMBOLS_H__
+#define __SYMBOLS_H__
+
+// Symbol table built from the "<name>:" lines of a .dis file
+struct symbols;
+
+struct symbols *symbols_create();
+void symbols_delete(struct symbols *syms);
+
+// add a symbol at addr
+void symbols_add(struct symbols *syms, int addr, const char *name);
+
+// address of the named symbol, -1 if it isn't known
+int symbols_lookup(struct symbols *syms, const char *name);
+
+// name of the nearest symbol at or below addr, NULL if there is none.
+// If offset is not NULL it receives addr minus the symbol address.
+const char *symbols_find(struct symbols *syms, int addr, int *offset);
+
+// index (in address order) of the nearest symbol at or below addr, -1 if none
+int symbols_index(struct symbols *syms, int addr);
+
+// number of symbols and access to them in address order
+int symbols_count(struct symbols *syms);
+int symbols_addr(struct symbols *syms, int index);
+const char *symbols_name(struct symbols *syms, int index);
+
+#endif
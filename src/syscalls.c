@@ -0,0 +1,643 @@
+#include "syscalls.h"
+#include "memory.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Course system calls
+#define NR_GETCHAR 1
+#define NR_PUTCHAR 2
+#define NR_QUIT 3
+
+// Linux system call numbers (asm-generic, as used by RISC-V)
+#define NR_OPENAT 56
+#define NR_CLOSE 57
+#define NR_LSEEK 62
+#define NR_READ 63
+#define NR_WRITE 64
+#define NR_FSTAT 80
+#define NR_FSYNC 82
+#define NR_EXIT 93
+#define NR_EXIT_GROUP 94
+#define NR_CLOCK_GETTIME 113
+#define NR_BRK 214
+#define NR_CLOCK_GETTIME64 403
+
+// Guest open() flags (asm-generic values)
+#define GUEST_O_ACCMODE 03
+#define GUEST_O_CREAT 0100
+#define GUEST_O_EXCL 0200
+#define GUEST_O_TRUNC 01000
+#define GUEST_O_APPEND 02000
+#define GUEST_AT_FDCWD -100
+
+#define MAX_FDS 64
+#define MAX_PATH 1024
+
+// The stack grows down from 0x1000000 (set up by _start) with the program
+// arguments placed just above it. The heap may not grow into the top MiB.
+#define HEAP_LIMIT 0x00F00000
+
+// Guest I/O is buffered on the host side so that a guest printing a line
+// costs one copy out of simulated memory instead of one trap per byte.
+// Output is only handed to the host when the buffer fills, when the guest
+// asks for input or writes to stderr, on fsync and when the simulation ends.
+#define IO_BUFFER_SIZE 65536
+
+// A recording starts with RECORD_MAGIC and holds an entry for each input
+// system call, followed by the len bytes it wrote to guest memory at addr.
+#define RECORD_MAGIC "rv32 input 1\n"
+
+struct entry
+{
+  int64_t count;
+  int32_t nr;
+  int32_t result;
+  uint32_t addr;
+  uint32_t len;
+};
+
+struct syscalls
+{
+  struct memory *mem;
+  int root_fd; // sandbox directory, -1 when file access is disabled
+  uint32_t brk_start;
+  uint32_t brk;
+  int fds[MAX_FDS]; // guest fd -> host fd, -1 when closed
+  int exit_code;
+  char out_buffer[IO_BUFFER_SIZE];
+  int out_length;
+  char in_buffer[IO_BUFFER_SIZE];
+  int in_start;
+  int in_length;
+  FILE *record;
+  // the recording being replayed, read in full when the run starts
+  char *replay;
+  size_t replay_size;
+  size_t replay_at;
+  int replay_drift; // set once a count has been found to differ
+};
+
+struct syscalls *syscalls_create(struct memory *mem, int heap_start, const char *root)
+{
+  struct syscalls *sys = calloc(sizeof(struct syscalls), 1);
+  sys->mem = mem;
+  sys->brk_start = (heap_start + 0xfff) & ~0xfff;
+  sys->brk = sys->brk_start;
+  for (int fd = 0; fd < MAX_FDS; ++fd)
+    sys->fds[fd] = fd < 3 ? fd : -1;
+  sys->root_fd = -1;
+  if (root)
+  {
+    sys->root_fd = open(root, O_RDONLY | O_DIRECTORY);
+    if (sys->root_fd < 0)
+    {
+      error_fail("Error: could not open directory '%s'. Exiting", root);
+    }
+  }
+  return sys;
+}
+
+void syscalls_delete(struct syscalls *sys)
+{
+  syscalls_flush(sys);
+  for (int fd = 3; fd < MAX_FDS; ++fd)
+    if (sys->fds[fd] >= 0)
+      close(sys->fds[fd]);
+  if (sys->root_fd >= 0)
+    close(sys->root_fd);
+  if (sys->record)
+    fclose(sys->record);
+  free(sys->replay);
+  free(sys);
+}
+
+int syscalls_exit_code(struct syscalls *sys)
+{
+  return sys->exit_code;
+}
+
+void syscalls_flush(struct syscalls *sys)
+{
+  if (sys->out_length > 0)
+  {
+    fwrite(sys->out_buffer, 1, sys->out_length, stdout);
+    sys->out_length = 0;
+  }
+  fflush(stdout);
+}
+
+static void output_char(struct syscalls *sys, int c)
+{
+  if (sys->out_length == IO_BUFFER_SIZE)
+    syscalls_flush(sys);
+  sys->out_buffer[sys->out_length++] = c;
+}
+
+// Copies len bytes at addr to guest stdout, page by page via the buffer
+static void output_block(struct syscalls *sys, uint32_t addr, uint32_t len)
+{
+  while (len > 0)
+  {
+    if (sys->out_length == IO_BUFFER_SIZE)
+      syscalls_flush(sys);
+    uint32_t chunk = IO_BUFFER_SIZE - sys->out_length;
+    if (chunk > len)
+      chunk = len;
+    memory_rd_block(sys->mem, addr, sys->out_buffer + sys->out_length, chunk);
+    sys->out_length += chunk;
+    addr += chunk;
+    len -= chunk;
+  }
+}
+
+// Refills the input buffer from host stdin. Returns 0 at end of file.
+static int fill_input(struct syscalls *sys)
+{
+  if (sys->in_start < sys->in_length)
+    return 1;
+  syscalls_flush(sys); // make any prompt visible before blocking on input
+  ssize_t got = read(STDIN_FILENO, sys->in_buffer, IO_BUFFER_SIZE);
+  sys->in_start = 0;
+  sys->in_length = got > 0 ? got : 0;
+  return sys->in_length > 0;
+}
+
+static int input_char(struct syscalls *sys)
+{
+  if (!fill_input(sys))
+    return -1; // EOF, as getchar()
+  return (unsigned char)sys->in_buffer[sys->in_start++];
+}
+
+static int host_fd(struct syscalls *sys, uint32_t fd)
+{
+  if (fd >= MAX_FDS)
+    return -1;
+  return sys->fds[fd];
+}
+
+// read(fd, buf, count): stdin goes through the input buffer, files are read
+// straight into the backing pages
+static int32_t sys_read(struct syscalls *sys, uint32_t fd, uint32_t addr, uint32_t count)
+{
+  if (fd == 0)
+  {
+    if (count == 0 || !fill_input(sys))
+      return 0;
+    uint32_t avail = sys->in_length - sys->in_start;
+    if (count > avail)
+      count = avail;
+    memory_wr_block(sys->mem, addr, sys->in_buffer + sys->in_start, count);
+    sys->in_start += count;
+    return count;
+  }
+  int hfd = host_fd(sys, fd);
+  if (hfd < 0)
+    return -EBADF;
+  uint32_t done = 0;
+  while (done < count)
+  {
+    // at most a page, which memory_wr_span would cut it to anyway, as
+    // count - done may not fit in an int
+    int chunk = count - done < MEMORY_PAGE_SIZE ? (int)(count - done) : MEMORY_PAGE_SIZE;
+    char *dst = memory_wr_span(sys->mem, addr + done, &chunk);
+    ssize_t got = read(hfd, dst, chunk);
+    if (got < 0)
+      return done ? (int32_t)done : -errno;
+    done += got;
+    if (got < chunk)
+      break;
+  }
+  return done;
+}
+
+// write(fd, buf, count)
+static int32_t sys_write(struct syscalls *sys, uint32_t fd, uint32_t addr, uint32_t count)
+{
+  if (fd == 1)
+  {
+    output_block(sys, addr, count);
+    return count;
+  }
+  int hfd = host_fd(sys, fd);
+  if (hfd < 0)
+    return -EBADF;
+  if (fd == 2)
+    syscalls_flush(sys); // keep stdout and stderr in program order
+  uint32_t done = 0;
+  while (done < count)
+  {
+    int chunk = count - done < MEMORY_PAGE_SIZE ? (int)(count - done) : MEMORY_PAGE_SIZE;
+    char *src = memory_span(sys->mem, addr + done, &chunk);
+    ssize_t put = write(hfd, src, chunk);
+    if (put < 0)
+      return done ? (int32_t)done : -errno;
+    done += put;
+  }
+  return done;
+}
+
+// Copies a zero terminated guest string, returns 0 if it does not fit
+static int read_string(struct syscalls *sys, uint32_t addr, char *buf, int size)
+{
+  for (int i = 0; i < size; ++i)
+  {
+    buf[i] = memory_rd_b(sys->mem, addr + i);
+    if (buf[i] == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// Opens rel below dir_fd one component at a time, so that a symbolic link
+// is refused wherever it is in the path and can't lead out of the sandbox.
+// Returns the host descriptor, or -errno.
+static int open_beneath(int dir_fd, char *rel, int flags, int mode)
+{
+  int dir = dir_fd;
+  for (;;)
+  {
+    char *end = strchr(rel, '/');
+    char *next = end;
+    while (next && *next == '/')
+      ++next;
+    if (end)
+      *end = 0;
+    int fd;
+    if (!end || *next == 0)
+      fd = openat(dir, rel, flags | (end ? O_DIRECTORY : 0), mode);
+    else
+      fd = openat(dir, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    int err = errno;
+    if (dir != dir_fd)
+      close(dir);
+    if (fd < 0)
+      return -err;
+    if (!end || *next == 0)
+      return fd;
+    dir = fd;
+    rel = next;
+  }
+}
+
+// Guest paths are resolved below the sandbox directory. Absolute paths are
+// taken relative to it, and ".." components and symbolic links are refused.
+static int32_t sys_openat(struct syscalls *sys, int32_t dirfd, uint32_t path_addr, uint32_t flags, uint32_t mode)
+{
+  char path[MAX_PATH];
+  if (sys->root_fd < 0)
+    return -EACCES;
+  if (dirfd != GUEST_AT_FDCWD)
+    return -EBADF;
+  if (!read_string(sys, path_addr, path, MAX_PATH))
+    return -ENAMETOOLONG;
+  char *rel = path;
+  while (*rel == '/')
+    ++rel;
+  if (*rel == 0)
+    rel = ".";
+  for (const char *p = rel; *p; )
+  {
+    const char *end = strchr(p, '/');
+    int len = end ? end - p : (int)strlen(p);
+    if (len == 2 && p[0] == '.' && p[1] == '.')
+      return -EACCES;
+    p += len;
+    while (*p == '/')
+      ++p;
+  }
+  int guest_fd = 3;
+  while (guest_fd < MAX_FDS && sys->fds[guest_fd] >= 0)
+    ++guest_fd;
+  if (guest_fd == MAX_FDS)
+    return -EMFILE;
+  int host_flags = O_NOFOLLOW;
+  switch (flags & GUEST_O_ACCMODE)
+  {
+  case 0:
+    host_flags |= O_RDONLY;
+    break;
+  case 1:
+    host_flags |= O_WRONLY;
+    break;
+  default:
+    host_flags |= O_RDWR;
+    break;
+  }
+  if (flags & GUEST_O_CREAT)
+    host_flags |= O_CREAT;
+  if (flags & GUEST_O_EXCL)
+    host_flags |= O_EXCL;
+  if (flags & GUEST_O_TRUNC)
+    host_flags |= O_TRUNC;
+  if (flags & GUEST_O_APPEND)
+    host_flags |= O_APPEND;
+  int hfd = open_beneath(sys->root_fd, rel, host_flags, mode & 0777);
+  if (hfd < 0)
+    return hfd;
+  sys->fds[guest_fd] = hfd;
+  return guest_fd;
+}
+
+static int32_t sys_close(struct syscalls *sys, uint32_t fd)
+{
+  int hfd = host_fd(sys, fd);
+  if (hfd < 0)
+    return -EBADF;
+  if (fd < 3)
+    return 0; // the simulator keeps its own standard streams
+  sys->fds[fd] = -1;
+  return close(hfd) < 0 ? -errno : 0;
+}
+
+// lseek(fd, offset, whence) as used by newlib on 32 bit targets
+static int32_t sys_lseek(struct syscalls *sys, uint32_t fd, int32_t offset, uint32_t whence)
+{
+  int hfd = host_fd(sys, fd);
+  if (hfd < 0)
+    return -EBADF;
+  if (whence > 2)
+    return -EINVAL;
+  off_t pos = lseek(hfd, offset, whence); // SEEK_SET/CUR/END are 0/1/2
+  if (pos < 0)
+    return -errno;
+  if (pos > INT32_MAX)
+    return -EOVERFLOW;
+  return pos;
+}
+
+static void put_u32(struct syscalls *sys, uint32_t addr, uint32_t value)
+{
+  memory_wr_w(sys->mem, addr, value);
+}
+
+static void put_u64(struct syscalls *sys, uint32_t addr, uint64_t value)
+{
+  memory_wr_w(sys->mem, addr, (uint32_t)value);
+  memory_wr_w(sys->mem, addr + 4, (uint32_t)(value >> 32));
+}
+
+// fstat(fd, buf) filling in the asm-generic struct stat (128 bytes)
+static int32_t sys_fstat(struct syscalls *sys, uint32_t fd, uint32_t addr)
+{
+  int hfd = host_fd(sys, fd);
+  if (hfd < 0)
+    return -EBADF;
+  if (addr & 3)
+    return -EFAULT;
+  struct stat st;
+  if (fstat(hfd, &st) < 0)
+    return -errno;
+  char zero[128] = {0};
+  memory_wr_block(sys->mem, addr, zero, sizeof(zero));
+  put_u64(sys, addr + 0, st.st_dev);
+  put_u64(sys, addr + 8, st.st_ino);
+  put_u32(sys, addr + 16, st.st_mode);
+  put_u32(sys, addr + 20, st.st_nlink);
+  put_u32(sys, addr + 24, st.st_uid);
+  put_u32(sys, addr + 28, st.st_gid);
+  put_u64(sys, addr + 32, st.st_rdev);
+  put_u64(sys, addr + 48, st.st_size);
+  put_u32(sys, addr + 56, st.st_blksize);
+  put_u64(sys, addr + 64, st.st_blocks);
+  put_u64(sys, addr + 72, st.st_atim.tv_sec);
+  put_u32(sys, addr + 80, st.st_atim.tv_nsec);
+  put_u64(sys, addr + 88, st.st_mtim.tv_sec);
+  put_u32(sys, addr + 96, st.st_mtim.tv_nsec);
+  put_u64(sys, addr + 104, st.st_ctim.tv_sec);
+  put_u32(sys, addr + 112, st.st_ctim.tv_nsec);
+  return 0;
+}
+
+// clock_gettime(clock, tp); time64 selects the 64 bit tv_sec layout
+static int32_t sys_clock_gettime(struct syscalls *sys, uint32_t clock, uint32_t addr, int time64)
+{
+  struct timespec ts;
+  if (addr & 3)
+    return -EFAULT;
+  if (clock_gettime(clock, &ts) < 0)
+    return -errno;
+  if (time64)
+  {
+    put_u64(sys, addr, ts.tv_sec);
+    put_u32(sys, addr + 8, ts.tv_nsec);
+    put_u32(sys, addr + 12, 0);
+  }
+  else
+  {
+    put_u32(sys, addr, ts.tv_sec);
+    put_u32(sys, addr + 4, ts.tv_nsec);
+  }
+  return 0;
+}
+
+// brk(addr): returns the new break, or the old one if addr can't be used.
+// Memory exposed by growing the break reads as zero, as on Linux, and the
+// pages above a lowered break are given back.
+static uint32_t sys_brk(struct syscalls *sys, uint32_t addr)
+{
+  if (addr < sys->brk_start || addr > HEAP_LIMIT)
+    return sys->brk;
+  if (addr < sys->brk)
+    memory_release(sys->mem, addr, sys->brk - addr);
+  // pages that aren't there yet read as zero already, and are left out
+  for (uint32_t from = sys->brk; from < addr;)
+  {
+    int chunk = MEMORY_PAGE_SIZE - (from & (MEMORY_PAGE_SIZE - 1));
+    if (chunk > (int)(addr - from))
+      chunk = addr - from;
+    if (memory_find_page(sys->mem, from))
+      memset(memory_wr_span(sys->mem, from, &chunk), 0, chunk);
+    from += chunk;
+  }
+  sys->brk = addr;
+  return sys->brk;
+}
+
+void syscalls_record(struct syscalls *sys, const char *file)
+{
+  sys->record = fopen(file, "wb");
+  if (sys->record == NULL)
+  {
+    error_fail("Error: could not create recording '%s'. Exiting", file);
+  }
+  fputs(RECORD_MAGIC, sys->record);
+}
+
+void syscalls_replay(struct syscalls *sys, const char *file)
+{
+  FILE *fp = fopen(file, "rb");
+  if (fp == NULL)
+  {
+    error_fail("Error: could not open recording '%s'. Exiting", file);
+  }
+  fseek(fp, 0, SEEK_END);
+  sys->replay_size = ftell(fp);
+  rewind(fp);
+  sys->replay = malloc(sys->replay_size + 1);
+  size_t got = fread(sys->replay, 1, sys->replay_size, fp);
+  fclose(fp);
+  size_t magic = strlen(RECORD_MAGIC);
+  if (got != sys->replay_size || got < magic || memcmp(sys->replay, RECORD_MAGIC, magic))
+  {
+    error_fail("Error: '%s' is not a recording. Exiting", file);
+  }
+  sys->replay_at = magic;
+}
+
+// The system calls whose result depends on more than the program
+static int is_input(uint32_t nr, uint32_t a0)
+{
+  switch (nr)
+  {
+  case NR_GETCHAR:
+  case NR_CLOCK_GETTIME:
+  case NR_CLOCK_GETTIME64:
+    return 1;
+  case NR_READ:
+    return a0 == 0;
+  case NR_FSTAT:
+    return a0 < 3;
+  default:
+    return 0;
+  }
+}
+
+// guest memory written by an input system call that returned result
+static uint32_t input_length(uint32_t nr, int32_t result)
+{
+  if (nr == NR_READ)
+    return result > 0 ? result : 0;
+  if (result != 0)
+    return 0;
+  if (nr == NR_FSTAT)
+    return 128;
+  if (nr == NR_CLOCK_GETTIME64)
+    return 16;
+  if (nr == NR_CLOCK_GETTIME)
+    return 8;
+  return 0;
+}
+
+static void record_input(struct syscalls *sys, long int count, uint32_t nr, int32_t result, uint32_t addr)
+{
+  struct entry e = {count, nr, result, addr, input_length(nr, result)};
+  fwrite(&e, sizeof(e), 1, sys->record);
+  for (uint32_t done = 0; done < e.len;)
+  {
+    int chunk = e.len - done;
+    fwrite(memory_span(sys->mem, addr + done, &chunk), 1, chunk, sys->record);
+    done += chunk;
+  }
+}
+
+// Gives the guest the next recorded result, which must be for the same
+// system call. The counts only differ if the run does, e.g. with -hle.
+static int32_t replay_input(struct syscalls *sys, long int count, uint32_t nr, uint32_t addr)
+{
+  struct entry e;
+  if (sys->replay_at + sizeof(e) > sys->replay_size)
+  {
+    error_fail("Replay: the program asks for more input than was recorded, at instruction %ld", count);
+  }
+  memcpy(&e, sys->replay + sys->replay_at, sizeof(e));
+  sys->replay_at += sizeof(e);
+  if ((uint32_t)e.nr != nr || sys->replay_at + e.len > sys->replay_size)
+  {
+    error_fail("Replay: system call %d at instruction %ld, but %d was recorded at %ld", nr, count, e.nr, (long int)e.count);
+  }
+  if (e.count != count && !sys->replay_drift)
+  {
+    fprintf(stderr, "Replay: input recorded at instruction %ld is asked for at %ld\n", (long int)e.count, count);
+    sys->replay_drift = 1;
+  }
+  memory_wr_block(sys->mem, addr, sys->replay + sys->replay_at, e.len);
+  sys->replay_at += e.len;
+  return e.result;
+}
+
+static int perform(struct syscalls *sys, uint32_t *regs)
+{
+  uint32_t a0 = regs[10], a1 = regs[11], a2 = regs[12], a3 = regs[13];
+  int32_t result = 0;
+  switch (regs[17])
+  {
+  case NR_GETCHAR:
+    result = input_char(sys);
+    break;
+  case NR_PUTCHAR:
+    output_char(sys, a0);
+    return SYSCALL_CONTINUE; // a0 is left untouched
+  case NR_QUIT:
+  case NR_EXIT:
+  case NR_EXIT_GROUP:
+    sys->exit_code = regs[17] == NR_QUIT ? 0 : (int32_t)a0;
+    syscalls_flush(sys);
+    return SYSCALL_EXIT;
+  case NR_READ:
+    result = sys_read(sys, a0, a1, a2);
+    break;
+  case NR_WRITE:
+    result = sys_write(sys, a0, a1, a2);
+    break;
+  case NR_FSYNC:
+    if (host_fd(sys, a0) < 0)
+      result = -EBADF;
+    else if (a0 < 3)
+      syscalls_flush(sys);
+    else if (fsync(host_fd(sys, a0)) < 0)
+      result = -errno;
+    break;
+  case NR_OPENAT:
+    result = sys_openat(sys, a0, a1, a2, a3);
+    break;
+  case NR_CLOSE:
+    result = sys_close(sys, a0);
+    break;
+  case NR_LSEEK:
+    result = sys_lseek(sys, a0, a1, a2);
+    break;
+  case NR_FSTAT:
+    result = sys_fstat(sys, a0, a1);
+    break;
+  case NR_CLOCK_GETTIME:
+    result = sys_clock_gettime(sys, a0, a1, 0);
+    break;
+  case NR_CLOCK_GETTIME64:
+    result = sys_clock_gettime(sys, a0, a1, 1);
+    break;
+  case NR_BRK:
+    result = sys_brk(sys, a0);
+    break;
+  default:
+    syscalls_flush(sys);
+    fprintf(stderr, "Unsupported system call A7 = %d\n", regs[17]);
+    result = -ENOSYS;
+    break;
+  }
+  regs[10] = result;
+  return SYSCALL_CONTINUE;
+}
+
+int syscalls_handle(struct syscalls *sys, uint32_t *regs, long int count)
+{
+  uint32_t nr = regs[17], buffer = regs[11];
+  if (!(sys->record || sys->replay) || !is_input(nr, regs[10]))
+    return perform(sys, regs);
+  // getchar has no buffer, the others write theirs at a1
+  if (sys->replay)
+    regs[10] = replay_input(sys, count, nr, buffer);
+  else
+  {
+    perform(sys, regs);
+    record_input(sys, count, nr, regs[10], buffer);
+  }
+  return SYSCALL_CONTINUE;
+}
@@ -0,0 +1,39 @@
+#ifndef __SYSCALLS_H__
+#define __SYSCALLS_H__
+
+#include "memory.h"
+#include <stdint.h>
+
+// Emulation of the ecall interface: the four course system calls plus the
+// Linux/newlib subset needed by programs built with a standard toolchain.
+// Number in a7, arguments in a0-a5, result (or -errno) in a0.
+struct syscalls;
+
+// heap_start is the initial program break, root the host directory guest
+// files are confined to (NULL disables file access)
+struct syscalls *syscalls_create(struct memory *mem, int heap_start, const char *root);
+void syscalls_delete(struct syscalls *sys);
+
+#define SYSCALL_CONTINUE 0
+#define SYSCALL_EXIT 1
+#define SYSCALL_DEFAULT 2 // from a hook in front of syscalls_handle: not handled there
+
+// perform the system call requested by the register file, return SYSCALL_EXIT
+// when the guest has asked to terminate. count is the number of instructions
+// executed so far, kept with recorded input.
+int syscalls_handle(struct syscalls *sys, uint32_t *regs, long int count);
+
+// Input that differs from run to run - stdin, the clock and the status of the
+// standard streams - is written to file with the instruction count it was
+// asked for at, or read back from there instead of from the host, so a
+// replayed run is the same as the recorded one.
+void syscalls_record(struct syscalls *sys, const char *file);
+void syscalls_replay(struct syscalls *sys, const char *file);
+
+// exit status given by the guest
+int syscalls_exit_code(struct syscalls *sys);
+
+// hand buffered guest output to the host
+void syscalls_flush(struct syscalls *sys);
+
+#endif
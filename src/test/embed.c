@@ -0,0 +1,137 @@
+#include "../libsim.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fenv.h>
+
+// Tests of the library interface, on a small program given as a buffer:
+// a0 = 42, then the exit system call
+
+static const char program[] =
+    "00010000 <_start>:\n"
+    "   10000:\t02a00513          \tli\ta0,42\n"
+    "   10004:\t05d00893          \tli\ta7,93\n"
+    "   10008:\t00000073          \tecall\n";
+
+// frm = round towards zero, f3 = 0.0 / 0.0, then exit with fflags
+static const char fp_program[] =
+    "00010000 <_start>:\n"
+    "   10000:\t0020d073          \tcsrwi\tfrm,1\n"
+    "   10004:\td00070d3          \tfcvt.s.w\tft1,zero\n"
+    "   10008:\t1810f1d3          \tfdiv.s\tft3,ft1,ft1\n"
+    "   1000c:\t00102573          \tfrflags\ta0\n"
+    "   10010:\t05d00893          \tli\ta7,93\n"
+    "   10014:\t00000073          \tecall\n";
+
+static int failures = 0;
+static int checks = 0;
+
+static void check(int ok, const char *what) {
+    checks++;
+    if (!ok) {
+        printf("FAIL %s\n", what);
+        failures++;
+    }
+}
+
+// ends the program with a0 + 1
+static int exit_plus_one(void *user, struct libsim *sim, uint32_t *regs) {
+    (void)sim;
+    ++*(int *)user;
+    regs[10] += 1;
+    return LIBSIM_SYSCALL_EXIT;
+}
+
+// guests loaded and run in threads of their own at the same time
+#define THREADS 4
+static void *run_guests(void *arg) {
+    int *ok = arg;
+    for (int i = 0; i < 50; ++i) {
+        struct libsim *sim = libsim_create(NULL);
+        *ok &= libsim_load_buffer(sim, program, strlen(program)) == LIBSIM_OK &&
+               libsim_run(sim, 0, NULL) == LIBSIM_EXITED && libsim_exit_code(sim) == 42;
+        libsim_delete(sim);
+    }
+    return NULL;
+}
+
+int main() {
+    struct libsim *sim = libsim_create(NULL);
+    uint32_t value;
+    long executed;
+    check(libsim_run(sim, 0, NULL) == LIBSIM_ERROR_STATE, "run before load");
+    check(libsim_load_file(sim, "no such file") == LIBSIM_ERROR_LOAD, "load missing file");
+    check(libsim_load_buffer(sim, "no program\n", 11) == LIBSIM_ERROR_LOAD, "load without _start");
+
+    check(libsim_load_buffer(sim, program, strlen(program)) == LIBSIM_OK, "load buffer");
+    check(libsim_get_pc(sim) == 0x10000, "pc at _start");
+    check(libsim_step(sim) == LIBSIM_OK && libsim_get_pc(sim) == 0x10004, "step");
+    check(libsim_get_reg(sim, 10, &value) == LIBSIM_OK && value == 42, "register after step");
+    check(libsim_get_reg(sim, 32, &value) == LIBSIM_ERROR_ARG, "no register 32");
+    check(libsim_run(sim, 0, &executed) == LIBSIM_EXITED && executed == 2, "run to exit");
+    check(libsim_exit_code(sim) == 42, "exit code");
+    check(libsim_step(sim) == LIBSIM_ERROR_STATE, "step after exit");
+
+    // a reload starts over, and the registers can be changed in between
+    int calls = 0;
+    libsim_set_syscall(sim, exit_plus_one, &calls);
+    check(libsim_load_buffer(sim, program, strlen(program)) == LIBSIM_OK, "reload");
+    check(libsim_run(sim, 2, &executed) == LIBSIM_OK && executed == 2, "run limited");
+    libsim_set_reg(sim, 10, 7);
+    check(libsim_run(sim, 0, NULL) == LIBSIM_EXITED && calls == 1, "syscall hook");
+    check(libsim_exit_code(sim) == 8, "exit code from hook");
+
+    // lw a0, 1(x0) is unaligned, which stops the run with an error
+    uint32_t unaligned = 0x00102503;
+    check(libsim_load_buffer(sim, program, strlen(program)) == LIBSIM_OK, "reload again");
+    libsim_write_mem(sim, 0x20000, &unaligned, 4);
+    libsim_read_mem(sim, 0x20000, &value, 4);
+    check(value == unaligned, "memory written");
+    libsim_set_pc(sim, 0x20000);
+    check(libsim_run(sim, 0, NULL) == LIBSIM_ERROR_FAULT, "fault");
+    check(strstr(libsim_error(sim), "Unaligned") != NULL, "fault message");
+    check(libsim_run(sim, 0, NULL) == LIBSIM_ERROR_STATE, "run after a fault");
+
+    // the program's page, its table and its decoded instructions fit in
+    // 64 KiB, another 4 MiB of the address space needs a table more
+    size_t committed, after, peak;
+    libsim_set_memory_limit(sim, 64 * 1024);
+    check(libsim_load_buffer(sim, program, strlen(program)) == LIBSIM_OK, "load within the limit");
+    libsim_memory_usage(sim, &committed, &peak);
+    check(committed > 0 && committed <= 32 * 1024 && peak == committed, "memory usage");
+    check(libsim_run(sim, 0, NULL) == LIBSIM_EXITED, "run within the limit");
+    libsim_memory_usage(sim, &after, &peak);
+    check(after > committed + 32 * 1024 && after <= 64 * 1024, "decoded instructions counted");
+    check(libsim_write_mem(sim, 0x800000, &value, 4) == LIBSIM_ERROR_FAULT, "write past the limit");
+    check(strstr(libsim_error(sim), "Out of memory") != NULL, "limit message");
+    libsim_set_memory_limit(sim, 4096);
+    check(libsim_load_buffer(sim, program, strlen(program)) == LIBSIM_ERROR_LOAD, "load past the limit");
+
+    // the guest and the application keep their floating point environments
+    libsim_set_memory_limit(sim, 0);
+    libsim_set_syscall(sim, NULL, NULL);
+    fesetround(FE_UPWARD);
+    feraiseexcept(FE_DIVBYZERO);
+    check(libsim_load_buffer(sim, fp_program, strlen(fp_program)) == LIBSIM_OK, "load fp program");
+    check(libsim_run(sim, 0, NULL) == LIBSIM_EXITED && libsim_exit_code(sim) == 0x10, "guest fflags");
+    check(fegetround() == FE_UPWARD && fetestexcept(FE_ALL_EXCEPT) == FE_DIVBYZERO, "host environment");
+    fesetround(FE_TONEAREST);
+    feclearexcept(FE_ALL_EXCEPT);
+    libsim_delete(sim);
+
+    pthread_t threads[THREADS];
+    int ok[THREADS];
+    for (int i = 0; i < THREADS; ++i) {
+        ok[i] = 1;
+        pthread_create(&threads[i], NULL, run_guests, &ok[i]);
+    }
+    int all_ok = 1;
+    for (int i = 0; i < THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+        all_ok &= ok[i];
+    }
+    check(all_ok, "guests in several threads");
+
+    printf("%d of %d library tests passed\n", checks - failures, checks);
+    return failures != 0;
+}
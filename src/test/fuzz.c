@@ -0,0 +1,750 @@
+#include "../memory.h"
+#include "../simulate.h"
+#include "../disasm.h"
+#include "../error.h"
+#include "../isa.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+
+// Randomized differential tests of the simulator core. Blocks of random
+// RV32IM instructions are run from random registers by the simulator and by
+// the reference model below, which is written from the spec and shares
+// nothing with the simulator but the instruction table used to generate
+// them, and the registers, pc and memory are compared afterwards. A block
+// where they differ is shrunk to as few instructions and as plain operands
+// as still differ, and printed.
+//
+//   ./fuzz [instructions [seed]]
+
+extern __thread uint32_t registers[32];
+
+#define CODE 0x10000 // the blocks take turns in these 64 KiB
+#define CODE_SIZE 0x10000
+#define SLOT_WORDS 32 // a block, then ecalls up to here that its jumps land on
+#define MAX_BLOCK 16
+#define DATA 0x100000 // loads and stores stay in here
+#define DATA_SIZE 0x4000
+#define BASE (DATA + DATA_SIZE / 2) // what sp and s0 point around
+#define ECALL 0x00000073
+#define SP 2
+#define S0 8
+
+// A test: the code and where it is, the registers it starts from, and
+// which loop of the simulator runs it
+struct block {
+    uint32_t slot;
+    int n;
+    uint32_t code[MAX_BLOCK];
+    uint32_t x[32];
+    int observed; // the loop that checks the limit at every instruction
+};
+
+// ---- the reference model ----
+
+enum { REF_OK, REF_FAULT, REF_INVALID };
+
+struct reference {
+    uint32_t x[32];
+    uint32_t pc;
+    uint8_t *data; // DATA_SIZE bytes from DATA
+    long int executed;
+    // the stores of the block, to undo them
+    struct {
+        uint32_t offset, size, old;
+    } undo[MAX_BLOCK];
+    int stores;
+    uint32_t loads[MAX_BLOCK]; // where the block loaded from, to show them
+    int num_loads;
+};
+
+static uint32_t sign_extend(uint32_t value, int bits) {
+    return (uint32_t)((int32_t)(value << (32 - bits)) >> (32 - bits));
+}
+
+static uint32_t load(const uint8_t *p, int size) {
+    uint32_t value = 0;
+    for (int i = size - 1; i >= 0; --i) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+static void store(uint8_t *p, int size, uint32_t value) {
+    for (int i = 0; i < size; ++i) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+// Executes one instruction. An access outside the data, or an instruction
+// the generator doesn't make, is REF_INVALID: the test itself is broken.
+static int ref_step(struct reference *r, uint32_t w) {
+    uint32_t opcode = w & 0x7F, rd = (w >> 7) & 31, funct3 = (w >> 12) & 7, funct7 = w >> 25;
+    uint32_t a = r->x[(w >> 15) & 31], b = r->x[(w >> 20) & 31];
+    uint32_t imm_i = sign_extend(w >> 20, 12);
+    uint32_t imm_s = sign_extend((w >> 25) << 5 | ((w >> 7) & 31), 12);
+    uint32_t imm_b = sign_extend((w >> 31) << 12 | ((w >> 7) & 1) << 11 | ((w >> 25) & 0x3F) << 5 | ((w >> 8) & 0xF) << 1, 13);
+    uint32_t imm_j = sign_extend((w >> 31) << 20 | ((w >> 12) & 0xFF) << 12 | ((w >> 20) & 1) << 11 | ((w >> 21) & 0x3FF) << 1, 21);
+    uint32_t next = r->pc + 4, result = 0;
+    int writes = 1;
+    switch (opcode) {
+        case 0x37: // lui
+            result = w & 0xFFFFF000;
+            break;
+        case 0x17: // auipc
+            result = r->pc + (w & 0xFFFFF000);
+            break;
+        case 0x6F: // jal
+            result = next;
+            next = r->pc + imm_j;
+            break;
+        case 0x67: // jalr
+            result = next;
+            next = (a + imm_i) & ~1U;
+            break;
+        case 0x63: { // branches
+            int taken;
+            switch (funct3) {
+                case 0: taken = a == b; break;
+                case 1: taken = a != b; break;
+                case 4: taken = (int32_t)a < (int32_t)b; break;
+                case 5: taken = (int32_t)a >= (int32_t)b; break;
+                case 6: taken = a < b; break;
+                case 7: taken = a >= b; break;
+                default: return REF_INVALID;
+            }
+            if (taken) {
+                next = r->pc + imm_b;
+            }
+            writes = 0;
+            break;
+        }
+        case 0x03: { // loads: lb lh lw lbu lhu
+            int size = 1 << (funct3 & 3);
+            uint32_t offset = a + imm_i - DATA;
+            if (funct3 == 3 || funct3 > 5 || offset > (uint32_t)(DATA_SIZE - size)) {
+                return REF_INVALID;
+            }
+            if (offset & (size - 1)) {
+                return REF_FAULT;
+            }
+            r->loads[r->num_loads++] = offset;
+            result = load(r->data + offset, size);
+            if (funct3 < 4 && size < 4) {
+                result = sign_extend(result, 8 * size);
+            }
+            break;
+        }
+        case 0x23: { // stores: sb sh sw
+            int size = 1 << funct3;
+            uint32_t offset = a + imm_s - DATA;
+            if (funct3 > 2 || offset > (uint32_t)(DATA_SIZE - size)) {
+                return REF_INVALID;
+            }
+            if (offset & (size - 1)) {
+                return REF_FAULT;
+            }
+            r->undo[r->stores].offset = offset;
+            r->undo[r->stores].size = size;
+            r->undo[r->stores].old = load(r->data + offset, size);
+            r->stores++;
+            store(r->data + offset, size, b);
+            writes = 0;
+            break;
+        }
+        case 0x13: // register-immediate
+        case 0x33: // register-register
+            if (opcode == 0x13) {
+                b = imm_i;
+                // only the shifts have a funct7, the others have the immediate there
+                if ((funct3 == 1 && funct7 != 0) || (funct3 == 5 && funct7 != 0 && funct7 != 0x20)) {
+                    return REF_INVALID;
+                }
+                if (funct3 != 1 && funct3 != 5) {
+                    funct7 = 0;
+                }
+            } else if (funct7 == 0x01) {
+                int64_t sa = (int32_t)a, sb = (int32_t)b;
+                switch (funct3) {
+                    case 0: result = (uint32_t)(sa * sb); break;
+                    case 1: result = (uint32_t)((sa * sb) >> 32); break;
+                    case 2: result = (uint32_t)((sa * (int64_t)(uint64_t)b) >> 32); break;
+                    case 3: result = (uint32_t)(((uint64_t)a * b) >> 32); break;
+                    // -2^31 / -1 is 2^31 in 64 bits, which is -2^31 again in 32
+                    case 4: result = b == 0 ? 0xFFFFFFFF : (uint32_t)(sa / sb); break;
+                    case 5: result = b == 0 ? 0xFFFFFFFF : a / b; break;
+                    case 6: result = b == 0 ? a : (uint32_t)(sa % sb); break;
+                    case 7: result = b == 0 ? a : a % b; break;
+                }
+                break;
+            } else if (funct7 != 0 && !(funct7 == 0x20 && (funct3 == 0 || funct3 == 5))) {
+                return REF_INVALID;
+            }
+            switch (funct3) {
+                case 0: result = opcode == 0x33 && funct7 ? a - b : a + b; break;
+                case 1: result = a << (b & 31); break;
+                case 2: result = (int32_t)a < (int32_t)b; break;
+                case 3: result = a < b; break;
+                case 4: result = a ^ b; break;
+                case 5: result = funct7 ? (uint32_t)((int32_t)a >> (b & 31)) : a >> (b & 31); break;
+                case 6: result = a | b; break;
+                case 7: result = a & b; break;
+            }
+            break;
+        case 0x0F: // fence
+            writes = 0;
+            break;
+        default:
+            return REF_INVALID;
+    }
+    if (writes && rd != 0) {
+        r->x[rd] = result;
+    }
+    r->pc = next;
+    r->executed++;
+    return REF_OK;
+}
+
+// Runs the block until it leaves it, which must be for one of the ecalls
+// after it
+static int ref_run(struct reference *r, const struct block *b) {
+    memcpy(r->x, b->x, sizeof(r->x));
+    r->x[0] = 0;
+    r->pc = b->slot;
+    r->executed = 0;
+    r->stores = 0;
+    r->num_loads = 0;
+    while (r->pc - b->slot < 4 * (uint32_t)b->n && r->executed < b->n) {
+        if (r->pc & 3) {
+            return REF_INVALID;
+        }
+        int result = ref_step(r, b->code[(r->pc - b->slot) / 4]);
+        if (result != REF_OK) {
+            return result;
+        }
+    }
+    if (r->pc - b->slot < 4 * (uint32_t)b->n || r->pc - b->slot >= 4 * SLOT_WORDS || (r->pc & 3)) {
+        return REF_INVALID;
+    }
+    return REF_OK;
+}
+
+static void ref_undo(struct reference *r) {
+    while (r->stores > 0) {
+        r->stores--;
+        store(r->data + r->undo[r->stores].offset, r->undo[r->stores].size, r->undo[r->stores].old);
+    }
+}
+
+// ---- the simulator ----
+
+struct outcome {
+    uint32_t x[32];
+    uint32_t pc;
+    char fault[256]; // the error that stopped it
+};
+
+static int stop_at_ecall(void *ctx, uint32_t *regs) {
+    (void)ctx;
+    (void)regs;
+    return SYSCALL_EXIT;
+}
+
+// the memory's code hook keeps pointing at it between the runs
+static struct simulation sim;
+
+static void sim_run(struct memory *mem, const struct block *b, struct outcome *out) {
+    for (int i = 0; i < SLOT_WORDS; ++i) {
+        uint32_t word = i < b->n ? b->code[i] : ECALL;
+        // code that is already there needn't be decoded again
+        if ((uint32_t)memory_rd_w(mem, b->slot + 4 * i) != word) {
+            memory_wr_w(mem, b->slot + 4 * i, word);
+        }
+    }
+    memory_clean(mem);
+    sim.syscall_hook = stop_at_ecall;
+    // a block that runs away is stopped too, in the fast loop at a jump
+    sim.limit = 4 * SLOT_WORDS;
+    sim.limit_at_jumps = !b->observed;
+    memcpy(registers, b->x, sizeof(registers));
+    registers[0] = 0;
+    out->pc = b->slot;
+    out->fault[0] = 0;
+    jmp_buf trap;
+    error_trap(&trap);
+    if (setjmp(trap)) {
+        snprintf(out->fault, sizeof(out->fault), "%s", error_message());
+    } else {
+        simulate_run(mem, &sim, &out->pc);
+    }
+    error_trap(NULL);
+    memcpy(out->x, registers, sizeof(out->x));
+}
+
+static const uint8_t *data_page(struct memory *mem, int page) {
+    static const uint8_t zero[MEMORY_PAGE_SIZE];
+    const uint8_t *p = (const uint8_t *)memory_find_page(mem, page << MEMORY_PAGE_BITS);
+    return p ? p : zero;
+}
+
+// whether the pages the simulator stored to, and the ones the reference
+// stored to, hold the same
+static int memory_differs(struct memory *mem, const struct reference *r) {
+    const int *pages;
+    int count = memory_dirty_pages(mem, &pages);
+    for (int i = 0; i < count; ++i) {
+        uint32_t offset = ((uint32_t)pages[i] << MEMORY_PAGE_BITS) - DATA;
+        if (offset >= DATA_SIZE || memcmp(data_page(mem, pages[i]), r->data + offset, MEMORY_PAGE_SIZE)) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < r->stores; ++i) {
+        uint32_t offset = r->undo[i].offset & ~(MEMORY_PAGE_SIZE - 1);
+        if (memcmp(data_page(mem, (DATA + offset) >> MEMORY_PAGE_BITS), r->data + offset, MEMORY_PAGE_SIZE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Only a fault is compared when there is one, as the fast loop doesn't
+// leave the registers exact where it stopped
+static int differs(struct memory *mem, int status, const struct reference *r, const struct outcome *out) {
+    if ((status == REF_FAULT) != (out->fault[0] != 0)) {
+        return 1;
+    }
+    if (status == REF_FAULT) {
+        return 0;
+    }
+    return out->pc != r->pc || memcmp(out->x, r->x, sizeof(out->x)) || memory_differs(mem, r);
+}
+
+static void set_data(struct memory *mem, uint8_t *ref_data, const uint8_t *data) {
+    memcpy(ref_data, data, DATA_SIZE);
+    for (int offset = 0; offset < DATA_SIZE; offset += MEMORY_PAGE_SIZE) {
+        int len = MEMORY_PAGE_SIZE;
+        memcpy(memory_wr_span(mem, DATA + offset, &len), data + offset, len);
+    }
+}
+
+// the simulator gets the pages it stored to from the reference again
+static void resync_data(struct memory *mem, const uint8_t *ref_data) {
+    const int *pages;
+    int count = memory_dirty_pages(mem, &pages);
+    for (int i = 0; i < count; ++i) {
+        uint32_t offset = ((uint32_t)pages[i] << MEMORY_PAGE_BITS) - DATA;
+        int len = MEMORY_PAGE_SIZE;
+        if (offset < DATA_SIZE) {
+            memcpy(memory_wr_span(mem, DATA + offset, &len), ref_data + offset, len);
+        }
+    }
+}
+
+// ---- generating the tests ----
+
+static uint64_t rng_state;
+
+// xorshift64*
+static uint32_t rng() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+static uint32_t pick(uint32_t n) {
+    return rng() % n;
+}
+
+struct kind {
+    const char *name;
+    uint32_t mask, match;
+    enum isa_format format;
+};
+
+#define KIND(op, name, mask, match, format, ...) {name, mask, match, ISA_##format},
+static const struct kind kinds[] = {ISA_RV32IM(KIND, KIND, KIND)};
+#define NUM_KINDS (int)(sizeof(kinds) / sizeof(kinds[0]))
+
+static const uint32_t values[] = {0, 1, 2, 31, 32, 0x7F, 0x80, 0xFF, 0x7FFF, 0x8000, 0xFFFF, 0x7FFFFFFF, 0x80000000,
+                                  0x80000001, 0xFFFF8000, 0xFFFFFF80, 0xFFFFFFFE, 0xFFFFFFFF};
+#define NUM_VALUES (sizeof(values) / sizeof(values[0]))
+
+// Half of the operands are the edges where sign extension, overflow and
+// shifts go wrong
+static uint32_t value() {
+    return pick(2) ? values[pick(NUM_VALUES)] : pick(4) ? rng() : pick(64) - 32;
+}
+
+static uint32_t rd_field(uint32_t rd) {
+    return rd << 7;
+}
+
+static uint32_t rs1_field(uint32_t rs1) {
+    return rs1 << 15;
+}
+
+static uint32_t rs2_field(uint32_t rs2) {
+    return rs2 << 20;
+}
+
+static uint32_t i_imm(int32_t imm) {
+    return ((uint32_t)imm & 0xFFF) << 20;
+}
+
+static uint32_t s_imm(int32_t imm) {
+    return ((uint32_t)imm >> 5 & 0x7F) << 25 | ((uint32_t)imm & 0x1F) << 7;
+}
+
+static uint32_t b_imm(int32_t imm) {
+    uint32_t u = imm;
+    return (u >> 12 & 1) << 31 | (u >> 5 & 0x3F) << 25 | (u >> 1 & 0xF) << 8 | (u >> 11 & 1) << 7;
+}
+
+static uint32_t j_imm(int32_t imm) {
+    uint32_t u = imm;
+    return (u >> 20 & 1) << 31 | (u >> 1 & 0x3FF) << 21 | (u >> 11 & 1) << 20 | (u >> 12 & 0xFF) << 12;
+}
+
+// sp and s0 are only changed as a stack frame is, so the loads and stores
+// through them stay in the data
+static uint32_t any_rd() {
+    uint32_t rd;
+    do {
+        rd = pick(32);
+    } while (rd == SP || rd == S0);
+    return rd;
+}
+
+static int32_t imm12() {
+    static const int32_t edges[] = {0, 1, -1, 0x7FF, -0x800};
+    return pick(4) ? (int32_t)pick(0x1000) - 0x800 : edges[pick(5)];
+}
+
+static uint32_t memory_access(const struct kind *k) {
+    int size = 1 << ((k->match >> 12) & 3);
+    int32_t imm = imm12();
+    // mostly aligned, the rest fault
+    if (pick(8)) {
+        imm &= ~(size - 1);
+    }
+    uint32_t base = rs1_field(pick(2) ? SP : S0);
+    if ((k->match & 0x7F) == 0x03) {
+        return k->match | rd_field(any_rd()) | base | i_imm(imm);
+    }
+    return k->match | base | rs2_field(pick(32)) | s_imm(imm);
+}
+
+static const struct kind *find(const char *name) {
+    for (int i = 0; i < NUM_KINDS; ++i) {
+        if (!strcmp(kinds[i].name, name)) {
+            return &kinds[i];
+        }
+    }
+    return NULL;
+}
+
+// An instruction that falls through, with the fields the table leaves
+// open filled in at random
+static uint32_t straight(uint32_t *written) {
+    const struct kind *k;
+    uint32_t opcode;
+    do {
+        k = &kinds[pick(NUM_KINDS)];
+        opcode = k->match & 0x7F;
+    } while (opcode == 0x63 || opcode == 0x6F || opcode == 0x67 || opcode == 0x73);
+    if (opcode == 0x03 || opcode == 0x23) {
+        uint32_t w = memory_access(k);
+        *written |= opcode == 0x03 ? 1U << ((w >> 7) & 31) : 0;
+        return w;
+    }
+    uint32_t w = k->match | (rng() & ~k->mask);
+    if (opcode != 0x0F) {
+        uint32_t rd = any_rd();
+        *written |= 1U << rd;
+        w = (w & ~rd_field(31)) | rd_field(rd);
+        if (k->format == ISA_I) {
+            w = (w & 0xFFFFF) | i_imm(imm12());
+        }
+    }
+    return w;
+}
+
+// The simulator fuses some pairs and runs into one, so they are made on
+// purpose: lui + addi of a constant, and a stack frame with stores
+static int fused(uint32_t *code, int room, uint32_t *written, int *frame) {
+    if (room >= 2 && pick(2)) {
+        uint32_t rd = any_rd();
+        *written |= 1U << rd;
+        code[0] = find("lui")->match | rd_field(rd) | (rng() & 0xFFFFF000);
+        code[1] = find("addi")->match | rd_field(rd) | rs1_field(rd) | i_imm(imm12());
+        return 2;
+    }
+    if (*frame || room < 2) {
+        return 0;
+    }
+    *frame = 1;
+    int n = 1 + pick(room - 1 < 5 ? room - 1 : 5);
+    code[0] = find("addi")->match | rd_field(SP) | rs1_field(SP) | i_imm(-16 * (int32_t)pick(33) + 16 * 16);
+    for (int i = 1; i <= n; ++i) {
+        int32_t imm = 4 * (int32_t)pick(64) - 128;
+        code[i] = find("sw")->match | rs1_field(SP) | rs2_field(pick(32)) | s_imm(pick(16) ? imm : imm + 2);
+    }
+    return n + 1;
+}
+
+// A jump or branch to one of the ecalls after the block, which is n long
+// with this as its last instruction
+static int ending(struct block *b, int at, uint32_t written) {
+    int room = SLOT_WORDS - 1 - at;
+    int32_t offset = 4 * (1 + (int32_t)pick(room));
+    uint32_t target = b->slot + 4 * at + offset;
+    int choice = pick(5);
+    if (choice == 0 || (choice == 1 && at == 0)) {
+        // beq..bgeu, but not the funct3 that isn't a branch
+        static const uint32_t conditions[] = {0, 1, 4, 5, 6, 7};
+        b->code[at] = 0x63 | conditions[pick(6)] << 12 | rs1_field(pick(32)) | rs2_field(pick(32)) | b_imm(offset);
+        return at + 1;
+    }
+    if (choice == 1) {
+        // slt, sltu, slti or sltiu into rd, then beqz or bnez rd, which are fused
+        static const char *sets[] = {"slt", "sltu", "slti", "sltiu"};
+        const struct kind *k = find(sets[pick(4)]);
+        uint32_t rd = any_rd();
+        b->code[at - 1] = k->match | rd_field(rd) | rs1_field(pick(32)) |
+                          (k->format == ISA_R ? rs2_field(pick(32)) : i_imm(imm12()));
+        b->code[at] = 0x63 | pick(2) << 12 | rs1_field(rd) | b_imm(offset);
+        return at + 1;
+    }
+    if (choice == 2) {
+        b->code[at] = find("jal")->match | rd_field(any_rd()) | j_imm(offset);
+        return at + 1;
+    }
+    if (choice == 3 && at > 0) {
+        // auipc t + jalr rd, lo(t), which is fused
+        uint32_t t;
+        do {
+            t = any_rd();
+        } while (t == 0);
+        b->code[at - 1] = find("auipc")->match | rd_field(t);
+        b->code[at] = find("jalr")->match | rd_field(any_rd()) | rs1_field(t) | i_imm(offset + 4);
+        return at + 1;
+    }
+    // jalr through a register the block hasn't changed, set up to reach the target
+    uint32_t rs1;
+    int tries = 0;
+    do {
+        rs1 = pick(32);
+    } while ((rs1 == 0 || rs1 == SP || rs1 == S0 || (written >> rs1 & 1)) && ++tries < 32);
+    if (tries == 32) {
+        b->code[at] = find("jal")->match | j_imm(offset);
+        return at + 1;
+    }
+    int32_t imm = imm12();
+    b->x[rs1] = target - imm + pick(2); // jalr clears bit 0
+    b->code[at] = find("jalr")->match | rd_field(any_rd()) | rs1_field(rs1) | i_imm(imm);
+    return at + 1;
+}
+
+static void generate(struct block *b, uint32_t slot) {
+    b->slot = slot;
+    b->observed = pick(4) == 0;
+    for (int i = 0; i < 32; ++i) {
+        b->x[i] = value();
+    }
+    b->x[0] = 0;
+    b->x[SP] = BASE + 16 * ((int32_t)pick(64) - 32);
+    b->x[S0] = BASE + (int32_t)pick(512) - 256;
+    if (pick(8)) {
+        b->x[S0] &= ~3U;
+    }
+    int length = 1 + pick(MAX_BLOCK);
+    int control = pick(3) == 0;
+    int body = length - control;
+    uint32_t written = 0;
+    int frame = 0;
+    int n = 0;
+    while (n < body) {
+        int made = pick(8) == 0 ? fused(b->code + n, body - n, &written, &frame) : 0;
+        if (made == 0) {
+            b->code[n] = straight(&written);
+            made = 1;
+        }
+        n += made;
+    }
+    // a pair at the end takes the place of the last instruction of the body
+    b->n = control ? ending(b, n, written) : n;
+}
+
+// ---- shrinking ----
+
+static struct memory *mem;
+static struct reference ref;
+static uint8_t data_before[DATA_SIZE];
+
+static int fails(const struct block *b, int *status, struct outcome *out) {
+    set_data(mem, ref.data, data_before);
+    *status = ref_run(&ref, b);
+    if (*status == REF_INVALID) {
+        return 0;
+    }
+    sim_run(mem, b, out);
+    return differs(mem, *status, &ref, out);
+}
+
+// bits of the immediate, or of the fields that only the generator fills in
+static uint32_t immediate_bits(uint32_t w) {
+    switch (w & 0x7F) {
+        case 0x23: case 0x63:
+            return 0xFE000F80;
+        case 0x37: case 0x17: case 0x6F:
+            return 0xFFFFF000;
+        case 0x13:
+            return ((w >> 12) & 3) == 1 ? 0x01F00000 : 0xFFF00000;
+        case 0x03: case 0x67:
+            return 0xFFF00000;
+    }
+    return 0;
+}
+
+static void shrink(struct block *b) {
+    struct outcome out;
+    int status;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < b->n && b->n > 1; ++i) {
+            struct block t = *b;
+            memmove(t.code + i, t.code + i + 1, (t.n - i - 1) * sizeof(t.code[0]));
+            t.n--;
+            if (fails(&t, &status, &out)) {
+                *b = t;
+                changed = 1;
+                --i;
+            }
+        }
+    }
+    for (int i = 1; i < 32; ++i) {
+        struct block t = *b;
+        t.x[i] = 0;
+        if (b->x[i] != 0 && fails(&t, &status, &out)) {
+            *b = t;
+        }
+        for (int bit = 31; bit >= 0; --bit) {
+            t = *b;
+            t.x[i] &= ~(1U << bit);
+            if (t.x[i] != b->x[i] && fails(&t, &status, &out)) {
+                *b = t;
+            }
+        }
+    }
+    for (int i = 0; i < b->n; ++i) {
+        uint32_t bits = immediate_bits(b->code[i]);
+        for (int bit = 31; bit >= 0; --bit) {
+            struct block t = *b;
+            t.code[i] &= ~(1U << bit);
+            if ((bits >> bit & 1) && t.code[i] != b->code[i] && fails(&t, &status, &out)) {
+                *b = t;
+            }
+        }
+    }
+    struct block t = *b;
+    t.observed = !b->observed;
+    if (fails(&t, &status, &out)) {
+        *b = t;
+    }
+}
+
+static void report(const struct block *b) {
+    struct outcome out;
+    int status;
+    fails(b, &status, &out);
+    char text[64];
+    printf("The simulator's %s loop differs from the reference in:\n", b->observed ? "observed" : "fast");
+    for (int i = 1; i < 32; ++i) {
+        if (b->x[i]) {
+            printf("  x%-2d = %8x\n", i, b->x[i]);
+        }
+    }
+    for (int i = 0; i < ref.num_loads; ++i) {
+        uint32_t offset = ref.loads[i] & ~3U;
+        printf("  [%6x] = %8x\n", DATA + offset, load(data_before + offset, 4));
+    }
+    for (int i = 0; i < b->n; ++i) {
+        printf("  %8x:  %08x  %s\n", b->slot + 4 * i, b->code[i], disasm(b->slot + 4 * i, b->code[i], NULL, text,
+                                                                       sizeof(text)));
+    }
+    if (status == REF_FAULT || out.fault[0]) {
+        printf("  the simulator %s%s, the reference %s\n", out.fault[0] ? "stopped: " : "did not stop", out.fault,
+               status == REF_FAULT ? "stopped" : "did not");
+        return;
+    }
+    printf("            simulator  reference\n");
+    if (out.pc != ref.pc) {
+        printf("  pc        %8x  %8x\n", out.pc, ref.pc);
+    }
+    for (int i = 0; i < 32; ++i) {
+        if (out.x[i] != ref.x[i]) {
+            printf("  x%-2d       %8x  %8x\n", i, out.x[i], ref.x[i]);
+        }
+    }
+    for (int offset = 0; offset < DATA_SIZE; offset += 4) {
+        uint32_t w = memory_rd_w(mem, DATA + offset), r = load(ref.data + offset, 4);
+        if (w != r) {
+            printf("  [%6x]  %8x  %8x\n", DATA + offset, w, r);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    long int total = argc > 1 ? atol(argv[1]) : 10000000;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : (uint64_t)time(NULL);
+    rng_state = seed ? seed : 1;
+    mem = memory_create();
+    ref.data = malloc(DATA_SIZE);
+    for (int i = 0; i < DATA_SIZE; ++i) {
+        data_before[i] = rng();
+    }
+    set_data(mem, ref.data, data_before);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long int done = 0, blocks = 0, faults = 0;
+    struct block b;
+    struct outcome out;
+    while (done < total) {
+        generate(&b, CODE + (blocks * 4 * SLOT_WORDS) % CODE_SIZE);
+        int status = ref_run(&ref, &b);
+        if (status == REF_INVALID) {
+            printf("Generated an invalid block at %x. Exiting\n", b.slot);
+            exit(-1);
+        }
+        sim_run(mem, &b, &out);
+        if (differs(mem, status, &ref, &out)) {
+            ref_undo(&ref);
+            memcpy(data_before, ref.data, DATA_SIZE);
+            printf("Seed %llu, after %ld blocks:\n", (unsigned long long)seed, blocks);
+            shrink(&b);
+            report(&b);
+            return 1;
+        }
+        if (status == REF_FAULT) {
+            // the stores before it may or may not have been made
+            ref_undo(&ref);
+            resync_data(mem, ref.data);
+            faults++;
+        }
+        done += ref.executed;
+        blocks++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%ld random instructions in %ld blocks, %ld of which faulted, agreed with the reference: "
+           "%.1f million per second (seed %llu)\n",
+           done, blocks, faults, done / seconds / 1e6, (unsigned long long)seed);
+    memory_delete(mem);
+    free(ref.data);
+    return 0;
+}
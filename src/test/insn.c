@@ -0,0 +1,330 @@
+#include "../memory.h"
+#include "../assembly.h"
+#include "../simulate.h"
+#include "../syscalls.h"
+#include "../fpu.h"
+#include "../isa.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// Table driven instruction tests: every instruction is run by the
+// simulator with x11 and x12 as operands, followed by an exit ecall, and
+// x10 is compared with the expected result.
+
+extern __thread uint32_t registers[32];
+
+struct insn_test {
+    const char *name;
+    uint32_t instruction;
+    uint32_t rs1, rs2; // values of x11 and x12
+    uint32_t expected; // value of x10 afterwards
+};
+
+// rd = x10, rs1 = x11, rs2 = x12
+#define R(funct7, funct3, opcode) (((uint32_t)(funct7) << 25) | (12 << 20) | (11 << 15) | ((funct3) << 12) | (10 << 7) | (opcode))
+#define I(imm, funct3, opcode) ((((uint32_t)(imm) & 0xFFF) << 20) | (11 << 15) | ((funct3) << 12) | (10 << 7) | (opcode))
+#define OP 0x33
+#define OP_IMM 0x13
+
+struct insn_test tests[] = {
+    // RV32I
+    {"add", R(0x00, 0, OP), 5, 7, 12},
+    {"sub", R(0x20, 0, OP), 5, 7, (uint32_t)-2},
+    {"sra", R(0x20, 5, OP), 0x80000000, 4, 0xF8000000},
+    {"srl", R(0x00, 5, OP), 0x80000000, 4, 0x08000000},
+    {"slt", R(0x00, 2, OP), (uint32_t)-1, 1, 1},
+    {"sltu", R(0x00, 3, OP), (uint32_t)-1, 1, 0},
+    {"addi", I(-3, 0, OP_IMM), 5, 0, 2},
+    {"srai", I(0x400 | 4, 5, OP_IMM), 0x80000000, 0, 0xF8000000},
+    {"slli", I(4, 1, OP_IMM), 0x1, 0, 0x10},
+    // RV32M
+    {"mul", R(0x01, 0, OP), 7, (uint32_t)-3, (uint32_t)-21},
+    {"mulh", R(0x01, 1, OP), 0x80000000, 2, 0xFFFFFFFF},
+    {"mulhsu", R(0x01, 2, OP), (uint32_t)-1, 0xFFFFFFFF, 0xFFFFFFFF},
+    {"mulhu", R(0x01, 3, OP), 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFE},
+    {"div", R(0x01, 4, OP), (uint32_t)-7, 2, (uint32_t)-3},
+    {"div by zero", R(0x01, 4, OP), 7, 0, 0xFFFFFFFF},
+    {"div overflow", R(0x01, 4, OP), 0x80000000, 0xFFFFFFFF, 0x80000000},
+    {"divu", R(0x01, 5, OP), 0xFFFFFFFE, 2, 0x7FFFFFFF},
+    {"rem", R(0x01, 6, OP), (uint32_t)-7, 2, (uint32_t)-1},
+    {"rem overflow", R(0x01, 6, OP), 0x80000000, 0xFFFFFFFF, 0},
+    {"remu by zero", R(0x01, 7, OP), 9, 0, 9},
+    // Zba
+    {"sh1add", R(0x10, 2, OP), 3, 100, 106},
+    {"sh2add", R(0x10, 4, OP), 3, 100, 112},
+    {"sh3add", R(0x10, 6, OP), 3, 100, 124},
+    // Zbb
+    {"andn", R(0x20, 7, OP), 0xFF, 0x0F, 0xF0},
+    {"orn", R(0x20, 6, OP), 0xF0, 0xFFFFFF0F, 0xF0},
+    {"xnor", R(0x20, 4, OP), 0xFF00FF00, 0x0F0F0F0F, 0x0FF00FF0},
+    {"clz", I(0x600, 1, OP_IMM), 0x00010000, 0, 15},
+    {"clz 0", I(0x600, 1, OP_IMM), 0, 0, 32},
+    {"ctz", I(0x601, 1, OP_IMM), 0x00010000, 0, 16},
+    {"ctz 0", I(0x601, 1, OP_IMM), 0, 0, 32},
+    {"cpop", I(0x602, 1, OP_IMM), 0xF00F0001, 0, 9},
+    {"sext.b", I(0x604, 1, OP_IMM), 0x1280, 0, 0xFFFFFF80},
+    {"sext.h", I(0x605, 1, OP_IMM), 0x18000, 0, 0xFFFF8000},
+    {"zext.h", R(0x04, 4, OP) & ~(0x1F << 20), 0xABCD1234, 0, 0x1234},
+    {"min", R(0x05, 4, OP), (uint32_t)-5, 3, (uint32_t)-5},
+    {"minu", R(0x05, 5, OP), (uint32_t)-5, 3, 3},
+    {"max", R(0x05, 6, OP), (uint32_t)-5, 3, 3},
+    {"maxu", R(0x05, 7, OP), (uint32_t)-5, 3, (uint32_t)-5},
+    {"rol", R(0x30, 1, OP), 0x80000001, 4, 0x00000018},
+    {"rol 0", R(0x30, 1, OP), 0x80000001, 32, 0x80000001},
+    {"ror", R(0x30, 5, OP), 0x80000001, 4, 0x18000000},
+    {"rori", I(0x600 | 8, 5, OP_IMM), 0x12345678, 0, 0x78123456},
+    {"orc.b", I(0x287, 5, OP_IMM), 0x00120001, 0, 0x00FF00FF},
+    {"rev8", I(0x698, 5, OP_IMM), 0x12345678, 0, 0x78563412},
+};
+
+// RV32F and RV32D, with f11 and f12 as operands (and f12 as rs3 too).
+// The result is checked in f10, or in x10 for compares, fclass and
+// conversions to integers.
+struct fp_test {
+    const char *name;
+    uint32_t instruction;
+    uint64_t rs1, rs2; // values of f11 and f12
+    uint64_t expected;
+    int to_x;
+};
+
+#define S(bits) (0xFFFFFFFF00000000ULL | (bits)) // NaN-boxed single
+#define OP_FP 0x53
+#define RM_DYNAMIC 7
+
+struct fp_test fp_tests[] = {
+    {"fadd.s", R(0x00, RM_DYNAMIC, OP_FP), S(0x3FC00000), S(0x40100000), S(0x40700000), 0}, // 1.5 + 2.25
+    {"fadd.d", R(0x01, RM_DYNAMIC, OP_FP), 0x3FF8000000000000, 0x4002000000000000, 0x400E000000000000, 0},
+    {"fdiv.s rtz", R(0x0C, 1, OP_FP), S(0x3F800000), S(0x40400000), S(0x3EAAAAAA), 0}, // 1 / 3
+    {"fdiv.s rup", R(0x0C, 3, OP_FP), S(0x3F800000), S(0x40400000), S(0x3EAAAAAB), 0},
+    {"fmadd.d", R(0x01, RM_DYNAMIC, 0x43) | (12u << 27), 0x4000000000000000, 0x4008000000000000,
+     0x4022000000000000, 0}, // 2 * 3 + 3
+    {"fsgnjn.d", R(0x11, 1, OP_FP), 0x3FF0000000000000, 0x3FF0000000000000, 0xBFF0000000000000, 0},
+    {"fmin.s nan", R(0x14, 0, OP_FP), S(0x7FC00000), S(0xBF800000), S(0xBF800000), 0},
+    {"fmax.s zeros", R(0x14, 1, OP_FP), S(0x80000000), S(0x00000000), S(0x00000000), 0},
+    {"not boxed", R(0x00, RM_DYNAMIC, OP_FP), 0x3FC00000, S(0x3FC00000), S(0x7FC00000), 0},
+    {"fcvt.s.d", (R(0x20, RM_DYNAMIC, OP_FP) & ~(0x1F << 20)) | (1 << 20), 0x3FF8000000000000, 0, S(0x3FC00000), 0},
+    {"feq.s nan", R(0x50, 2, OP_FP), S(0x7FC00000), S(0x7FC00000), 0, 1},
+    {"fle.d", R(0x51, 0, OP_FP), 0xBFF0000000000000, 0x0000000000000000, 1, 1},
+    {"fclass.s -0", R(0x70, 1, OP_FP) & ~(0x1F << 20), S(0x80000000), 0, 1 << 3, 1},
+    {"fclass.d snan", R(0x71, 1, OP_FP) & ~(0x1F << 20), 0x7FF0000000000001, 0, 1 << 8, 1},
+    {"fcvt.w.s rmm", R(0x60, 4, OP_FP) & ~(0x1F << 20), S(0xC0200000), 0, (uint32_t)-3, 1}, // -2.5
+    {"fcvt.w.d big", R(0x61, 1, OP_FP) & ~(0x1F << 20), 0x41F0000000000000, 0, 0x7FFFFFFF, 1}, // 2^32
+};
+
+// RV32A on the word at x11, with x12 as operand. x10 gets the old value.
+struct amo_test {
+    const char *name;
+    uint32_t funct5;
+    uint32_t before, rs2, after; // the word in memory before and after
+};
+
+#define AMO_ADDR 0x80000
+#define OP_AMO 0x2F
+
+struct amo_test amo_tests[] = {
+    {"amoswap.w", 0x01, 5, 7, 7},
+    {"amoadd.w", 0x00, 5, 7, 12},
+    {"amoxor.w", 0x04, 0xFF, 0x0F, 0xF0},
+    {"amoand.w", 0x0C, 0xFF, 0x0F, 0x0F},
+    {"amoor.w", 0x08, 0xF0, 0x0F, 0xFF},
+    {"amomin.w", 0x10, 5, (uint32_t)-7, (uint32_t)-7},
+    {"amomax.w", 0x14, 5, (uint32_t)-7, 5},
+    {"amominu.w", 0x18, 5, (uint32_t)-7, 5},
+    {"amomaxu.w", 0x1C, 5, (uint32_t)-7, (uint32_t)-7},
+};
+
+#define EXIT_A7 ((93 << 20) | (17 << 7) | OP_IMM) // addi a7, x0, 93
+#define ECALL 0x73
+
+// Every RV32IM computation in isa.h, checked against its own expression for
+// some operands, and with rd, rs1 or rs2 = x0 for the forms the decoder
+// specializes
+struct isa_test {
+    const char *name;
+    uint32_t match;
+    int format;
+    uint32_t (*expected)(uint32_t a, uint32_t b);
+};
+
+#define ISA_EXPECTED(op, name, mask, match, format, expression) \
+    static uint32_t expected_##op(uint32_t a, uint32_t b) { \
+        (void)a; \
+        return (expression); \
+    }
+#define ISA_TEST(op, name, mask, match, format, expression) {name, match, ISA_##format, expected_##op},
+#define ISA_SKIP(...)
+ISA_RV32IM(ISA_EXPECTED, ISA_SKIP, ISA_SKIP)
+struct isa_test isa_tests[] = {ISA_RV32IM(ISA_TEST, ISA_SKIP, ISA_SKIP)};
+
+uint32_t isa_values[] = {0, 1, 7, 0x7FF, 0x80000000, 0xFFFFFFFF, (uint32_t)-7};
+#define NUM_VALUES (sizeof(isa_values) / sizeof(isa_values[0]))
+
+// The text assembly_get makes from the word at DISASM_ADDR
+struct disasm_test {
+    uint32_t instruction;
+    const char *expected;
+};
+
+#define DISASM_ADDR 0x90000
+
+struct disasm_test disasm_tests[] = {
+    {0x00000013, "nop"},
+    {0x00500513, "li       a0,5"},
+    {0x00058513, "mv       a0,a1"},
+    {0xFF010113, "addi     sp,sp,-16"},
+    {0x00008067, "ret"},
+    {0xFEC42783, "lw       a5,-20(s0)"},
+    {0x00112623, "sw       ra,12(sp)"},
+    {0x000117B7, "lui      a5,0x11"},
+    {0x02C58533, "mul      a0,a1,a2"},
+    {0x0080006F, "j        90008"},
+    {0xFE050EE3, "beqz     a0,8fffc"},
+    {0x00102573, "csrr     a0,fflags"},
+    {0x00004515, "li       a0,5"}, // c.li
+    {0xFFFFFFFF, ".word    0xffffffff"},
+};
+
+// Runs the instruction at addr with x11 = a and x12 = b, and returns x10,
+// or 0xBAD if it wrote x0
+static uint32_t run_isa_test(struct memory *mem, struct assembly *as, int addr, uint32_t instruction, uint32_t a,
+                             uint32_t b) {
+    memory_wr_w(mem, addr, instruction);
+    memory_wr_w(mem, addr + 4, EXIT_A7);
+    memory_wr_w(mem, addr + 8, ECALL);
+    struct syscalls *sys = syscalls_create(mem, 0x100000, NULL);
+    struct simulation sim = {0};
+    sim.sys = sys;
+    registers[10] = 0xDEADBEEF;
+    registers[11] = a;
+    registers[12] = b;
+    simulate(mem, as, &sim, addr, NULL);
+    syscalls_delete(sys);
+    return registers[0] ? 0xBAD : registers[10];
+}
+
+int main() {
+    struct memory *mem = memory_create();
+    struct assembly *as = assembly_create();
+    int num_tests = sizeof(tests) / sizeof(tests[0]);
+    int failures = 0;
+    for (int i = 0; i < num_tests; ++i) {
+        // every test gets its own code, so nothing decoded before is reused
+        int addr = 0x10000 + 16 * i;
+        memory_wr_w(mem, addr, tests[i].instruction);
+        memory_wr_w(mem, addr + 4, EXIT_A7);
+        memory_wr_w(mem, addr + 8, ECALL);
+        struct syscalls *sys = syscalls_create(mem, 0x100000, NULL);
+        struct simulation sim = {0};
+        sim.sys = sys;
+        registers[10] = 0xDEADBEEF;
+        registers[11] = tests[i].rs1;
+        registers[12] = tests[i].rs2;
+        simulate(mem, as, &sim, addr, NULL);
+        syscalls_delete(sys);
+        if (registers[10] != tests[i].expected) {
+            printf("FAIL %-12s %08x: x11=%08x x12=%08x gave %08x, expected %08x\n", tests[i].name,
+                   tests[i].instruction, tests[i].rs1, tests[i].rs2, registers[10], tests[i].expected);
+            failures++;
+        }
+    }
+    int num_fp_tests = sizeof(fp_tests) / sizeof(fp_tests[0]);
+    for (int i = 0; i < num_fp_tests; ++i) {
+        int addr = 0x10000 + 16 * (num_tests + i);
+        memory_wr_w(mem, addr, fp_tests[i].instruction);
+        memory_wr_w(mem, addr + 4, EXIT_A7);
+        memory_wr_w(mem, addr + 8, ECALL);
+        struct syscalls *sys = syscalls_create(mem, 0x100000, NULL);
+        struct simulation sim = {0};
+        sim.sys = sys;
+        registers[10] = 0xDEADBEEF;
+        fregisters[10] = 0xDEADBEEF;
+        fregisters[11] = fp_tests[i].rs1;
+        fregisters[12] = fp_tests[i].rs2;
+        simulate(mem, as, &sim, addr, NULL);
+        syscalls_delete(sys);
+        uint64_t result = fp_tests[i].to_x ? registers[10] : fregisters[10];
+        if (result != fp_tests[i].expected) {
+            printf("FAIL %-12s %08x: f11=%016llx f12=%016llx gave %016llx, expected %016llx\n", fp_tests[i].name,
+                   fp_tests[i].instruction, (unsigned long long)fp_tests[i].rs1, (unsigned long long)fp_tests[i].rs2,
+                   (unsigned long long)result, (unsigned long long)fp_tests[i].expected);
+            failures++;
+        }
+    }
+    num_tests += num_fp_tests;
+    int num_amo_tests = sizeof(amo_tests) / sizeof(amo_tests[0]);
+    for (int i = 0; i < num_amo_tests; ++i) {
+        int addr = 0x10000 + 16 * (num_tests + i);
+        memory_wr_w(mem, addr, R(amo_tests[i].funct5 << 2, 2, OP_AMO));
+        memory_wr_w(mem, addr + 4, EXIT_A7);
+        memory_wr_w(mem, addr + 8, ECALL);
+        memory_wr_w(mem, AMO_ADDR, amo_tests[i].before);
+        struct syscalls *sys = syscalls_create(mem, 0x100000, NULL);
+        struct simulation sim = {0};
+        sim.sys = sys;
+        registers[10] = 0xDEADBEEF;
+        registers[11] = AMO_ADDR;
+        registers[12] = amo_tests[i].rs2;
+        simulate(mem, as, &sim, addr, NULL);
+        syscalls_delete(sys);
+        uint32_t after = memory_rd_w(mem, AMO_ADDR);
+        if (registers[10] != amo_tests[i].before || after != amo_tests[i].after) {
+            printf("FAIL %-12s: %08x with x12=%08x gave x10=%08x and %08x, expected %08x\n", amo_tests[i].name,
+                   amo_tests[i].before, amo_tests[i].rs2, registers[10], after, amo_tests[i].after);
+            failures++;
+        }
+    }
+    num_tests += num_amo_tests;
+    int num_isa_tests = sizeof(isa_tests) / sizeof(isa_tests[0]);
+    int addr = 0x10000 + 16 * num_tests;
+    for (int i = 0; i < num_isa_tests; ++i) {
+        struct isa_test *t = &isa_tests[i];
+        for (unsigned j = 0; j < NUM_VALUES * NUM_VALUES; ++j) {
+            uint32_t a = isa_values[j / NUM_VALUES], b = isa_values[j % NUM_VALUES];
+            if (t->format == ISA_SHAMT) {
+                b &= 0x1F;
+            } else if (t->format == ISA_I) {
+                b = (int32_t)(b << 20) >> 20; // what the 12 bit immediate holds
+            } else if (t->format == ISA_U) {
+                b &= 0xFFFFF000;
+            }
+            uint32_t operand = t->format == ISA_R ? 12 << 20 : t->format == ISA_U ? b : b << 20;
+            // rd rs1 rs2, then with x0 for each of them
+            uint32_t rd = 10 << 7, rs1 = t->format == ISA_U ? 0 : 11 << 15;
+            uint32_t variants[4][2] = {{rd | rs1 | operand, t->expected(a, b)},
+                                       {rs1 | operand, 0xDEADBEEF},
+                                       {rd | operand, t->expected(0, b)},
+                                       {rd | rs1, t->expected(a, 0)}};
+            int num_variants = t->format == ISA_R ? 4 : t->format == ISA_U ? 2 : 3;
+            for (int v = 0; v < num_variants; ++v) {
+                uint32_t instruction = t->match | variants[v][0];
+                uint32_t result = run_isa_test(mem, as, addr, instruction, a, b);
+                addr += 16;
+                num_tests++;
+                if (result != variants[v][1]) {
+                    printf("FAIL %-12s %08x: x11=%08x x12=%08x gave %08x, expected %08x\n", t->name, instruction, a,
+                           b, result, variants[v][1]);
+                    failures++;
+                }
+            }
+        }
+    }
+    int num_disasm_tests = sizeof(disasm_tests) / sizeof(disasm_tests[0]);
+    assembly_attach(as, mem, NULL);
+    for (int i = 0; i < num_disasm_tests; ++i) {
+        memory_wr_w(mem, DISASM_ADDR, disasm_tests[i].instruction);
+        const char *text = assembly_get(as, DISASM_ADDR);
+        if (strcmp(text, disasm_tests[i].expected)) {
+            printf("FAIL disasm %08x: gave \"%s\", expected \"%s\"\n", disasm_tests[i].instruction, text,
+                   disasm_tests[i].expected);
+            failures++;
+        }
+    }
+    num_tests += num_disasm_tests;
+    printf("%d of %d instruction tests passed\n", num_tests - failures, num_tests);
+    assembly_delete(as);
+    memory_delete(mem);
+    return failures != 0;
+}
@@ -0,0 +1,293 @@
+#include "timing.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PREDICT_BIMODAL 0
+#define PREDICT_GSHARE 1
+
+// Branches and indirect jumps are resolved in EX: a wrong guess flushes the
+// two younger instructions. A direct jump missing in the BTB is redirected
+// from ID, which costs one bubble.
+#define MISPREDICT_PENALTY 2
+#define DECODE_REDIRECT_PENALTY 1
+#define MUL_LATENCY 3
+#define DIV_LATENCY 32
+#define PIPELINE_FILL 4
+
+struct timing
+{
+  int predictor;
+  int table_bits;
+  uint8_t *counters; // 2-bit saturating counters
+  uint32_t history;  // global branch history for gshare
+  int btb_entries;
+  uint32_t *btb_pc; // direct mapped branch target buffer
+  uint32_t *btb_target;
+  int ras_depth;
+  uint32_t *ras; // return address stack, circular
+  int ras_top;
+  int load_rd; // destination of the previous instruction if it was a load, numbered as by read_regs
+  long instructions;
+  long cycles;
+  long branches, branch_mispredicts;
+  long jumps, jump_mispredicts;
+  long load_use_stalls;
+  long control_stalls;
+  long muldiv_stalls;
+};
+
+struct timing *timing_create(const char *config)
+{
+  struct timing *timing = calloc(sizeof(struct timing), 1);
+  timing->table_bits = 12;
+  timing->btb_entries = 512;
+  timing->ras_depth = 8;
+  if (strncmp(config, "bimodal", 7) == 0)
+    timing->predictor = PREDICT_BIMODAL;
+  else if (strncmp(config, "gshare", 6) == 0)
+    timing->predictor = PREDICT_GSHARE;
+  else
+  {
+    printf("Unknown branch predictor '%s'. Exiting\n", config);
+    exit(-1);
+  }
+  const char *p = strchr(config, ':');
+  int *fields[] = {&timing->table_bits, &timing->btb_entries, &timing->ras_depth};
+  for (int i = 0; p && i < 3; ++i)
+  {
+    *fields[i] = atoi(p + 1);
+    p = strchr(p + 1, ':');
+  }
+  int btb = timing->btb_entries;
+  if (timing->table_bits < 1 || timing->table_bits > 24 || btb < 1 || (btb & (btb - 1)) || timing->ras_depth < 1)
+  {
+    printf("Bad timing configuration '%s'. Exiting\n", config);
+    exit(-1);
+  }
+  timing->counters = malloc(1 << timing->table_bits);
+  memset(timing->counters, 1, 1 << timing->table_bits); // weakly not taken
+  timing->btb_pc = malloc(btb * sizeof(uint32_t));
+  memset(timing->btb_pc, 0xff, btb * sizeof(uint32_t));
+  timing->btb_target = calloc(sizeof(uint32_t), btb);
+  timing->ras = calloc(sizeof(uint32_t), timing->ras_depth);
+  return timing;
+}
+
+void timing_delete(struct timing *timing)
+{
+  free(timing->counters);
+  free(timing->btb_pc);
+  free(timing->btb_target);
+  free(timing->ras);
+  free(timing);
+}
+
+// predicted target of the control transfer at pc, 0 on a BTB miss
+static uint32_t btb_lookup(struct timing *timing, uint32_t pc)
+{
+  int index = (pc >> 2) & (timing->btb_entries - 1);
+  return timing->btb_pc[index] == pc ? timing->btb_target[index] : 0;
+}
+
+static void btb_update(struct timing *timing, uint32_t pc, uint32_t target)
+{
+  int index = (pc >> 2) & (timing->btb_entries - 1);
+  timing->btb_pc[index] = pc;
+  timing->btb_target[index] = target;
+}
+
+static void ras_push(struct timing *timing, uint32_t addr)
+{
+  timing->ras_top = (timing->ras_top + 1) % timing->ras_depth;
+  timing->ras[timing->ras_top] = addr;
+}
+
+static uint32_t ras_pop(struct timing *timing)
+{
+  uint32_t addr = timing->ras[timing->ras_top];
+  timing->ras_top = (timing->ras_top + timing->ras_depth - 1) % timing->ras_depth;
+  return addr;
+}
+
+// Conditional branch: direction from the counters, target from the BTB
+static int branch_penalty(struct timing *timing, uint32_t pc, int taken, uint32_t next_pc)
+{
+  uint32_t mask = (1u << timing->table_bits) - 1;
+  uint32_t index = (pc >> 2) & mask;
+  if (timing->predictor == PREDICT_GSHARE)
+    index ^= timing->history & mask;
+  uint8_t *counter = &timing->counters[index];
+  int predict_taken = *counter >= 2;
+  int correct = predict_taken == taken && (!taken || btb_lookup(timing, pc) == next_pc);
+  if (taken && *counter < 3)
+    (*counter)++;
+  if (!taken && *counter > 0)
+    (*counter)--;
+  timing->history = (timing->history << 1) | taken;
+  if (taken)
+    btb_update(timing, pc, next_pc);
+  timing->branches++;
+  if (correct)
+    return 0;
+  timing->branch_mispredicts++;
+  return MISPREDICT_PENALTY;
+}
+
+// link registers ra and t0 mark calls and returns, as in the ISA manual
+static int is_link(int reg)
+{
+  return reg == 1 || reg == 5;
+}
+
+// The registers an instruction reads, numbered 1-31 for x1-x31 and 32-63
+// for f0-f31, so a load into one register file never seems to feed the
+// other; 0 where an operand is absent or x0. Returns how many there are.
+static int read_regs(uint32_t instruction, int regs[3])
+{
+  int opcode = instruction & 0x7f;
+  int rs1 = (instruction >> 15) & 0x1f;
+  int rs2 = (instruction >> 20) & 0x1f;
+  int funct5 = instruction >> 27;
+  switch (opcode)
+  {
+  case 0x03: // loads
+  case 0x07: // FP loads
+  case 0x13: // OP-IMM
+  case 0x67: // JALR
+    regs[0] = rs1;
+    return 1;
+  case 0x23: // stores
+  case 0x2f: // AMOs, and lr.w whose rs2 is x0
+  case 0x33: // OP
+  case 0x63: // branches
+    regs[0] = rs1;
+    regs[1] = rs2;
+    return 2;
+  case 0x27: // FP stores
+    regs[0] = rs1;
+    regs[1] = 32 + rs2;
+    return 2;
+  case 0x43: // fmadd, fmsub, fnmsub, fnmadd
+  case 0x47:
+  case 0x4b:
+  case 0x4f:
+    regs[0] = 32 + rs1;
+    regs[1] = 32 + rs2;
+    regs[2] = 32 + funct5;
+    return 3;
+  case 0x53: // OP-FP: fcvt from and fmv from an integer read x rs1, and
+             // only the arithmetic, sign injection, min/max and compares rs2
+    regs[0] = funct5 == 0x1a || funct5 == 0x1e ? rs1 : 32 + rs1;
+    if (funct5 >= 0x08 && funct5 != 0x14)
+      return 1;
+    regs[1] = 32 + rs2;
+    return 2;
+  case 0x73: // csrrw, csrrs and csrrc read rs1; ecall and the immediate forms nothing
+  {
+    int funct3 = (instruction >> 12) & 0x7;
+    regs[0] = rs1;
+    return funct3 >= 1 && funct3 <= 3;
+  }
+  default: // LUI, AUIPC, JAL, fences
+    return 0;
+  }
+}
+
+void timing_insn(struct timing *timing, uint32_t pc, uint32_t instruction, int size, uint32_t next_pc)
+{
+  int opcode = instruction & 0x7f;
+  int rd = (instruction >> 7) & 0x1f;
+  int funct3 = (instruction >> 12) & 0x7;
+  int rs1 = (instruction >> 15) & 0x1f;
+  int funct7 = instruction >> 25;
+  int stall = 0;
+
+  int regs[3];
+  int num_regs = read_regs(instruction, regs);
+  for (int i = 0; i < num_regs && timing->load_rd; ++i)
+  {
+    if (regs[i] == timing->load_rd)
+    {
+      stall++;
+      timing->load_use_stalls++;
+      break;
+    }
+  }
+  timing->load_rd = opcode == 0x03 ? rd : opcode == 0x07 ? 32 + rd : 0;
+
+  int penalty = 0;
+  switch (opcode)
+  {
+  case 0x63: // branches
+    penalty = branch_penalty(timing, pc, next_pc != pc + size, next_pc);
+    break;
+  case 0x6f: // JAL
+    timing->jumps++;
+    if (btb_lookup(timing, pc) != next_pc)
+    {
+      penalty = DECODE_REDIRECT_PENALTY;
+      timing->jump_mispredicts++;
+    }
+    btb_update(timing, pc, next_pc);
+    if (is_link(rd))
+      ras_push(timing, pc + size);
+    break;
+  case 0x67: // JALR
+  {
+    timing->jumps++;
+    uint32_t predicted;
+    if (is_link(rs1) && !is_link(rd))
+      predicted = ras_pop(timing);
+    else
+      predicted = btb_lookup(timing, pc);
+    if (is_link(rd))
+      ras_push(timing, pc + size);
+    if (predicted != next_pc)
+    {
+      penalty = MISPREDICT_PENALTY;
+      timing->jump_mispredicts++;
+    }
+    btb_update(timing, pc, next_pc);
+    break;
+  }
+  case 0x33: // M extension runs unpipelined in EX
+    if (funct7 == 0x01)
+    {
+      int latency = funct3 < 4 ? MUL_LATENCY : DIV_LATENCY;
+      stall += latency - 1;
+      timing->muldiv_stalls += latency - 1;
+    }
+    break;
+  }
+  timing->control_stalls += penalty;
+  timing->instructions++;
+  timing->cycles += 1 + stall + penalty;
+}
+
+int timing_counts(struct timing *timing, const char **names, long *values)
+{
+  static const char *count_names[TIMING_COUNTS] = {
+      "cycles",  "branches", "branch mispredicts", "jumps", "jump mispredicts", "load-use stalls",
+      "control stalls", "mul/div stalls"};
+  long counts[TIMING_COUNTS] = {timing->cycles, timing->branches, timing->branch_mispredicts, timing->jumps,
+                                timing->jump_mispredicts, timing->load_use_stalls, timing->control_stalls,
+                                timing->muldiv_stalls};
+  memcpy(names, count_names, sizeof(count_names));
+  memcpy(values, counts, sizeof(counts));
+  return TIMING_COUNTS;
+}
+
+void timing_report(struct timing *timing, FILE *out)
+{
+  long cycles = timing->cycles + PIPELINE_FILL;
+  long n = timing->instructions;
+  fprintf(out, "Timing (%s, %d-bit table, %d-entry BTB, %d-entry RAS): %ld cycles, CPI %.3f\n",
+          timing->predictor == PREDICT_GSHARE ? "gshare" : "bimodal", timing->table_bits,
+          timing->btb_entries, timing->ras_depth, cycles, n ? (double)cycles / n : 0.0);
+  fprintf(out, "  branches %ld, mispredicted %ld (%.2f%%)\n", timing->branches, timing->branch_mispredicts,
+          timing->branches ? 100.0 * timing->branch_mispredicts / timing->branches : 0.0);
+  fprintf(out, "  jumps    %ld, mispredicted %ld (%.2f%%)\n", timing->jumps, timing->jump_mispredicts,
+          timing->jumps ? 100.0 * timing->jump_mispredicts / timing->jumps : 0.0);
+  fprintf(out, "  stall cycles: load-use %ld, control %ld, mul/div %ld\n", timing->load_use_stalls,
+          timing->control_stalls, timing->muldiv_stalls);
+}
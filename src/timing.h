@@ -0,0 +1,29 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Cycle estimate for a simple in-order 5-stage pipeline (IF ID EX MEM WB)
+// with full forwarding. Stalls come from load-use hazards, mispredicted
+// branches and jumps, and multi-cycle multiply/divide in EX.
+struct timing;
+
+// config is predictor[:table_bits[:btb_entries[:ras_depth]]] where the
+// predictor is "bimodal" or "gshare", e.g. "gshare:12:512:8"
+struct timing *timing_create(const char *config);
+void timing_delete(struct timing *timing);
+
+// account for one executed instruction at pc, next_pc is where it went.
+// A compressed instruction is given expanded, with size 2.
+void timing_insn(struct timing *timing, uint32_t pc, uint32_t instruction, int size, uint32_t next_pc);
+
+// CPI, mispredict rate and stall breakdown
+void timing_report(struct timing *timing, FILE *out);
+
+// the totals behind the report, for sampling; fills in TIMING_COUNTS names
+// and values and returns how many
+#define TIMING_COUNTS 8
+int timing_counts(struct timing *timing, const char **names, long *values);
+
+#endif
@@ -0,0 +1,242 @@
+#include "verify.h"
+#include "syscalls.h"
+#include "fpu.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern __thread uint32_t registers[32];
+
+#define MAX_REPORTED_WORDS 16
+// how far the reference may run to see if it fails like the fast engine
+#define FAULT_SEARCH 1000000
+
+// One of the two copies of the program, between runs
+struct side
+{
+  const char *name;
+  struct memory *mem;
+  struct simulation sim;
+  uint32_t pc;
+  uint32_t regs[32];
+  uint64_t fregs[32];
+  uint32_t fcsr; // the flags are the thread's, and would leak from one side to the other
+  int at_ecall; // stopped in front of an ecall
+  char fault[256]; // the error that stopped it, such as an unaligned access
+};
+
+// Both sides stop at an ecall, which is then made once by verify_run
+static int stop_at_ecall(void *ctx, uint32_t *regs)
+{
+  (void)regs;
+  *(int *)ctx = 1;
+  return SYSCALL_EXIT;
+}
+
+// Runs a side in the registers of this thread. Returns the number of
+// instructions executed, which doesn't include an ecall it stopped at, or
+// -1 if it failed.
+static long int run_side(struct side *side)
+{
+  memcpy(registers, side->regs, sizeof(side->regs));
+  memcpy(fregisters, side->fregs, sizeof(side->fregs));
+  fpu_set_fcsr(side->fcsr);
+  side->at_ecall = 0;
+  side->fault[0] = 0;
+  volatile long int executed = -1;
+  jmp_buf trap;
+  error_trap(&trap);
+  if (setjmp(trap))
+    snprintf(side->fault, sizeof(side->fault), "%s", error_message());
+  else
+    executed = simulate_run(side->mem, &side->sim, &side->pc) - side->at_ecall;
+  error_trap(NULL);
+  memcpy(side->regs, registers, sizeof(side->regs));
+  memcpy(side->fregs, fregisters, sizeof(side->fregs));
+  side->fcsr = fpu_get_fcsr();
+  return executed;
+}
+
+// a page given back reads as zero, and isn't made again to be compared
+static const char *page_of(struct memory *mem, int page)
+{
+  static const char zero[MEMORY_PAGE_SIZE];
+  const char *p = (const char *)memory_find_page(mem, page << MEMORY_PAGE_BITS);
+  return p ? p : zero;
+}
+
+static const char *text(struct assembly *as, uint32_t pc)
+{
+  return as ? assembly_get(as, pc) : "";
+}
+
+static int contains(const int *pages, int count, int page)
+{
+  for (int i = 0; i < count; ++i)
+  {
+    if (pages[i] == page)
+      return 1;
+  }
+  return 0;
+}
+
+// Words that differ in the pages either side has written but not in the
+// ones already reported, up to a limit
+static int report_pages(struct side *fast, struct side *ref, const int *pages, int count, const int *skip,
+                        int skip_count, int reported)
+{
+  for (int i = 0; i < count && reported < MAX_REPORTED_WORDS; ++i)
+  {
+    if (contains(skip, skip_count, pages[i]))
+      continue;
+    const uint32_t *a = (const uint32_t *)page_of(fast->mem, pages[i]);
+    const uint32_t *b = (const uint32_t *)page_of(ref->mem, pages[i]);
+    for (int w = 0; w < MEMORY_PAGE_SIZE / 4 && reported < MAX_REPORTED_WORDS; ++w)
+    {
+      if (a[w] != b[w])
+      {
+        printf("  [%6x]  %8x  %8x\n", (pages[i] << MEMORY_PAGE_BITS) + 4 * w, a[w], b[w]);
+        reported++;
+      }
+    }
+  }
+  return reported;
+}
+
+// the pages in pages and not in skip
+static int pages_differ(struct side *fast, struct side *ref, const int *pages, int count, const int *skip,
+                        int skip_count)
+{
+  for (int i = 0; i < count; ++i)
+  {
+    if (!contains(skip, skip_count, pages[i]) &&
+        memcmp(page_of(fast->mem, pages[i]), page_of(ref->mem, pages[i]), MEMORY_PAGE_SIZE))
+      return 1;
+  }
+  return 0;
+}
+
+// Compares the two sides after a run from pc from, where the fast side ran
+// n instructions and the reference m, and ends the simulation if they differ.
+// A fault both of them ran into is the program's own.
+static void check(struct side *fast, struct side *ref, long int n, long int m, uint32_t from, long int done,
+                  struct assembly *as)
+{
+  const int *fast_pages, *ref_pages;
+  int fast_count = memory_dirty_pages(fast->mem, &fast_pages);
+  int ref_count = memory_dirty_pages(ref->mem, &ref_pages);
+  if (fast->fault[0] && !strcmp(fast->fault, ref->fault))
+  {
+    syscalls_flush(fast->sim.sys);
+    error_fail("%s", fast->fault);
+  }
+  if (n == m && !fast->fault[0] && !ref->fault[0] && fast->pc == ref->pc &&
+      !memcmp(fast->regs, ref->regs, sizeof(fast->regs)) && !memcmp(fast->fregs, ref->fregs, sizeof(fast->fregs)) &&
+      fast->fcsr == ref->fcsr &&
+      !pages_differ(fast, ref, fast_pages, fast_count, NULL, 0) &&
+      !pages_differ(fast, ref, ref_pages, ref_count, fast_pages, fast_count))
+    return;
+  syscalls_flush(fast->sim.sys);
+  printf("Verification failed after instruction %ld, in the block from %8x: %s\n", done, from, text(as, from));
+  // a side that failed stopped somewhere in the block, so the states can't
+  // be compared
+  struct side *sides[2] = {fast, ref};
+  for (int i = 0; i < 2; ++i)
+  {
+    if (sides[i]->fault[0])
+    {
+      printf("  the %s engine stopped: %s\n", sides[i]->name, sides[i]->fault);
+      printf("  the %s engine did not\nExiting\n", sides[1 - i]->name);
+      exit(-1);
+    }
+  }
+  if (n != m)
+    printf("  the fast engine ran %ld instructions, the reference %ld\n", n, m);
+  printf("            %8s  %8s\n", fast->name, ref->name);
+  if (fast->pc != ref->pc)
+    printf("  pc        %8x  %8x  %s\n", fast->pc, ref->pc, text(as, ref->pc));
+  for (int i = 1; i < 32; ++i)
+  {
+    if (fast->regs[i] != ref->regs[i])
+      printf("  x%-2d       %8x  %8x\n", i, fast->regs[i], ref->regs[i]);
+  }
+  for (int i = 0; i < 32; ++i)
+  {
+    if (fast->fregs[i] != ref->fregs[i])
+      printf("  f%-2d       %16llx  %16llx\n", i, (unsigned long long)fast->fregs[i],
+             (unsigned long long)ref->fregs[i]);
+  }
+  if (fast->fcsr != ref->fcsr)
+    printf("  fcsr      %8x  %8x\n", fast->fcsr, ref->fcsr);
+  int reported = report_pages(fast, ref, fast_pages, fast_count, NULL, 0, 0);
+  report_pages(fast, ref, ref_pages, ref_count, fast_pages, fast_count, reported);
+  printf("Exiting\n");
+  exit(-1);
+}
+
+// The reference gets what the system call wrote in the fast side's memory
+static void copy_pages(struct memory *from, struct memory *to)
+{
+  const int *pages;
+  int count = memory_dirty_pages(from, &pages);
+  for (int i = 0; i < count; ++i)
+  {
+    int len = MEMORY_PAGE_SIZE;
+    if (memory_find_page(from, pages[i] << MEMORY_PAGE_BITS) == NULL)
+      memory_release(to, pages[i] << MEMORY_PAGE_BITS, len);
+    else
+      memcpy(memory_wr_span(to, pages[i] << MEMORY_PAGE_BITS, &len), page_of(from, pages[i]), len);
+  }
+}
+
+long int verify_run(struct memory *mem, struct memory *ref_mem, struct assembly *as, struct simulation *sim,
+                    uint32_t start_addr, long int every)
+{
+  struct side fast = {"fast", mem, *sim, start_addr, {0}, {0}, fpu_get_fcsr(), 0, ""};
+  fast.sim.limit = every;
+  fast.sim.limit_at_jumps = 1;
+  fast.sim.syscall_hook = stop_at_ecall;
+  fast.sim.syscall_ctx = &fast.at_ecall;
+  struct side ref = {"reference", ref_mem, {0}, start_addr, {0}, {0}, fast.fcsr, 0, ""};
+  ref.sim.sys = sim->sys;
+  ref.sim.syscall_hook = stop_at_ecall;
+  ref.sim.syscall_ctx = &ref.at_ecall;
+  memcpy(fast.regs, registers, sizeof(fast.regs));
+  memcpy(ref.regs, registers, sizeof(ref.regs));
+  memory_clean(mem);
+  memory_clean(ref_mem);
+  long int done = 0;
+  while (1)
+  {
+    uint32_t from = fast.pc;
+    long int n = run_side(&fast);
+    long int m = 0;
+    if (n != 0)
+    {
+      ref.sim.limit = n > 0 ? n : FAULT_SEARCH;
+      m = run_side(&ref);
+    }
+    check(&fast, &ref, n, m, from, done, as);
+    done += n;
+    memory_clean(mem);
+    memory_clean(ref_mem);
+    if (!fast.at_ecall)
+      continue;
+    memcpy(registers, fast.regs, sizeof(fast.regs));
+    int result = syscalls_handle(sim->sys, registers, ++done);
+    memcpy(fast.regs, registers, sizeof(fast.regs));
+    if (result == SYSCALL_EXIT)
+    {
+      sim->exited = 1;
+      break;
+    }
+    fast.pc += 4;
+    ref.pc = fast.pc;
+    memcpy(ref.regs, fast.regs, sizeof(fast.regs));
+    copy_pages(mem, ref_mem);
+    memory_clean(mem);
+    memory_clean(ref_mem);
+  }
+  return done;
+}
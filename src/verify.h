@@ -0,0 +1,19 @@
+#ifndef __VERIFY_H__
+#define __VERIFY_H__
+
+#include "memory.h"
+#include "assembly.h"
+#include "simulate.h"
+
+// Lockstep checking of the fast engines against the reference interpreter.
+// The program runs in the loop with superinstructions, or in the
+// translation when sim->aot is set, on mem, and in the loop that executes
+// one instruction at a time on ref_mem, a second copy of the program. At
+// the first jump after every instructions and at every system call the two
+// are stopped and their pc, registers and the pages written since the last
+// check are compared. System calls are made once and their effect copied to
+// the reference. The first difference is reported and ends the simulation.
+long int verify_run(struct memory *mem, struct memory *ref_mem, struct assembly *as, struct simulation *sim,
+                    uint32_t start_addr, long int every);
+
+#endif